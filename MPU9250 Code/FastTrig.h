@@ -0,0 +1,113 @@
+#ifndef FASTTRIG_H
+#define FASTTRIG_H
+#include <math.h>
+
+// Cheap atan2 and asin for turning the fused quaternion into yaw, pitch and roll.
+// Without an FPU every libm call is a long soft-float routine on the LPC1768, and
+// these angles are only for display, so two approximations with bounded error are
+// offered next to libm:
+//  - EULER_POLY: a polynomial in the octant-reduced ratio for atan2 (Abramowitz and
+//    Stegun 4.4.49) and A&S 4.4.45 for asin, max error 1.2e-5 and 7e-5 rad in float
+//  - EULER_LUT: 129 entries of atan on [0, 1] with linear interpolation, max error
+//    6e-6 rad; asin goes through atan2(x, sqrt(1 - x*x)) on the same table
+// host/trig_bench measures the errors and the cost of each against libm.
+// Everything is float, no double maths on the target.
+
+enum EulerMethod {
+    EULER_LIBM,     // atan2f and asinf
+    EULER_POLY,
+    EULER_LUT
+};
+
+#define FAST_TRIG_PI        3.14159265358979f
+#define FAST_TRIG_HALF_PI   1.57079632679490f
+#define FAST_TRIG_LUT_SIZE  128
+
+// atan(i / FAST_TRIG_LUT_SIZE) for i = 0 .. FAST_TRIG_LUT_SIZE, 516 bytes of flash
+static const float fastTrigAtanTable[FAST_TRIG_LUT_SIZE + 1] = {
+    0.000000000f, 7.812341060e-03f, 1.562372862e-02f, 2.343320988e-02f, 3.123983343e-02f, 3.904264996e-02f,
+    4.684071292e-02f, 5.463307924e-02f, 6.241881000e-02f, 7.019697107e-02f, 7.796663383e-02f, 8.572687577e-02f,
+    9.347678116e-02f, 1.012154417e-01f, 1.089419570e-01f, 1.166554354e-01f, 1.243549945e-01f, 1.320397616e-01f,
+    1.397088743e-01f, 1.473614811e-01f, 1.549967419e-01f, 1.626138286e-01f, 1.702119253e-01f, 1.777902290e-01f,
+    1.853479500e-01f, 1.928843123e-01f, 2.003985538e-01f, 2.078899272e-01f, 2.153576997e-01f, 2.228011538e-01f,
+    2.302195873e-01f, 2.376123139e-01f, 2.449786631e-01f, 2.523179809e-01f, 2.596296294e-01f, 2.669129876e-01f,
+    2.741674511e-01f, 2.813924326e-01f, 2.885873619e-01f, 2.957516858e-01f, 3.028848684e-01f, 3.099863912e-01f,
+    3.170557532e-01f, 3.240924705e-01f, 3.310960767e-01f, 3.380661228e-01f, 3.450021772e-01f, 3.519038254e-01f,
+    3.587706703e-01f, 3.656023317e-01f, 3.723984467e-01f, 3.791586690e-01f, 3.858826694e-01f, 3.925701350e-01f,
+    3.992207696e-01f, 4.058342931e-01f, 4.124104416e-01f, 4.189489671e-01f, 4.254496374e-01f, 4.319122355e-01f,
+    4.383365599e-01f, 4.447224240e-01f, 4.510696560e-01f, 4.573780987e-01f, 4.636476090e-01f, 4.698780580e-01f,
+    4.760693303e-01f, 4.822213242e-01f, 4.883339511e-01f, 4.944071351e-01f, 5.004408131e-01f, 5.064349345e-01f,
+    5.123894603e-01f, 5.183043636e-01f, 5.241796288e-01f, 5.300152514e-01f, 5.358112380e-01f, 5.415676054e-01f,
+    5.472843810e-01f, 5.529616020e-01f, 5.585993153e-01f, 5.641975774e-01f, 5.697564535e-01f, 5.752760180e-01f,
+    5.807563536e-01f, 5.861975514e-01f, 5.915997103e-01f, 5.969629372e-01f, 6.022873461e-01f, 6.075730584e-01f,
+    6.128202022e-01f, 6.180289123e-01f, 6.231993299e-01f, 6.283316024e-01f, 6.334258830e-01f, 6.384823304e-01f,
+    6.435011088e-01f, 6.484823876e-01f, 6.534263412e-01f, 6.583331484e-01f, 6.632029927e-01f, 6.680360619e-01f,
+    6.728325476e-01f, 6.775926455e-01f, 6.823165549e-01f, 6.870044783e-01f, 6.916566219e-01f, 6.962731944e-01f,
+    7.008544079e-01f, 7.054004769e-01f, 7.099116185e-01f, 7.143880522e-01f, 7.188299996e-01f, 7.232376846e-01f,
+    7.276113326e-01f, 7.319511711e-01f, 7.362574290e-01f, 7.405303366e-01f, 7.447701257e-01f, 7.489770292e-01f,
+    7.531512810e-01f, 7.572931159e-01f, 7.614027698e-01f, 7.654804790e-01f, 7.695264804e-01f, 7.735410116e-01f,
+    7.775243104e-01f, 7.814766149e-01f, 7.853981634e-01f
+};
+
+// atan(z) for z in [0, 1]
+static inline float fastAtanUnitPoly(float z){
+    float z2 = z * z;
+    return z * (0.9998660f + z2 * (-0.3302995f + z2 * (0.1801410f + z2 * (-0.0851330f + z2 * 0.0208351f))));
+}
+
+static inline float fastAtanUnitLut(float z){
+    float f = z * (float)FAST_TRIG_LUT_SIZE;
+    int i = (int)f;
+    if (i >= FAST_TRIG_LUT_SIZE) return fastTrigAtanTable[FAST_TRIG_LUT_SIZE];
+    float a = fastTrigAtanTable[i];
+    return a + (fastTrigAtanTable[i + 1] - a) * (f - (float)i);
+}
+
+// Reduce atan2 to atan of a ratio in [0, 1] with one division, then unfold the octant
+static inline float fastAtan2(float y, float x, int method){
+    float ax = fabsf(x), ay = fabsf(y);
+    float big = ax > ay ? ax : ay;
+    float small = ax > ay ? ay : ax;
+    if (big == 0.0f) return 0.0f;
+    float z = small / big;
+    float a = method == EULER_LUT ? fastAtanUnitLut(z) : fastAtanUnitPoly(z);
+    if (ay > ax) a = FAST_TRIG_HALF_PI - a;
+    if (x < 0.0f) a = FAST_TRIG_PI - a;
+    return y < 0.0f ? -a : a;
+}
+
+static inline float fastAsin(float x, int method){
+    if (x > 1.0f) x = 1.0f;
+    if (x < -1.0f) x = -1.0f;
+    if (method == EULER_LUT) {
+        return fastAtan2(x, sqrtf(1.0f - x * x), EULER_LUT);
+    }
+    float ax = fabsf(x);
+    float a = FAST_TRIG_HALF_PI - sqrtf(1.0f - ax) * (1.5707288f + ax * (-0.2121144f + ax * (0.0742610f + ax * -0.0187293f)));
+    return x < 0.0f ? -a : a;
+}
+
+// Tait-Bryan yaw, pitch and roll in degrees from (qw, qx, qy, qz), as MPU9250::update()
+// has always derived them
+static inline void quaternionToEuler(const float *q, int method, float *yaw, float *pitch, float *roll){
+    float ys = 2.0f * (q[1] * q[2] + q[0] * q[3]);
+    float yc = 1.0f - 2.0f * (q[2] * q[2] + q[3] * q[3]);
+    float ps = 2.0f * (q[1] * q[3] - q[0] * q[2]);
+    float rs = 2.0f * (q[0] * q[1] + q[2] * q[3]);
+    float rc = q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3];
+    if (method == EULER_LIBM) {
+        *yaw = atan2f(ys, yc);
+        *pitch = -asinf(ps > 1.0f ? 1.0f : (ps < -1.0f ? -1.0f : ps));
+        *roll = atan2f(rs, rc);
+    } else {
+        *yaw = fastAtan2(ys, yc, method);
+        *pitch = -fastAsin(ps, method);
+        *roll = fastAtan2(rs, rc, method);
+    }
+    const float degrees = 180.0f / FAST_TRIG_PI;
+    *yaw *= degrees;
+    *pitch *= degrees;
+    *roll *= degrees;
+}
+
+#endif
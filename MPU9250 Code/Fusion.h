@@ -0,0 +1,322 @@
+#ifndef FUSION_H
+#define FUSION_H
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// Mahony and Madgwick orientation filters written once and instantiated per numeric
+// type: float, double, or the Q16/Q30 fixed point of Fixed<> below. Like QuatFrame.h
+// this only uses plain C/C++ headers so it builds for the LPC1768 and on the host.
+//
+// The LPC1768 has no FPU, so every float operation is a library call there. The
+// fixed point variants keep the whole update in 32x32->64 bit integer multiplies.
+// To let Q30 (range +-2) hold every intermediate, the kernels take
+//  - accel and mag in any units, each vector only needs its components to fit T
+//    since it is normalised first, e.g. g / 4 and Gauss,
+//  - the gyro as half the rotation of this step, rate in rad/s * dt / 2,
+//  - the gains already multiplied by dt.
+// Normalisation uses a fast inverse square root: the bit-level estimate plus Newton
+// steps for float/double, a table seed plus Newton steps in integers for Fixed<>.
+// The float version takes three steps; after two it still reads 5e-6 low, a bias
+// the simulator shows as 0.2 deg of extra orientation error.
+// FusionMath<T, true> uses the libm square root instead, for reference runs.
+
+// Signed fixed point with F fractional bits in 32 bits: Q16 is s15.16, Q30 is s1.30
+template <int F>
+class Fixed {
+public:
+    int32_t raw;
+
+    Fixed() {}
+    Fixed(double value) : raw((int32_t)floor(value * (double)(1LL << F) + 0.5)) {}
+    Fixed(float value) : raw((int32_t)(value * (float)(1LL << F))) {}     // no double maths on the target
+
+    static Fixed fromRaw(int32_t raw){
+        Fixed f;
+        f.raw = raw;
+        return f;
+    }
+    double toDouble() const { return raw / (double)(1LL << F); }
+    float toFloat() const { return (float)raw * (1.0f / (float)(1LL << F)); }
+
+    Fixed operator+(Fixed b) const { return fromRaw(raw + b.raw); }
+    Fixed operator-(Fixed b) const { return fromRaw(raw - b.raw); }
+    Fixed operator-() const { return fromRaw(-raw); }
+    Fixed operator*(Fixed b) const {
+        return fromRaw((int32_t)(((int64_t)raw * b.raw + (1LL << (F - 1))) >> F)); // rounded
+    }
+    Fixed &operator+=(Fixed b) { raw += b.raw; return *this; }
+    Fixed &operator-=(Fixed b) { raw -= b.raw; return *this; }
+    Fixed &operator*=(Fixed b) { *this = *this * b; return *this; }
+    bool operator>(Fixed b) const { return raw > b.raw; }
+    bool operator<(Fixed b) const { return raw < b.raw; }
+};
+
+typedef Fixed<16> Q16;
+typedef Fixed<30> Q30;
+
+static inline float fusionToFloat(float v) { return v; }
+template <int F>
+static inline float fusionToFloat(Fixed<F> v) { return v.toFloat(); }
+
+static inline float fusionFastInvSqrt(float x){
+    union { float f; uint32_t i; } u;
+    u.f = x;
+    u.i = 0x5F375A86u - (u.i >> 1);
+    float y = u.f;
+    y = y * (1.5f - 0.5f * x * y * y);
+    y = y * (1.5f - 0.5f * x * y * y);
+    y = y * (1.5f - 0.5f * x * y * y);
+    return y;
+}
+
+static inline double fusionFastInvSqrt(double x){
+    union { double f; uint64_t i; } u;
+    u.f = x;
+    u.i = 0x5FE6EB50C7B537A9ull - (u.i >> 1);
+    double y = u.f;
+    y = y * (1.5 - 0.5 * x * y * y);
+    y = y * (1.5 - 0.5 * x * y * y);
+    y = y * (1.5 - 0.5 * x * y * y);
+    return y;
+}
+
+static inline int fusionClz64(uint64_t v){
+#if defined(__GNUC__)
+    return v ? __builtin_clzll(v) : 64;
+#else
+    int n = 0;
+    while (n < 64 && !(v & (1ull << 63))) {
+        v <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// 1/sqrt(m / 2^64) for m in [2^62, 2^64), as Q30 in (2^30, 2^31]. A 12 entry table
+// gets within 6 %, three Newton steps then reach the Q30 resolution.
+static inline uint32_t fusionInvSqrtMantissa(uint64_t m){
+    static const uint32_t seed[12] = {     // 1/sqrt((i + 4.5) / 16) in Q30
+        2024667000u, 1831380208u, 1684624773u, 1568300315u, 1473161629u, 1393471397u,
+        1325455684u, 1266516759u, 1214800200u, 1168942037u, 1127913670u, 1090922784u
+    };
+    uint32_t y = seed[(m >> 60) - 4];
+    uint64_t m32 = m >> 32;                                 // m in Q32
+    for (int i = 0; i < 3; i++) {
+        uint64_t y2 = ((uint64_t)y * y) >> 30;              // Q30
+        uint64_t my2 = (m32 * y2) >> 32;                    // Q30, close to 1
+        uint64_t t = (3ull << 30) - my2;
+        y = (uint32_t)(((uint64_t)y * t) >> 31);            // y * (3 - m y^2) / 2
+    }
+    return y;
+}
+
+// Exact and fast normalisation for the floating point types
+template <typename T, bool Exact = false>
+struct FusionMath {
+    static T invSqrt(T x) { return Exact ? (T)1 / (T)sqrt(x) : fusionFastInvSqrt(x); }
+
+    static bool normalise(T &x, T &y, T &z){
+        T n = x * x + y * y + z * z;
+        if (n == (T)0) return false; // handle NaN
+        n = invSqrt(n);
+        x *= n;
+        y *= n;
+        z *= n;
+        return true;
+    }
+
+    static bool normalise(T &a, T &b, T &c, T &d){
+        T n = a * a + b * b + c * c + d * d;
+        if (n == (T)0) return false;
+        n = invSqrt(n);
+        a *= n;
+        b *= n;
+        c *= n;
+        d *= n;
+        return true;
+    }
+
+    static T hypot(T x, T y){
+        T n = x * x + y * y;
+        return n == (T)0 ? n : n * invSqrt(n);
+    }
+
+    static T select(bool condition, T a, T b) { return condition ? a : b; }
+};
+
+// Fixed point normalisation works on the raw values with 64 bit sums, so it is
+// independent of the format and cannot overflow on the squares
+template <int F, bool Exact>
+struct FusionMath<Fixed<F>, Exact> {
+    typedef Fixed<F> T;
+
+    // Scale the n raw values to unit length; false when they are all zero
+    static bool normaliseRaw(int32_t **v, int n){
+        uint64_t s = 0;
+        for (int i = 0; i < n; i++) {
+            s += (uint64_t)((int64_t)*v[i] * *v[i]) >> 2;   // sum of (raw / 2)^2, fits for n <= 4
+        }
+        if (s == 0) return false;
+        int e = fusionClz64(s) & ~1;
+        uint32_t y = fusionInvSqrtMantissa(s << e);
+        // raw / |v| = raw * y * 2^(e/2 - 63), rescaled to F fractional bits
+        int shift = 63 - F - e / 2;
+        int64_t round = 1LL << (shift - 1);
+        for (int i = 0; i < n; i++) {
+            *v[i] = (int32_t)(((int64_t)*v[i] * y + round) >> shift);
+        }
+        return true;
+    }
+
+    static bool normalise(T &x, T &y, T &z){
+        int32_t *v[3] = { &x.raw, &y.raw, &z.raw };
+        return normaliseRaw(v, 3);
+    }
+
+    static bool normalise(T &a, T &b, T &c, T &d){
+        int32_t *v[4] = { &a.raw, &b.raw, &c.raw, &d.raw };
+        return normaliseRaw(v, 4);
+    }
+
+    static T select(bool condition, T a, T b) { return condition ? a : b; }
+
+    static T hypot(T x, T y){
+        uint64_t s = ((uint64_t)((int64_t)x.raw * x.raw) >> 2) + ((uint64_t)((int64_t)y.raw * y.raw) >> 2);
+        if (s == 0) return T::fromRaw(0);
+        int e = fusionClz64(s) & ~1;
+        uint64_t m = s << e;
+        uint64_t root = ((m >> 32) * fusionInvSqrtMantissa(m)) >> 32;  // sqrt(m / 2^64) in Q30
+        // |(x, y)| = 2 sqrt(s) = root * 2^(3 - e/2)
+        int shift = e / 2 - 3;
+        return T::fromRaw((int32_t)(shift >= 0 ? root >> shift : root << -shift));
+    }
+};
+
+template <typename T, typename M = FusionMath<T> >
+struct FusionKernel {
+
+    // Mahony: proportional and integral feedback of the error between the measured and the
+    // estimated gravity and field directions. eInt keeps the integral of half the error.
+    static void Mahony(T *q, T *eInt, T ax, T ay, T az, T hgx, T hgy, T hgz, T mx, T my, T mz, T kpDt, T kiDt){
+        T q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
+        const T half = T(0.5);
+
+        // Auxiliary variables to avoid repeated arithmetic
+        T q1q1 = q1 * q1;
+        T q1q2 = q1 * q2;
+        T q1q3 = q1 * q3;
+        T q1q4 = q1 * q4;
+        T q2q2 = q2 * q2;
+        T q2q3 = q2 * q3;
+        T q2q4 = q2 * q4;
+        T q3q3 = q3 * q3;
+        T q3q4 = q3 * q4;
+        T q4q4 = q4 * q4;
+
+        if (!M::normalise(ax, ay, az)) return;
+        if (!M::normalise(mx, my, mz)) return;
+
+        // Reference direction of Earth's magnetic field, each component sums to at most 1
+        T hx = mx * (half - q3q3 - q4q4) + my * (q2q3 - q1q4) + mz * (q2q4 + q1q3);
+        T hy = mx * (q2q3 + q1q4) + my * (half - q2q2 - q4q4) + mz * (q3q4 - q1q2);
+        T hz = mx * (q2q4 - q1q3) + my * (q3q4 + q1q2) + mz * (half - q2q2 - q3q3);
+        hx += hx;
+        hy += hy;
+        T bx = M::hypot(hx, hy);
+        T bz = hz + hz;
+
+        // Estimated direction of gravity and magnetic field
+        T vx = q2q4 - q1q3;
+        T vy = q1q2 + q3q4;
+        vx += vx;
+        vy += vy;
+        T vz = q1q1 - q2q2 - q3q3 + q4q4;
+        T wx = bx * (half - q3q3 - q4q4) + bz * (q2q4 - q1q3);
+        T wy = bx * (q2q3 - q1q4) + bz * (q1q2 + q3q4);
+        T wz = bx * (q1q3 + q2q4) + bz * (half - q2q2 - q3q3);
+        wx += wx;
+        wy += wy;
+        wz += wz;
+
+        // Half the cross product between estimated and measured directions
+        T ex = half * (ay * vz - az * vy) + half * (my * wz - mz * wy);
+        T ey = half * (az * vx - ax * vz) + half * (mz * wx - mx * wz);
+        T ez = half * (ax * vy - ay * vx) + half * (mx * wy - my * wx);
+        // Accumulate integral error while Ki is on, otherwise prevent integral wind up.
+        // A select rather than a branch, so that batched lanes can differ in Ki.
+        eInt[0] = M::select(kiDt > T(0.0), eInt[0] + ex, T(0.0));
+        eInt[1] = M::select(kiDt > T(0.0), eInt[1] + ey, T(0.0));
+        eInt[2] = M::select(kiDt > T(0.0), eInt[2] + ez, T(0.0));
+
+        // Apply feedback terms to the half step rotation
+        hgx += kpDt * ex + kiDt * eInt[0];
+        hgy += kpDt * ey + kiDt * eInt[1];
+        hgz += kpDt * ez + kiDt * eInt[2];
+
+        // Integrate rate of change of quaternion
+        q[0] = q1 + (-q2 * hgx - q3 * hgy - q4 * hgz);
+        q[1] = q2 + (q1 * hgx + q3 * hgz - q4 * hgy);
+        q[2] = q3 + (q1 * hgy - q2 * hgz + q4 * hgx);
+        q[3] = q4 + (q1 * hgz + q2 * hgy - q3 * hgx);
+        M::normalise(q[0], q[1], q[2], q[3]);
+    }
+
+    // Madgwick: gradient descent step on the gravity and field alignment error. The
+    // objective is kept at an eighth of its size and the gradient at 1/32; only the
+    // gradient's direction is used, and this keeps every term below 2.
+    static void Madgwick(T *q, T ax, T ay, T az, T hgx, T hgy, T hgz, T mx, T my, T mz, T betaDt){
+        T q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
+        const T half = T(0.5);
+        const T quarter = T(0.25);
+
+        // Auxiliary variables to avoid repeated arithmetic
+        T q1q2 = q1 * q2;
+        T q1q3 = q1 * q3;
+        T q1q4 = q1 * q4;
+        T q2q2 = q2 * q2;
+        T q2q3 = q2 * q3;
+        T q2q4 = q2 * q4;
+        T q3q3 = q3 * q3;
+        T q3q4 = q3 * q4;
+        T q4q4 = q4 * q4;
+
+        if (!M::normalise(ax, ay, az)) return;
+        if (!M::normalise(mx, my, mz)) return;
+
+        // Reference direction of Earth's magnetic field, at half size like f below
+        T hx = mx * (half - q3q3 - q4q4) + my * (q2q3 - q1q4) + mz * (q2q4 + q1q3);
+        T hy = mx * (q2q3 + q1q4) + my * (half - q2q2 - q4q4) + mz * (q3q4 - q1q2);
+        T hbz = mx * (q2q4 - q1q3) + my * (q3q4 + q1q2) + mz * (half - q2q2 - q3q3);
+        T hbx = M::hypot(hx, hy);
+
+        // Objective function / 8: gravity and field misalignment
+        T f1 = quarter * ((q2q4 - q1q3) - half * ax);
+        T f2 = quarter * ((q1q2 + q3q4) - half * ay);
+        T f3 = quarter * ((half - q2q2 - q3q3) - half * az);
+        T f4 = quarter * (hbx * (half - q3q3 - q4q4) + hbz * (q2q4 - q1q3) - half * mx);
+        T f5 = quarter * (hbx * (q2q3 - q1q4) + hbz * (q1q2 + q3q4) - half * my);
+        T f6 = quarter * (hbx * (q1q3 + q2q4) + hbz * (half - q2q2 - q3q3) - half * mz);
+        T f3x2 = f3 + f3;
+        T f6x2 = f6 + f6;
+
+        // Gradient decent algorithm corrective step, J^T f / 32
+        T s1 = -q3 * f1 + q2 * f2 - hbz * q3 * f4 + (-hbx * q4 + hbz * q2) * f5 + hbx * q3 * f6;
+        T s2 = q4 * f1 + q1 * f2 - q2 * f3x2 + hbz * q4 * f4 + (hbx * q3 + hbz * q1) * f5 + hbx * q4 * f6 - hbz * q2 * f6x2;
+        T s3 = -q1 * f1 + q4 * f2 - q3 * f3x2 - hbx * q3 * (f4 + f4) - hbz * q1 * f4 + (hbx * q2 + hbz * q4) * f5 + hbx * q1 * f6 - hbz * q3 * f6x2;
+        T s4 = q2 * f1 + q3 * f2 - hbx * q4 * (f4 + f4) + hbz * q2 * f4 + (-hbx * q1 + hbz * q3) * f5 + hbx * q2 * f6;
+        if (!M::normalise(s1, s2, s3, s4)) {
+            s1 = s2 = s3 = s4 = T(0.0);       // already at the minimum
+        }
+
+        // Integrate rate of change of quaternion
+        q[0] = q1 + (-q2 * hgx - q3 * hgy - q4 * hgz) - betaDt * s1;
+        q[1] = q2 + (q1 * hgx + q3 * hgz - q4 * hgy) - betaDt * s2;
+        q[2] = q3 + (q1 * hgy - q2 * hgz + q4 * hgx) - betaDt * s3;
+        q[3] = q4 + (q1 * hgz + q2 * hgy - q3 * hgx) - betaDt * s4;
+        M::normalise(q[0], q[1], q[2], q[3]);
+    }
+};
+
+#endif
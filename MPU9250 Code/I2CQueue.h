@@ -0,0 +1,165 @@
+#ifndef I2CQUEUE_H
+#define I2CQUEUE_H
+#include "mbed.h"
+#include "rtos.h"
+
+// Non-blocking register reads on one I2C bus. Callers queue a read (also from an
+// interrupt handler) and get a callback when the data has arrived, so a sampling
+// thread can fuse the previous sample while the bus fetches the next one.
+//
+// Targets with DEVICE_I2C_ASYNCH chain I2C::transfer() calls from the transfer
+// complete event. The LPC1768 has no asynchronous I2C in mbed, so there a worker
+// thread per bus runs the blocking write/read pairs instead. mbed serialises all
+// blocking I2C objects behind one mutex, so that fallback frees the sampling
+// threads but does not overlap the two buses. The worker's stack is a member, so a
+// queue defined at file scope, as in main.cpp, takes nothing from the heap.
+
+#define I2C_QUEUE_DEPTH 8
+
+// Completion callback; status is 0 on success and non-zero when the device did not ACK
+typedef void (*I2CDoneHandler)(void *context, int status);
+
+struct I2CTransaction {
+    uint8_t address;        // 8-bit bus address
+    uint8_t subAddress;     // first register to read
+    uint8_t * data;
+    uint16_t length;
+    I2CDoneHandler done;
+    void * context;
+};
+
+class I2CQueue {
+
+    protected:
+
+    I2C *i2c;
+
+    public:
+
+    uint32_t completed;     // transactions finished without error
+    uint32_t failed;        // transactions the device did not ACK
+    uint32_t rejected;      // read() calls refused because the queue was full
+    uint32_t maxDepth;      // most transactions waiting at once
+
+#if DEVICE_I2C_ASYNCH
+    I2CQueue(I2C &i2c_port):i2c(&i2c_port){
+      completed = failed = rejected = maxDepth = 0;
+      head = tail = 0;
+      active = false;
+    }
+#else
+    I2CQueue(I2C &i2c_port, osPriority priority = osPriorityAboveNormal):i2c(&i2c_port), worker(priority, DEFAULT_STACK_SIZE, (unsigned char *)stack){
+      completed = failed = rejected = maxDepth = 0;
+      depth = 0;
+      worker.start(callback(this, &I2CQueue::run));
+    }
+#endif
+
+    // Queue a read of length bytes starting at subAddress. Returns false when the
+    // queue is full; done is not called in that case.
+    bool read(uint8_t address, uint8_t subAddress, uint8_t * data, uint16_t length, I2CDoneHandler done, void * context){
+#if DEVICE_I2C_ASYNCH
+      core_util_critical_section_enter();
+      if (tail - head >= I2C_QUEUE_DEPTH) {
+        rejected++;
+        core_util_critical_section_exit();
+        return false;
+      }
+      I2CTransaction *t = &ring[tail % I2C_QUEUE_DEPTH];
+      t->address = address;
+      t->subAddress = subAddress;
+      t->data = data;
+      t->length = length;
+      t->done = done;
+      t->context = context;
+      tail++;
+      if (tail - head > maxDepth) maxDepth = tail - head;
+      bool start = !active;
+      active = true;
+      core_util_critical_section_exit();
+      if (start) startNext();
+      return true;
+#else
+      I2CTransaction *t = mail.alloc();
+      if (t == NULL) {
+        rejected++;
+        return false;
+      }
+      t->address = address;
+      t->subAddress = subAddress;
+      t->data = data;
+      t->length = length;
+      t->done = done;
+      t->context = context;
+      core_util_critical_section_enter();
+      depth++;
+      if (depth > maxDepth) maxDepth = depth;
+      core_util_critical_section_exit();
+      mail.put(t);
+      return true;
+#endif
+    }
+
+    private:
+
+#if DEVICE_I2C_ASYNCH
+    void startNext(){
+      I2CTransaction *t = &ring[head % I2C_QUEUE_DEPTH];
+      subAddress = (char)t->subAddress;
+      if (i2c->transfer(t->address, &subAddress, 1, (char *)t->data, t->length,
+                        event_callback_t(this, &I2CQueue::transferDone), I2C_EVENT_ALL, false) != 0) {
+        transferDone(I2C_EVENT_ERROR);
+      }
+    }
+
+    // Transfer event, in interrupt context: report and start the next queued read.
+    // transfer() takes the bus mutex, which RTX skips with osErrorISR in an interrupt.
+    void transferDone(int event){
+      I2CTransaction *t = &ring[head % I2C_QUEUE_DEPTH];
+      int status = (event & I2C_EVENT_TRANSFER_COMPLETE) ? 0 : 1;
+      if (status == 0) completed++; else failed++;
+      t->done(t->context, status);
+
+      core_util_critical_section_enter();
+      head++;
+      bool more = head != tail;
+      active = more;
+      core_util_critical_section_exit();
+      if (more) startNext();
+    }
+
+    I2CTransaction ring[I2C_QUEUE_DEPTH];
+    volatile uint32_t head;     // next transaction to run
+    volatile uint32_t tail;     // next free slot
+    volatile bool active;       // a transfer is on the bus
+    char subAddress;            // tx buffer of the running transfer
+#else
+    void run(){
+      while (true) {
+        osEvent evt = mail.get();
+        if (evt.status != osEventMail) continue;
+        I2CTransaction *t = (I2CTransaction *)evt.value.p;
+
+        char subAddress = (char)t->subAddress;
+        int status = i2c->write(t->address, &subAddress, 1, 1); // no stop
+        if (status == 0) {
+          status = i2c->read(t->address, (char *)t->data, t->length, 0);
+        }
+        if (status == 0) completed++; else failed++;
+        t->done(t->context, status);
+
+        mail.free(t);
+        core_util_critical_section_enter();
+        depth--;
+        core_util_critical_section_exit();
+      }
+    }
+
+    Mail<I2CTransaction, I2C_QUEUE_DEPTH> mail;
+    uint64_t stack[DEFAULT_STACK_SIZE / 8];   // declared before worker, which is built on it
+    Thread worker;
+    volatile uint32_t depth;
+#endif
+};
+
+#endif
@@ -0,0 +1,315 @@
+#ifndef LINKNEGOTIATOR_H
+#define LINKNEGOTIATOR_H
+#include <stdint.h>
+#include "QuatFrame.h"
+
+// Host side of the baud rate negotiation of QuatFrame.h, shared by the viewer's
+// SerialReader and host/link_bench. Plain C++ like QuatFrame.h: it owns no port and no
+// clock, the caller hands it the link frames it decodes, the running frame and error
+// counts of its parser and the time, and it acts through a LinkPort.
+//
+// It first finds the rate the board is at by listening at each rate in turn, starting
+// with QUAT_LINK_DEFAULT_BAUD. It then proposes the next faster rate, counts good and
+// corrupted frames for trialMs after the switch and commits the rate when the frame
+// error rate stays within maxErrorRate, and carries on up to maxBaud; a trial with more
+// errors, or one the board rejects, ends the climb at the last committed rate. Once
+// settled it keeps watching: a window with too many errors proposes the next slower
+// rate, and a silent link starts the search again. Every trial is kept in trials[],
+// which is the measured samples per second of each rate.
+
+#define LINK_PROBE_MS       600     // listening per rate while searching for the board
+#define LINK_REPLY_MS       500     // for an ACCEPT, REJECT or COMMIT echo
+#define LINK_SETTLE_MS      100     // after a switch, before frames count
+#define LINK_TRIAL_MS       1000    // must end well inside QUAT_LINK_TRIAL_MS
+#define LINK_WATCH_MS       1000    // error rate window once settled
+#define LINK_SILENT_MS      3000    // no frame for this long starts the search again
+#define LINK_MAX_ERROR_RATE 0.002f  // corrupted / (good + corrupted) frames
+
+// Where the negotiator sends its frames and changes the rate
+class LinkPort {
+public:
+    virtual ~LinkPort() {}
+    virtual void setBaud(uint32_t baud) = 0;
+    virtual void write(const uint8_t *data, int length) = 0;
+};
+
+enum LinkTrialResult {
+    LINK_TRIAL_NONE,        // rate not tried
+    LINK_TRIAL_COMMITTED,
+    LINK_TRIAL_ERRORS,      // frame error rate above maxErrorRate, or no frames at all
+    LINK_TRIAL_REJECTED,    // the board does not support the rate
+    LINK_TRIAL_NO_REPLY     // no ACCEPT or no COMMIT echo
+};
+
+struct LinkTrial {
+    uint32_t baud;
+    uint8_t result;
+    uint32_t frames;        // good frames during the trial
+    uint32_t errors;        // corrupted frames and lost alignments
+    uint32_t ms;
+
+    float framesPerSecond() const { return ms > 0 ? frames * 1000.0f / ms : 0.0f; }
+    float errorRate() const { return frames + errors > 0 ? (float)errors / (frames + errors) : 0.0f; }
+};
+
+class LinkNegotiator {
+
+    public:
+
+    enum Phase {
+      LINK_SEARCH,          // listening for the board at one rate after the other
+      LINK_PROPOSE,         // PROPOSE sent, waiting for the answer
+      LINK_SETTLE,          // switched, letting the garbled bytes of the switch pass
+      LINK_TRIAL,           // counting frames at the proposed rate
+      LINK_COMMIT,          // COMMIT sent, waiting for the echo
+      LINK_RECOVER,         // trial failed, waiting for the board to fall back as well
+      LINK_STEADY           // settled, watching the error rate
+    };
+
+    uint32_t maxBaud;           // fastest rate to propose
+    float maxErrorRate;
+    uint32_t trialMs;
+    bool sweep;                 // try every rate up to maxBaud, even past a failed trial
+    LinkTrial trials[QUAT_LINK_RATE_COUNT];   // latest trial of each rate of quatLinkRates
+    uint32_t proposals;
+    uint32_t fallbacks;         // trials failed and rates given up while settled
+
+    LinkNegotiator(LinkPort &port):port(&port){
+      maxBaud = quatLinkRates[QUAT_LINK_RATE_COUNT - 1];
+      maxErrorRate = LINK_MAX_ERROR_RATE;
+      trialMs = LINK_TRIAL_MS;
+      sweep = false;
+      proposals = fallbacks = 0;
+      for (int i = 0; i < QUAT_LINK_RATE_COUNT; i++) {
+        trials[i].baud = quatLinkRates[i];
+        trials[i].result = LINK_TRIAL_NONE;
+        trials[i].frames = trials[i].errors = trials[i].ms = 0;
+      }
+      phase = LINK_STEADY;
+      phaseMs = switchMs = lastFrameMs = 0;
+      current = committed = target = ceiling = searchFirst = probe = 0;
+      seq = 0;
+      frames0 = errors0 = lastFrames = lastErrors = 0;
+    }
+
+    uint32_t baud() const { return quatLinkRates[current]; }
+    uint32_t committedBaud() const { return quatLinkRates[committed]; }
+    int currentPhase() const { return phase; }
+    bool settled() const { return phase == LINK_STEADY; }
+
+    // Look for the board, from the default rate. frames and errors as for update().
+    void start(uint32_t nowMs, uint64_t frames, uint64_t errors){
+      ceiling = QUAT_LINK_RATE_COUNT - 1;
+      while (ceiling > 0 && quatLinkRates[ceiling] > maxBaud) ceiling--;
+      committed = indexOf(QUAT_LINK_DEFAULT_BAUD);
+      search(nowMs, frames, errors);
+    }
+
+    // A link frame from the board
+    void onLink(const QuatLink &link, uint32_t nowMs){
+      if (link.seq != seq) return;      // answer to an earlier request
+      if (phase == LINK_PROPOSE) {
+        if (link.command == QUAT_LINK_ACCEPT && link.baud == quatLinkRates[target]) {
+          current = target;
+          port->setBaud(baud());
+          switchMs = nowMs;
+          enter(LINK_SETTLE, nowMs);
+        } else if (link.command == QUAT_LINK_REJECT) {
+          finishTrial(LINK_TRIAL_REJECTED, 0, 0, 0);
+          if (!sweep) ceiling = target - 1;
+          next(nowMs);
+        }
+      } else if (phase == LINK_COMMIT && link.command == QUAT_LINK_COMMIT && link.baud == baud()) {
+        committed = current;
+        trials[current].result = LINK_TRIAL_COMMITTED;
+        next(nowMs);
+      }
+    }
+
+    // Call every few tens of milliseconds and after each parse, with the totals of
+    // good frames and of corrupted frames plus lost alignments so far
+    void update(uint32_t nowMs, uint64_t frames, uint64_t errors){
+      if (frames != lastFrames) {
+        lastFrameMs = nowMs;
+      }
+      lastFrames = frames;
+      lastErrors = errors;
+      uint32_t elapsed = nowMs - phaseMs;
+      uint32_t good = (uint32_t)(frames - frames0), bad = (uint32_t)(errors - errors0);
+
+      switch (phase) {
+        case LINK_SEARCH:
+          if (elapsed < LINK_PROBE_MS) break;
+          // Frames pass the CRC at the wrong rate only by chance, a few in a row do not
+          if (good >= 3 && bad < good) {
+            committed = current;
+            lastFrameMs = nowMs;
+            next(nowMs);
+          } else {
+            probe = (probe + 1) % QUAT_LINK_RATE_COUNT;
+            listen(probeOrder(probe), nowMs, frames, errors);
+          }
+          break;
+        case LINK_PROPOSE:
+        case LINK_COMMIT:
+          if (elapsed < LINK_REPLY_MS) break;
+          if (phase == LINK_PROPOSE) {
+            finishTrial(LINK_TRIAL_NO_REPLY, 0, 0, 0);
+            // Without an answer at the committed rate the board may be gone or elsewhere
+            if (nowMs - lastFrameMs > LINK_SILENT_MS) search(nowMs, frames, errors);
+            else settle(nowMs, frames, errors);
+          } else {
+            // The board may have committed without the echo getting through; look for it
+            trials[current].result = LINK_TRIAL_NO_REPLY;
+            fail(nowMs);
+          }
+          break;
+        case LINK_SETTLE:
+          if (elapsed >= LINK_SETTLE_MS) {
+            enter(LINK_TRIAL, nowMs);
+            frames0 = frames;
+            errors0 = errors;
+          }
+          break;
+        case LINK_TRIAL:
+          if (elapsed < trialMs) break;
+          if (good > 0 && bad <= maxErrorRate * (good + bad)) {
+            finishTrial(LINK_TRIAL_NONE, good, bad, elapsed);
+            send(QUAT_LINK_COMMIT, baud());
+            enter(LINK_COMMIT, nowMs);
+          } else {
+            finishTrial(LINK_TRIAL_ERRORS, good, bad, elapsed);
+            fail(nowMs);
+          }
+          break;
+        case LINK_RECOVER:
+          // The board goes back to its committed rate QUAT_LINK_TRIAL_MS after switching
+          if (nowMs - switchMs >= QUAT_LINK_TRIAL_MS + LINK_SETTLE_MS) {
+            current = committed;
+            port->setBaud(baud());
+            search(nowMs, frames, errors, true);
+          }
+          break;
+        case LINK_STEADY:
+          if (nowMs - lastFrameMs > LINK_SILENT_MS) {
+            search(nowMs, frames, errors);
+          } else if (elapsed >= LINK_WATCH_MS) {
+            if (bad > maxErrorRate * (good + bad) && committed > 0) {
+              // Errors appeared at a committed rate: never come back above the next one down
+              fallbacks++;
+              ceiling = committed - 1;
+              propose(committed - 1, nowMs);
+            } else {
+              settle(nowMs, frames, errors);
+            }
+          }
+          break;
+      }
+    }
+
+    private:
+
+    static int indexOf(uint32_t baud){
+      for (int i = 0; i < QUAT_LINK_RATE_COUNT; i++) {
+        if (quatLinkRates[i] == baud) return i;
+      }
+      return 0;
+    }
+
+    // Search order: the committed rate, then the default, then the others fastest first
+    int probeOrder(int n) const {
+      if (n == 0) return searchFirst;
+      int order[QUAT_LINK_RATE_COUNT];
+      int count = 0;
+      int preferred = indexOf(QUAT_LINK_DEFAULT_BAUD);
+      if (preferred != searchFirst) order[count++] = preferred;
+      for (int i = QUAT_LINK_RATE_COUNT - 1; i >= 0; i--) {
+        if (i != searchFirst && i != preferred) order[count++] = i;
+      }
+      return order[n - 1];
+    }
+
+    void enter(int p, uint32_t nowMs){
+      phase = p;
+      phaseMs = nowMs;
+    }
+
+    void listen(int index, uint32_t nowMs, uint64_t frames, uint64_t errors){
+      current = index;
+      port->setBaud(baud());
+      enter(LINK_SEARCH, nowMs);
+      frames0 = frames;
+      errors0 = errors;
+    }
+
+    void search(uint32_t nowMs, uint64_t frames, uint64_t errors, bool fromCommitted = false){
+      searchFirst = fromCommitted ? committed : indexOf(QUAT_LINK_DEFAULT_BAUD);
+      probe = 0;
+      listen(searchFirst, nowMs, frames, errors);
+    }
+
+    void settle(uint32_t nowMs, uint64_t frames, uint64_t errors){
+      enter(LINK_STEADY, nowMs);
+      frames0 = frames;
+      errors0 = errors;
+    }
+
+    // Climb to the next rate to try, or settle at the committed one
+    void next(uint32_t nowMs){
+      int from = sweep && target > committed ? target : committed;
+      if (from < ceiling) {
+        propose(from + 1, nowMs);
+      } else {
+        settle(nowMs, lastFrames, lastErrors);
+        lastFrameMs = nowMs;
+      }
+    }
+
+    void propose(int index, uint32_t nowMs){
+      target = index;
+      seq++;
+      proposals++;
+      send(QUAT_LINK_PROPOSE, quatLinkRates[index]);
+      enter(LINK_PROPOSE, nowMs);
+    }
+
+    // Give up the trial rate: back to the committed one once the board has, then the
+    // next rate when sweeping
+    void fail(uint32_t nowMs){
+      fallbacks++;
+      if (!sweep) ceiling = current - 1;
+      enter(LINK_RECOVER, nowMs);
+    }
+
+    void finishTrial(uint8_t result, uint32_t frames, uint32_t errors, uint32_t ms){
+      LinkTrial &t = trials[target];
+      t.result = result;
+      t.frames = frames;
+      t.errors = errors;
+      t.ms = ms;
+    }
+
+    void send(uint8_t command, uint32_t rate){
+      uint8_t data[QUAT_LINK_FRAME_SIZE];
+      port->write(data, quatLinkEncode(data, command, seq, 0, rate));
+    }
+
+    LinkPort *port;
+    int phase;
+    uint32_t phaseMs;
+    uint32_t switchMs;          // when the port went to the trial rate
+    int current;                // index in quatLinkRates of the port's rate
+    int committed;              // of the board's committed rate
+    int target;                 // of the rate proposed last
+    int ceiling;                // highest index left to try
+    int searchFirst;
+    int probe;                  // position in the search order
+    uint16_t seq;
+    uint64_t frames0;           // counts at the start of the phase
+    uint64_t errors0;
+    uint64_t lastFrames;        // counts passed to the last update()
+    uint64_t lastErrors;
+    uint32_t lastFrameMs;       // when the frame count last moved
+};
+
+#endif
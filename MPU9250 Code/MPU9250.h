@@ -5,6 +5,12 @@
 
 #include "mbed.h"
 #include "math.h"
+#include "QuatFrame.h"
+#include "I2CQueue.h"
+#include "Fusion.h"
+#include "FastTrig.h"
+#include "UartTx.h"
+#include "SerialLink.h"
 
 // See also MPU-9250 Register Map and Descriptions, Revision 4.0, RM-MPU-9250A-00, Rev. 1.4, 9/9/2013 for registers not listed in
 // above document; the MPU9250 and MPU9150 are virtually identical but the latter has a different register map
@@ -157,6 +163,28 @@
 #define YA_OFFSET_L      0x7B
 #define ZA_OFFSET_H      0x7D
 #define ZA_OFFSET_L      0x7E
+
+// FIFO streaming mode: each FIFO packet holds, in register order, accel (6), temperature (2),
+// gyro (6) and the 7 AK8963 bytes HXL..ST2 that the internal I2C master copies to EXT_SENS_DATA_00
+#define FIFO_PACKET_SIZE   21
+#define FIFO_BURST_PACKETS 12    // packets drained per burst read of FIFO_R_W
+#define FIFO_SIZE          512   // bytes, the FIFO wraps and loses alignment beyond this
+
+// Interrupt driven acquisition
+#define INT_WAIT_MS        100   // stop waiting for a data-ready edge after this long
+#define LATENCY_BUCKETS    16    // power-of-two microsecond buckets, the last one collects the rest
+#define BURST_SLOTS        3     // buffers of the queued burst reads: newest result, one being copied, one on the bus
+
+// Number type of the fusion filters, see Fusion.h: float, or Q30 to run the filter
+// updates in integer arithmetic instead of soft float
+#ifndef FUSION_TYPE
+#define FUSION_TYPE float
+#endif
+// 1 normalises with libm's sqrt instead of the fast inverse square root of Fusion.h
+#ifndef FUSION_EXACT
+#define FUSION_EXACT 0
+#endif
+
 #define Kp 2.0f * 5.0f // these are the free parameters in the Mahony filter and fusion scheme, Kp for proportional feedback, Ki for integral
 #define Ki 0.0f
 
@@ -191,7 +219,29 @@ enum Mscale {
   MFS_16BITS      // 0.15 mG per LSB
 };
 
-Serial pc(USBTX, USBRX); // tx, rx
+// What goes out at each output tick. The angles are only for display, so by default
+// none are computed; the Euler modes send QUAT_FRAME_EULER frames with yaw, pitch and
+// roll from the EulerMethod of FastTrig.h
+enum OutputMode {
+  OUTPUT_QUATERNION = 0,                // frames of frameType
+  OUTPUT_EULER_LIBM = 1 + EULER_LIBM,
+  OUTPUT_EULER_POLY = 1 + EULER_POLY,   // max error 7e-5 rad
+  OUTPUT_EULER_LUT  = 1 + EULER_LUT     // max error 6e-6 rad
+};
+
+// One time-coherent accel, temperature and gyro sample: ACCEL_XOUT_H..GYRO_ZOUT_L are
+// contiguous, so a single 14 byte burst lands in register order and is swapped in place
+#define SENSOR_SNAPSHOT_SIZE 14
+
+MBED_PACKED(struct) SensorSnapshot {
+  int16_t accel[3];
+  int16_t temp;
+  int16_t gyro[3];
+};
+
+RawSerial pc(USBTX, USBRX); // tx, rx
+UartTx uartTx(pc);          // the frames of every board go out through this
+SerialLink serialLink(pc, uartTx);  // baud rate negotiation with the viewer
 
 class MPU9250 {
 
@@ -237,11 +287,58 @@ class MPU9250 {
     uint32_t sumCount;
     char buffer[14];
 
+    // FIFO streaming acquisition
+    bool fifoMode;           // drain the hardware FIFO in bursts instead of polling INT_STATUS
+    float fifoPeriod;        // time between FIFO samples in seconds
+    uint8_t fifoDivider;     // SMPLRT_DIV in FIFO mode, rate = 1 kHz / (1 + divider)
+    int fifoDrainUs;         // last drain without an interrupt pin
+    uint32_t fifoOverflows;  // times the FIFO filled up and had to be reset
+    uint8_t fifoBuffer[FIFO_BURST_PACKETS * FIFO_PACKET_SIZE];
+
+    // Interrupt driven acquisition, see attachInterrupt()
+    InterruptIn * intPin;    // data-ready input, NULL to poll INT_STATUS over I2C
+    Semaphore dataReady;     // released from the INT handler, taken by update()
+    volatile int irqUs;      // time of the edge that last released dataReady
+    volatile int irqEdges;   // edges counted towards the next release
+    int wakeEdges;           // edges per release, a partial FIFO burst in FIFO mode
+    int lastSampleUs;
+    uint32_t interruptTimeouts;  // waits that saw no edge within INT_WAIT_MS
+    uint32_t interruptOverruns;  // releases that piled up while a sample was being fused
+    Semaphore * busReady;    // also released on data ready when a Pipeline serves the bus
+
+    // Queued burst reads, see attachQueue()
+    I2CQueue * queue;        // bus queue the INT handler submits to, NULL for blocking reads
+    uint8_t burstBuffer[BURST_SLOTS][FIFO_PACKET_SIZE];  // bursts land while another is decoded
+    int burstUs[BURST_SLOTS];  // edge time of the burst in each buffer
+    int fillSlot;            // buffer the next queued read goes to
+    int doneSlot;            // buffer of the oldest read still on the bus
+    volatile int readySlot;  // newest completed buffer
+    volatile int readingSlot;  // buffer the sampling thread is copying, -1 when none
+    volatile uint8_t burstStarts[BURST_SLOTS];  // reads started into each buffer
+    uint8_t readyStarts;     // burstStarts of readySlot when it completed
+    uint32_t burstOverwrites;  // copies whose buffer a newer read was started into
+    uint32_t queueRejects;   // edges dropped because every buffer or the bus queue was busy
+    uint32_t burstErrors;    // queued reads the board did not ACK
+    uint8_t sampleDivider;   // SMPLRT_DIV outside FIFO mode, rate = 1 kHz / (1 + divider)
+
+    // Interrupt to fused quaternion latency
+    uint32_t latencyCount;
+    uint32_t latencyMinUs;
+    uint32_t latencyMaxUs;
+    uint64_t latencySumUs;
+    uint32_t latencyBuckets[LATENCY_BUCKETS];
+
     //output rate
     Timer t;
     int delt_t;        // used to control display output rate
     int count;         // used to control display output rate
 
+    // binary telemetry output, see QuatFrame.h
+    uint8_t frameType;       // QUAT_FRAME_FLOAT, QUAT_FRAME_Q15 or QUAT_FRAME_RAW to add the raw counts
+    uint8_t outputMode;      // OUTPUT_QUATERNION, or an OUTPUT_EULER_ mode for QUAT_FRAME_EULER frames
+    uint16_t frameSeq;       // sequence number of the next frame
+    uint8_t frame[QUAT_FRAME_MAX_SIZE];
+
 
     MPU9250(I2C &i2c_port, uint8_t address, uint8_t board):i2c(&i2c_port){
 
@@ -251,6 +348,7 @@ class MPU9250 {
     q[1] = 0.0f;
     q[2] = 0.0f;
     q[3] = 0.0f;
+    pitch = yaw = roll = 0.0f;
 
     // vector to hold integral error for Mahony method
     eInt[0] = 0.0f;
@@ -295,6 +393,38 @@ class MPU9250 {
     sum = 0;
     sumCount = 0;
 
+    fifoMode = false;
+    fifoPeriod = 0.001f;
+    fifoDivider = 0;
+    fifoDrainUs = 0;
+    fifoOverflows = 0;
+
+    intPin = NULL;
+    irqUs = 0;
+    irqEdges = 0;
+    wakeEdges = 1;
+    lastSampleUs = 0;
+    interruptTimeouts = 0;
+    interruptOverruns = 0;
+    busReady = NULL;
+    resetLatency();
+
+    queue = NULL;
+    fillSlot = doneSlot = 0;
+    readySlot = BURST_SLOTS - 1;
+    readingSlot = -1;
+    memset((void *)burstStarts, 0, sizeof(burstStarts));
+    readyStarts = 0;
+    burstOverwrites = 0;
+    memset(burstUs, 0, sizeof(burstUs));
+    queueRejects = 0;
+    burstErrors = 0;
+    sampleDivider = 4;
+
+    frameType = QUAT_FRAME_FLOAT;
+    outputMode = OUTPUT_QUATERNION;
+    frameSeq = 0;
+
     MPU9250_ADDRESS = address;
 
     }
@@ -326,14 +456,15 @@ class MPU9250 {
     }
 
     void readBytes(uint8_t address, uint8_t subAddress, uint8_t count, uint8_t * dest){
-        char data[14];
+        readBurst(address, subAddress, count, dest);
+    }
+
+    // Read count bytes straight into dest in one transaction, no scratch copy or size limit
+    void readBurst(uint8_t address, uint8_t subAddress, uint16_t count, uint8_t * dest){
         char data_write[1];
         data_write[0] = subAddress;
         i2c->write(address, data_write, 1, 1); // no stop
-        i2c->read(address, data, count, 0);
-        for(int ii = 0; ii < count; ii++) {
-         dest[ii] = data[ii];
-        }
+        i2c->read(address, (char *)dest, count, 0);
     }
 
     void getMres(){
@@ -423,12 +554,234 @@ class MPU9250 {
       //pc.printf("out");
     }
 
+    // Accel, temperature and gyro in one transaction instead of three. The registers are big
+    // endian; the Cortex-M3 (and the host build) are little endian, so swap each pair.
+    void readSensorSnapshot(SensorSnapshot &snapshot){
+      uint8_t * raw = (uint8_t *)&snapshot;
+      readBurst(MPU9250_ADDRESS, ACCEL_XOUT_H, SENSOR_SNAPSHOT_SIZE, raw);
+      for (int i = 0; i < SENSOR_SNAPSHOT_SIZE; i += 2) {
+        uint8_t high = raw[i];
+        raw[i] = raw[i + 1];
+        raw[i + 1] = high;
+      }
+    }
+
     int16_t readTempData(){
       uint8_t rawData[2];  // x/y/z gyro register data stored here
       readBytes(MPU9250_ADDRESS, TEMP_OUT_H, 2, &rawData[0]);  // Read the two raw data registers sequentially into data array 
       return (int16_t)(((int16_t)rawData[0]) << 8 | rawData[1]) ;  // Turn the MSB and LSB into a 16-bit value
     }
 
+    // Convert the raw counts into g, deg/s and milliGauss
+    void scaleRawData(){
+      ax = (float)accelCount[0]*aRes - accelBias[0];  // get actual g value, this depends on scale being set
+      ay = (float)accelCount[1]*aRes - accelBias[1];
+      az = (float)accelCount[2]*aRes - accelBias[2];
+      gx = (float)gyroCount[0]*gRes - gyroBias[0];  // get actual gyro value, this depends on scale being set
+      gy = (float)gyroCount[1]*gRes - gyroBias[1];
+      gz = (float)gyroCount[2]*gRes - gyroBias[2];
+      // Include factory calibration per data sheet and user environmental corrections
+      mx = (float)magCount[0]*mRes*magCalibration[0] - magbias[0];  // get actual magnetometer value, this depends on scale being set
+      my = (float)magCount[1]*mRes*magCalibration[1] - magbias[1];
+      mz = (float)magCount[2]*mRes*magCalibration[2] - magbias[2];
+    }
+
+    // Switch to FIFO streaming after initMPU9250() and initAK8963().
+    // The MPU9250 samples at 1 kHz / (1 + fifoDivider) and its I2C master reads the AK8963
+    // on every sample, so the host only needs one FIFO_COUNT read and one burst read per
+    // drain. At 1 kHz one board's packets take about half of a 400 kHz bus, so boards
+    // sharing a bus need fifoDivider >= 1, and four boards behind the one mbed I2C mutex
+    // need 2.
+    void initFIFOMode(){
+      writeByte(MPU9250_ADDRESS, FIFO_EN, 0x00);        // Stop filling the FIFO
+      writeByte(MPU9250_ADDRESS, USER_CTRL, 0x00);      // Disable FIFO and I2C master
+      writeByte(MPU9250_ADDRESS, USER_CTRL, 0x06);      // Reset FIFO and I2C master
+      wait(0.01);
+
+      writeByte(MPU9250_ADDRESS, SMPLRT_DIV, fifoDivider);  // 1 kHz by default, DLPF in CONFIG is still 41/42 Hz
+      fifoPeriod = (1 + fifoDivider) / 1000.0f;
+
+      writeByte(MPU9250_ADDRESS, INT_PIN_CFG, 0x20);    // Latch INT, clear I2C_BYPASS_EN
+      initMagSlave();
+
+      writeByte(MPU9250_ADDRESS, USER_CTRL, 0x60);      // Enable FIFO and I2C master
+      writeByte(MPU9250_ADDRESS, FIFO_EN, 0xF9);        // Temperature, gyro x/y/z, accel and SLV0 into the FIFO
+      writeByte(MPU9250_ADDRESS, INT_ENABLE, 0x11);     // FIFO overflow and data ready interrupts
+      fifoMode = true;
+    }
+
+    // Put the AK8963 behind the MPU9250 I2C master instead of the bypass: SLV0 copies
+    // its data and ST2 to EXT_SENS_DATA_00..06 on every sample. Enable the master in USER_CTRL.
+    void initMagSlave(){
+      writeByte(MPU9250_ADDRESS, I2C_MST_CTRL, 0x0D);   // 400 kHz master clock
+      writeByte(MPU9250_ADDRESS, I2C_SLV0_ADDR, 0x80 | (AK8963_ADDRESS >> 1)); // Read from the 7-bit AK8963 address
+      writeByte(MPU9250_ADDRESS, I2C_SLV0_REG, AK8963_XOUT_L);
+      writeByte(MPU9250_ADDRESS, I2C_SLV0_CTRL, 0x80 | 7); // Enable, 7 bytes: data and ST2 so the AK8963 releases the next sample
+    }
+
+    void resetFIFO(){
+      writeByte(MPU9250_ADDRESS, USER_CTRL, 0x60 | 0x04); // FIFO_RST self-clears, FIFO and master stay enabled
+    }
+
+    // Unpack one FIFO_PACKET_SIZE packet: a FIFO packet, or the same registers read directly
+    void decodePacket(const uint8_t * rawData){
+      accelCount[0] = (int16_t)(((int16_t)rawData[0] << 8) | rawData[1]);
+      accelCount[1] = (int16_t)(((int16_t)rawData[2] << 8) | rawData[3]);
+      accelCount[2] = (int16_t)(((int16_t)rawData[4] << 8) | rawData[5]);
+      tempCount     = (int16_t)(((int16_t)rawData[6] << 8) | rawData[7]);
+      gyroCount[0]  = (int16_t)(((int16_t)rawData[8] << 8) | rawData[9]);
+      gyroCount[1]  = (int16_t)(((int16_t)rawData[10] << 8) | rawData[11]);
+      gyroCount[2]  = (int16_t)(((int16_t)rawData[12] << 8) | rawData[13]);
+      if (!(rawData[20] & 0x08)) { // ST2 magnetic overflow, keep the previous reading
+        magCount[0] = (int16_t)(((int16_t)rawData[15] << 8) | rawData[14]); // AK8963 data is little endian
+        magCount[1] = (int16_t)(((int16_t)rawData[17] << 8) | rawData[16]);
+        magCount[2] = (int16_t)(((int16_t)rawData[19] << 8) | rawData[18]);
+      }
+    }
+
+    // Use the MPU9250 INT output instead of polling. Call before Calculations()/begin();
+    // the pin is wired to the board's INT pad.
+    void attachInterrupt(InterruptIn &pin){
+      intPin = &pin;
+    }
+
+    // Fetch the register burst through a per-bus queue: the INT handler submits the read and
+    // update() only decodes the result, so the bus fetches the next sample while this one is
+    // fused and boards on different buses transfer at the same time. Needs attachInterrupt();
+    // FIFO mode keeps its blocking reads since the burst length depends on FIFO_COUNT.
+    void attachQueue(I2CQueue &busQueue){
+      queue = &busQueue;
+    }
+
+    // Called at the end of begin() when a pin is attached. INT becomes a 50 us active high
+    // pulse per data ready, so no INT_STATUS read is needed to re-arm it. Without the FIFO the
+    // AK8963 is moved behind the I2C master too, so one burst from ACCEL_XOUT_H covers all sensors.
+    void initInterruptMode(){
+      if (!fifoMode) {
+        writeByte(MPU9250_ADDRESS, USER_CTRL, 0x00);    // Disable I2C master
+        writeByte(MPU9250_ADDRESS, USER_CTRL, 0x02);    // Reset I2C master
+        wait(0.01);
+        initMagSlave();
+        writeByte(MPU9250_ADDRESS, USER_CTRL, 0x20);    // Enable I2C master, FIFO stays off
+      }
+      writeByte(MPU9250_ADDRESS, INT_PIN_CFG, 0x00);    // Active high, push-pull, 50 us pulse, bypass off
+      writeByte(MPU9250_ADDRESS, INT_ENABLE, 0x01);     // Data ready only
+
+      // In FIFO mode wake up once half a burst has been queued
+      wakeEdges = fifoMode ? FIFO_BURST_PACKETS / 2 : 1;
+      irqEdges = 0;
+      irqUs = lastSampleUs = t.read_us();
+      intPin->rise(callback(this, &MPU9250::onDataReady));
+    }
+
+    // INT handler: timestamp the edge and wake the sampling thread, or with a queue
+    // start the burst read and let its completion wake the thread
+    void onDataReady(){
+      if (++irqEdges < wakeEdges) return;
+      irqEdges = 0;
+      if (queue != NULL && !fifoMode) {
+        // Never refill the newest result or the buffer being copied; reads complete
+        // in order, so this also keeps two reads from sharing a buffer
+        if (fillSlot == readySlot || fillSlot == readingSlot) {
+          queueRejects++;
+          return;
+        }
+        burstUs[fillSlot] = t.read_us();
+        burstStarts[fillSlot]++;
+        if (queue->read(MPU9250_ADDRESS, ACCEL_XOUT_H, burstBuffer[fillSlot], FIFO_PACKET_SIZE, &MPU9250::burstDone, this)) {
+          fillSlot = (fillSlot + 1) % BURST_SLOTS;
+        } else {
+          queueRejects++;
+        }
+        return;
+      }
+      irqUs = t.read_us();
+      signalReady();
+    }
+
+    static void burstDone(void *context, int status){
+      ((MPU9250 *)context)->onBurstDone(status);
+    }
+
+    // Queued burst finished, in the bus event context
+    void onBurstDone(int status){
+      int slot = doneSlot;
+      doneSlot = (doneSlot + 1) % BURST_SLOTS;
+      if (status != 0) {
+        burstErrors++;
+        return;
+      }
+      core_util_critical_section_enter();   // the sampling thread takes both at once
+      readyStarts = burstStarts[slot];
+      readySlot = slot;
+      core_util_critical_section_exit();
+      irqUs = burstUs[slot];
+      signalReady();
+    }
+
+    void signalReady(){
+      dataReady.release();
+      if (busReady != NULL) busReady->release();
+    }
+
+    void resetLatency(){
+      latencyCount = 0;
+      latencyMinUs = 0xFFFFFFFF;
+      latencyMaxUs = 0;
+      latencySumUs = 0;
+      for (int i = 0; i < LATENCY_BUCKETS; i++) latencyBuckets[i] = 0;
+    }
+
+    void recordLatency(uint32_t us){
+      int bucket = 0;
+      while (bucket < LATENCY_BUCKETS - 1 && (us >> (bucket + 1)) != 0) bucket++; // floor(log2(us))
+      latencyBuckets[bucket]++;
+      latencyCount++;
+      latencySumUs += us;
+      if (us < latencyMinUs) latencyMinUs = us;
+      if (us > latencyMaxUs) latencyMaxUs = us;
+    }
+
+    // Upper bound of the bucket holding the given fraction of the samples, e.g. 0.99
+    uint32_t latencyPercentileUs(float fraction){
+      uint32_t target = (uint32_t)(fraction * latencyCount), seen = 0;
+      for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latencyBuckets[i];
+        if (seen > target) return 2u << i;
+      }
+      return latencyMaxUs;
+    }
+
+    // Text report for bench runs, it shares the UART with the binary frames
+    void printLatency(){
+      pc.printf("Board %d: %lu samples, interrupt to quaternion min %lu avg %lu p99 < %lu max %lu us, %lu timeouts, %lu overruns\n\r",
+                boardNo, (unsigned long)latencyCount, (unsigned long)(latencyCount ? latencyMinUs : 0),
+                (unsigned long)(latencyCount ? latencySumUs / latencyCount : 0), (unsigned long)latencyPercentileUs(0.99f),
+                (unsigned long)latencyMaxUs, (unsigned long)interruptTimeouts, (unsigned long)interruptOverruns);
+    }
+
+    // Drain up to FIFO_BURST_PACKETS packets into dest with one burst read.
+    // Returns the number of packets read.
+    int readFIFOPackets(uint8_t * dest){
+      uint8_t countData[2];
+      readBurst(MPU9250_ADDRESS, FIFO_COUNTH, 2, &countData[0]);
+      uint16_t fifoCount = ((uint16_t)(countData[0] & 0x1F) << 8) | countData[1];
+
+      if (fifoCount >= FIFO_SIZE - FIFO_PACKET_SIZE) {
+        // About to wrap: old packets would be overwritten mid-packet, so start over aligned
+        resetFIFO();
+        fifoOverflows++;
+        return 0;
+      }
+
+      int packets = fifoCount / FIFO_PACKET_SIZE;
+      if (packets > FIFO_BURST_PACKETS) packets = FIFO_BURST_PACKETS;
+      if (packets == 0) return 0;
+
+      readBurst(MPU9250_ADDRESS, FIFO_R_W, packets * FIFO_PACKET_SIZE, dest);
+      return packets;
+    }
+
     void resetMPU9250(){
       // reset device
       writeByte(MPU9250_ADDRESS, PWR_MGMT_1, 0x80); // Write a one to bit 7 reset bit; toggle reset device
@@ -471,7 +824,7 @@ class MPU9250 {
       writeByte(MPU9250_ADDRESS, CONFIG, 0x03);
 
      // Set sample rate = gyroscope output rate/(1 + SMPLRT_DIV)
-      writeByte(MPU9250_ADDRESS, SMPLRT_DIV, 0x04);  // Use a 200 Hz rate; the same rate set in CONFIG above
+      writeByte(MPU9250_ADDRESS, SMPLRT_DIV, sampleDivider);  // 200 Hz by default; the DLPF in CONFIG above limits the bandwidth to 41 Hz
 
      // Set gyroscope full scale range
      // Range selects FS_SEL and AFS_SEL are 0 - 3, so 2-bit values are left-shifted into positions 4:3
@@ -654,7 +1007,7 @@ class MPU9250 {
 
        uint8_t rawData[6] = {0, 0, 0, 0, 0, 0};
        uint8_t selfTest[6];
-       int16_t gAvg[3], aAvg[3], aSTAvg[3], gSTAvg[3];
+       int32_t gAvg[3] = {0}, aAvg[3] = {0}, aSTAvg[3] = {0}, gSTAvg[3] = {0};  // sums of 200 readings
        float factoryTrim[6];
        uint8_t FS = 0;
 
@@ -743,193 +1096,42 @@ class MPU9250 {
     // device orientation -- which can be converted to yaw, pitch, and roll. Useful for stabilizing quadcopters, etc.
     // The performance of the orientation filter is at least as good as conventional Kalman-based filtering algorithms
     // but is much less computationally intensive---it can be performed on a 3.3 V Pro Mini operating at 8 MHz!
+    // Both filter bodies are in Fusion.h, shared with the fixed point and host variants.
 
+    // The kernels take accel and mag at any scale; 1/4 g and 1/1024 mG keep them in the Q30
+    // range and are exact in float. The float results are not those of the filter code the
+    // kernels replaced, with or without FUSION_EXACT: the old Mahony integrated q2..q4 from the
+    // already updated q1, and dt now comes in with the gyro and gains. Over 10 s of
+    // mpu9250_sim the quaternions stay within 0.18 deg of the old ones, 0.07 deg rms.
     void MadgwickQuaternionUpdate(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz){
-                float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
-                float norm;
-                float hx, hy, _2bx, _2bz;
-                float s1, s2, s3, s4;
-                float qDot1, qDot2, qDot3, qDot4;
-
-                // Auxiliary variables to avoid repeated arithmetic
-                float _2q1mx;
-                float _2q1my;
-                float _2q1mz;
-                float _2q2mx;
-                float _4bx;
-                float _4bz;
-                float _2q1 = 2.0f * q1;
-                float _2q2 = 2.0f * q2;
-                float _2q3 = 2.0f * q3;
-                float _2q4 = 2.0f * q4;
-                float _2q1q3 = 2.0f * q1 * q3;
-                float _2q3q4 = 2.0f * q3 * q4;
-                float q1q1 = q1 * q1;
-                float q1q2 = q1 * q2;
-                float q1q3 = q1 * q3;
-                float q1q4 = q1 * q4;
-                float q2q2 = q2 * q2;
-                float q2q3 = q2 * q3;
-                float q2q4 = q2 * q4;
-                float q3q3 = q3 * q3;
-                float q3q4 = q3 * q4;
-                float q4q4 = q4 * q4;
-
-                // Normalise accelerometer measurement
-                norm = sqrt(ax * ax + ay * ay + az * az);
-                if (norm == 0.0f) return; // handle NaN
-                norm = 1.0f/norm;
-                ax *= norm;
-                ay *= norm;
-                az *= norm;
-
-                // Normalise magnetometer measurement
-                norm = sqrt(mx * mx + my * my + mz * mz);
-                if (norm == 0.0f) return; // handle NaN
-                norm = 1.0f/norm;
-                mx *= norm;
-                my *= norm;
-                mz *= norm;
-
-                // Reference direction of Earth's magnetic field
-                _2q1mx = 2.0f * q1 * mx;
-                _2q1my = 2.0f * q1 * my;
-                _2q1mz = 2.0f * q1 * mz;
-                _2q2mx = 2.0f * q2 * mx;
-                hx = mx * q1q1 - _2q1my * q4 + _2q1mz * q3 + mx * q2q2 + _2q2 * my * q3 + _2q2 * mz * q4 - mx * q3q3 - mx * q4q4;
-                hy = _2q1mx * q4 + my * q1q1 - _2q1mz * q2 + _2q2mx * q3 - my * q2q2 + my * q3q3 + _2q3 * mz * q4 - my * q4q4;
-                _2bx = sqrt(hx * hx + hy * hy);
-                _2bz = -_2q1mx * q3 + _2q1my * q2 + mz * q1q1 + _2q2mx * q4 - mz * q2q2 + _2q3 * my * q4 - mz * q3q3 + mz * q4q4;
-                _4bx = 2.0f * _2bx;
-                _4bz = 2.0f * _2bz;
-
-                // Gradient decent algorithm corrective step
-                s1 = -_2q3 * (2.0f * q2q4 - _2q1q3 - ax) + _2q2 * (2.0f * q1q2 + _2q3q4 - ay) - _2bz * q3 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q4 + _2bz * q2) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q3 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-                s2 = _2q4 * (2.0f * q2q4 - _2q1q3 - ax) + _2q1 * (2.0f * q1q2 + _2q3q4 - ay) - 4.0f * q2 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) + _2bz * q4 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q3 + _2bz * q1) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q4 - _4bz * q2) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-                s3 = -_2q1 * (2.0f * q2q4 - _2q1q3 - ax) + _2q4 * (2.0f * q1q2 + _2q3q4 - ay) - 4.0f * q3 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) + (-_4bx * q3 - _2bz * q1) * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q2 + _2bz * q4) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q1 - _4bz * q3) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-                s4 = _2q2 * (2.0f * q2q4 - _2q1q3 - ax) + _2q3 * (2.0f * q1q2 + _2q3q4 - ay) + (-_4bx * q4 + _2bz * q2) * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q1 + _2bz * q3) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q2 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-                norm = sqrt(s1 * s1 + s2 * s2 + s3 * s3 + s4 * s4);    // normalise step magnitude
-                norm = 1.0f/norm;
-                s1 *= norm;
-                s2 *= norm;
-                s3 *= norm;
-                s4 *= norm;
-
-                // Compute rate of change of quaternion
-                qDot1 = 0.5f * (-q2 * gx - q3 * gy - q4 * gz) - beta * s1;
-                qDot2 = 0.5f * (q1 * gx + q3 * gz - q4 * gy) - beta * s2;
-                qDot3 = 0.5f * (q1 * gy - q2 * gz + q4 * gx) - beta * s3;
-                qDot4 = 0.5f * (q1 * gz + q2 * gy - q3 * gx) - beta * s4;
-
-                // Integrate to yield quaternion
-                q1 += qDot1 * deltat;
-                q2 += qDot2 * deltat;
-                q3 += qDot3 * deltat;
-                q4 += qDot4 * deltat;
-                norm = sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);    // normalise quaternion
-                norm = 1.0f/norm;
-                q[0] = q1 * norm;
-                q[1] = q2 * norm;
-                q[2] = q3 * norm;
-                q[3] = q4 * norm;
-
+                typedef FUSION_TYPE T;
+                typedef FusionKernel<T, FusionMath<T, FUSION_EXACT> > Kernel;
+                float halfDt = 0.5f * deltat;
+                T fq[4] = { T(q[0]), T(q[1]), T(q[2]), T(q[3]) };
+                Kernel::Madgwick(fq, T(ax * 0.25f), T(ay * 0.25f), T(az * 0.25f),
+                                 T(gx * halfDt), T(gy * halfDt), T(gz * halfDt),
+                                 T(mx * (1.0f / 1024)), T(my * (1.0f / 1024)), T(mz * (1.0f / 1024)), T(beta * deltat));
+                for (int i = 0; i < 4; i++) q[i] = fusionToFloat(fq[i]);
             }
 
     // Similar to Madgwick scheme but uses proportional and integral filtering on the error between estimated reference vectors and
     // measured ones.
     void MahonyQuaternionUpdate(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz){
-                float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
-                float norm;
-                float hx, hy, bx, bz;
-                float vx, vy, vz, wx, wy, wz;
-                float ex, ey, ez;
-                float pa, pb, pc;
-
-                // Auxiliary variables to avoid repeated arithmetic
-                float q1q1 = q1 * q1;
-                float q1q2 = q1 * q2;
-                float q1q3 = q1 * q3;
-                float q1q4 = q1 * q4;
-                float q2q2 = q2 * q2;
-                float q2q3 = q2 * q3;
-                float q2q4 = q2 * q4;
-                float q3q3 = q3 * q3;
-                float q3q4 = q3 * q4;
-                float q4q4 = q4 * q4;
-
-                // Normalise accelerometer measurement
-                norm = sqrt(ax * ax + ay * ay + az * az);
-                if (norm == 0.0f) return; // handle NaN
-                norm = 1.0f / norm;        // use reciprocal for division
-                ax *= norm;
-                ay *= norm;
-                az *= norm;
-
-                // Normalise magnetometer measurement
-                norm = sqrt(mx * mx + my * my + mz * mz);
-                if (norm == 0.0f) return; // handle NaN
-                norm = 1.0f / norm;        // use reciprocal for division
-                mx *= norm;
-                my *= norm;
-                mz *= norm;
-
-                // Reference direction of Earth's magnetic field
-                hx = 2.0f * mx * (0.5f - q3q3 - q4q4) + 2.0f * my * (q2q3 - q1q4) + 2.0f * mz * (q2q4 + q1q3);
-                hy = 2.0f * mx * (q2q3 + q1q4) + 2.0f * my * (0.5f - q2q2 - q4q4) + 2.0f * mz * (q3q4 - q1q2);
-                bx = sqrt((hx * hx) + (hy * hy));
-                bz = 2.0f * mx * (q2q4 - q1q3) + 2.0f * my * (q3q4 + q1q2) + 2.0f * mz * (0.5f - q2q2 - q3q3);
-
-                // Estimated direction of gravity and magnetic field
-                vx = 2.0f * (q2q4 - q1q3);
-                vy = 2.0f * (q1q2 + q3q4);
-                vz = q1q1 - q2q2 - q3q3 + q4q4;
-                wx = 2.0f * bx * (0.5f - q3q3 - q4q4) + 2.0f * bz * (q2q4 - q1q3);
-                wy = 2.0f * bx * (q2q3 - q1q4) + 2.0f * bz * (q1q2 + q3q4);
-                wz = 2.0f * bx * (q1q3 + q2q4) + 2.0f * bz * (0.5f - q2q2 - q3q3);
-
-                // Error is cross product between estimated direction and measured direction of gravity
-                ex = (ay * vz - az * vy) + (my * wz - mz * wy);
-                ey = (az * vx - ax * vz) + (mz * wx - mx * wz);
-                ez = (ax * vy - ay * vx) + (mx * wy - my * wx);
-                if (Ki > 0.0f)
-                {
-                    eInt[0] += ex;      // accumulate integral error
-                    eInt[1] += ey;
-                    eInt[2] += ez;
-                }
-                else
-                {
-                    eInt[0] = 0.0f;     // prevent integral wind up
-                    eInt[1] = 0.0f;
-                    eInt[2] = 0.0f;
-                }
-
-                // Apply feedback terms
-                gx = gx + Kp * ex + Ki * eInt[0];
-                gy = gy + Kp * ey + Ki * eInt[1];
-                gz = gz + Kp * ez + Ki * eInt[2];
-
-                // Integrate rate of change of quaternion
-                pa = q2;
-                pb = q3;
-                pc = q4;
-                q1 = q1 + (-q2 * gx - q3 * gy - q4 * gz) * (0.5f * deltat);
-                q2 = pa + (q1 * gx + pb * gz - pc * gy) * (0.5f * deltat);
-                q3 = pb + (q1 * gy - pa * gz + pc * gx) * (0.5f * deltat);
-                q4 = pc + (q1 * gz + pa * gy - pb * gx) * (0.5f * deltat);
-
-                // Normalise quaternion
-                norm = sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);
-                norm = 1.0f / norm;
-                q[0] = q1 * norm;
-                q[1] = q2 * norm;
-                q[2] = q3 * norm;
-                q[3] = q4 * norm;
-
+                typedef FUSION_TYPE T;
+                typedef FusionKernel<T, FusionMath<T, FUSION_EXACT> > Kernel;
+                float halfDt = 0.5f * deltat;
+                T fq[4] = { T(q[0]), T(q[1]), T(q[2]), T(q[3]) };
+                T fe[3] = { T(eInt[0]), T(eInt[1]), T(eInt[2]) };
+                Kernel::Mahony(fq, fe, T(ax * 0.25f), T(ay * 0.25f), T(az * 0.25f),
+                               T(gx * halfDt), T(gy * halfDt), T(gz * halfDt),
+                               T(mx * (1.0f / 1024)), T(my * (1.0f / 1024)), T(mz * (1.0f / 1024)), T(Kp * deltat), T(Ki * deltat));
+                for (int i = 0; i < 4; i++) q[i] = fusionToFloat(fq[i]);
+                for (int i = 0; i < 3; i++) eInt[i] = fusionToFloat(fe[i]);
             }
 
 
   void led2_thread(void const *args) {
+    (void)args;
     while (true) {
         pc.printf("mama");
         Thread::wait(1000);
@@ -938,7 +1140,21 @@ class MPU9250 {
 
 
 
-    void Calculations(){
+    // Encode the current quaternion as one binary frame instead of formatted text.
+    // dest holds QUAT_FRAME_MAX_SIZE bytes; returns the frame length.
+    int encodeQuaternionFrame(uint8_t * dest){
+        int16_t raw[QUAT_FRAME_RAW_COUNTS] = {
+            accelCount[0], accelCount[1], accelCount[2], gyroCount[0], gyroCount[1], gyroCount[2],
+            magCount[0], magCount[1], magCount[2], tempCount
+        };
+        float euler[3] = { yaw, pitch, roll };
+        uint8_t type = outputMode == OUTPUT_QUATERNION ? frameType : QUAT_FRAME_EULER;
+        return quatFrameEncode(dest, type, boardNo, frameSeq++, (uint32_t)t.read_us(), q, raw, euler);
+    }
+
+    // Probe, self test, calibrate and configure the board for streaming.
+    // Returns false when the board does not answer.
+    bool begin(){
         t.start();
         // Read the WHO_AM_I register, this is a good test of communication
         uint8_t whoami = readByte(MPU9250_ADDRESS, WHO_AM_I_MPU9250);  // Read WHO_AM_I register for MPU-9250
@@ -981,7 +1197,7 @@ class MPU9250 {
             //pc.printf("Could not connect to MPU9250: \n\r");
             //pc.printf("%#x \n",  whoami);
             //sprintf(buffer, "WHO_AM_I 0x%x", whoami);
-            while(1) ; // Loop forever if communication doesn't happen
+            return false; // Board not fitted
        }
 
 
@@ -995,31 +1211,125 @@ class MPU9250 {
         magbias[1] = 55.780052;  // User environmental x-axis correction in milliGauss
         magbias[2] = -177.798920;  // User environmental x-axis correction in milliGauss
 
+        lastSampleUs = t.read_us();
+        if (fifoMode) {
+            initFIFOMode(); // last, so the FIFO does not overflow during the settling waits
+        }
+        if (intPin != NULL) {
+            initInterruptMode();
+        }
+        return true;
+    }
 
+    // Wait for and read the next samples into dest as FIFO_PACKET_SIZE packets (accel,
+    // temperature, gyro, then the AK8963 data and ST2), up to FIFO_BURST_PACKETS in FIFO
+    // mode. eventUs gets the time of the data-ready edge and period the spacing of the
+    // packets. Returns the number of packets. This is the acquisition half of update();
+    // Pipeline.h runs it on a thread of its own, so it touches no fusion state.
+    int acquireSamples(uint8_t * dest, int &eventUs, float &period, uint32_t waitMs = INT_WAIT_MS){
+        int32_t wakeups = 0;
+
+        if (intPin != NULL) {
+            // Sleep until the INT pin reports new data instead of polling the bus
+            wakeups = dataReady.wait(waitMs);
+            if (wakeups <= 0) {
+                if (waitMs > 0) interruptTimeouts++;
+            } else if (!fifoMode) {
+                while (dataReady.wait(0) > 0) {
+                    interruptOverruns++; // the registers only hold the newest sample anyway
+                }
+            }
+            eventUs = irqUs;
+        } else {
+            if (fifoMode) {
+                // No watermark edge to wait for: sleep until half a burst has queued
+                // instead of spinning on FIFO_COUNT
+                int dueUs = fifoDrainUs + (int)(FIFO_BURST_PACKETS / 2 * fifoPeriod * 1000000.0f) - t.read_us();
+                if (dueUs > 0) {
+                    if (waitMs == 0) return 0;
+                    uint32_t ms = (uint32_t)(dueUs + 999) / 1000;
+                    Thread::wait(ms < waitMs ? ms : waitMs);
+                }
+                fifoDrainUs = t.read_us();
+            }
+            eventUs = t.read_us();
+        }
 
+        if (fifoMode) {
+            // With the pin the bus is only read at a watermark, or after a timeout in
+            // case an edge was missed; a check without waiting leaves it alone
+            if (intPin != NULL && wakeups <= 0 && waitMs == 0) return 0;
+            // Every queued sample is fused with the FIFO sample period
+            period = fifoPeriod;
+            return readFIFOPackets(dest);
+        }
+        if (intPin != NULL) {
+            if (wakeups <= 0) return 0;
+            if (queue != NULL) {
+                // Hold the buffer so the INT handler starts no read into it meanwhile
+                core_util_critical_section_enter();
+                int slot = readingSlot = readySlot;
+                uint8_t starts = readyStarts;
+                core_util_critical_section_exit();
+                memcpy(dest, burstBuffer[slot], FIFO_PACKET_SIZE); // already read by the queue
+                if (burstStarts[slot] != starts) burstOverwrites++;
+                readingSlot = -1;
+            } else {
+                readBurst(MPU9250_ADDRESS, ACCEL_XOUT_H, FIFO_PACKET_SIZE, dest);
+            }
+        } else {
+            // Polling leaves the AK8963 in bypass, so build the same packet from two reads
+            if (!(readByte(MPU9250_ADDRESS, INT_STATUS) & 0x01)) return 0;
+            readBurst(MPU9250_ADDRESS, ACCEL_XOUT_H, SENSOR_SNAPSHOT_SIZE, dest);
+            if (readByte(AK8963_ADDRESS, AK8963_ST1) & 0x01) {
+                readBurst(AK8963_ADDRESS, AK8963_XOUT_L, 7, dest + SENSOR_SNAPSHOT_SIZE);
+            } else {
+                dest[FIFO_PACKET_SIZE - 1] = 0x08; // no new mag data, decodePacket keeps the last one
+            }
+        }
+        period = (float)(eventUs - lastSampleUs) / 1000000.0f; // spacing of the data-ready edges
+        lastSampleUs = eventUs;
+        return 1;
+    }
 
+    // Fuse one packet of acquireSamples(), period seconds after the previous sample
+    void fuseSample(const uint8_t * packet, float period){
+        decodePacket(packet);
+        scaleRawData();
+        deltat = period;
+        sum += deltat;
+        sumCount++;
+        MahonyQuaternionUpdate(ax, ay, az, gx*PI/180.0f, gy*PI/180.0f, gz*PI/180.0f, my, mx, -mz);
+    }
 
-
-        while(1) {
+    // One acquisition, fusion and output step. Returns the number of new samples fused.
+    // With an interrupt pin waitMs bounds the wait for data; 0 only checks, which lets
+    // one thread round-robin several boards.
+    int update(uint32_t waitMs = INT_WAIT_MS){
+        int fused = 0;
+        int eventUs = 0;
+
+        if (intPin != NULL || fifoMode) {
+            float period;
+            fused = acquireSamples(fifoBuffer, eventUs, period, waitMs);
+            for (int p = 0; p < fused; p++) {
+                fuseSample(&fifoBuffer[p * FIFO_PACKET_SIZE], period);
+            }
+        } else {
 
         // If intPin goes high, all data registers have new data
         if(readByte(MPU9250_ADDRESS, INT_STATUS) & 0x01) {  // On interrupt, check if data ready interrupt
-            readAccelData(accelCount);  // Read the x/y/z adc values
-            // Now we'll calculate the accleration value into actual g's
-            ax = (float)accelCount[0]*aRes - accelBias[0];  // get actual g value, this depends on scale being set
-            ay = (float)accelCount[1]*aRes - accelBias[1];
-            az = (float)accelCount[2]*aRes - accelBias[2];
-            readGyroData(gyroCount);  // Read the x/y/z adc values
-            // Calculate the gyro value into actual degrees per second
-            gx = (float)gyroCount[0]*gRes - gyroBias[0];  // get actual gyro value, this depends on scale being set
-            gy = (float)gyroCount[1]*gRes - gyroBias[1];
-            gz = (float)gyroCount[2]*gRes - gyroBias[2];
+            SensorSnapshot snapshot;
+            readSensorSnapshot(snapshot);  // Read the x/y/z accel and gyro and the temperature adc values
+            for (int i = 0; i < 3; i++) {
+                accelCount[i] = snapshot.accel[i];
+                gyroCount[i] = snapshot.gyro[i];
+            }
+            tempCount = snapshot.temp;
             readMagData(magCount);  // Read the x/y/z adc values
-            // Calculate the magnetometer values in milliGauss
-            // Include factory calibration per data sheet and user environmental corrections
-            mx = (float)magCount[0]*mRes*magCalibration[0] - magbias[0];  // get actual magnetometer value, this depends on scale being set
-            my = (float)magCount[1]*mRes*magCalibration[1] - magbias[1];
-            mz = (float)magCount[2]*mRes*magCalibration[2] - magbias[2];
+            // Now we'll calculate the values in g's, degrees per second and milliGauss
+            scaleRawData();
+            fused = 1;
         }
 
         Now = t.read_us();
@@ -1029,30 +1339,47 @@ class MPU9250 {
         sum += deltat;
         sumCount++;
 
-        // Pass gyro rate as rad/s
-        //mpu9250.MadgwickQuaternionUpdate(ax, ay, az, gx*PI/180.0f, gy*PI/180.0f, gz*PI/180.0f,  my,  mx, mz);
-        MahonyQuaternionUpdate(ax, ay, az, gx*PI/180.0f, gy*PI/180.0f, gz*PI/180.0f, my, mx, mz);
+        // Pass gyro rate as rad/s. The AK8963 x/y axes are swapped and its z axis points
+        // down relative to the accel/gyro, so the magnetometer goes in as (my, mx, -mz).
+        //mpu9250.MadgwickQuaternionUpdate(ax, ay, az, gx*PI/180.0f, gy*PI/180.0f, gz*PI/180.0f,  my,  mx, -mz);
+        MahonyQuaternionUpdate(ax, ay, az, gx*PI/180.0f, gy*PI/180.0f, gz*PI/180.0f, my, mx, -mz);
+        }
+
+        if (intPin != NULL && fused > 0) {
+            recordLatency(t.read_us() - eventUs);
+        }
+
+        if (outputDue()) {
+            int length = outputFrame(frame);
+            uartTx.send(boardNo, frame, length);
+        }
+        return fused;
+    }
 
-        // Serial print and/or display at 0.5 s rate independent of data rates
+    // Serial print and/or display at 0.5 s rate independent of data rates
+    bool outputDue(){
         delt_t = t.read_ms() - count;
-       // if (delt_t > 500) { // update LCD once per half-second independent of read rate
-        if (delt_t > 5) { // update LCD once per 0.005s independent of read rate
+       // return delt_t > 500; // update LCD once per half-second independent of read rate
+        return delt_t > 5; // update LCD once per 0.005s independent of read rate
+    }
 
-           // pc.printf("ax = %f", 1000*ax);
-           // pc.printf(" ay = %f", 1000*ay);
-           // pc.printf(" az = %f  mg\n\r", 1000*az);
+    // The output of one tick: derive what the output mode needs and encode the frame into
+    // dest, which holds QUAT_FRAME_MAX_SIZE bytes. Returns the frame length.
+    int outputFrame(uint8_t * dest){
+       // pc.printf("ax = %f", 1000*ax);
+       // pc.printf(" ay = %f", 1000*ay);
+       // pc.printf(" az = %f  mg\n\r", 1000*az);
 
-           // pc.printf("gx = %f", gx);
-           // pc.printf(" gy = %f", gy);
-           // pc.printf(" gz = %f  deg/s\n\r", gz);
+       // pc.printf("gx = %f", gx);
+       // pc.printf(" gy = %f", gy);
+       // pc.printf(" gz = %f  deg/s\n\r", gz);
 
-           // pc.printf("gx = %f", mx);
-           // pc.printf(" gy = %f", my);
-           // pc.printf(" gz = %f  mG\n\r", mz);
+       // pc.printf("gx = %f", mx);
+       // pc.printf(" gy = %f", my);
+       // pc.printf(" gz = %f  mG\n\r", mz);
 
-            tempCount = readTempData();  // Read the adc values
-            temperature = ((float) tempCount) / 333.87f + 21.0f; // Temperature in degrees Centigrade
-           // pc.printf(" temperature = %f  C\n\r", temperature);
+        temperature = ((float) tempCount) / 333.87f + 21.0f; // Temperature in degrees Centigrade
+       // pc.printf(" temperature = %f  C\n\r", temperature);
 
 //           switch (boardNo) {
 //  case 1:
@@ -1072,59 +1399,48 @@ class MPU9250 {
 //  }
 
 
-            // Define output variables from updated quaternion---these are Tait-Bryan angles, commonly used in aircraft orientation.
-            // In this coordinate system, the positive z-axis is down toward Earth.
-            // Yaw is the angle between Sensor x-axis and Earth magnetic North (or true North if corrected for local declination, looking down on the sensor positive yaw is counterclockwise.
-            // Pitch is angle between sensor x-axis and Earth ground plane, toward the Earth is positive, up toward the sky is negative.
-            // Roll is angle between sensor y-axis and Earth ground plane, y-axis up is positive roll.
-            // These arise from the definition of the homogeneous rotation matrix constructed from quaternions.
-            // Tait-Bryan angles as well as Euler angles are non-commutative; that is, the get the correct orientation the rotations must be
-            // applied in the correct order which for this configuration is yaw, pitch, and then roll.
-            // For more see http://en.wikipedia.org/wiki/Conversion_between_quaternions_and_Euler_angles which has additional links.
-            //yaw   = atan2(2.0f * (q[1] * q[2] + q[0] * q[3]), q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3]);
-            yaw   = atan2(2.0f * (q[1] * q[2] + q[0] * q[3]), 1 - 2.0f * (q[2] * q[2] + q[3] * q[3]));
-            pitch = -asin(2.0f * (q[1] * q[3] - q[0] * q[2]));
-            roll  = atan2(2.0f * (q[0] * q[1] + q[2] * q[3]), q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3]);
-            pitch *= 180.0f / PI;
-            yaw   *= 180.0f / PI;
+        // Define output variables from updated quaternion---these are Tait-Bryan angles, commonly used in aircraft orientation.
+        // In this coordinate system, the positive z-axis is down toward Earth.
+        // Yaw is the angle between Sensor x-axis and Earth magnetic North (or true North if corrected for local declination, looking down on the sensor positive yaw is counterclockwise.
+        // Pitch is angle between sensor x-axis and Earth ground plane, toward the Earth is positive, up toward the sky is negative.
+        // Roll is angle between sensor y-axis and Earth ground plane, y-axis up is positive roll.
+        // These arise from the definition of the homogeneous rotation matrix constructed from quaternions.
+        // Tait-Bryan angles as well as Euler angles are non-commutative; that is, the get the correct orientation the rotations must be
+        // applied in the correct order which for this configuration is yaw, pitch, and then roll.
+        // For more see http://en.wikipedia.org/wiki/Conversion_between_quaternions_and_Euler_angles which has additional links.
+        // The conversion is in quaternionToEuler() of FastTrig.h and only runs when the
+        // angles are sent; the host derives its own from the quaternion otherwise.
+        if (outputMode != OUTPUT_QUATERNION) {
+            quaternionToEuler(q, outputMode - 1, &yaw, &pitch, &roll);
             //yaw   -= 13.8f; // Declination at Danville, California is 13 degrees 48 minutes and 47 seconds on 2014-04-04
             //yaw   -= -0.38f;  // Declination in London, UK
-            roll  *= 180.0f / PI;
-            //pc.printf("Yaw, Pitch, Roll: %f %f %f\n\r", yaw, pitch, roll);
-            //pc.printf("average rate = %f\n\r", (float) sumCount/sum);
-
-        switch (boardNo) {
- case 1:
-    pc.printf("Board 1:  roll = %f   pitch = %f   yaw = %f   \n\r", roll, pitch, yaw);
-    //pc.printf("Yaw, Pitch, Roll: %f %f %f\n\r", yaw, pitch, roll);
-    break;
- case 2:
-    pc.printf("Board 2:  roll = %f   pitch = %f   yaw = %f   \n\r", roll, pitch, yaw);
-    break;
-   case 3:
-    pc.printf("Board 3:  roll = %f   pitch = %f   yaw = %f   \n\r", roll, pitch, yaw);
-   break;
-     case 4:
-   pc.printf("Board 4:  roll = %f   pitch = %f   yaw = %f   \n\r", roll, pitch, yaw);
-   break;
-default:
-   pc.printf("unknown \n");
-}
+        }
+        //pc.printf("Yaw, Pitch, Roll: %f %f %f\n\r", yaw, pitch, roll);
+        //pc.printf("average rate = %f\n\r", (float) sumCount/sum);
 
-            count = t.read_ms();
+        int length = encodeQuaternionFrame(dest);
 
-            if(count > 1<<21) {
-                t.start(); // start the timer over again if ~30 minutes has passed
-                count = 0;
-                deltat= 0;
-                lastUpdate = t.read_us();
-            }
-            sum = 0;
-            sumCount = 0;
-        }
-               // Thread::wait(10);
+        count = t.read_ms();
 
+        if(count > 1<<21) {
+            t.start(); // start the timer over again if ~30 minutes has passed
+            count = 0;
+            deltat= 0;
+            lastUpdate = t.read_us();
+        }
+        sum = 0;
+        sumCount = 0;
+        return length;
     }
+
+    void Calculations(){
+        if (!begin()) {
+            return; // Board not fitted; let the other boards' threads have the CPU
+        }
+        while(1) {
+            update();
+               // Thread::wait(10);
+        }
     }
 
 
@@ -1134,7 +1450,7 @@ default:
  uint16_t ii = 0;
  uint16_t sample_count = 0;
  int32_t mag_bias[3] = {0, 0, 0}, mag_scale[3] = {0, 0, 0};
- int16_t mag_max[3] = {0x8000, 0x8000, 0x8000}, mag_min[3] = {0x7FFF, 0x7FFF, 0x7FFF}, mag_temp[3];
+ int16_t mag_max[3] = {-32768, -32768, -32768}, mag_min[3] = {32767, 32767, 32767}, mag_temp[3];
 
  pc.printf("Mag Calibration: Wave device in a figure eight until done!");
  wait(0.1);
@@ -0,0 +1,293 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include "mbed.h"
+#include "rtos.h"
+#include "MPU9250.h"
+
+// Acquisition, fusion and output of all boards as separate stages instead of one
+// Calculations() loop per board, so a slow UART write never delays a sensor read
+// and deltat only ever comes from the data-ready edges:
+//  - one acquisition thread per bus, at high priority, reads the samples of its
+//    boards and queues one SampleBlock per sample
+//  - one fusion thread runs the filter of whichever board a block belongs to and
+//    queues a FrameBlock at each output tick of that board
+//  - one transmit thread, at low priority, takes the frames of all boards in
+//    batches and hands them to the UART service of UartTx.h
+// The stages are connected by rtos::Mail, whose blocks live inside this object,
+// so nothing is allocated on the heap; give the threads static stacks too.
+// A full queue drops the newest block and counts it instead of blocking the stage
+// that produced it.
+
+#define PIPELINE_MAX_BUSES     2
+#define PIPELINE_BUS_BOARDS    2     // 0x68 and 0x69
+#define PIPELINE_SAMPLE_DEPTH  32    // sample blocks between acquisition and fusion
+#define PIPELINE_FRAME_DEPTH   16    // frame blocks between fusion and transmit
+#define PIPELINE_TX_BATCH      8     // frames taken per wakeup of the transmit thread
+#define PIPELINE_POLL_MS       1     // acquisition sleep per pass on a bus without INT pins
+
+// One sample from the acquisition to the fusion stage
+struct SampleBlock {
+    MPU9250 * board;
+    int eventUs;            // data-ready edge, on the board's timer
+    float period;           // seconds since the previous sample of the board
+    uint8_t packet[FIFO_PACKET_SIZE];
+};
+
+// One encoded frame from the fusion to the transmit stage
+struct FrameBlock {
+    MPU9250 * board;
+    int eventUs;            // data-ready edge of the newest sample in the frame
+    uint8_t length;
+    uint8_t data[QUAT_FRAME_MAX_SIZE];
+};
+
+// Time per item spent in a stage
+struct PipelineStage {
+    uint32_t count;
+    uint32_t maxUs;
+    uint64_t sumUs;
+};
+
+class Pipeline;
+
+struct PipelineBus {
+    Pipeline * owner;
+    int index;
+    int boardCount;
+    MPU9250 * boards[PIPELINE_BUS_BOARDS];
+    bool interrupts;        // every board has an INT pin, so the thread sleeps on ready
+    Semaphore ready;        // released by the data-ready handlers of the boards
+    PipelineStage stage;    // acquisition passes that found samples
+};
+
+class Pipeline {
+
+    public:
+
+    PipelineStage fuseStage;      // one sample, and its frame when output was due
+    PipelineStage transmitStage;  // one batch
+    PipelineStage latency;        // data-ready edge to the frame queued for the UART
+    uint32_t samplesQueued;       // sample blocks between acquisition and fusion now
+    uint32_t samplesHighWater;
+    uint32_t sampleDrops;         // samples read while every sample block was taken
+    uint32_t framesQueued;
+    uint32_t framesHighWater;
+    uint32_t frameDrops;          // output ticks that found no free frame block, retried on the next sample
+    uint32_t framesSent;          // frames handed to uartTx
+
+    Pipeline(){
+      for (int b = 0; b < PIPELINE_MAX_BUSES; b++) {
+        buses[b].owner = this;
+        buses[b].index = b;
+        buses[b].boardCount = 0;
+        buses[b].interrupts = false;
+      }
+      samplesQueued = framesQueued = 0;
+      resetStats();
+      clock.start();
+    }
+
+    // Serve board from the acquisition thread of bus 0 or 1. Call after attachInterrupt()
+    // and attachQueue() and before the threads start. Returns false when the bus is full.
+    bool addBoard(MPU9250 &board, int bus){
+      PipelineBus &b = buses[bus];
+      if (b.boardCount >= PIPELINE_BUS_BOARDS) return false;
+      b.boards[b.boardCount++] = &board;
+      b.interrupts = (b.boardCount == 1 || b.interrupts) && board.intPin != NULL;
+      board.busReady = &b.ready;
+      return true;
+    }
+
+    PipelineBus * bus(int index){
+      return &buses[index];
+    }
+
+    // One acquisition pass over a bus: wait up to waitMs for a data-ready edge, then
+    // queue a block for every new sample of its boards. Returns the samples queued.
+    int acquire(int index, uint32_t waitMs = INT_WAIT_MS){
+      PipelineBus &b = buses[index];
+      if (b.interrupts) {
+        b.ready.wait(waitMs);     // the boards are checked either way, a token may be stale
+      } else if (waitMs > 0) {
+        Thread::wait(PIPELINE_POLL_MS); // polling must leave the lower stages some CPU
+      }
+
+      int start = clock.read_us();
+      int queued = 0;
+      for (int i = 0; i < b.boardCount; i++) {
+        MPU9250 *board = b.boards[i];
+        int eventUs;
+        float period;
+        // fifoBuffer belongs to the acquisition side once a board is in a pipeline
+        int packets = board->acquireSamples(board->fifoBuffer, eventUs, period, 0);
+        for (int p = 0; p < packets; p++) {
+          SampleBlock *s = samples.alloc();
+          if (s == NULL) {
+            core_util_critical_section_enter();
+            sampleDrops++;
+            core_util_critical_section_exit();
+            continue;
+          }
+          s->board = board;
+          s->eventUs = eventUs;
+          s->period = period;
+          memcpy(s->packet, &board->fifoBuffer[p * FIFO_PACKET_SIZE], FIFO_PACKET_SIZE);
+          core_util_critical_section_enter();
+          samplesQueued++;
+          if (samplesQueued > samplesHighWater) samplesHighWater = samplesQueued;
+          core_util_critical_section_exit();
+          samples.put(s);
+          queued++;
+        }
+      }
+      if (queued > 0) {
+        record(b.stage, clock.read_us() - start);
+      }
+      return queued;
+    }
+
+    // Fuse the next sample, waiting up to waitMs for one, and queue the frame of its
+    // board when an output tick is due. Returns the board, NULL when no sample came.
+    MPU9250 * fuse(uint32_t waitMs = osWaitForever){
+      osEvent evt = samples.get(waitMs);
+      if (evt.status != osEventMail) return NULL;
+      SampleBlock *s = (SampleBlock *)evt.value.p;
+
+      int start = clock.read_us();
+      MPU9250 *board = s->board;
+      board->fuseSample(s->packet, s->period);
+      if (board->intPin != NULL) {
+        board->recordLatency(board->t.read_us() - s->eventUs);
+      }
+      if (board->outputDue()) {
+        FrameBlock *f = frames.alloc();
+        if (f == NULL) {
+          frameDrops++;
+        } else {
+          f->board = board;
+          f->eventUs = s->eventUs;
+          f->length = (uint8_t)board->outputFrame(f->data);
+          core_util_critical_section_enter();
+          framesQueued++;
+          if (framesQueued > framesHighWater) framesHighWater = framesQueued;
+          core_util_critical_section_exit();
+          frames.put(f);
+        }
+      }
+      samples.free(s);
+      core_util_critical_section_enter();
+      samplesQueued--;
+      core_util_critical_section_exit();
+      record(fuseStage, clock.read_us() - start);
+      return board;
+    }
+
+    // Hand the next frames of any board to uartTx, waiting up to waitMs for the first and
+    // taking whatever else is queued up to PIPELINE_TX_BATCH. Returns the frames taken.
+    int transmit(uint32_t waitMs = osWaitForever){
+      osEvent evt = frames.get(waitMs);
+      if (evt.status != osEventMail) return 0;
+
+      int start = clock.read_us();
+      int n = 0;
+      do {
+        FrameBlock *f = (FrameBlock *)evt.value.p;
+        uartTx.send(f->board->boardNo, f->data, f->length);
+        record(latency, f->board->t.read_us() - f->eventUs);
+        n++;
+        frames.free(f);
+        core_util_critical_section_enter();
+        framesQueued--;
+        core_util_critical_section_exit();
+      } while (n < PIPELINE_TX_BATCH && (evt = frames.get(0)).status == osEventMail);
+
+      framesSent += n;
+      record(transmitStage, clock.read_us() - start);
+      return n;
+    }
+
+    // Thread bodies. args is a PipelineBus from bus() for the acquisition threads and
+    // the Pipeline for the others.
+    static void acquisitionThread(void const *args){
+      PipelineBus *b = (PipelineBus *)args;
+      // Bring the boards up here, so the two buses calibrate at the same time
+      int fitted = 0;
+      for (int i = 0; i < b->boardCount; i++) {
+        if (b->boards[i]->begin()) {
+          b->boards[fitted++] = b->boards[i];
+        }
+      }
+      b->boardCount = fitted;
+      if (fitted == 0) {
+        return; // no board on this bus
+      }
+      while (true) {
+        b->owner->acquire(b->index);
+      }
+    }
+
+    static void fusionThread(void const *args){
+      Pipeline *pipeline = (Pipeline *)args;
+      while (true) {
+        pipeline->fuse();
+      }
+    }
+
+    static void transmitThread(void const *args){
+      Pipeline *pipeline = (Pipeline *)args;
+      while (true) {
+        pipeline->transmit();
+      }
+    }
+
+    // Counters back to zero; the high-water marks start again from the current depth
+    void resetStats(){
+      for (int b = 0; b < PIPELINE_MAX_BUSES; b++) {
+        memset(&buses[b].stage, 0, sizeof(PipelineStage));
+      }
+      memset(&fuseStage, 0, sizeof(fuseStage));
+      memset(&transmitStage, 0, sizeof(transmitStage));
+      memset(&latency, 0, sizeof(latency));
+      samplesHighWater = samplesQueued;
+      framesHighWater = framesQueued;
+      sampleDrops = frameDrops = framesSent = 0;
+    }
+
+    // Text report for bench runs, it shares the UART with the binary frames
+    void printStats(){
+      for (int b = 0; b < PIPELINE_MAX_BUSES; b++) {
+        if (buses[b].boardCount > 0) {
+          printStage("Acquisition bus", b + 1, buses[b].stage);
+        }
+      }
+      printStage("Fusion", -1, fuseStage);
+      printStage("Transmit", -1, transmitStage);
+      printStage("Edge to UART queue", -1, latency);
+      pc.printf("Sample queue high water %lu / %d, %lu dropped; frame queue high water %lu / %d, %lu dropped; %lu frames sent\n\r",
+                (unsigned long)samplesHighWater, PIPELINE_SAMPLE_DEPTH, (unsigned long)sampleDrops,
+                (unsigned long)framesHighWater, PIPELINE_FRAME_DEPTH, (unsigned long)frameDrops,
+                (unsigned long)framesSent);
+    }
+
+    private:
+
+    static void record(PipelineStage &stage, uint32_t us){
+      stage.count++;
+      stage.sumUs += us;
+      if (us > stage.maxUs) stage.maxUs = us;
+    }
+
+    void printStage(const char *name, int number, const PipelineStage &stage){
+      if (number >= 0) pc.printf("%s %d", name, number);
+      else pc.printf("%s", name);
+      pc.printf(": %lu, avg %lu max %lu us\n\r", (unsigned long)stage.count,
+                (unsigned long)(stage.count ? stage.sumUs / stage.count : 0), (unsigned long)stage.maxUs);
+    }
+
+    Mail<SampleBlock, PIPELINE_SAMPLE_DEPTH> samples;
+    Mail<FrameBlock, PIPELINE_FRAME_DEPTH> frames;
+    PipelineBus buses[PIPELINE_MAX_BUSES];
+    Timer clock;
+};
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef QUATFRAME_H
+#define QUATFRAME_H
+#include <stdint.h>
+#include <string.h>
+
+// Binary quaternion telemetry frame shared by the firmware (encoder) and the
+// SideBySideRenderWindowsQt viewer (decoder). Only plain C/C++ headers are used
+// here so the same file builds for the LPC1768 and on the host.
+//
+// All multi-byte fields are little endian.
+//
+//  offset  size   field
+//  0       2      sync word 0xA5 0x5A
+//  2       1      frame type, QUAT_FRAME_FLOAT, QUAT_FRAME_Q15, QUAT_FRAME_RAW, QUAT_FRAME_EULER
+//                 or QUAT_FRAME_LINK
+//  3       1      board number
+//  4       2      sequence number, incremented per frame and per board
+//  6       4      timestamp in microseconds
+//  10      16/8   qw, qx, qy, qz as IEEE float or Q15 fixed point (float for RAW and EULER)
+//  26      20     RAW only: accel x y z, gyro x y z, mag x y z, temperature as int16 counts
+//  26      6      EULER only: yaw, pitch, roll as int16 hundredths of a degree
+//  26/18/46/32 2  CRC-16/CCITT (poly 0x1021, init 0xFFFF) over bytes 2 .. end of payload
+//
+// QUAT_FRAME_LINK frames negotiate the baud rate and go both ways; board is 0, seq is
+// the host's request number, echoed in the reply, and the 6 byte payload holds
+//  10      1      command, QUAT_LINK_PROPOSE .. QUAT_LINK_COMMIT
+//  11      1      reserved, 0
+//  12      4      baud rate
+//  16      2      CRC as above
+//
+// Negotiation, always started by the host:
+//  1. host PROPOSE(rate) at the current rate; the board answers ACCEPT(rate) or
+//     REJECT(current rate) and, after ACCEPT has left the UART, switches to rate
+//  2. the host switches too and counts good and corrupted frames for a while
+//  3. a clean trial ends with host COMMIT(rate), echoed by the board, which makes the
+//     rate stick; without a COMMIT the board falls back to its last committed rate
+//     after QUAT_LINK_TRIAL_MS, and so does the host, so a rate that garbles the
+//     link never has to carry a message
+//
+#define QUAT_FRAME_SYNC0        0xA5
+#define QUAT_FRAME_SYNC1        0x5A
+#define QUAT_FRAME_FLOAT        0x01
+#define QUAT_FRAME_Q15          0x02
+#define QUAT_FRAME_RAW          0x03
+#define QUAT_FRAME_EULER        0x04
+#define QUAT_FRAME_LINK         0x05
+#define QUAT_FRAME_RAW_COUNTS   10
+#define QUAT_FRAME_HEADER_SIZE  10
+#define QUAT_FRAME_CRC_SIZE     2
+#define QUAT_FRAME_MIN_SIZE     (QUAT_FRAME_HEADER_SIZE + 8 + QUAT_FRAME_CRC_SIZE)
+#define QUAT_FRAME_MAX_SIZE     (QUAT_FRAME_HEADER_SIZE + 16 + 2 * QUAT_FRAME_RAW_COUNTS + QUAT_FRAME_CRC_SIZE)
+
+#define QUAT_LINK_PROPOSE       1
+#define QUAT_LINK_ACCEPT        2
+#define QUAT_LINK_REJECT        3
+#define QUAT_LINK_COMMIT        4
+#define QUAT_LINK_FRAME_SIZE    (QUAT_FRAME_HEADER_SIZE + 6 + QUAT_FRAME_CRC_SIZE)
+#define QUAT_LINK_DEFAULT_BAUD  9600    // what the board starts at, MBED_CONF_PLATFORM_STDIO_BAUD_RATE
+#define QUAT_LINK_TRIAL_MS      2000    // board side; the host must decide well within this
+#define QUAT_LINK_RATE_COUNT    6
+
+// Rates either side may propose, slowest first. 1500000 is the fastest the LPC1768
+// divides exactly from a 24 MHz PCLK; 921600 is 0.16 % off, well within a UART's margin.
+static const uint32_t quatLinkRates[QUAT_LINK_RATE_COUNT] = {
+    9600, 115200, 230400, 460800, 921600, 1500000
+};
+
+// Return values of quatFrameDecode() other than a frame length
+#define QUAT_FRAME_INCOMPLETE   0   // not enough bytes yet, call again with more data
+#define QUAT_FRAME_INVALID     -1   // no valid frame starts at this byte, skip it and resync
+
+// One decoded orientation sample
+struct QuatSample {
+    uint8_t  board;
+    uint16_t seq;
+    uint32_t timestampUs;
+    float    q[4];           // qw, qx, qy, qz
+    bool     hasRaw;         // raw holds the sensor counts of a QUAT_FRAME_RAW frame
+    int16_t  raw[QUAT_FRAME_RAW_COUNTS];   // accel[3], gyro[3], mag[3], temperature
+    bool     hasEuler;       // euler holds the board's angles of a QUAT_FRAME_EULER frame
+    float    euler[3];       // yaw, pitch, roll in degrees
+};
+
+static inline uint16_t quatFrameCrc16(const uint8_t *data, int length, uint16_t crc = 0xFFFF){
+    for (int i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+// Payload size for a frame type, 0 for an unknown type
+static inline int quatFramePayloadSize(uint8_t type){
+    switch (type) {
+        case QUAT_FRAME_FLOAT: return 16;
+        case QUAT_FRAME_Q15:   return 8;
+        case QUAT_FRAME_RAW:   return 16 + 2 * QUAT_FRAME_RAW_COUNTS;
+        case QUAT_FRAME_EULER: return 16 + 6;
+        case QUAT_FRAME_LINK:  return 6;
+        default:               return 0;
+    }
+}
+
+static inline void quatFramePut16(uint8_t *p, uint16_t v){
+    p[0] = (uint8_t)(v);
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void quatFramePut32(uint8_t *p, uint32_t v){
+    p[0] = (uint8_t)(v);
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint16_t quatFrameGet16(const uint8_t *p){
+    return (uint16_t)(p[0] | ((uint16_t)p[1] << 8));
+}
+
+static inline uint32_t quatFrameGet32(const uint8_t *p){
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline int16_t quatFrameToQ15(float v){
+    if (v >= 1.0f)  return 32767;
+    if (v <= -1.0f) return -32768;
+    return (int16_t)(v * 32768.0f + (v >= 0.0f ? 0.5f : -0.5f));
+}
+
+static inline int16_t quatFrameToCentidegrees(float degrees){
+    float v = degrees * 100.0f + (degrees >= 0.0f ? 0.5f : -0.5f);
+    if (v >= 32767.0f)  return 32767;
+    if (v <= -32768.0f) return -32768;
+    return (int16_t)v;
+}
+
+// Encode one frame into dest, which must hold QUAT_FRAME_MAX_SIZE bytes. raw points to
+// QUAT_FRAME_RAW_COUNTS counts for QUAT_FRAME_RAW, euler to yaw, pitch and roll in
+// degrees for QUAT_FRAME_EULER; each is ignored by the other types.
+// Returns the number of bytes written, or 0 for an unknown frame type or
+// QUAT_FRAME_LINK, which quatLinkEncode() writes.
+static inline int quatFrameEncode(uint8_t *dest, uint8_t type, uint8_t board, uint16_t seq,
+                                  uint32_t timestampUs, const float *q, const int16_t *raw = 0,
+                                  const float *euler = 0){
+    int payload = quatFramePayloadSize(type);
+    if (payload == 0 || type == QUAT_FRAME_LINK || (type == QUAT_FRAME_RAW && raw == 0) || (type == QUAT_FRAME_EULER && euler == 0)) return 0;
+
+    dest[0] = QUAT_FRAME_SYNC0;
+    dest[1] = QUAT_FRAME_SYNC1;
+    dest[2] = type;
+    dest[3] = board;
+    quatFramePut16(&dest[4], seq);
+    quatFramePut32(&dest[6], timestampUs);
+
+    uint8_t *p = &dest[QUAT_FRAME_HEADER_SIZE];
+    for (int i = 0; i < 4; i++) {
+        if (type != QUAT_FRAME_Q15) {
+            uint32_t bits;
+            memcpy(&bits, &q[i], 4);
+            quatFramePut32(p, bits);
+            p += 4;
+        } else {
+            quatFramePut16(p, (uint16_t)quatFrameToQ15(q[i]));
+            p += 2;
+        }
+    }
+    if (type == QUAT_FRAME_RAW) {
+        for (int i = 0; i < QUAT_FRAME_RAW_COUNTS; i++) {
+            quatFramePut16(p, (uint16_t)raw[i]);
+            p += 2;
+        }
+    }
+    if (type == QUAT_FRAME_EULER) {
+        for (int i = 0; i < 3; i++) {
+            quatFramePut16(p, (uint16_t)quatFrameToCentidegrees(euler[i]));
+            p += 2;
+        }
+    }
+
+    int length = QUAT_FRAME_HEADER_SIZE + payload;
+    quatFramePut16(&dest[length], quatFrameCrc16(&dest[2], length - 2));
+    return length + QUAT_FRAME_CRC_SIZE;
+}
+
+// A decoded QUAT_FRAME_LINK frame
+struct QuatLink {
+    uint8_t  command;
+    uint16_t seq;
+    uint32_t timestampUs;
+    uint32_t baud;
+};
+
+static inline bool quatLinkRateSupported(uint32_t baud){
+    for (int i = 0; i < QUAT_LINK_RATE_COUNT; i++) {
+        if (quatLinkRates[i] == baud) return true;
+    }
+    return false;
+}
+
+// Encode a QUAT_FRAME_LINK frame into dest, which must hold QUAT_LINK_FRAME_SIZE bytes.
+// Returns QUAT_LINK_FRAME_SIZE.
+static inline int quatLinkEncode(uint8_t *dest, uint8_t command, uint16_t seq, uint32_t timestampUs,
+                                 uint32_t baud){
+    dest[0] = QUAT_FRAME_SYNC0;
+    dest[1] = QUAT_FRAME_SYNC1;
+    dest[2] = QUAT_FRAME_LINK;
+    dest[3] = 0;
+    quatFramePut16(&dest[4], seq);
+    quatFramePut32(&dest[6], timestampUs);
+    dest[10] = command;
+    dest[11] = 0;
+    quatFramePut32(&dest[12], baud);
+    int length = QUAT_LINK_FRAME_SIZE - QUAT_FRAME_CRC_SIZE;
+    quatFramePut16(&dest[length], quatFrameCrc16(&dest[2], length - 2));
+    return QUAT_LINK_FRAME_SIZE;
+}
+
+// Decode a QUAT_FRAME_LINK frame, with the return values of quatFrameDecode(); any other
+// frame type is QUAT_FRAME_INVALID here.
+static inline int quatLinkDecode(const uint8_t *data, int available, QuatLink *link){
+    if (available < 3) return QUAT_FRAME_INCOMPLETE;
+    if (data[0] != QUAT_FRAME_SYNC0 || data[1] != QUAT_FRAME_SYNC1 || data[2] != QUAT_FRAME_LINK) return QUAT_FRAME_INVALID;
+    if (available < QUAT_LINK_FRAME_SIZE) return QUAT_FRAME_INCOMPLETE;
+    int length = QUAT_LINK_FRAME_SIZE - QUAT_FRAME_CRC_SIZE;
+    if (quatFrameCrc16(&data[2], length - 2) != quatFrameGet16(&data[length])) return QUAT_FRAME_INVALID;
+
+    link->seq = quatFrameGet16(&data[4]);
+    link->timestampUs = quatFrameGet32(&data[6]);
+    link->command = data[10];
+    link->baud = quatFrameGet32(&data[12]);
+    return QUAT_LINK_FRAME_SIZE;
+}
+
+// Decode the frame starting at data[0] straight out of the caller's buffer.
+// Returns the frame length on success, QUAT_FRAME_INCOMPLETE when more bytes
+// are needed, or QUAT_FRAME_INVALID when data[0] does not start a valid frame.
+// QUAT_FRAME_LINK frames carry no sample and are QUAT_FRAME_INVALID here, decode them
+// with quatLinkDecode().
+static inline int quatFrameDecode(const uint8_t *data, int available, QuatSample *sample){
+    if (available < 1) return QUAT_FRAME_INCOMPLETE;
+    if (data[0] != QUAT_FRAME_SYNC0) return QUAT_FRAME_INVALID;
+    if (available < 2) return QUAT_FRAME_INCOMPLETE;
+    if (data[1] != QUAT_FRAME_SYNC1) return QUAT_FRAME_INVALID;
+    if (available < 3) return QUAT_FRAME_INCOMPLETE;
+
+    uint8_t type = data[2];
+    int payload = quatFramePayloadSize(type);
+    if (payload == 0 || type == QUAT_FRAME_LINK) return QUAT_FRAME_INVALID;
+
+    int length = QUAT_FRAME_HEADER_SIZE + payload;
+    if (available < length + QUAT_FRAME_CRC_SIZE) return QUAT_FRAME_INCOMPLETE;
+    if (quatFrameCrc16(&data[2], length - 2) != quatFrameGet16(&data[length])) return QUAT_FRAME_INVALID;
+
+    sample->board = data[3];
+    sample->seq = quatFrameGet16(&data[4]);
+    sample->timestampUs = quatFrameGet32(&data[6]);
+
+    const uint8_t *p = &data[QUAT_FRAME_HEADER_SIZE];
+    for (int i = 0; i < 4; i++) {
+        if (type != QUAT_FRAME_Q15) {
+            uint32_t bits = quatFrameGet32(p);
+            memcpy(&sample->q[i], &bits, 4);
+            p += 4;
+        } else {
+            sample->q[i] = (float)(int16_t)quatFrameGet16(p) / 32768.0f;
+            p += 2;
+        }
+    }
+    sample->hasRaw = type == QUAT_FRAME_RAW;
+    for (int i = 0; i < QUAT_FRAME_RAW_COUNTS; i++) {
+        sample->raw[i] = sample->hasRaw ? (int16_t)quatFrameGet16(p + 2 * i) : 0;
+    }
+    sample->hasEuler = type == QUAT_FRAME_EULER;
+    for (int i = 0; i < 3; i++) {
+        sample->euler[i] = sample->hasEuler ? (int16_t)quatFrameGet16(p + 2 * i) / 100.0f : 0.0f;
+    }
+    return length + QUAT_FRAME_CRC_SIZE;
+}
+
+#endif
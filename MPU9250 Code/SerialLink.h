@@ -0,0 +1,175 @@
+#ifndef SERIALLINK_H
+#define SERIALLINK_H
+#include "mbed.h"
+#include "rtos.h"
+#include "QuatFrame.h"
+#include "UartTx.h"
+
+// Board side of the baud rate negotiation of QuatFrame.h. The board starts at
+// QUAT_LINK_DEFAULT_BAUD and only ever answers the host: the receive interrupt stores
+// the bytes, and poll(), from a thread, decodes the host's QUAT_FRAME_LINK frames,
+// answers through uartTx, switches the rate once an ACCEPT has left the UART and goes
+// back to the last committed rate when a trial is not committed within
+// QUAT_LINK_TRIAL_MS. Anything else the host sends is skipped.
+
+#define LINK_RX_BYTES   64      // receive ring, a few link frames
+#define LINK_POLL_MS    5       // longest poll() wait of the link thread, bounds the switch delay
+
+class SerialLink {
+
+    protected:
+
+    RawSerial *serial;
+    UartTx *tx;
+
+    public:
+
+    enum State {
+      LINK_IDLE,          // at the committed rate
+      LINK_SWITCHING,     // ACCEPT queued, the rate changes once it is out
+      LINK_TRIAL          // at the proposed rate, waiting for COMMIT
+    };
+
+    uint32_t baudRate;        // current rate
+    uint32_t committedBaud;   // rate to fall back to
+    uint8_t state;
+    uint32_t proposals;       // PROPOSE frames received
+    uint32_t rejects;         // of those, for a rate not in quatLinkRates or mid-trial
+    uint32_t commits;
+    uint32_t fallbacks;       // trials that timed out
+    uint32_t rxOverflows;     // bytes lost because poll() fell behind
+
+    // Takes the receive interrupt of port, which must be the one uart writes to
+    SerialLink(RawSerial &port, UartTx &uart):serial(&port), tx(&uart){
+      baudRate = committedBaud = QUAT_LINK_DEFAULT_BAUD;
+      state = LINK_IDLE;
+      length = 0;
+      switchArmed = false;
+      proposals = rejects = commits = fallbacks = rxOverflows = 0;
+      clock.start();
+      serial->attach(callback(this, &SerialLink::onRx), RawSerial::RxIrq);
+    }
+
+    // Wait up to waitMs for host bytes, then handle them and the pending switch or
+    // fallback. Call at least every LINK_POLL_MS while a negotiation may run.
+    void poll(uint32_t waitMs = LINK_POLL_MS){
+      received.wait(waitMs);
+
+      uint8_t c;
+      while (takeByte(c)) {
+        frame[length++] = c;
+        while (length > 0) {
+          QuatLink link;
+          int n = quatLinkDecode(frame, length, &link);
+          if (n == QUAT_FRAME_INCOMPLETE) break;
+          if (n > 0) handle(link);
+          // Drop the frame, or the byte that did not start one
+          int drop = n > 0 ? n : 1;
+          length -= drop;
+          memmove(frame, frame + drop, length);
+        }
+      }
+
+      if (state == LINK_SWITCHING) {
+        if (!tx->controlWritten()) {
+          switchArmed = false;
+        } else if (!switchArmed) {
+          // Leave the ACCEPT time to clear the FIFO and the shift register at the old rate
+          switchAtUs = nowUs() + (UART_TX_FIFO + 1) * 10 * 1000000 / baudRate + 1000;
+          switchArmed = true;
+        } else if ((int32_t)(nowUs() - switchAtUs) >= 0) {
+          baudRate = target;
+          tx->baud(baudRate);
+          trialStartUs = nowUs();
+          state = LINK_TRIAL;
+        }
+      } else if (state == LINK_TRIAL && nowUs() - trialStartUs > QUAT_LINK_TRIAL_MS * 1000u) {
+        baudRate = committedBaud;
+        tx->baud(baudRate);
+        fallbacks++;
+        state = LINK_IDLE;
+      }
+    }
+
+    static void linkThread(void const *args){
+      SerialLink *link = (SerialLink *)args;
+      while (true) {
+        link->poll();
+      }
+    }
+
+    // Text report for bench runs, it shares the UART with the binary frames
+    void printStats(){
+      serial->printf("Link at %lu baud (committed %lu): %lu proposals, %lu rejected, %lu commits, %lu fallbacks, %lu bytes lost\n\r",
+                     (unsigned long)baudRate, (unsigned long)committedBaud, (unsigned long)proposals,
+                     (unsigned long)rejects, (unsigned long)commits, (unsigned long)fallbacks,
+                     (unsigned long)rxOverflows);
+    }
+
+    private:
+
+    // Receive interrupt: move the bytes out of the UART FIFO and wake poll()
+    void onRx(){
+      while (serial->readable()) {
+        uint8_t c = (uint8_t)serial->getc();
+        if (rx.full()) rxOverflows++;
+        rx.push(c);             // overwrites the oldest when full
+      }
+      received.release();
+    }
+
+    bool takeByte(uint8_t &c){
+      core_util_critical_section_enter();
+      bool got = rx.pop(c);
+      core_util_critical_section_exit();
+      return got;
+    }
+
+    void handle(const QuatLink &link){
+      if (link.command == QUAT_LINK_PROPOSE) {
+        proposals++;
+        if (state != LINK_IDLE || !quatLinkRateSupported(link.baud)) {
+          rejects++;
+          reply(QUAT_LINK_REJECT, link.seq, baudRate);
+          return;
+        }
+        reply(QUAT_LINK_ACCEPT, link.seq, link.baud);
+        target = link.baud;
+        switchArmed = false;
+        state = LINK_SWITCHING;
+      } else if (link.command == QUAT_LINK_COMMIT) {
+        if (state == LINK_TRIAL && link.baud == baudRate) {
+          committedBaud = baudRate;
+          commits++;
+          state = LINK_IDLE;
+        } else if (state != LINK_IDLE || link.baud != committedBaud) {
+          return;
+        }
+        // Echo every commit of the current rate, so the host may repeat one whose echo it missed
+        reply(QUAT_LINK_COMMIT, link.seq, committedBaud);
+      }
+    }
+
+    void reply(uint8_t command, uint16_t seq, uint32_t baud){
+      uint8_t data[QUAT_LINK_FRAME_SIZE];
+      tx->sendControl(data, quatLinkEncode(data, command, seq, nowUs(), baud));
+    }
+
+    // Timer::read_us() goes negative after 35.8 minutes; differences of the unsigned
+    // value stay right across the wrap for intervals shorter than that
+    uint32_t nowUs(){
+      return (uint32_t)clock.read_us();
+    }
+
+    CircularBuffer<uint8_t, LINK_RX_BYTES> rx;
+    Semaphore received;
+    uint8_t frame[QUAT_LINK_FRAME_SIZE];    // bytes of a link frame being received
+    int length;
+    uint32_t target;            // rate of the accepted proposal
+    bool switchArmed;           // the ACCEPT is in the FIFO and switchAtUs is set
+    uint32_t switchAtUs;        // when the ACCEPT has left the UART
+    uint32_t trialStartUs;
+    Timer clock;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef UARTTX_H
+#define UARTTX_H
+#include "mbed.h"
+#include "QuatFrame.h"
+
+// The one writer of the UART. Any thread hands over whole frames with send(), which
+// copies the frame into the queue of its board and returns at once; the transmit
+// interrupt feeds the UART FIFO from the queues, taking one frame from each board in
+// turn, so frames never interleave byte-wise and a busy board cannot starve the
+// others. When the link is slower than the boards produce, a board's oldest waiting
+// frame is overwritten by its newest: the viewer wants the current pose, and no
+// sensor thread ever waits for the UART. Link frames of the baud rate negotiation
+// (SerialLink.h) go in a slot of their own, ahead of every board, and are never dropped
+// for board frames.
+
+#define UART_TX_BOARDS   4     // one queue per board number 1..4, other numbers share the last
+#define UART_TX_FRAMES   4     // frames waiting per board before the oldest is dropped
+#define UART_TX_FIFO     16    // transmit FIFO of the LPC1768 UART
+
+struct TxFrame {
+    uint8_t length;
+    uint8_t data[QUAT_FRAME_MAX_SIZE];
+};
+
+class UartTx {
+
+    protected:
+
+    RawSerial *serial;
+
+    public:
+
+    uint32_t sent[UART_TX_BOARDS];      // frames written, per board
+    uint32_t dropped[UART_TX_BOARDS];   // frames overwritten before they were written
+    uint32_t interrupts;                // transmit interrupts taken
+
+    // The port must not be written by anything else while frames are queued; RawSerial
+    // because its putc() is safe in the interrupt
+    UartTx(RawSerial &port):serial(&port){
+      resetStats();
+      next = 0;
+      position = 0;
+      current.length = 0;
+      controlPending = currentIsControl = false;
+      serial->attach(callback(this, &UartTx::onTxEmpty), RawSerial::TxIrq);
+    }
+
+    // Queue a link frame ahead of the board frames, from any thread; replaces a link
+    // frame that is still waiting.
+    void sendControl(const uint8_t * data, int length){
+      core_util_critical_section_enter();
+      control.length = (uint8_t)length;
+      memcpy(control.data, data, length);
+      controlPending = true;
+      fill();
+      core_util_critical_section_exit();
+    }
+
+    // True once the last link frame is in the UART FIFO; it still takes up to
+    // UART_TX_FIFO + 1 byte times to leave, the FIFO and the byte being shifted out
+    bool controlWritten(){
+      core_util_critical_section_enter();
+      bool written = !controlPending && !(currentIsControl && position < current.length);
+      core_util_critical_section_exit();
+      return written;
+    }
+
+    // Change the rate from a thread. A frame being written when the rate changes reaches
+    // the reader garbled and is dropped there by its CRC.
+    void baud(int rate){
+      core_util_critical_section_enter();
+      serial->baud(rate);
+      core_util_critical_section_exit();
+    }
+
+    // Queue a frame of board, from any thread; never blocks. Returns false when the
+    // board's oldest waiting frame was dropped to make room.
+    bool send(uint8_t board, const uint8_t * data, int length){
+      int q = board >= 1 && board <= UART_TX_BOARDS ? board - 1 : UART_TX_BOARDS - 1;
+      TxFrame frame;
+      frame.length = (uint8_t)length;
+      memcpy(frame.data, data, length);
+
+      core_util_critical_section_enter();
+      bool full = queues[q].full();
+      if (full) dropped[q]++;
+      queues[q].push(frame);       // overwrites the oldest when full
+      fill();                      // starts the UART when it was idle
+      core_util_critical_section_exit();
+      return !full;
+    }
+
+    void resetStats(){
+      for (int i = 0; i < UART_TX_BOARDS; i++) {
+        sent[i] = dropped[i] = 0;
+      }
+      interrupts = 0;
+    }
+
+    // Text report for bench runs; it bypasses the queues, so it can split a frame
+    void printStats(){
+      for (int i = 0; i < UART_TX_BOARDS; i++) {
+        serial->printf("Board %d: %lu frames sent, %lu dropped\n\r", i + 1,
+                       (unsigned long)sent[i], (unsigned long)dropped[i]);
+      }
+    }
+
+    private:
+
+    // Transmit FIFO empty, in interrupt context
+    void onTxEmpty(){
+      core_util_critical_section_enter();
+      interrupts++;
+      fill();
+      core_util_critical_section_exit();
+    }
+
+    // Top up the UART FIFO, the next board in turn once the current frame is out.
+    // Runs with interrupts masked; writes only while the FIFO has room, so never waits.
+    // mbed's writeable() counts the bytes put since THRE, so one interrupt fills the FIFO.
+    void fill(){
+      while (serial->writeable()) {
+        if (position == current.length && !takeNext()) {
+          return;
+        }
+        serial->putc(current.data[position++]);
+      }
+    }
+
+    bool takeNext(){
+      currentIsControl = controlPending;
+      if (controlPending) {
+        current = control;
+        controlPending = false;
+        position = 0;
+        return true;
+      }
+      for (int i = 0; i < UART_TX_BOARDS; i++) {
+        int q = (next + i) % UART_TX_BOARDS;
+        if (queues[q].pop(current)) {
+          next = (q + 1) % UART_TX_BOARDS;
+          position = 0;
+          sent[q]++;
+          return true;
+        }
+      }
+      position = current.length = 0;
+      return false;
+    }
+
+    CircularBuffer<TxFrame, UART_TX_FRAMES> queues[UART_TX_BOARDS];
+    TxFrame current;            // frame being written
+    TxFrame control;            // link frame waiting, see sendControl()
+    bool controlPending;
+    bool currentIsControl;
+    int position;               // next byte of current
+    int next;                   // queue to take the next frame from
+};
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef FUSIONBATCH_H
+#define FUSIONBATCH_H
+// Host only: the Fusion.h kernels run over N independent streams at once, for
+// reprocessing recorded sensor data and gain sweeps. FusionLanes<N> is N floats in
+// a GCC vector, so FusionKernel<FusionLanes<N> > is the scalar filter body with
+// every operation applied lane by lane: 4 lanes fill an SSE register, 8 AVX2 and
+// 16 AVX-512; wider than the target ISA the compiler splits the vector.
+//
+// Every lane computes exactly what FusionKernel<float> computes for that stream,
+// bit for bit, as long as both are built without floating point contraction
+// (-ffp-contract=off; FMA would round differently from separate multiply and add).
+#include "Fusion.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// GCC ignores vector_size on a typedef that depends on a template parameter of the
+// enclosing class, it has to come from a separate template
+template <typename E, int Bytes>
+struct FusionVector {
+    typedef E type __attribute__((vector_size(Bytes)));
+};
+
+template <int N>
+struct FusionMask {
+    typedef typename FusionVector<int32_t, N * sizeof(int32_t)>::type V;
+    V v;
+};
+
+template <int N>
+struct FusionLanes {
+    typedef typename FusionVector<float, N * sizeof(float)>::type V;
+    typedef typename FusionVector<uint32_t, N * sizeof(uint32_t)>::type U;
+    enum { Lanes = N };
+    V v;
+
+    FusionLanes() {}
+    FusionLanes(double value) { for (int i = 0; i < N; i++) v[i] = (float)value; }
+
+    static FusionLanes fromVector(V v){
+        FusionLanes l;
+        l.v = v;
+        return l;
+    }
+    static FusionLanes load(const float *p){
+        FusionLanes l;
+        memcpy(&l.v, p, sizeof(l.v));
+        return l;
+    }
+    void store(float *p) const { memcpy(p, &v, sizeof(v)); }
+
+    FusionLanes operator+(FusionLanes b) const { return fromVector(v + b.v); }
+    FusionLanes operator-(FusionLanes b) const { return fromVector(v - b.v); }
+    FusionLanes operator-() const { return fromVector(-v); }
+    FusionLanes operator*(FusionLanes b) const { return fromVector(v * b.v); }
+    FusionLanes &operator+=(FusionLanes b) { v += b.v; return *this; }
+    FusionLanes &operator-=(FusionLanes b) { v -= b.v; return *this; }
+    FusionLanes &operator*=(FusionLanes b) { v *= b.v; return *this; }
+    FusionMask<N> operator>(FusionLanes b) const { FusionMask<N> m; m.v = v > b.v; return m; }
+    FusionMask<N> operator==(FusionLanes b) const { FusionMask<N> m; m.v = v == b.v; return m; }
+};
+
+template <int N>
+static inline FusionMask<N> operator|(FusionMask<N> a, FusionMask<N> b)
+{
+    FusionMask<N> m;
+    m.v = a.v | b.v;
+    return m;
+}
+
+// The fast inverse square root of fusionFastInvSqrt(float), lane by lane. The lanes
+// cannot share an early return, so normalise() always reports success; a zero
+// vector comes out as zero, which is what Madgwick substitutes for a zero gradient,
+// and FusionBatch restores the lanes whose inputs the scalar filter would skip.
+template <int N>
+struct FusionMath<FusionLanes<N>, false> {
+    typedef FusionLanes<N> T;
+
+    static T invSqrt(T x){
+        typename T::U i = (typename T::U)x.v;
+        i = 0x5F375A86u - (i >> 1);
+        T y = T::fromVector((typename T::V)i);
+        const T threeHalves = T(1.5), half = T(0.5);
+        y = y * (threeHalves - half * x * y * y);
+        y = y * (threeHalves - half * x * y * y);
+        y = y * (threeHalves - half * x * y * y);
+        return y;
+    }
+
+    static bool normalise(T &x, T &y, T &z){
+        T n = invSqrt(x * x + y * y + z * z);
+        x *= n;
+        y *= n;
+        z *= n;
+        return true;
+    }
+
+    static bool normalise(T &a, T &b, T &c, T &d){
+        T n = invSqrt(a * a + b * b + c * c + d * d);
+        a *= n;
+        b *= n;
+        c *= n;
+        d *= n;
+        return true;
+    }
+
+    static T select(FusionMask<N> condition, T a, T b){
+        typename T::U m = (typename T::U)condition.v;
+        return T::fromVector((typename T::V)((m & (typename T::U)a.v) | (~m & (typename T::U)b.v)));
+    }
+
+    static T hypot(T x, T y){
+        T n = x * x + y * y;
+        return select(n == T(0.0), n, n * invSqrt(n));
+    }
+};
+
+// Filter state of N streams in structure of arrays layout. Inputs are in the units
+// of FusionKernel: accel and mag at any scale, the gyro as the half step rotation,
+// gains multiplied by dt; one value per lane each.
+template <int N>
+class FusionBatch {
+public:
+    typedef FusionLanes<N> L;
+    typedef FusionMath<L, false> M;
+    enum { Lanes = N };
+
+    float q[4][N];
+    float eInt[3][N];
+
+    FusionBatch() { reset(); }
+
+    void reset(){
+        for (int i = 0; i < N; i++) {
+            q[0][i] = 1.0f;
+            q[1][i] = q[2][i] = q[3][i] = 0.0f;
+            eInt[0][i] = eInt[1][i] = eInt[2][i] = 0.0f;
+        }
+    }
+
+    // in[0..8] point to N values each of ax, ay, az, hgx, hgy, hgz, mx, my, mz
+    void Mahony(const float * const *in, const float *kpDt, const float *kiDt){
+        L lq[4], le[3], v[9];
+        loadState(lq, le);
+        for (int i = 0; i < 9; i++) v[i] = L::load(in[i]);
+        L sq[4] = { lq[0], lq[1], lq[2], lq[3] }, se[3] = { le[0], le[1], le[2] };
+        FusionKernel<L, M>::Mahony(lq, le, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8],
+                                   L::load(kpDt), L::load(kiDt));
+        skipInvalid(v, lq, sq, 4);
+        skipInvalid(v, le, se, 3);
+        storeState(lq, le);
+    }
+
+    void Madgwick(const float * const *in, const float *betaDt){
+        L lq[4], le[3], v[9];
+        loadState(lq, le);
+        for (int i = 0; i < 9; i++) v[i] = L::load(in[i]);
+        L sq[4] = { lq[0], lq[1], lq[2], lq[3] };
+        FusionKernel<L, M>::Madgwick(lq, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], L::load(betaDt));
+        skipInvalid(v, lq, sq, 4);
+        storeState(lq, le);
+    }
+
+private:
+    void loadState(L *lq, L *le){
+        for (int i = 0; i < 4; i++) lq[i] = L::load(q[i]);
+        for (int i = 0; i < 3; i++) le[i] = L::load(eInt[i]);
+    }
+
+    void storeState(const L *lq, const L *le){
+        for (int i = 0; i < 4; i++) lq[i].store(q[i]);
+        for (int i = 0; i < 3; i++) le[i].store(eInt[i]);
+    }
+
+    // Keep the saved state in lanes with a zero accel or mag vector, where the scalar
+    // filter returns before touching anything; same sums as its normalise()
+    static void skipInvalid(const L *v, L *state, const L *saved, int count){
+        FusionMask<N> skip = (v[0] * v[0] + v[1] * v[1] + v[2] * v[2] == L(0.0))
+                           | (v[6] * v[6] + v[7] * v[7] + v[8] * v[8] == L(0.0));
+        for (int i = 0; i < count; i++) {
+            state[i] = M::select(skip, saved[i], state[i]);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,465 @@
+#include "MPU9250Sim.h"
+
+#include <math.h>
+#include <string.h>
+
+// MPU9250 registers used by the model
+static const uint8_t SIM_SELF_TEST_X_GYRO  = 0x00;
+static const uint8_t SIM_SELF_TEST_X_ACCEL = 0x0D;
+static const uint8_t SIM_SMPLRT_DIV        = 0x19;
+static const uint8_t SIM_GYRO_CONFIG       = 0x1B;
+static const uint8_t SIM_ACCEL_CONFIG      = 0x1C;
+static const uint8_t SIM_FIFO_EN           = 0x23;
+static const uint8_t SIM_I2C_SLV0_ADDR     = 0x25;
+static const uint8_t SIM_I2C_SLV0_REG      = 0x26;
+static const uint8_t SIM_I2C_SLV0_CTRL     = 0x27;
+static const uint8_t SIM_INT_PIN_CFG       = 0x37;
+static const uint8_t SIM_INT_ENABLE        = 0x38;
+static const uint8_t SIM_INT_STATUS        = 0x3A;
+static const uint8_t SIM_ACCEL_XOUT_H      = 0x3B;
+static const uint8_t SIM_TEMP_OUT_H        = 0x41;
+static const uint8_t SIM_GYRO_XOUT_H       = 0x43;
+static const uint8_t SIM_EXT_SENS_DATA_00  = 0x49;
+static const uint8_t SIM_USER_CTRL         = 0x6A;
+static const uint8_t SIM_PWR_MGMT_1        = 0x6B;
+static const uint8_t SIM_FIFO_COUNTH       = 0x72;
+static const uint8_t SIM_FIFO_COUNTL       = 0x73;
+static const uint8_t SIM_FIFO_R_W          = 0x74;
+static const uint8_t SIM_WHO_AM_I          = 0x75;
+static const uint8_t SIM_XA_OFFSET_H       = 0x77;
+
+// AK8963 registers
+static const int     SIM_AK8963_ADDRESS    = 0x0C << 1;
+static const uint8_t SIM_AK_WIA            = 0x00;
+static const uint8_t SIM_AK_INFO           = 0x01;
+static const uint8_t SIM_AK_ST1            = 0x02;
+static const uint8_t SIM_AK_HXL            = 0x03;
+static const uint8_t SIM_AK_ST2            = 0x09;
+static const uint8_t SIM_AK_CNTL           = 0x0A;
+static const uint8_t SIM_AK_CNTL2          = 0x0B;
+static const uint8_t SIM_AK_ASAX           = 0x10;
+
+static const double SIM_PI = 3.14159265358979323846;
+
+// Local field in milliGauss, earth frame x north, z up
+static const double earthField[3] = { 200.0, 0.0, -400.0 };
+
+MotionTrace::MotionTrace()
+    : restSeconds(8.0), frequencyHz(0.2)
+{
+    amplitudeDps[0] = 20.0;
+    amplitudeDps[1] = 15.0;
+    amplitudeDps[2] = 90.0;
+    phase[0] = 0.0;
+    phase[1] = SIM_PI / 2;
+    phase[2] = SIM_PI / 4;
+}
+
+SensorErrors::SensorErrors()
+    : accelNoiseG(0.003), gyroNoiseDps(0.05), magNoiseMg(3.0), seed(1)
+{
+    accelBiasG[0] = 0.020;
+    accelBiasG[1] = -0.015;
+    accelBiasG[2] = 0.030;
+    gyroBiasDps[0] = 1.5;
+    gyroBiasDps[1] = -0.8;
+    gyroBiasDps[2] = 0.6;
+    // Matches the magbias constants in MPU9250.h at the driver's 16-bit scale
+    magBiasCounts[0] = 69.8;
+    magBiasCounts[1] = 43.3;
+    magBiasCounts[2] = -138.1;
+}
+
+void SensorErrors::scaleNoise(double factor)
+{
+    accelNoiseG *= factor;
+    gyroNoiseDps *= factor;
+    magNoiseMg *= factor;
+}
+
+MPU9250Sim::MPU9250Sim(int address, const MotionTrace &motion, const SensorErrors &errors)
+    : address(address), motion(motion), errors(errors), rng(errors.seed), gauss(0.0, 1.0),
+      regPointer(0), akPointer(0), akSinglePending(false), intPin(NULL), pulseEndUs(0),
+      lastTickUs(sim::nowUs()), ticks(0), samples(0), fifoOverflows(0), magMeasurements(0)
+{
+    q[0] = 1.0;
+    q[1] = q[2] = q[3] = 0.0;
+    omegaDps[0] = omegaDps[1] = omegaDps[2] = 0.0;
+
+    memset(ak, 0, sizeof(ak));
+    ak[SIM_AK_WIA] = 0x48;
+    ak[SIM_AK_INFO] = 0x9A;
+    ak[SIM_AK_ASAX] = 0xB0;     // typical fuse ROM sensitivity adjustments
+    ak[SIM_AK_ASAX + 1] = 0xB3;
+    ak[SIM_AK_ASAX + 2] = 0xA7;
+
+    reset();
+    sim::addClocked(this);
+}
+
+void MPU9250Sim::reset()
+{
+    memset(regs, 0, sizeof(regs));
+    regs[SIM_WHO_AM_I] = 0x71;
+    regs[SIM_PWR_MGMT_1] = 0x01;
+    static const uint8_t selfTestCodes[3] = { 0x8C, 0x90, 0x94 };
+    for (int i = 0; i < 3; i++) {
+        regs[SIM_SELF_TEST_X_GYRO + i] = selfTestCodes[i];
+        regs[SIM_SELF_TEST_X_ACCEL + i] = selfTestCodes[2 - i];
+    }
+    // Factory accelerometer trims, bit 0 is the temperature compensation flag
+    static const uint8_t accelTrim[6] = { 0x1A, 0x3B, 0xE6, 0x21, 0x24, 0x7F };
+    for (int i = 0; i < 3; i++) {
+        regs[SIM_XA_OFFSET_H + 3 * i] = accelTrim[2 * i];
+        regs[SIM_XA_OFFSET_H + 3 * i + 1] = accelTrim[2 * i + 1];
+    }
+    fifoHead = 0;
+    fifoUsed = 0;
+    fifoLast = 0;
+}
+
+bool MPU9250Sim::acks(int address)
+{
+    if (address == this->address) {
+        return true;
+    }
+    // The AK8963 shows up on the host bus only in bypass mode with the I2C master off
+    return address == SIM_AK8963_ADDRESS
+        && (regs[SIM_INT_PIN_CFG] & 0x02) && !(regs[SIM_USER_CTRL] & 0x20);
+}
+
+void MPU9250Sim::write(int address, const uint8_t *data, int length)
+{
+    catchUp();
+    if (length == 0) {
+        return;
+    }
+    if (address == this->address) {
+        regPointer = data[0] & 0x7F;
+        for (int i = 1; i < length; i++) {
+            writeRegister(regPointer, data[i]);
+            if (regPointer != SIM_FIFO_R_W) {
+                regPointer = (regPointer + 1) & 0x7F;
+            }
+        }
+    } else {
+        akPointer = data[0];
+        for (int i = 1; i < length; i++) {
+            writeAk(akPointer++, data[i]);
+        }
+    }
+}
+
+void MPU9250Sim::read(int address, uint8_t *data, int length)
+{
+    catchUp();
+    if (address == this->address) {
+        for (int i = 0; i < length; i++) {
+            data[i] = readRegister(regPointer);
+            if (regPointer != SIM_FIFO_R_W) {
+                regPointer = (regPointer + 1) & 0x7F;
+            }
+        }
+        if (regs[SIM_INT_PIN_CFG] & 0x10) {
+            clearInterrupt();           // INT_ANYRD_2CLEAR
+        }
+    } else {
+        for (int i = 0; i < length; i++) {
+            data[i] = readAk(akPointer++);
+        }
+    }
+}
+
+void MPU9250Sim::trueQuaternion(double q[4]) const
+{
+    for (int i = 0; i < 4; i++) {
+        q[i] = this->q[i];
+    }
+}
+
+bool MPU9250Sim::interruptAsserted()
+{
+    catchUp();
+    return (regs[SIM_INT_STATUS] & regs[SIM_INT_ENABLE] & 0x11) != 0;
+}
+
+void MPU9250Sim::advanceTo(uint64_t us)
+{
+    while (lastTickUs + 1000 <= us) {
+        lastTickUs += 1000;
+        tick();
+    }
+    if (intPin != NULL && !(regs[SIM_INT_PIN_CFG] & 0x20) && us >= pulseEndUs) {
+        intPin->simDrive(0);
+    }
+}
+
+// The chip runs on its own 1 kHz clock; bring it up to the bus time
+void MPU9250Sim::catchUp()
+{
+    advanceTo(sim::nowUs());
+}
+
+void MPU9250Sim::clearInterrupt()
+{
+    regs[SIM_INT_STATUS] = 0;
+    if (intPin != NULL && (regs[SIM_INT_PIN_CFG] & 0x20)) {
+        intPin->simDrive(0);
+    }
+}
+
+void MPU9250Sim::tick()
+{
+    ticks++;
+    double t = ticks * 0.001 - motion.restSeconds;
+    for (int i = 0; i < 3; i++) {
+        omegaDps[i] = t < 0 ? 0.0 : motion.amplitudeDps[i] * sin(2 * SIM_PI * motion.frequencyHz * t + motion.phase[i]);
+    }
+
+    // q = q * exp(omega dt / 2), body rates
+    double w[3], norm = 0;
+    for (int i = 0; i < 3; i++) {
+        w[i] = omegaDps[i] * SIM_PI / 180.0 * 0.001;
+        norm += w[i] * w[i];
+    }
+    norm = sqrt(norm);
+    if (norm > 0) {
+        double s = sin(norm / 2) / norm, c = cos(norm / 2);
+        double d[4] = { c, w[0] * s, w[1] * s, w[2] * s };
+        double r[4];
+        r[0] = q[0] * d[0] - q[1] * d[1] - q[2] * d[2] - q[3] * d[3];
+        r[1] = q[0] * d[1] + q[1] * d[0] + q[2] * d[3] - q[3] * d[2];
+        r[2] = q[0] * d[2] - q[1] * d[3] + q[2] * d[0] + q[3] * d[1];
+        r[3] = q[0] * d[3] + q[1] * d[2] - q[2] * d[1] + q[3] * d[0];
+        double n = sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2] + r[3] * r[3]);
+        for (int i = 0; i < 4; i++) {
+            q[i] = r[i] / n;
+        }
+    }
+
+    if (regs[SIM_PWR_MGMT_1] & 0x40) {
+        return;     // sleeping
+    }
+    if (ticks % (regs[SIM_SMPLRT_DIV] + 1) == 0) {
+        outputSample();
+    }
+
+    int mode = ak[SIM_AK_CNTL] & 0x0F;
+    if (akSinglePending) {
+        akSinglePending = false;
+        measureMag();
+        ak[SIM_AK_CNTL] &= 0xF0;    // back to power down
+    } else if ((mode == 0x02 && ticks % 125 == 0) || (mode == 0x06 && ticks % 10 == 0)) {
+        measureMag();
+    }
+}
+
+void MPU9250Sim::toBody(const double earth[3], double body[3]) const
+{
+    double qw = q[0], qx = q[1], qy = q[2], qz = q[3];
+    // Rows of the body to earth rotation, applied transposed
+    double r[3][3] = {
+        { qw*qw + qx*qx - qy*qy - qz*qz, 2*(qx*qy - qw*qz), 2*(qx*qz + qw*qy) },
+        { 2*(qx*qy + qw*qz), qw*qw - qx*qx + qy*qy - qz*qz, 2*(qy*qz - qw*qx) },
+        { 2*(qx*qz - qw*qy), 2*(qy*qz + qw*qx), qw*qw - qx*qx - qy*qy + qz*qz }
+    };
+    for (int i = 0; i < 3; i++) {
+        body[i] = r[0][i] * earth[0] + r[1][i] * earth[1] + r[2][i] * earth[2];
+    }
+}
+
+void MPU9250Sim::put16(uint8_t *dest, double value)
+{
+    long v = lround(value);
+    if (v > 32767) v = 32767;
+    if (v < -32768) v = -32768;
+    dest[0] = (uint8_t)((v >> 8) & 0xFF);
+    dest[1] = (uint8_t)(v & 0xFF);
+}
+
+void MPU9250Sim::outputSample()
+{
+    static const double up[3] = { 0.0, 0.0, 1.0 };
+    double accel[3];
+    toBody(up, accel);
+
+    double accelScale = 32768.0 / (2 << ((regs[SIM_ACCEL_CONFIG] >> 3) & 3));
+    double gyroScale = 32768.0 / (250 << ((regs[SIM_GYRO_CONFIG] >> 3) & 3));
+    for (int i = 0; i < 3; i++) {
+        double a = (accel[i] + errors.accelBiasG[i] + errors.accelNoiseG * gauss(rng)) * accelScale;
+        double g = (omegaDps[i] + errors.gyroBiasDps[i] + errors.gyroNoiseDps * gauss(rng)) * gyroScale;
+        // Self test adds the factory response on the enabled axes
+        if (regs[SIM_ACCEL_CONFIG] & (0x80 >> i)) {
+            a += 2620.0 * pow(1.01, regs[SIM_SELF_TEST_X_ACCEL + i] - 1.0);
+        }
+        if (regs[SIM_GYRO_CONFIG] & (0x80 >> i)) {
+            g += 2620.0 * pow(1.01, regs[SIM_SELF_TEST_X_GYRO + i] - 1.0);
+        }
+        put16(&regs[SIM_ACCEL_XOUT_H + 2 * i], a);
+        put16(&regs[SIM_GYRO_XOUT_H + 2 * i], g);
+    }
+    put16(&regs[SIM_TEMP_OUT_H], (25.0 - 21.0) * 333.87);
+
+    // I2C master: SLV0 reads the AK8963 into EXT_SENS_DATA once per sample
+    uint8_t slv0Length = regs[SIM_I2C_SLV0_CTRL] & 0x0F;
+    bool slv0 = (regs[SIM_USER_CTRL] & 0x20) && (regs[SIM_I2C_SLV0_CTRL] & 0x80)
+        && (regs[SIM_I2C_SLV0_ADDR] & 0x80) && (regs[SIM_I2C_SLV0_ADDR] & 0x7F) == (SIM_AK8963_ADDRESS >> 1);
+    if (slv0) {
+        for (int i = 0; i < slv0Length; i++) {
+            regs[SIM_EXT_SENS_DATA_00 + i] = readAk(regs[SIM_I2C_SLV0_REG] + i);
+        }
+    }
+
+    if (regs[SIM_USER_CTRL] & 0x40) {
+        // FIFO packets follow register order: accel, temperature, gyro x/y/z, slaves
+        uint8_t enable = regs[SIM_FIFO_EN];
+        bool overflow = false;
+        if (enable & 0x08) overflow |= fifoPush(&regs[SIM_ACCEL_XOUT_H], 6);
+        if (enable & 0x80) overflow |= fifoPush(&regs[SIM_TEMP_OUT_H], 2);
+        if (enable & 0x40) overflow |= fifoPush(&regs[SIM_GYRO_XOUT_H], 2);
+        if (enable & 0x20) overflow |= fifoPush(&regs[SIM_GYRO_XOUT_H + 2], 2);
+        if (enable & 0x10) overflow |= fifoPush(&regs[SIM_GYRO_XOUT_H + 4], 2);
+        if ((enable & 0x01) && slv0) overflow |= fifoPush(&regs[SIM_EXT_SENS_DATA_00], slv0Length);
+        if (overflow) {
+            fifoOverflows++;    // samples that pushed older data out
+        }
+    }
+
+    regs[SIM_INT_STATUS] |= 0x01;   // RAW_DATA_RDY_INT, latched until INT_STATUS is read
+    samples++;
+
+    if (intPin != NULL && (regs[SIM_INT_ENABLE] & 0x01)) {
+        if (!(regs[SIM_INT_PIN_CFG] & 0x20)) {
+            intPin->simDrive(0);        // a new pulse starts with a rising edge
+            pulseEndUs = lastTickUs + 50;
+        }
+        intPin->simDrive(1);
+    }
+}
+
+bool MPU9250Sim::fifoPush(const uint8_t *data, int length)
+{
+    bool overflow = false;
+    for (int i = 0; i < length; i++) {
+        if (fifoUsed == FifoSize) {
+            fifoHead = (fifoHead + 1) % FifoSize;   // overwrite the oldest byte
+            fifoUsed--;
+            overflow = true;
+        }
+        fifo[(fifoHead + fifoUsed) % FifoSize] = data[i];
+        fifoUsed++;
+    }
+    if (overflow) {
+        regs[SIM_INT_STATUS] |= 0x10;
+    }
+    return overflow;
+}
+
+void MPU9250Sim::measureMag()
+{
+    double body[3];
+    toBody(earthField, body);
+    // AK8963 axes: x and y swapped, z reversed relative to the accelerometer
+    double field[3] = { body[1], body[0], -body[2] };
+    double lsb = (ak[SIM_AK_CNTL] & 0x10) ? 1.5 : 6.0;    // mG per count, 16 or 14 bit
+    for (int i = 0; i < 3; i++) {
+        double adjust = (ak[SIM_AK_ASAX + i] - 128) / 256.0 + 1.0;
+        double counts = (field[i] + errors.magNoiseMg * gauss(rng)) / lsb + errors.magBiasCounts[i];
+        long v = lround(counts / adjust);
+        if (v > 32767) v = 32767;
+        if (v < -32768) v = -32768;
+        ak[SIM_AK_HXL + 2 * i] = (uint8_t)(v & 0xFF);          // little endian
+        ak[SIM_AK_HXL + 2 * i + 1] = (uint8_t)((v >> 8) & 0xFF);
+    }
+    if (ak[SIM_AK_ST1] & 0x01) {
+        ak[SIM_AK_ST1] |= 0x02;     // data overrun, the last sample was never read
+    }
+    ak[SIM_AK_ST1] |= 0x01;
+    ak[SIM_AK_ST2] = ak[SIM_AK_CNTL] & 0x10;    // BITM mirrors the output width
+    magMeasurements++;
+}
+
+uint8_t MPU9250Sim::readRegister(uint8_t reg)
+{
+    uint8_t value;
+    switch (reg) {
+    case SIM_INT_STATUS:
+        value = regs[SIM_INT_STATUS];
+        clearInterrupt();
+        return value;
+    case SIM_FIFO_COUNTH:
+        return (uint8_t)((fifoUsed >> 8) & 0x1F);
+    case SIM_FIFO_COUNTL:
+        return (uint8_t)(fifoUsed & 0xFF);
+    case SIM_FIFO_R_W:
+        if (fifoUsed > 0) {
+            fifoLast = fifo[fifoHead];
+            fifoHead = (fifoHead + 1) % FifoSize;
+            fifoUsed--;
+        }
+        return fifoLast;
+    default:
+        return regs[reg];
+    }
+}
+
+void MPU9250Sim::writeRegister(uint8_t reg, uint8_t value)
+{
+    switch (reg) {
+    case SIM_PWR_MGMT_1:
+        if (value & 0x80) {
+            reset();
+        } else {
+            regs[reg] = value;
+        }
+        break;
+    case SIM_USER_CTRL:
+        if (value & 0x04) {
+            fifoHead = 0;
+            fifoUsed = 0;
+        }
+        regs[reg] = value & ~0x07;  // reset bits clear themselves
+        break;
+    case SIM_INT_STATUS:
+    case SIM_WHO_AM_I:
+    case SIM_FIFO_COUNTH:
+    case SIM_FIFO_COUNTL:
+        break;                      // read only
+    case SIM_FIFO_R_W:
+        fifoPush(&value, 1);
+        break;
+    default:
+        regs[reg] = value;
+        break;
+    }
+}
+
+uint8_t MPU9250Sim::readAk(uint8_t reg)
+{
+    if (reg >= AkRegisters) {
+        return 0;
+    }
+    if (reg >= SIM_AK_ASAX && (ak[SIM_AK_CNTL] & 0x0F) != 0x0F) {
+        return 0;                   // fuse ROM is only visible in fuse access mode
+    }
+    uint8_t value = ak[reg];
+    if (reg == SIM_AK_ST2) {
+        ak[SIM_AK_ST1] &= ~0x03;    // reading ST2 ends the data read
+    }
+    return value;
+}
+
+void MPU9250Sim::writeAk(uint8_t reg, uint8_t value)
+{
+    if (reg == SIM_AK_CNTL) {
+        ak[SIM_AK_CNTL] = value;
+        akSinglePending = (value & 0x0F) == 0x01;
+    } else if (reg == SIM_AK_CNTL2) {
+        if (value & 0x01) {
+            ak[SIM_AK_CNTL] = 0;    // soft reset
+            ak[SIM_AK_ST1] = 0;
+        }
+    } else if (reg < SIM_AK_ASAX && reg > SIM_AK_ST2) {
+        ak[reg] = value;
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef MPU9250SIM_H
+#define MPU9250SIM_H
+// Register level model of an MPU9250 with its AK8963, attached to a host I2C bus.
+//
+// Modelled: WHO_AM_I and reset, accel/gyro/temperature data registers, sample rate
+// divider, data ready in INT_STATUS and on the INT pin (pulsed or latched), the 512
+// byte FIFO with FIFO_EN packet layout and overwrite-on-overflow, the I2C master
+// reading the AK8963 through SLV0 into EXT_SENS_DATA, I2C bypass, the AK8963 fuse
+// ROM, ST1/ST2 data-ready handshake and its 8 Hz / 100 Hz continuous modes, and
+// accel/gyro self-test responses.
+// Not modelled: DLPF response, DMP, interrupts other than data ready and FIFO overflow.
+#include "mbed.h"
+
+#include <stdint.h>
+#include <random>
+
+// Body rates applied after an initial rest period; every axis follows
+// amplitude * sin(2 pi f t + phase). The sensor starts level with x towards north.
+struct MotionTrace
+{
+    MotionTrace();
+
+    double restSeconds;
+    double amplitudeDps[3];
+    double frequencyHz;
+    double phase[3];
+};
+
+struct SensorErrors
+{
+    SensorErrors();
+
+    void scaleNoise(double factor);
+
+    double accelNoiseG;       // white noise standard deviation per sample
+    double gyroNoiseDps;
+    double magNoiseMg;
+    double accelBiasG[3];
+    double gyroBiasDps[3];
+    double magBiasCounts[3];  // hard iron offset in AK8963 axes, before sensitivity adjustment
+    unsigned seed;
+};
+
+class MPU9250Sim : public SimI2CDevice, public sim::Clocked
+{
+public:
+    // address is the 8-bit bus address, 0x68<<1 or 0x69<<1
+    MPU9250Sim(int address, const MotionTrace &motion, const SensorErrors &errors);
+
+    bool acks(int address);
+    void write(int address, const uint8_t *data, int length);
+    void read(int address, uint8_t *data, int length);
+    void advanceTo(uint64_t us);
+
+    // Drive pin from the INT output: a 50 us pulse per data ready, or a level held
+    // until INT_STATUS is read when LATCH_INT_EN is set
+    void connectInterrupt(InterruptIn *pin) { intPin = pin; }
+
+    // Orientation of the board (qw, qx, qy, qz) at the last internal sample
+    void trueQuaternion(double q[4]) const;
+
+    // INT pin level: a latched data-ready or FIFO overflow enabled in INT_ENABLE
+    bool interruptAsserted();
+
+    uint64_t samplesProduced() const { return samples; }
+    uint64_t fifoOverflowCount() const { return fifoOverflows; }
+    uint64_t magMeasurementCount() const { return magMeasurements; }
+    int fifoBytes() const { return fifoUsed; }
+
+private:
+    enum { FifoSize = 512, AkRegisters = 0x13 };
+
+    void reset();
+    void catchUp();
+    void clearInterrupt();
+    void tick();
+    void outputSample();
+    void measureMag();
+    bool fifoPush(const uint8_t *data, int length);
+    uint8_t readRegister(uint8_t reg);
+    void writeRegister(uint8_t reg, uint8_t value);
+    uint8_t readAk(uint8_t reg);
+    void writeAk(uint8_t reg, uint8_t value);
+    void toBody(const double earth[3], double body[3]) const;
+    static void put16(uint8_t *dest, double value);
+
+    int address;
+    MotionTrace motion;
+    SensorErrors errors;
+    std::mt19937 rng;
+    std::normal_distribution<double> gauss;
+
+    uint8_t regs[128];
+    uint8_t ak[AkRegisters];
+    uint8_t regPointer;
+    uint8_t akPointer;
+    bool akSinglePending;
+
+    uint8_t fifo[FifoSize];
+    int fifoHead;
+    int fifoUsed;
+    uint8_t fifoLast;
+
+    InterruptIn *intPin;
+    uint64_t pulseEndUs;
+
+    uint64_t lastTickUs;
+    uint64_t ticks;
+    double q[4];
+    double omegaDps[3];
+
+    uint64_t samples;
+    uint64_t fifoOverflows;
+    uint64_t magMeasurements;
+};
+
+#endif
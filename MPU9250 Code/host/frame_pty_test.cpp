@@ -0,0 +1,254 @@
+// Round trip of the QuatFrame.h telemetry through a pseudo-terminal pair, the way the
+// viewer reads a board: frames from the firmware encoder are written to the slave side
+// in raw mode and decoded from the master side with quatFrameDecode(), resyncing byte by
+// byte as the viewer's FrameParser does.
+//
+//   frame_pty_test [--frames N] [--seed N] [--sim PATH]
+//
+// Every frame type is sent, with noise bytes between some frames, and board, seq,
+// timestamp, quaternion, raw counts and Euler angles are checked; Q15 components must
+// equal the encoder's rounding to the nearest 1/32768. --sim also runs PATH (an
+// mpu9250_sim) with --serial on the slave side for 5 simulated seconds and checks that its
+// frames decode with consecutive sequence numbers. Exits with 1 on any mismatch.
+#include "QuatFrame.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+static unsigned long long rngState = 88172645463325252ULL;
+static double uniform()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (rngState >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int failures = 0;
+
+static void fail(const char *what, int frame)
+{
+    if (failures++ < 10) {
+        fprintf(stderr, "frame %d: %s\n", frame, what);
+    }
+}
+
+// Open a pty pair in raw mode, so no byte of a binary frame is translated
+static bool openPty(int &master, int &slave, char *slaveName, size_t nameSize)
+{
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return false;
+    }
+    const char *name = ptsname(master);
+    if (name == NULL) {
+        perror("ptsname");
+        return false;
+    }
+    snprintf(slaveName, nameSize, "%s", name);
+    slave = open(slaveName, O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        perror(slaveName);
+        return false;
+    }
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+    return true;
+}
+
+// Read what the master side has, waiting up to timeoutMs for the first byte
+static int readMaster(int master, std::vector<uint8_t> &into, int timeoutMs)
+{
+    struct pollfd p = { master, POLLIN, 0 };
+    if (poll(&p, 1, timeoutMs) <= 0) {
+        return 0;
+    }
+    uint8_t chunk[4096];
+    ssize_t got = read(master, chunk, sizeof(chunk));
+    if (got <= 0) {
+        return 0;
+    }
+    into.insert(into.end(), chunk, chunk + got);
+    return (int)got;
+}
+
+// Decode every complete frame at the front of buffer, skipping bytes that start none
+static void decodeAll(std::vector<uint8_t> &buffer, std::vector<QuatSample> &samples, int &skipped)
+{
+    size_t pos = 0;
+    while (pos < buffer.size()) {
+        QuatSample sample;
+        int n = quatFrameDecode(&buffer[pos], (int)(buffer.size() - pos), &sample);
+        if (n == QUAT_FRAME_INCOMPLETE) break;
+        if (n == QUAT_FRAME_INVALID) {
+            pos++;
+            skipped++;
+            continue;
+        }
+        samples.push_back(sample);
+        pos += n;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + pos);
+}
+
+struct Sent {
+    uint8_t type;
+    uint8_t board;
+    uint16_t seq;
+    uint32_t timestampUs;
+    float q[4];
+    int16_t raw[QUAT_FRAME_RAW_COUNTS];
+    float euler[3];
+};
+
+static void check(const Sent &s, const QuatSample &r, int index)
+{
+    if (r.board != s.board) fail("board", index);
+    if (r.seq != s.seq) fail("seq", index);
+    if (r.timestampUs != s.timestampUs) fail("timestamp", index);
+    for (int i = 0; i < 4; i++) {
+        float expected = s.q[i];
+        if (s.type == QUAT_FRAME_Q15) {
+            expected = quatFrameToQ15(s.q[i]) / 32768.0f;
+            // Rounded, never truncated: within half a step, or clamped at +1
+            if (fabsf(expected - s.q[i]) > 0.5f / 32768.0f + 1e-7f && s.q[i] < 32767.0f / 32768.0f) {
+                fail("Q15 rounding", index);
+            }
+        }
+        if (r.q[i] != expected) fail("quaternion", index);
+    }
+    if (r.hasRaw != (s.type == QUAT_FRAME_RAW)) fail("hasRaw", index);
+    if (r.hasRaw && memcmp(r.raw, s.raw, sizeof(s.raw)) != 0) fail("raw counts", index);
+    if (r.hasEuler != (s.type == QUAT_FRAME_EULER)) fail("hasEuler", index);
+    for (int i = 0; r.hasEuler && i < 3; i++) {
+        if (fabsf(r.euler[i] - s.euler[i]) > 0.005f + 1e-4f) fail("euler", index);
+    }
+}
+
+// mpu9250_sim writing its frames to the slave side, decoded from the master side
+static bool simRoundTrip(const char *simPath, int master, const char *slaveName)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(simPath, simPath, "--serial", slaveName, "--seconds", "5", (char *)NULL);
+        _exit(127);
+    }
+    std::vector<uint8_t> buffer;
+    std::vector<QuatSample> samples;
+    int skipped = 0, status = 0;
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        readMaster(master, buffer, 50);
+        decodeAll(buffer, samples, skipped);
+    }
+    while (readMaster(master, buffer, 100) > 0) {
+        decodeAll(buffer, samples, skipped);
+    }
+    int gaps = 0;
+    for (size_t i = 1; i < samples.size(); i++) {
+        if ((uint16_t)(samples[i].seq - samples[i - 1].seq) != 1) gaps++;
+    }
+    printf("mpu9250_sim:   %d frames decoded, %d sequence gaps, %d bytes skipped, exit %d\n",
+           (int)samples.size(), gaps, skipped, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return samples.size() > 100 && gaps == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int count = 2000;
+    const char *simPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--frames") && hasValue) count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && hasValue) rngState += (unsigned long long)atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--sim") && hasValue) simPath = argv[++i];
+        else {
+            fprintf(stderr, "usage: frame_pty_test [--frames N] [--seed N] [--sim PATH]\n");
+            return 2;
+        }
+    }
+
+    int master, slave;
+    char slaveName[128];
+    if (!openPty(master, slave, slaveName, sizeof(slaveName))) {
+        return 1;
+    }
+
+    static const uint8_t types[4] = { QUAT_FRAME_FLOAT, QUAT_FRAME_Q15, QUAT_FRAME_RAW, QUAT_FRAME_EULER };
+    std::vector<Sent> sent(count);
+    std::vector<uint8_t> buffer;
+    std::vector<QuatSample> received;
+    int skipped = 0, noise = 0;
+    for (int f = 0; f < count; f++) {
+        Sent &s = sent[f];
+        s.type = types[f % 4];
+        s.board = (uint8_t)(1 + f % 4);
+        s.seq = (uint16_t)(65530 + f);      // wraps early on
+        s.timestampUs = (uint32_t)(uniform() * 4294967295.0);
+        double norm = 0;
+        for (int i = 0; i < 4; i++) {
+            s.q[i] = (float)(uniform() * 2 - 1);
+            norm += s.q[i] * s.q[i];
+        }
+        for (int i = 0; i < 4; i++) {
+            s.q[i] /= (float)sqrt(norm);
+        }
+        if (f % 50 == 0) s.q[0] = 1.0f;     // clamps to 32767 in Q15
+        for (int i = 0; i < QUAT_FRAME_RAW_COUNTS; i++) {
+            s.raw[i] = (int16_t)(uniform() * 65535 - 32768);
+        }
+        for (int i = 0; i < 3; i++) {
+            s.euler[i] = (float)(uniform() * 360 - 180);
+        }
+
+        uint8_t frame[QUAT_FRAME_MAX_SIZE + 8];
+        int length = 0;
+        if (f % 7 == 3) {
+            // Noise the reader has to skip, a stray sync byte included
+            frame[length++] = QUAT_FRAME_SYNC0;
+            frame[length++] = (uint8_t)(uniform() * 256);
+            noise += 2;
+        }
+        length += quatFrameEncode(frame + length, s.type, s.board, s.seq, s.timestampUs, s.q, s.raw, s.euler);
+        if (write(slave, frame, length) != length) {
+            perror("write");
+            return 1;
+        }
+        readMaster(master, buffer, 0);
+        decodeAll(buffer, received, skipped);
+    }
+    while (received.size() < sent.size() && readMaster(master, buffer, 500) > 0) {
+        decodeAll(buffer, received, skipped);
+    }
+
+    if (received.size() != sent.size()) {
+        fprintf(stderr, "%d frames sent, %d decoded\n", count, (int)received.size());
+        failures++;
+    }
+    for (size_t i = 0; i < received.size() && i < sent.size(); i++) {
+        check(sent[i], received[i], (int)i);
+    }
+    printf("pty %s: %d frames sent, %d decoded, %d noise bytes, %d skipped, %d mismatches\n", slaveName,
+           count, (int)received.size(), noise, skipped, failures);
+
+    if (simPath != NULL && !simRoundTrip(simPath, master, slaveName)) {
+        failures++;
+    }
+    close(slave);
+    close(master);
+    return failures == 0 ? 0 : 1;
+}
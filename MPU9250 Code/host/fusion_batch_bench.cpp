@@ -0,0 +1,238 @@
+// Throughput of the batched fusion kernels of FusionBatch.h against the scalar float
+// kernel, and a bit for bit comparison of the two.
+//
+//   fusion_batch_bench TRACE.csv [--streams S] [--min-seconds S]
+//
+// TRACE.csv is the --csv output of mpu9250_sim in register mode. Each stream replays
+// the trace from its own starting point with its own gains, like a gain sweep over a
+// set of recordings. Stream 1 also loses the magnetometer every 97th sample, which
+// exercises the lanes the kernels must leave untouched.
+#include "FusionBatch.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+static const double DegPerRad = 180.0 / 3.14159265358979323846;
+
+// Everything a stream feeds the kernels, already in kernel units
+struct Streams {
+    int count;
+    size_t samples;
+    std::vector<float> in;      // [sample][input 0..8][stream]
+    std::vector<float> kpDt, kiDt, betaDt;  // [sample][stream]
+};
+
+static double monotonicSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static bool loadTrace(const char *path, std::vector<double> &rows)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    char line[1024];
+    if (fgets(line, sizeof(line), file) == NULL || strncmp(line, "t_us,", 5) != 0) {
+        fprintf(stderr, "%s: not an mpu9250_sim --csv trace\n", path);
+        fclose(file);
+        return false;
+    }
+    // t_us, a[3] in g, g[3] in rad/s, m[3] in mG as the firmware passes them
+    while (fgets(line, sizeof(line), file) != NULL) {
+        double v[19];
+        int n = sscanf(line, "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+                       &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9],
+                       &v[10], &v[11], &v[12], &v[13], &v[14], &v[15], &v[16], &v[17], &v[18]);
+        if (n != 19) continue;
+        double row[10] = { v[0], v[10], v[11], v[12], v[13] / DegPerRad, v[14] / DegPerRad, v[15] / DegPerRad,
+                           v[17], v[16], -v[18] };
+        rows.insert(rows.end(), row, row + 10);
+    }
+    fclose(file);
+    return rows.size() > 10;
+}
+
+static void buildStreams(const std::vector<double> &rows, int count, Streams &s)
+{
+    size_t samples = rows.size() / 10;
+    s.count = count;
+    s.samples = samples;
+    s.in.resize(samples * 9 * count);
+    s.kpDt.resize(samples * count);
+    s.kiDt.resize(samples * count);
+    s.betaDt.resize(samples * count);
+    for (int j = 0; j < count; j++) {
+        size_t offset = samples * j / count;
+        // Kp 1 to 20, Ki off for every fourth stream, beta 10 to 120 deg/s gyro error
+        double kp = 1.0 + 19.0 * j / (count > 1 ? count - 1 : 1);
+        double ki = (j % 4 == 0) ? 0.0 : 0.05 * (j % 4);
+        double beta = sqrt(3.0 / 4.0) * (10.0 + 110.0 * ((j * 7) % count) / count) / DegPerRad;
+        for (size_t k = 0; k < samples; k++) {
+            size_t r = (offset + k) % samples;
+            size_t prev = (r > 0 ? r : 1) - 1;
+            double dt = (rows[10 * (prev + 1)] - rows[10 * prev]) * 1e-6;
+            const double *row = &rows[10 * r];
+            float *in = &s.in[k * 9 * count + j];
+            for (int i = 0; i < 3; i++) {
+                in[i * count] = (float)(row[1 + i] / 4.0);
+                in[(3 + i) * count] = (float)(row[4 + i] * dt * 0.5);
+                in[(6 + i) * count] = (j == 1 && k % 97 == 0) ? 0.0f : (float)(row[7 + i] / 1024.0);
+            }
+            s.kpDt[k * count + j] = (float)(kp * dt);
+            s.kiDt[k * count + j] = (float)(ki * dt);
+            s.betaDt[k * count + j] = (float)(beta * dt);
+        }
+    }
+}
+
+// q is [sample][component][stream] when recording
+static void runScalar(const Streams &s, bool madgwick, float *record)
+{
+    int count = s.count;
+    for (int j = 0; j < count; j++) {
+        float q[4] = { 1.0f, 0.0f, 0.0f, 0.0f };
+        float eInt[3] = { 0.0f, 0.0f, 0.0f };
+        for (size_t k = 0; k < s.samples; k++) {
+            const float *in = &s.in[k * 9 * count + j];
+            size_t g = k * count + j;
+            if (madgwick) {
+                FusionKernel<float>::Madgwick(q, in[0], in[count], in[2 * count], in[3 * count], in[4 * count],
+                                              in[5 * count], in[6 * count], in[7 * count], in[8 * count], s.betaDt[g]);
+            } else {
+                FusionKernel<float>::Mahony(q, eInt, in[0], in[count], in[2 * count], in[3 * count], in[4 * count],
+                                            in[5 * count], in[6 * count], in[7 * count], in[8 * count],
+                                            s.kpDt[g], s.kiDt[g]);
+            }
+            if (record != NULL) {
+                for (int i = 0; i < 4; i++) record[(k * 4 + i) * count + j] = q[i];
+            }
+        }
+    }
+}
+
+template <int N>
+static void runBatch(const Streams &s, bool madgwick, float *record)
+{
+    int count = s.count;
+    for (int j0 = 0; j0 < count; j0 += N) {
+        FusionBatch<N> batch;
+        for (size_t k = 0; k < s.samples; k++) {
+            const float *in[9];
+            for (int i = 0; i < 9; i++) in[i] = &s.in[(k * 9 + i) * count + j0];
+            size_t g = k * count + j0;
+            if (madgwick) {
+                batch.Madgwick(in, &s.betaDt[g]);
+            } else {
+                batch.Mahony(in, &s.kpDt[g], &s.kiDt[g]);
+            }
+            if (record != NULL) {
+                for (int i = 0; i < 4; i++) memcpy(&record[(k * 4 + i) * count + j0], batch.q[i], N * sizeof(float));
+            }
+        }
+    }
+}
+
+struct Timing {
+    const char *name;
+    double samplesPerSecond;    // stream samples, i.e. filter updates
+    size_t bitDifferences;
+    size_t valueDifferences;
+};
+
+template <typename Run>
+static Timing measure(const char *name, Run run, const Streams &s, bool madgwick, double minSeconds,
+                      const std::vector<float> &reference)
+{
+    Timing t;
+    t.name = name;
+    std::vector<float> q(s.samples * 4 * s.count);
+    run(s, madgwick, &q[0]);
+    t.bitDifferences = t.valueDifferences = 0;
+    for (size_t i = 0; i < q.size() && !reference.empty(); i++) {
+        if (memcmp(&q[i], &reference[i], sizeof(float)) != 0) t.bitDifferences++;
+        if (q[i] != reference[i]) t.valueDifferences++;
+    }
+
+    long passes = 0;
+    double start = monotonicSeconds(), elapsed;
+    do {
+        run(s, madgwick, NULL);
+        passes++;
+        elapsed = monotonicSeconds() - start;
+    } while (elapsed < minSeconds);
+    t.samplesPerSecond = (double)passes * s.samples * s.count / elapsed;
+    return t;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: fusion_batch_bench TRACE.csv [--streams S] [--min-seconds S]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int streams = 64;
+    double minSeconds = 0.5;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "--streams") && hasValue) streams = atoi(argv[++i]);
+        else if (!strcmp(arg, "--min-seconds") && hasValue) minSeconds = atof(argv[++i]);
+        else if (arg[0] != '-' && path == NULL) path = arg;
+        else usage();
+    }
+    if (path == NULL || streams < 16 || streams % 16 != 0) {
+        if (path != NULL) fprintf(stderr, "--streams must be a multiple of 16\n");
+        usage();
+    }
+
+    std::vector<double> rows;
+    if (!loadTrace(path, rows)) {
+        return 1;
+    }
+    Streams s;
+    buildStreams(rows, streams, s);
+    printf("%d streams of %zu samples\n", streams, s.samples);
+#if defined(__AVX512F__)
+    printf("built for AVX-512\n");
+#elif defined(__AVX2__)
+    printf("built for AVX2\n");
+#elif defined(__AVX__)
+    printf("built for AVX\n");
+#else
+    printf("built for SSE2\n");
+#endif
+
+    for (int filter = 0; filter < 2; filter++) {
+        bool madgwick = filter == 1;
+        std::vector<float> reference(s.samples * 4 * streams), none;
+        runScalar(s, madgwick, &reference[0]);
+
+        std::vector<Timing> timings;
+        timings.push_back(measure("scalar", runScalar, s, madgwick, minSeconds, none));
+        timings.push_back(measure("4 lanes", runBatch<4>, s, madgwick, minSeconds, reference));
+        timings.push_back(measure("8 lanes", runBatch<8>, s, madgwick, minSeconds, reference));
+        timings.push_back(measure("16 lanes", runBatch<16>, s, madgwick, minSeconds, reference));
+
+        printf("\n%s\n", madgwick ? "Madgwick" : "Mahony");
+        printf("  %-10s %14s %8s %14s %14s\n", "variant", "updates/s", "speedup", "bits differ", "values differ");
+        for (size_t v = 0; v < timings.size(); v++) {
+            const Timing &t = timings[v];
+            printf("  %-10s %14.0f %7.2fx %14zu %14zu\n", t.name, t.samplesPerSecond,
+                   t.samplesPerSecond / timings[0].samplesPerSecond, t.bitDifferences, t.valueDifferences);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,268 @@
+// Accuracy against cost of the Fusion.h kernels per numeric type, on a recorded trace.
+//
+//   fusion_bench TRACE.csv [--kp K] [--ki K] [--beta B] [--min-seconds S]
+//
+// TRACE.csv is the --csv output of mpu9250_sim in register mode (one sample per row),
+// e.g. mpu9250_sim --seconds 60 --csv trace.csv. Every variant runs Mahony and Madgwick
+// over the whole trace; the reference is the double kernel with the libm square root.
+// Errors are the angle to the reference quaternion and to the simulated truth (after
+// the first 3 s). Time per update is host time: it ranks the variants, but the soft
+// float cost on the LPC1768 is far higher than here, fixed point is not.
+#include "Fusion.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+static const double DegPerRad = 180.0 / 3.14159265358979323846;
+
+struct TraceSample {
+    double tUs;
+    double a[3];        // g
+    double g[3];        // rad/s
+    double m[3];        // mG, already in accel/gyro axes
+    double truth[4];
+};
+
+struct Gains {
+    double kp, ki, beta;
+};
+
+struct Result {
+    const char *name;
+    double nsPerUpdate;
+    double cyclesPerUpdate;
+    std::vector<double> q;  // 4 per sample, first pass
+};
+
+static double monotonicSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static double toDouble(float v) { return v; }
+static double toDouble(double v) { return v; }
+template <int F>
+static double toDouble(Fixed<F> v) { return v.toDouble(); }
+
+// Rotation angle of conj(a) * b; atan2 keeps the resolution that acos of the dot
+// product loses near zero
+static double angleDeg(const double *a, const double *b)
+{
+    double w = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+    double x = a[0] * b[1] - a[1] * b[0] - a[2] * b[3] + a[3] * b[2];
+    double y = a[0] * b[2] + a[1] * b[3] - a[2] * b[0] - a[3] * b[1];
+    double z = a[0] * b[3] - a[1] * b[2] + a[2] * b[1] - a[3] * b[0];
+    return 2.0 * atan2(sqrt(x * x + y * y + z * z), fabs(w)) * DegPerRad;
+}
+
+static bool loadTrace(const char *path, std::vector<TraceSample> &trace)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    char line[1024];
+    if (fgets(line, sizeof(line), file) == NULL || strncmp(line, "t_us,", 5) != 0) {
+        fprintf(stderr, "%s: not an mpu9250_sim --csv trace\n", path);
+        fclose(file);
+        return false;
+    }
+    int multi = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        double v[19];
+        int n = sscanf(line, "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+                       &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9],
+                       &v[10], &v[11], &v[12], &v[13], &v[14], &v[15], &v[16], &v[17], &v[18]);
+        if (n != 19) continue;
+        if (v[1] != 1) multi++;
+        TraceSample s;
+        s.tUs = v[0];
+        for (int i = 0; i < 4; i++) s.truth[i] = v[6 + i];
+        for (int i = 0; i < 3; i++) {
+            s.a[i] = v[10 + i];
+            s.g[i] = v[13 + i] / DegPerRad;
+        }
+        // The AK8963 axes as the firmware passes them: (my, mx, -mz)
+        s.m[0] = v[17];
+        s.m[1] = v[16];
+        s.m[2] = -v[18];
+        trace.push_back(s);
+    }
+    fclose(file);
+    if (multi > 0) {
+        fprintf(stderr, "%s: %d rows fused several FIFO samples, only the last of each is here\n", path, multi);
+    }
+    return trace.size() > 1;
+}
+
+// Inputs converted to T once, outside the timed loop
+template <typename T>
+struct Inputs {
+    std::vector<T> a, hg, m;            // 3 per sample
+    std::vector<T> kpDt, kiDt, betaDt;  // 1 per sample
+};
+
+template <typename T>
+static void convert(const std::vector<TraceSample> &trace, const Gains &gains, Inputs<T> &in)
+{
+    size_t n = trace.size();
+    in.a.resize(3 * n);
+    in.hg.resize(3 * n);
+    in.m.resize(3 * n);
+    in.kpDt.resize(n);
+    in.kiDt.resize(n);
+    in.betaDt.resize(n);
+    for (size_t k = 0; k < n; k++) {
+        double dt = (k > 0 ? trace[k].tUs - trace[k - 1].tUs : trace[1].tUs - trace[0].tUs) * 1e-6;
+        for (int i = 0; i < 3; i++) {
+            // Only the direction matters; scale so Q30 holds every component
+            in.a[3 * k + i] = T(trace[k].a[i] / 4.0);
+            in.m[3 * k + i] = T(trace[k].m[i] / 1024.0);
+            in.hg[3 * k + i] = T(trace[k].g[i] * dt * 0.5);
+        }
+        in.kpDt[k] = T(gains.kp * dt);
+        in.kiDt[k] = T(gains.ki * dt);
+        in.betaDt[k] = T(gains.beta * dt);
+    }
+}
+
+template <typename T, typename M>
+static void runPass(const Inputs<T> &in, size_t n, bool madgwick, double *out)
+{
+    T q[4] = { T(1.0), T(0.0), T(0.0), T(0.0) };
+    T eInt[3] = { T(0.0), T(0.0), T(0.0) };
+    for (size_t k = 0; k < n; k++) {
+        const T *a = &in.a[3 * k], *hg = &in.hg[3 * k], *m = &in.m[3 * k];
+        if (madgwick) {
+            FusionKernel<T, M>::Madgwick(q, a[0], a[1], a[2], hg[0], hg[1], hg[2], m[0], m[1], m[2], in.betaDt[k]);
+        } else {
+            FusionKernel<T, M>::Mahony(q, eInt, a[0], a[1], a[2], hg[0], hg[1], hg[2], m[0], m[1], m[2], in.kpDt[k], in.kiDt[k]);
+        }
+        if (out != NULL) {
+            for (int i = 0; i < 4; i++) out[4 * k + i] = toDouble(q[i]);
+        }
+    }
+}
+
+template <typename T, typename M>
+static Result run(const char *name, const std::vector<TraceSample> &trace, const Gains &gains,
+                  bool madgwick, double minSeconds)
+{
+    Inputs<T> in;
+    convert(trace, gains, in);
+    size_t n = trace.size();
+
+    Result r;
+    r.name = name;
+    r.q.resize(4 * n);
+    runPass<T, M>(in, n, madgwick, &r.q[0]);
+
+    // Repeat without recording until the timing is stable
+    long passes = 0;
+    double start = monotonicSeconds(), elapsed;
+#ifdef BENCH_HAVE_TSC
+    unsigned long long tsc = __rdtsc();
+#endif
+    do {
+        runPass<T, M>(in, n, madgwick, NULL);
+        passes++;
+        elapsed = monotonicSeconds() - start;
+    } while (elapsed < minSeconds);
+    double updates = (double)passes * n;
+    r.nsPerUpdate = elapsed * 1e9 / updates;
+#ifdef BENCH_HAVE_TSC
+    r.cyclesPerUpdate = (__rdtsc() - tsc) / updates;
+#else
+    r.cyclesPerUpdate = 0;
+#endif
+    return r;
+}
+
+static void report(const char *filter, const std::vector<TraceSample> &trace, const std::vector<Result> &results)
+{
+    const std::vector<double> &reference = results[0].q;
+    double settleUs = trace[0].tUs + 3000000.0;
+    printf("\n%s\n", filter);
+    printf("  %-12s %12s %12s %12s %12s %10s %10s\n", "variant", "rms vs ref", "max vs ref",
+           "rms vs true", "final", "ns/update", "tsc/update");
+    for (size_t v = 0; v < results.size(); v++) {
+        const Result &r = results[v];
+        double squares = 0, max = 0, trueSquares = 0;
+        size_t trueCount = 0;
+        for (size_t k = 0; k < trace.size(); k++) {
+            double e = angleDeg(&r.q[4 * k], &reference[4 * k]);
+            squares += e * e;
+            if (e > max) max = e;
+            if (trace[k].tUs >= settleUs) {
+                double t = angleDeg(&r.q[4 * k], trace[k].truth);
+                trueSquares += t * t;
+                trueCount++;
+            }
+        }
+        size_t last = trace.size() - 1;
+        printf("  %-12s %12.5f %12.5f %12.3f %12.3f %10.1f %10.0f\n", r.name,
+               sqrt(squares / trace.size()), max,
+               trueCount ? sqrt(trueSquares / trueCount) : 0.0,
+               angleDeg(&r.q[4 * last], trace[last].truth), r.nsPerUpdate, r.cyclesPerUpdate);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: fusion_bench TRACE.csv [--kp K] [--ki K] [--beta B] [--min-seconds S]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    // Defaults of MPU9250.h: Kp 2 * 5, Ki 0, beta from a 60 deg/s gyro error
+    Gains gains;
+    gains.kp = 10.0;
+    gains.ki = 0.0;
+    gains.beta = sqrt(3.0 / 4.0) * 60.0 / DegPerRad;
+    double minSeconds = 0.3;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "--kp") && hasValue) gains.kp = atof(argv[++i]);
+        else if (!strcmp(arg, "--ki") && hasValue) gains.ki = atof(argv[++i]);
+        else if (!strcmp(arg, "--beta") && hasValue) gains.beta = atof(argv[++i]);
+        else if (!strcmp(arg, "--min-seconds") && hasValue) minSeconds = atof(argv[++i]);
+        else if (arg[0] != '-' && path == NULL) path = arg;
+        else usage();
+    }
+    if (path == NULL) usage();
+
+    std::vector<TraceSample> trace;
+    if (!loadTrace(path, trace)) {
+        return 1;
+    }
+    printf("%zu samples, %.1f s, Kp %g Ki %g beta %g\n", trace.size(),
+           (trace.back().tUs - trace.front().tUs) * 1e-6, gains.kp, gains.ki, gains.beta);
+
+    for (int filter = 0; filter < 2; filter++) {
+        bool madgwick = filter == 1;
+        std::vector<Result> results;
+        results.push_back(run<double, FusionMath<double, true> >("double libm", trace, gains, madgwick, minSeconds));
+        results.push_back(run<double, FusionMath<double> >("double", trace, gains, madgwick, minSeconds));
+        results.push_back(run<float, FusionMath<float, true> >("float libm", trace, gains, madgwick, minSeconds));
+        results.push_back(run<float, FusionMath<float> >("float", trace, gains, madgwick, minSeconds));
+        results.push_back(run<Q30, FusionMath<Q30> >("Q30", trace, gains, madgwick, minSeconds));
+        results.push_back(run<Q16, FusionMath<Q16> >("Q16", trace, gains, madgwick, minSeconds));
+        report(madgwick ? "Madgwick" : "Mahony", trace, results);
+    }
+    return 0;
+}
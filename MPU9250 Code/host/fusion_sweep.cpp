@@ -0,0 +1,440 @@
+// Gain search for the Mahony and Madgwick filters over recorded traces, on all cores.
+//
+//   fusion_sweep TRACE.csv... [--kp MIN:MAX:STEPS] [--ki MIN:MAX:STEPS] [--beta MIN:MAX:STEPS]
+//                [--random N] [--seed S] [--threads N] [--settle S] [--top N] [--report FILE]
+//
+// Each TRACE.csv is the --csv output of mpu9250_sim in register mode; its true
+// orientation is the reference. Without --random the gains form a grid with STEPS
+// values per range (Kp x Ki for Mahony, beta for Madgwick); with --random N each
+// filter gets N gain sets drawn uniformly from the ranges. Every gain set runs on
+// every trace and scores the rms angle to the truth after the first --settle
+// seconds; the ranking is by the mean of that over the traces.
+//
+// Gains are in the units of MPU9250.h: Kp and Ki per second, beta in rad/s. A task
+// is one trace with one block of FusionBatch lanes; tasks start spread over the
+// worker queues and idle workers steal from the others, since traces differ in
+// length and so do the tasks.
+#include "FusionBatch.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+static const double DegPerRad = 180.0 / 3.14159265358979323846;
+
+enum { Lanes = 8 };
+typedef FusionBatch<Lanes> Batch;
+
+// One trace in kernel units, 9 inputs per sample as FusionBatch takes them
+struct Trace {
+    const char *path;
+    std::vector<float> in;          // ax ay az, hgx hgy hgz, mx my mz per sample
+    std::vector<float> dt;          // seconds
+    std::vector<double> truth;      // 4 per sample
+    size_t samples;
+    size_t settled;                 // first sample that is scored
+};
+
+struct Range {
+    double min, max;
+    int steps;
+};
+
+struct GainSet {
+    bool madgwick;
+    double kp, ki, beta;
+};
+
+// Score of one gain set on one trace
+struct Score {
+    double rms;
+    double max;
+    double final;
+};
+
+struct Task {
+    int trace;
+    int first;      // first gain set; the block is up to Lanes sets of one filter
+    int count;
+};
+
+struct WorkerQueue {
+    pthread_mutex_t lock;
+    std::deque<int> tasks;
+};
+
+struct Sweep {
+    std::vector<Trace> traces;
+    std::vector<GainSet> gains;
+    std::vector<Task> tasks;
+    std::vector<Score> scores;      // [gain set][trace]
+    std::vector<WorkerQueue> queues;
+    std::vector<long> executed, stolen;
+    std::vector<double> busySeconds;
+};
+
+struct Worker {
+    Sweep *sweep;
+    int index;
+};
+
+static double monotonicSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Rotation angle of conj(a) * b, as in fusion_bench
+static double angleDeg(const float *a, const double *b)
+{
+    double w = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+    double x = a[0] * b[1] - a[1] * b[0] - a[2] * b[3] + a[3] * b[2];
+    double y = a[0] * b[2] + a[1] * b[3] - a[2] * b[0] - a[3] * b[1];
+    double z = a[0] * b[3] - a[1] * b[2] + a[2] * b[1] - a[3] * b[0];
+    return 2.0 * atan2(sqrt(x * x + y * y + z * z), fabs(w)) * DegPerRad;
+}
+
+static bool loadTrace(const char *path, double settleSeconds, Trace &trace)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    char line[1024];
+    if (fgets(line, sizeof(line), file) == NULL || strncmp(line, "t_us,", 5) != 0) {
+        fprintf(stderr, "%s: not an mpu9250_sim --csv trace\n", path);
+        fclose(file);
+        return false;
+    }
+    std::vector<double> t;
+    trace.path = path;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        double v[19];
+        int n = sscanf(line, "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+                       &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9],
+                       &v[10], &v[11], &v[12], &v[13], &v[14], &v[15], &v[16], &v[17], &v[18]);
+        if (n != 19) continue;
+        t.push_back(v[0]);
+        // The same scaling as the firmware wrappers; the gyro is converted once dt is known
+        float in[9] = { (float)(v[10] / 4.0), (float)(v[11] / 4.0), (float)(v[12] / 4.0),
+                        (float)(v[13] / DegPerRad), (float)(v[14] / DegPerRad), (float)(v[15] / DegPerRad),
+                        (float)(v[17] / 1024.0), (float)(v[16] / 1024.0), (float)(-v[18] / 1024.0) };
+        trace.in.insert(trace.in.end(), in, in + 9);
+        trace.truth.insert(trace.truth.end(), &v[6], &v[10]);
+    }
+    fclose(file);
+    trace.samples = t.size();
+    if (trace.samples < 2) {
+        fprintf(stderr, "%s: no samples\n", path);
+        return false;
+    }
+    trace.dt.resize(trace.samples);
+    trace.settled = trace.samples - 1;
+    for (size_t k = 0; k < trace.samples; k++) {
+        double dt = (k > 0 ? t[k] - t[k - 1] : t[1] - t[0]) * 1e-6;
+        trace.dt[k] = (float)dt;
+        for (int i = 3; i < 6; i++) trace.in[9 * k + i] *= (float)(dt * 0.5);
+        if (t[k] - t[0] < settleSeconds * 1e6) trace.settled = k + 1;
+    }
+    if (trace.settled >= trace.samples) trace.settled = trace.samples - 1;
+    return true;
+}
+
+static void runTask(Sweep &sweep, const Task &task)
+{
+    const Trace &trace = sweep.traces[task.trace];
+    const GainSet *gains = &sweep.gains[task.first];
+    bool madgwick = gains[0].madgwick;
+    Batch batch;
+    float in[9][Lanes], kpDt[Lanes], kiDt[Lanes], betaDt[Lanes];
+    const float *inputs[9];
+    for (int i = 0; i < 9; i++) inputs[i] = in[i];
+
+    double squares[Lanes] = { 0 }, max[Lanes] = { 0 };
+    for (size_t k = 0; k < trace.samples; k++) {
+        const float *sample = &trace.in[9 * k];
+        float dt = trace.dt[k];
+        for (int j = 0; j < Lanes; j++) {
+            // Lanes past the block repeat its last gain set and are not scored
+            const GainSet &g = gains[j < task.count ? j : task.count - 1];
+            for (int i = 0; i < 9; i++) in[i][j] = sample[i];
+            kpDt[j] = (float)g.kp * dt;
+            kiDt[j] = (float)g.ki * dt;
+            betaDt[j] = (float)g.beta * dt;
+        }
+        if (madgwick) batch.Madgwick(inputs, betaDt);
+        else batch.Mahony(inputs, kpDt, kiDt);
+
+        if (k < trace.settled) continue;
+        for (int j = 0; j < task.count; j++) {
+            float q[4] = { batch.q[0][j], batch.q[1][j], batch.q[2][j], batch.q[3][j] };
+            double e = angleDeg(q, &trace.truth[4 * k]);
+            squares[j] += e * e;
+            if (e > max[j]) max[j] = e;
+            if (k == trace.samples - 1) {
+                Score &s = sweep.scores[(size_t)(task.first + j) * sweep.traces.size() + task.trace];
+                s.rms = sqrt(squares[j] / (trace.samples - trace.settled));
+                s.max = max[j];
+                s.final = e;
+            }
+        }
+    }
+}
+
+// Own queue from the back, other queues from the front; no task creates new ones,
+// so a worker that finds every queue empty is done
+static bool nextTask(Sweep &sweep, int self, int &task)
+{
+    int workers = (int)sweep.queues.size();
+    for (int n = 0; n < workers; n++) {
+        int victim = (self + n) % workers;
+        WorkerQueue &q = sweep.queues[victim];
+        pthread_mutex_lock(&q.lock);
+        bool found = !q.tasks.empty();
+        if (found) {
+            if (n == 0) {
+                task = q.tasks.back();
+                q.tasks.pop_back();
+            } else {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+                sweep.stolen[self]++;
+            }
+        }
+        pthread_mutex_unlock(&q.lock);
+        if (found) return true;
+    }
+    return false;
+}
+
+static void *workerMain(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    Sweep &sweep = *worker->sweep;
+    int task;
+    double start = monotonicSeconds();
+    while (nextTask(sweep, worker->index, task)) {
+        runTask(sweep, sweep.tasks[task]);
+        sweep.executed[worker->index]++;
+    }
+    sweep.busySeconds[worker->index] = monotonicSeconds() - start;
+    return NULL;
+}
+
+// VALUE, MIN:MAX (keeping the default steps) or MIN:MAX:STEPS
+static bool parseRange(const char *text, Range &range)
+{
+    int n = sscanf(text, "%lf:%lf:%d", &range.min, &range.max, &range.steps);
+    if (n == 1) {
+        range.max = range.min;
+        range.steps = 1;
+    }
+    return n >= 1 && range.steps >= 1 && range.max >= range.min;
+}
+
+static double gridValue(const Range &range, int i)
+{
+    return range.steps > 1 ? range.min + (range.max - range.min) * i / (range.steps - 1) : range.min;
+}
+
+// xorshift64*, so a seed gives the same gain sets everywhere
+static double uniform(uint64_t &state, const Range &range)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    uint64_t r = state * 2685821657736338717ull;
+    return range.min + (range.max - range.min) * ((r >> 11) * (1.0 / 9007199254740992.0));
+}
+
+static void addMahony(Sweep &sweep, double kp, double ki)
+{
+    GainSet g = { false, kp, ki, 0.0 };
+    sweep.gains.push_back(g);
+}
+
+static void addMadgwick(Sweep &sweep, double beta)
+{
+    GainSet g = { true, 0.0, 0.0, beta };
+    sweep.gains.push_back(g);
+}
+
+struct Ranked {
+    int gain;
+    double meanRms, worstMax, meanFinal;
+    bool operator<(const Ranked &other) const { return meanRms < other.meanRms; }
+};
+
+static void usage()
+{
+    fprintf(stderr, "usage: fusion_sweep TRACE.csv... [--kp MIN:MAX:STEPS] [--ki MIN:MAX:STEPS] [--beta MIN:MAX:STEPS]\n"
+                    "                    [--random N] [--seed S] [--threads N] [--settle S] [--top N] [--report FILE]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    Range kp = { 1.0, 30.0, 12 }, ki = { 0.0, 0.5, 3 }, beta = { 0.05, 2.0, 16 };
+    int random = 0, top = 10;
+    uint64_t seed = 1;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double settleSeconds = 3.0;
+    const char *reportPath = NULL;
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "--kp") && hasValue) { if (!parseRange(argv[++i], kp)) usage(); }
+        else if (!strcmp(arg, "--ki") && hasValue) { if (!parseRange(argv[++i], ki)) usage(); }
+        else if (!strcmp(arg, "--beta") && hasValue) { if (!parseRange(argv[++i], beta)) usage(); }
+        else if (!strcmp(arg, "--random") && hasValue) random = atoi(argv[++i]);
+        else if (!strcmp(arg, "--seed") && hasValue) seed = strtoull(argv[++i], NULL, 0) | 1;
+        else if (!strcmp(arg, "--threads") && hasValue) threads = atoi(argv[++i]);
+        else if (!strcmp(arg, "--settle") && hasValue) settleSeconds = atof(argv[++i]);
+        else if (!strcmp(arg, "--top") && hasValue) top = atoi(argv[++i]);
+        else if (!strcmp(arg, "--report") && hasValue) reportPath = argv[++i];
+        else if (arg[0] != '-') paths.push_back(arg);
+        else usage();
+    }
+    if (paths.empty()) usage();
+    if (threads < 1) threads = 1;
+
+    Sweep sweep;
+    sweep.traces.resize(paths.size());
+    size_t totalSamples = 0;
+    for (size_t t = 0; t < paths.size(); t++) {
+        if (!loadTrace(paths[t], settleSeconds, sweep.traces[t])) {
+            return 1;
+        }
+        totalSamples += sweep.traces[t].samples;
+    }
+
+    // Mahony first, then Madgwick, so no task block mixes the filters
+    if (random > 0) {
+        for (int i = 0; i < random; i++) {
+            double p = uniform(seed, kp);
+            addMahony(sweep, p, uniform(seed, ki));
+        }
+        for (int i = 0; i < random; i++) addMadgwick(sweep, uniform(seed, beta));
+    } else {
+        for (int i = 0; i < kp.steps; i++) {
+            for (int j = 0; j < ki.steps; j++) addMahony(sweep, gridValue(kp, i), gridValue(ki, j));
+        }
+        for (int i = 0; i < beta.steps; i++) addMadgwick(sweep, gridValue(beta, i));
+    }
+    int gainCount = (int)sweep.gains.size();
+    sweep.scores.resize((size_t)gainCount * sweep.traces.size());
+
+    for (int first = 0; first < gainCount; ) {
+        int count = 1;
+        while (count < Lanes && first + count < gainCount &&
+               sweep.gains[first + count].madgwick == sweep.gains[first].madgwick) {
+            count++;
+        }
+        for (size_t t = 0; t < sweep.traces.size(); t++) {
+            Task task = { (int)t, first, count };
+            sweep.tasks.push_back(task);
+        }
+        first += count;
+    }
+
+    sweep.queues.resize(threads);
+    sweep.executed.assign(threads, 0);
+    sweep.stolen.assign(threads, 0);
+    sweep.busySeconds.assign(threads, 0.0);
+    for (int w = 0; w < threads; w++) {
+        pthread_mutex_init(&sweep.queues[w].lock, NULL);
+    }
+    for (size_t i = 0; i < sweep.tasks.size(); i++) {
+        sweep.queues[i % threads].tasks.push_back((int)i);
+    }
+
+    printf("%zu traces, %zu samples; %d gain sets, %zu tasks of up to %d lanes on %d threads\n",
+           sweep.traces.size(), totalSamples, gainCount, sweep.tasks.size(), (int)Lanes, threads);
+    double start = monotonicSeconds();
+    std::vector<pthread_t> ids(threads);
+    std::vector<Worker> workers(threads);
+    for (int w = 0; w < threads; w++) {
+        workers[w].sweep = &sweep;
+        workers[w].index = w;
+        if (pthread_create(&ids[w], NULL, workerMain, &workers[w]) != 0) {
+            fprintf(stderr, "cannot start worker %d\n", w);
+            return 1;
+        }
+    }
+    for (int w = 0; w < threads; w++) {
+        pthread_join(ids[w], NULL);
+    }
+    double elapsed = monotonicSeconds() - start;
+
+    long steals = 0;
+    for (int w = 0; w < threads; w++) steals += sweep.stolen[w];
+    double updates = 0;
+    for (size_t i = 0; i < sweep.tasks.size(); i++) {
+        updates += (double)sweep.tasks[i].count * sweep.traces[sweep.tasks[i].trace].samples;
+    }
+    printf("%.2f s, %.1f M filter updates/s, %ld tasks stolen\n", elapsed, updates / elapsed * 1e-6, steals);
+    for (int w = 0; w < threads; w++) {
+        printf("  worker %d: %ld tasks, %ld stolen, %.2f s\n", w, sweep.executed[w], sweep.stolen[w],
+               sweep.busySeconds[w]);
+    }
+
+    std::vector<Ranked> ranked(gainCount);
+    size_t traceCount = sweep.traces.size();
+    for (int g = 0; g < gainCount; g++) {
+        Ranked &r = ranked[g];
+        r.gain = g;
+        r.meanRms = r.worstMax = r.meanFinal = 0;
+        for (size_t t = 0; t < traceCount; t++) {
+            const Score &s = sweep.scores[(size_t)g * traceCount + t];
+            // A diverged filter can produce NaN; rank it last
+            r.meanRms += s.rms == s.rms ? s.rms : HUGE_VAL;
+            r.worstMax = std::max(r.worstMax, s.max);
+            r.meanFinal += s.final;
+        }
+        r.meanRms /= traceCount;
+        r.meanFinal /= traceCount;
+    }
+    std::stable_sort(ranked.begin(), ranked.end());
+
+    FILE *report = NULL;
+    if (reportPath != NULL) {
+        if ((report = fopen(reportPath, "w")) == NULL) {
+            perror(reportPath);
+            return 1;
+        }
+        fprintf(report, "rank,filter,kp,ki,beta,rms_deg,max_deg,final_deg\n");
+    }
+    int shown[2] = { 0, 0 };
+    printf("\n  %4s %-8s %8s %8s %8s %10s %10s %10s\n", "rank", "filter", "Kp", "Ki", "beta", "rms deg",
+           "max deg", "final deg");
+    for (int i = 0; i < gainCount; i++) {
+        const Ranked &r = ranked[i];
+        const GainSet &g = sweep.gains[r.gain];
+        if (report != NULL) {
+            fprintf(report, "%d,%s,%g,%g,%g,%f,%f,%f\n", i + 1, g.madgwick ? "madgwick" : "mahony",
+                    g.kp, g.ki, g.beta, r.meanRms, r.worstMax, r.meanFinal);
+        }
+        // The best of each filter, up to --top each
+        if (shown[g.madgwick]++ >= top) continue;
+        if (g.madgwick) {
+            printf("  %4d %-8s %8s %8s %8.3f %10.3f %10.3f %10.3f\n", i + 1, "Madgwick", "", "", g.beta,
+                   r.meanRms, r.worstMax, r.meanFinal);
+        } else {
+            printf("  %4d %-8s %8.3f %8.3f %8s %10.3f %10.3f %10.3f\n", i + 1, "Mahony", g.kp, g.ki, "",
+                   r.meanRms, r.worstMax, r.meanFinal);
+        }
+    }
+    if (report != NULL) fclose(report);
+    return 0;
+}
@@ -0,0 +1,267 @@
+// Baud rate negotiation of SerialLink.h against the LinkNegotiator.h the viewer runs,
+// over the simulated UART, and the samples per second that get through at each rate.
+//
+//   link_bench [--boards N] [--output-hz HZ] [--raw-frames] [--seconds S] [--sweep]
+//              [--max-baud N] [--reliable-baud N] [--byte-error-rate P] [--seed N] [--uptime S]
+//
+// Each board hands a frame to uartTx at its output tick, as the pipeline does (166 Hz
+// for the 333 Hz sampling of main.cpp). Bytes sent faster than --reliable-baud, in
+// either direction, are corrupted with probability --byte-error-rate, standing in for
+// a USB bridge or cable that cannot keep up; bytes received at a rate other than the
+// sender's arrive garbled. --sweep tries every rate up to --max-baud even past a failed
+// trial, so each gets a samples per second figure. Without it, exits with 1 when the
+// negotiation does not settle at the fastest rate up to --reliable-baud. --uptime idles
+// the link for S seconds first, e.g. 2150 to negotiate after the board's Timer::read_us()
+// has wrapped at 35.8 minutes.
+#include "mbed.h"
+#include "rtos.h"
+#include "QuatFrame.h"
+#include "UartTx.h"
+#include "SerialLink.h"
+#include "LinkNegotiator.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+RawSerial pc(USBTX, USBRX);
+UartTx uartTx(pc);
+SerialLink serialLink(pc, uartTx);
+
+enum { MaxBoards = 4 };
+
+// Uniform in [0, 1), xorshift so every run sees the same errors
+static unsigned long long rngState = 88172645463325252ULL;
+static double uniform()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (rngState >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint32_t reliableBaud = 921600;
+static double byteErrorRate = 1e-3;
+static uint32_t hostBaud = QUAT_LINK_DEFAULT_BAUD;
+
+static uint8_t corrupt(uint8_t c, uint32_t baud)
+{
+    if (baud > reliableBaud && uniform() < byteErrorRate) {
+        c ^= (uint8_t)(1 << (int)(uniform() * 8));
+    }
+    return c;
+}
+
+// The viewer's port: the host end of the simulated UART
+class BenchPort : public LinkPort {
+public:
+    virtual void setBaud(uint32_t baud) { hostBaud = baud; }
+    virtual void write(const uint8_t *data, int length) {
+        uint8_t wire[QUAT_FRAME_MAX_SIZE];
+        for (int i = 0; i < length; i++) {
+            wire[i] = corrupt(data[i], hostBaud);
+        }
+        pc.simReceive(wire, length, (int)hostBaud);
+    }
+};
+
+static BenchPort port;
+static LinkNegotiator negotiator(port);
+
+// Host frame parser, counting as FrameParser does
+static std::vector<uint8_t> received;
+static bool aligned = false;
+static uint64_t frames = 0, errors = 0, boardFrames[MaxBoards];
+
+static uint32_t nowMs()
+{
+    return (uint32_t)(sim::nowUs() / 1000);
+}
+
+static void skipByte(size_t &pos)
+{
+    pos++;
+    if (aligned) {
+        errors++;   // lost alignment
+        aligned = false;
+    }
+}
+
+static void parse()
+{
+    size_t pos = 0;
+    while (received.size() - pos >= 3) {
+        const uint8_t *data = &received[pos];
+        if (data[0] != QUAT_FRAME_SYNC0 || data[1] != QUAT_FRAME_SYNC1) {
+            skipByte(pos);
+            continue;
+        }
+        int payload = quatFramePayloadSize(data[2]);
+        if (payload == 0) {
+            skipByte(pos);
+            continue;
+        }
+        int length = QUAT_FRAME_HEADER_SIZE + payload + QUAT_FRAME_CRC_SIZE;
+        if ((int)(received.size() - pos) < length) {
+            break;
+        }
+        QuatLink link = QuatLink();
+        QuatSample sample = QuatSample();
+        if (data[2] == QUAT_FRAME_LINK && quatLinkDecode(data, length, &link) == length) {
+            negotiator.onLink(link, nowMs());
+        } else if (data[2] != QUAT_FRAME_LINK && quatFrameDecode(data, length, &sample) == length) {
+            frames++;
+            if (sample.board >= 1 && sample.board <= MaxBoards) boardFrames[sample.board - 1]++;
+        } else {
+            errors++;   // corrupted frame
+            skipByte(pos);
+            continue;
+        }
+        pos += length;
+        aligned = true;
+    }
+    received.erase(received.begin(), received.begin() + pos);
+}
+
+// Every byte the board writes, tagged with the rate it went out at
+static void onByte(uint8_t c, int baud)
+{
+    if ((uint32_t)baud != hostBaud) {
+        c = (uint8_t)(((c << 3) | (c >> 5)) ^ 0x5A);
+    }
+    received.push_back(corrupt(c, (uint32_t)baud));
+    if (received.size() >= QUAT_FRAME_MAX_SIZE) {
+        parse();
+    }
+}
+
+static const char *resultName(uint8_t result)
+{
+    switch (result) {
+        case LINK_TRIAL_COMMITTED: return "committed";
+        case LINK_TRIAL_ERRORS:    return "errors";
+        case LINK_TRIAL_REJECTED:  return "rejected";
+        case LINK_TRIAL_NO_REPLY:  return "no reply";
+        default:                   return "-";
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: link_bench [--boards N] [--output-hz HZ] [--raw-frames] [--seconds S] [--sweep]\n"
+                    "                  [--max-baud N] [--reliable-baud N] [--byte-error-rate P] [--seed N] [--uptime S]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int boards = 4;
+    double outputHz = 166.0, seconds = 30.0, uptime = 0.0;
+    bool rawFrames = false;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "--raw-frames")) rawFrames = true;
+        else if (!strcmp(arg, "--sweep")) negotiator.sweep = true;
+        else if (!strcmp(arg, "--boards") && hasValue) boards = atoi(argv[++i]);
+        else if (!strcmp(arg, "--output-hz") && hasValue) outputHz = atof(argv[++i]);
+        else if (!strcmp(arg, "--seconds") && hasValue) seconds = atof(argv[++i]);
+        else if (!strcmp(arg, "--max-baud") && hasValue) negotiator.maxBaud = (uint32_t)atol(argv[++i]);
+        else if (!strcmp(arg, "--reliable-baud") && hasValue) reliableBaud = (uint32_t)atol(argv[++i]);
+        else if (!strcmp(arg, "--byte-error-rate") && hasValue) byteErrorRate = atof(argv[++i]);
+        else if (!strcmp(arg, "--seed") && hasValue) rngState += (unsigned long long)atoll(argv[++i]);
+        else if (!strcmp(arg, "--uptime") && hasValue) uptime = atof(argv[++i]);
+        else usage();
+    }
+    if (boards < 1 || boards > MaxBoards || outputHz <= 0 || seconds <= 0 || uptime < 0) {
+        usage();
+    }
+
+    pc.baud(QUAT_LINK_DEFAULT_BAUD);
+    sim::advanceUs((uint64_t)(uptime * 1000000.0));
+    Serial::setSink(onByte);
+    memset(boardFrames, 0, sizeof(boardFrames));
+
+    // Frames as the boards encode them; only the sequence number and time change
+    uint8_t frame[QUAT_FRAME_MAX_SIZE];
+    const float q[4] = { 1.0f, 0.0f, 0.0f, 0.0f };
+    const int16_t raw[QUAT_FRAME_RAW_COUNTS] = { 0 };
+    uint16_t seq[MaxBoards] = { 0 };
+    uint64_t periodUs = (uint64_t)(1000000.0 / outputHz);
+    uint64_t nextUs[MaxBoards];
+    for (int b = 0; b < boards; b++) {
+        nextUs[b] = sim::nowUs() + b * periodUs / boards;
+    }
+
+    uint64_t endUs = sim::nowUs() + (uint64_t)(seconds * 1000000.0);
+    uint64_t settledUs = 0, settledFrames = 0, settledErrors = 0;
+    uint32_t lastUpdateMs = nowMs();
+    negotiator.start(lastUpdateMs, frames, errors);
+    while (sim::nowUs() < endUs) {
+        for (int b = 0; b < boards; b++) {
+            if (sim::nowUs() >= nextUs[b]) {
+                int length = quatFrameEncode(frame, rawFrames ? QUAT_FRAME_RAW : QUAT_FRAME_FLOAT, (uint8_t)(b + 1),
+                                             seq[b]++, (uint32_t)sim::nowUs(), q, raw);
+                uartTx.send((uint8_t)(b + 1), frame, length);
+                nextUs[b] += periodUs;
+            }
+        }
+        serialLink.poll(0);
+        sim::advanceUs(100);
+        if (nowMs() != lastUpdateMs) {
+            lastUpdateMs = nowMs();
+            parse();
+            negotiator.update(lastUpdateMs, frames, errors);
+            // Measure the settled link from its last change on
+            bool settled = negotiator.settled() && serialLink.state == SerialLink::LINK_IDLE;
+            if (!settled) {
+                settledUs = 0;
+            } else if (settledUs == 0) {
+                settledUs = sim::nowUs();
+                settledFrames = frames;
+                settledErrors = errors;
+            }
+        }
+    }
+
+    printf("%d board%s at %.0f Hz, %s frames, bytes above %lu baud corrupted with p = %g\n", boards,
+           boards > 1 ? "s" : "", outputHz, rawFrames ? "raw" : "float", (unsigned long)reliableBaud, byteErrorRate);
+    printf("%8s %-10s %10s %10s %12s %12s\n", "baud", "trial", "frames/s", "errors", "error rate", "samples/s/board");
+    for (int i = 0; i < QUAT_LINK_RATE_COUNT; i++) {
+        const LinkTrial &t = negotiator.trials[i];
+        if (t.result == LINK_TRIAL_NONE && t.ms == 0) continue;
+        printf("%8lu %-10s %10.1f %10lu %11.3f%% %12.1f\n", (unsigned long)t.baud, resultName(t.result),
+               t.framesPerSecond(), (unsigned long)t.errors, 100.0f * t.errorRate(), t.framesPerSecond() / boards);
+    }
+    printf("negotiated:             %lu baud (board %lu, committed %lu), %lu proposals, %lu fallbacks\n",
+           (unsigned long)negotiator.baud(), (unsigned long)serialLink.baudRate, (unsigned long)serialLink.committedBaud,
+           (unsigned long)negotiator.proposals, (unsigned long)negotiator.fallbacks);
+    double settledSeconds = settledUs > 0 ? (sim::nowUs() - settledUs) / 1000000.0 : 0.0;
+    if (settledSeconds > 0) {
+        printf("settled:                %.1f s, %.1f samples/s (%.1f per board) of %.1f produced, %lu errors\n",
+               settledSeconds, (frames - settledFrames) / settledSeconds, (frames - settledFrames) / settledSeconds / boards,
+               boards * outputHz, (unsigned long)(errors - settledErrors));
+    } else {
+        printf("settled:                never\n");
+    }
+    for (int b = 0; b < boards; b++) {
+        printf("board %d:                %lu frames received, %u sent, %u dropped by uartTx\n", b + 1,
+               (unsigned long)boardFrames[b], (unsigned)uartTx.sent[b], (unsigned)uartTx.dropped[b]);
+    }
+    int bitsPerSecond = (int)(boards * outputHz * 10 * (QUAT_FRAME_HEADER_SIZE + quatFramePayloadSize(rawFrames ? QUAT_FRAME_RAW : QUAT_FRAME_FLOAT) + QUAT_FRAME_CRC_SIZE));
+    uint32_t expected = 0;
+    for (int i = 0; i < QUAT_LINK_RATE_COUNT; i++) {
+        if (quatLinkRates[i] <= reliableBaud && quatLinkRates[i] <= negotiator.maxBaud) expected = quatLinkRates[i];
+    }
+    printf("frames need:            %d bit/s on the wire\n", bitsPerSecond);
+    printf("uart interrupts:        %.0f per second, %.1f bytes each\n", uartTx.interrupts / seconds,
+           uartTx.interrupts > 0 ? (double)Serial::bytesWritten() / uartTx.interrupts : 0.0);
+    if (negotiator.sweep) {
+        return 0;
+    }
+    if (!negotiator.settled() || negotiator.baud() != expected || serialLink.baudRate != expected) {
+        fprintf(stderr, "negotiated %lu baud, expected %lu\n", (unsigned long)negotiator.baud(), (unsigned long)expected);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,310 @@
+#ifndef MBED_H
+#define MBED_H
+// Host stand-in for the parts of mbed used by MPU9250.h so the driver and the
+// fusion code build and run on Linux. Time is simulated: wait() and every blocking I2C
+// transaction advance a global clock, which Timer reads back.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#define MBED_PACKED(struct) struct __attribute__((packed))
+
+typedef enum {
+    p9, p10, p21, p22, p23, p24, p27, p28,
+    LED1, LED2, LED3, LED4,
+    USBTX, USBRX,
+    NC = -1
+} PinName;
+
+namespace sim {
+    // Simulated hardware that runs on its own clock, e.g. a sensor sampling at 1 kHz
+    class Clocked {
+    public:
+        virtual ~Clocked() {}
+        virtual void advanceTo(uint64_t us) = 0;
+    };
+
+    uint64_t nowUs();
+    // Advances in steps of at most StepUs so interrupts fire close to their real time
+    void advanceUs(uint64_t us);
+    void addClocked(Clocked *device);
+    // Simulated time spent blocked in Semaphore::wait() or idleUs(), i.e. with the CPU free
+    uint64_t blockedUs();
+    void idleUs(uint64_t us);
+    // Sleep as needed so simulated time does not run ahead of the wall clock
+    void setRealtime(bool enable);
+
+    static const uint64_t StepUs = 20;
+}
+
+template <typename F> class Callback;
+
+// Subset of mbed::Callback: a plain function or a member function without arguments
+template <> class Callback<void()> {
+public:
+    Callback() : thunk(0), object(0), function(0) {}
+    Callback(void (*function)()) : thunk(0), object(0), function(function) {}
+    template <typename T>
+    Callback(T *object, void (T::*method)()) : thunk(&callMethod<T>), object(object), function(0) {
+        memcpy(methodStorage, &method, sizeof(method));
+    }
+
+    void call() const {
+        if (thunk != 0) thunk(object, methodStorage);
+        else if (function != 0) function();
+    }
+    void operator()() const { call(); }
+    operator bool() const { return thunk != 0 || function != 0; }
+
+private:
+    template <typename T>
+    static void callMethod(void *object, const char *storage) {
+        void (T::*method)();
+        memcpy(&method, storage, sizeof(method));
+        (static_cast<T *>(object)->*method)();
+    }
+
+    void (*thunk)(void *, const char *);
+    void *object;
+    void (*function)();
+    char methodStorage[2 * sizeof(void *)];
+};
+
+template <> class Callback<void(int)> {
+public:
+    Callback() : thunk(0), object(0), function(0) {}
+    Callback(void (*function)(int)) : thunk(0), object(0), function(function) {}
+    template <typename T>
+    Callback(T *object, void (T::*method)(int)) : thunk(&callMethod<T>), object(object), function(0) {
+        memcpy(methodStorage, &method, sizeof(method));
+    }
+
+    void call(int arg) const {
+        if (thunk != 0) thunk(object, methodStorage, arg);
+        else if (function != 0) function(arg);
+    }
+    void operator()(int arg) const { call(arg); }
+    operator bool() const { return thunk != 0 || function != 0; }
+
+private:
+    template <typename T>
+    static void callMethod(void *object, const char *storage, int arg) {
+        void (T::*method)(int);
+        memcpy(&method, storage, sizeof(method));
+        (static_cast<T *>(object)->*method)(arg);
+    }
+
+    void (*thunk)(void *, const char *, int);
+    void *object;
+    void (*function)(int);
+    char methodStorage[2 * sizeof(void *)];
+};
+
+typedef Callback<void(int)> event_callback_t;
+
+template <typename T>
+Callback<void()> callback(T *object, void (T::*method)())
+{
+    return Callback<void()>(object, method);
+}
+
+template <typename T>
+Callback<void(int)> callback(T *object, void (T::*method)(int))
+{
+    return Callback<void(int)>(object, method);
+}
+
+// Subset of mbed::CircularBuffer: a ring that overwrites its oldest element when full
+template <typename T, uint32_t BufferSize>
+class CircularBuffer {
+public:
+    CircularBuffer() : head(0), tail(0), isFull(false) {}
+    void push(const T &data) {
+        if (isFull) tail = (tail + 1) % BufferSize;
+        pool[head] = data;
+        head = (head + 1) % BufferSize;
+        isFull = head == tail;
+    }
+    bool pop(T &data) {
+        if (empty()) return false;
+        data = pool[tail];
+        tail = (tail + 1) % BufferSize;
+        isFull = false;
+        return true;
+    }
+    bool empty() { return head == tail && !isFull; }
+    bool full() { return isFull; }
+    void reset() { head = tail = 0; isFull = false; }
+
+private:
+    T pool[BufferSize];
+    uint32_t head, tail;
+    bool isFull;
+};
+
+// The simulator runs handlers synchronously, there is nothing to mask
+inline void core_util_critical_section_enter() {}
+inline void core_util_critical_section_exit() {}
+
+// The simulated bus implements the asynchronous transfer API: a transfer occupies
+// the bus for its wire time without blocking the caller, so two buses overlap
+#define DEVICE_I2C_ASYNCH 1
+#define I2C_EVENT_ERROR               (1 << 1)
+#define I2C_EVENT_ERROR_NO_SLAVE      (1 << 2)
+#define I2C_EVENT_TRANSFER_COMPLETE   (1 << 3)
+#define I2C_EVENT_TRANSFER_EARLY_NACK (1 << 4)
+#define I2C_EVENT_ALL                 (I2C_EVENT_ERROR | I2C_EVENT_TRANSFER_COMPLETE | I2C_EVENT_ERROR_NO_SLAVE | I2C_EVENT_TRANSFER_EARLY_NACK)
+
+// A device on a simulated bus; addresses are 8-bit as in the mbed I2C API
+class SimI2CDevice {
+public:
+    virtual ~SimI2CDevice() {}
+    virtual bool acks(int address) = 0;
+    virtual void write(int address, const uint8_t *data, int length) = 0;
+    virtual void read(int address, uint8_t *data, int length) = 0;
+};
+
+class I2C : public sim::Clocked {
+public:
+    enum { MaxDevices = 8 };
+
+    I2C(PinName sda, PinName scl);
+    void frequency(int hz);
+    // 0 on ACK, non-zero when no device answers the address.
+    // Blocking calls first wait for a running asynchronous transfer.
+    int write(int address, const char *data, int length, bool repeated = false);
+    int read(int address, char *data, int length, bool repeated = false);
+
+    // Write tx then read rx; the device sees the transfer at once and the callback
+    // runs when the bus time has elapsed. -1 when a transfer is still running.
+    int transfer(int address, const char *tx_buffer, int tx_length, char *rx_buffer, int rx_length,
+                 const event_callback_t &callback, int event = I2C_EVENT_TRANSFER_COMPLETE, bool repeated = false);
+    void abort_transfer();
+
+    // Host only
+    void attach(SimI2CDevice *device);
+    void advanceTo(uint64_t us);
+    uint64_t transactions;
+    uint64_t bytes;
+    uint64_t nacks;
+    uint64_t busUs;
+
+private:
+    SimI2CDevice *find(int address);
+    uint64_t account(int length);
+    void waitIdle();
+
+    SimI2CDevice *devices[MaxDevices];
+    int deviceCount;
+    int hz;
+
+    bool transferActive;
+    uint64_t transferDoneUs;
+    int transferEvent;
+    event_callback_t transferCallback;
+};
+
+class Timer {
+public:
+    Timer() : running(false), startUs(0), accumulatedUs(0) {}
+    void start() { if (!running) { startUs = sim::nowUs(); running = true; } }
+    void stop() { if (running) { accumulatedUs += sim::nowUs() - startUs; running = false; } }
+    void reset() { startUs = sim::nowUs(); accumulatedUs = 0; }
+    float read() { return (float)elapsedUs() / 1000000.0f; }
+    int read_ms() { return (int)(elapsedUs() / 1000); }
+    int read_us() { return (int)elapsedUs(); }
+
+private:
+    uint64_t elapsedUs() { return accumulatedUs + (running ? sim::nowUs() - startUs : 0); }
+
+    bool running;
+    uint64_t startUs;
+    uint64_t accumulatedUs;
+};
+
+void wait(float s);
+void wait_ms(int ms);
+void wait_us(int us);
+
+// A UART with the 16 byte transmit FIFO of the LPC1768. Until baud() is called it is
+// ideal and every byte leaves at once. After baud() each byte takes ten bit times on
+// the wire: putc() blocks while the FIFO is full and the TxIrq handler runs when the
+// FIFO has drained. Received bytes come from simReceive() and raise the RxIrq handler.
+class Serial : public sim::Clocked {
+public:
+    enum IrqType { RxIrq = 0, TxIrq };
+    enum { TxFifoSize = 16, RxBufferSize = 256 };
+
+    Serial(PinName tx, PinName rx);
+    void baud(int rate);
+    int putc(int c);
+    int getc();
+    int printf(const char *format, ...);
+    int writeable() { return byteNs == 0 || txFifo < TxFifoSize; }
+    int readable() { return rxCount > 0; }
+    void attach(Callback<void()> func, IrqType type = RxIrq);
+
+    // Host only: where the UART bytes go, NULL discards them
+    static void setOutput(FILE *file);
+    // Host only: every byte written is also handed to sink with the rate it went out at,
+    // 0 while ideal
+    static void setSink(void (*sink)(uint8_t c, int baud));
+    static uint64_t bytesWritten();
+    // Host only: bytes the other end sent at senderBaud. Unless the UART is ideal they
+    // arrive garbled when that is not the rate set with baud(), as on a real link.
+    void simReceive(const uint8_t *data, int length, int senderBaud);
+    void advanceTo(uint64_t us);
+
+private:
+    int rate;               // set with baud(), 0 while ideal
+    uint64_t byteNs;        // wire time of a byte, 0 while ideal
+    uint64_t nextDoneNs;    // when the oldest byte in the FIFO has left
+    int txFifo;
+    bool clocked;
+    uint8_t rxData[RxBufferSize];
+    int rxHead;
+    int rxCount;
+    Callback<void()> txHandler;
+    Callback<void()> rxHandler;
+};
+
+// Interrupt safe on mbed; the same UART here
+typedef Serial RawSerial;
+
+class DigitalOut {
+public:
+    DigitalOut(PinName pin) : value(0) { (void)pin; }
+    void write(int v) { value = v; }
+    int read() { return value; }
+    DigitalOut &operator=(int v) { value = v; return *this; }
+    operator int() { return value; }
+
+private:
+    int value;
+};
+
+// Handlers run synchronously from inside sim::advanceUs(), the host analogue of an ISR
+class InterruptIn {
+public:
+    InterruptIn(PinName pin) : level(0) { (void)pin; }
+    void rise(Callback<void()> func) { riseHandler = func; }
+    void fall(Callback<void()> func) { fallHandler = func; }
+    int read() { return level; }
+    operator int() { return level; }
+
+    // Host only: drive the pin from a simulated device
+    void simDrive(int value) {
+        if (value && !level) { level = 1; riseHandler.call(); }
+        else if (!value && level) { level = 0; fallHandler.call(); }
+    }
+
+private:
+    int level;
+    Callback<void()> riseHandler;
+    Callback<void()> fallHandler;
+};
+
+#include "rtos.h"
+
+#endif
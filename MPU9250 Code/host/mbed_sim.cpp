@@ -0,0 +1,367 @@
+#include "mbed.h"
+
+#include <time.h>
+#include <errno.h>
+
+static uint64_t simNowUs = 0;
+static bool simRealtime = false;
+static struct timespec simWallStart;
+
+enum { MaxClocked = 16 };
+static sim::Clocked *clocked[MaxClocked];
+static int clockedCount = 0;
+static uint64_t simBlockedUs = 0;
+
+namespace sim {
+
+uint64_t nowUs()
+{
+    return simNowUs;
+}
+
+uint64_t blockedUs()
+{
+    return simBlockedUs;
+}
+
+void addClocked(Clocked *device)
+{
+    if (clockedCount < MaxClocked) {
+        clocked[clockedCount++] = device;
+    }
+}
+
+void advanceUs(uint64_t us)
+{
+    while (us > 0) {
+        uint64_t step = us < StepUs ? us : StepUs;
+        simNowUs += step;
+        us -= step;
+        for (int i = 0; i < clockedCount; i++) {
+            clocked[i]->advanceTo(simNowUs);
+        }
+    }
+    if (!simRealtime) {
+        return;
+    }
+    struct timespec target = simWallStart;
+    target.tv_sec += simNowUs / 1000000;
+    target.tv_nsec += (simNowUs % 1000000) * 1000;
+    if (target.tv_nsec >= 1000000000L) {
+        target.tv_sec++;
+        target.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR) {
+    }
+}
+
+void idleUs(uint64_t us)
+{
+    advanceUs(us);
+    simBlockedUs += us;
+}
+
+void setRealtime(bool enable)
+{
+    simRealtime = enable;
+    if (enable) {
+        // Anchor so that the current simulated time is "now"
+        clock_gettime(CLOCK_MONOTONIC, &simWallStart);
+        uint64_t sec = simNowUs / 1000000, nsec = (simNowUs % 1000000) * 1000;
+        simWallStart.tv_sec -= sec;
+        if (simWallStart.tv_nsec < (long)nsec) {
+            simWallStart.tv_sec--;
+            simWallStart.tv_nsec += 1000000000L;
+        }
+        simWallStart.tv_nsec -= nsec;
+    }
+}
+
+}
+
+void wait(float s)
+{
+    sim::advanceUs((uint64_t)(s * 1000000.0f));
+}
+
+void wait_ms(int ms)
+{
+    sim::advanceUs((uint64_t)ms * 1000);
+}
+
+void wait_us(int us)
+{
+    sim::advanceUs((uint64_t)us);
+}
+
+osStatus Thread::wait(uint32_t ms)
+{
+    sim::advanceUs((uint64_t)ms * 1000);
+    return osOK;
+}
+
+int32_t Semaphore::wait(uint32_t millisec)
+{
+    uint64_t waitedUs = 0;
+    while (tokens == 0) {
+        if (millisec != osWaitForever && waitedUs >= (uint64_t)millisec * 1000) {
+            return 0;
+        }
+        sim::idleUs(sim::StepUs);
+        waitedUs += sim::StepUs;
+    }
+    return tokens--;
+}
+
+I2C::I2C(PinName sda, PinName scl)
+    : transactions(0), bytes(0), nacks(0), busUs(0), deviceCount(0), hz(100000),
+      transferActive(false), transferDoneUs(0), transferEvent(0)
+{
+    (void)sda;
+    (void)scl;
+    sim::addClocked(this);
+}
+
+void I2C::frequency(int hz)
+{
+    this->hz = hz;
+}
+
+void I2C::attach(SimI2CDevice *device)
+{
+    if (deviceCount < MaxDevices) {
+        devices[deviceCount++] = device;
+    }
+}
+
+SimI2CDevice *I2C::find(int address)
+{
+    for (int i = 0; i < deviceCount; i++) {
+        if (devices[i]->acks(address)) {
+            return devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Start, address byte, data bytes and stop: 9 clocks per byte plus about two
+// for the start and stop conditions
+uint64_t I2C::account(int length)
+{
+    uint64_t us = ((uint64_t)(length + 1) * 9 + 2) * 1000000 / hz;
+    transactions++;
+    bytes += length;
+    busUs += us;
+    return us;
+}
+
+void I2C::waitIdle()
+{
+    while (transferActive) {
+        sim::advanceUs(sim::StepUs);
+    }
+}
+
+int I2C::write(int address, const char *data, int length, bool repeated)
+{
+    (void)repeated;
+    waitIdle();
+    SimI2CDevice *device = find(address);
+    if (device == NULL) {
+        nacks++;
+        sim::advanceUs(account(0));
+        return 1;
+    }
+    device->write(address, (const uint8_t *)data, length);
+    sim::advanceUs(account(length));
+    return 0;
+}
+
+int I2C::read(int address, char *data, int length, bool repeated)
+{
+    (void)repeated;
+    waitIdle();
+    SimI2CDevice *device = find(address);
+    if (device == NULL) {
+        nacks++;
+        for (int i = 0; i < length; i++) {
+            data[i] = (char)0xFF;   // released bus reads back as ones
+        }
+        sim::advanceUs(account(0));
+        return 1;
+    }
+    device->read(address, (uint8_t *)data, length);
+    sim::advanceUs(account(length));
+    return 0;
+}
+
+int I2C::transfer(int address, const char *tx_buffer, int tx_length, char *rx_buffer, int rx_length,
+                  const event_callback_t &callback, int event, bool repeated)
+{
+    (void)repeated;
+    if (transferActive) {
+        return -1;
+    }
+    uint64_t us;
+    SimI2CDevice *device = find(address);
+    if (device == NULL) {
+        nacks++;
+        us = account(0);
+        transferEvent = I2C_EVENT_ERROR_NO_SLAVE;
+    } else {
+        us = 0;
+        if (tx_length > 0) {
+            device->write(address, (const uint8_t *)tx_buffer, tx_length);
+            us += account(tx_length);
+        }
+        if (rx_length > 0) {
+            device->read(address, (uint8_t *)rx_buffer, rx_length);
+            us += account(rx_length);
+        }
+        transferEvent = I2C_EVENT_TRANSFER_COMPLETE;
+    }
+    transferEvent &= event;
+    transferCallback = callback;
+    transferDoneUs = sim::nowUs() + us;
+    transferActive = true;
+    return 0;
+}
+
+void I2C::abort_transfer()
+{
+    transferActive = false;
+}
+
+// The completion handler may start the next transfer, so the bus is released first
+void I2C::advanceTo(uint64_t us)
+{
+    if (transferActive && us >= transferDoneUs) {
+        transferActive = false;
+        event_callback_t done = transferCallback;
+        done.call(transferEvent);
+    }
+}
+
+static FILE *serialOutput = NULL;
+static uint64_t serialBytes = 0;
+static void (*serialSink)(uint8_t c, int baud) = NULL;
+
+Serial::Serial(PinName tx, PinName rx)
+    : rate(0), byteNs(0), nextDoneNs(0), txFifo(0), clocked(false), rxHead(0), rxCount(0)
+{
+    (void)tx;
+    (void)rx;
+}
+
+void Serial::baud(int rate)
+{
+    this->rate = rate;
+    byteNs = rate > 0 ? 10000000000ULL / rate : 0; // start, eight data and stop bit
+    if (byteNs > 0 && !clocked) {
+        sim::addClocked(this);
+        clocked = true;
+    }
+}
+
+void Serial::attach(Callback<void()> func, IrqType type)
+{
+    if (type == TxIrq) {
+        txHandler = func;
+    } else {
+        rxHandler = func;
+    }
+}
+
+int Serial::putc(int c)
+{
+    while (!writeable()) {
+        sim::advanceUs(1);
+    }
+    if (byteNs > 0) {
+        if (txFifo == 0) {
+            nextDoneNs = sim::nowUs() * 1000 + byteNs;
+        }
+        txFifo++;
+    }
+    serialBytes++;
+    if (serialOutput != NULL) {
+        fputc(c, serialOutput);
+    }
+    if (serialSink != NULL) {
+        serialSink((uint8_t)c, rate);
+    }
+    return c;
+}
+
+int Serial::getc()
+{
+    while (rxCount == 0) {
+        sim::advanceUs(1);
+    }
+    int c = rxData[rxHead];
+    rxHead = (rxHead + 1) % RxBufferSize;
+    rxCount--;
+    return c;
+}
+
+void Serial::simReceive(const uint8_t *data, int length, int senderBaud)
+{
+    for (int i = 0; i < length; i++) {
+        uint8_t c = data[i];
+        if (rate > 0 && senderBaud != rate) {
+            // Sampled at the wrong bit times; any mangling will do, the CRC rejects it
+            c = (uint8_t)(((c << 3) | (c >> 5)) ^ 0x5A);
+        }
+        if (rxCount == RxBufferSize) {
+            break; // overrun, the rest is lost
+        }
+        rxData[(rxHead + rxCount) % RxBufferSize] = c;
+        rxCount++;
+    }
+    rxHandler.call();
+}
+
+void Serial::advanceTo(uint64_t us)
+{
+    if (txFifo == 0) {
+        return;
+    }
+    while (txFifo > 0 && us * 1000 >= nextDoneNs) {
+        txFifo--;
+        nextDoneNs += byteNs;
+    }
+    if (txFifo == 0) {
+        txHandler.call(); // THRE, the FIFO is empty
+    }
+}
+
+int Serial::printf(const char *format, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length > (int)sizeof(text) - 1) {
+        length = sizeof(text) - 1;
+    }
+    for (int i = 0; i < length; i++) {
+        putc(text[i]);
+    }
+    return length;
+}
+
+void Serial::setOutput(FILE *file)
+{
+    serialOutput = file;
+}
+
+void Serial::setSink(void (*sink)(uint8_t c, int baud))
+{
+    serialSink = sink;
+}
+
+uint64_t Serial::bytesWritten()
+{
+    return serialBytes;
+}
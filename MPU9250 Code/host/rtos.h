@@ -0,0 +1,66 @@
+#ifndef RTOS_H
+#define RTOS_H
+// Host stand-in for the rtos calls reachable from MPU9250.h and Pipeline.h. The
+// simulator runs the driver on one thread, so waiting only advances the simulated clock.
+#include <stdint.h>
+
+typedef int osStatus;
+#define osOK 0
+#define osWaitForever 0xFFFFFFFFu
+
+class Thread {
+public:
+    static osStatus wait(uint32_t ms);
+};
+
+// Waiting lets simulated time pass until an interrupt handler releases a token
+class Semaphore {
+public:
+    Semaphore(int32_t count = 0) : tokens(count) {}
+    // Tokens available before this call took one, 0 on timeout
+    int32_t wait(uint32_t millisec = osWaitForever);
+    osStatus release() { tokens++; return osOK; }
+
+private:
+    volatile int32_t tokens;
+};
+
+#define osEventMail     0x20
+#define osEventTimeout  0x40
+
+typedef struct {
+    osStatus status;
+    union {
+        uint32_t v;
+        void *p;
+    } value;
+} osEvent;
+
+// Fixed pool of queue_sz blocks and a FIFO of the ones put. The simulator steps the
+// stages of a pipeline from its one thread, so get() never blocks and reports a
+// timeout when nothing was put.
+template <typename T, uint32_t queue_sz>
+class Mail {
+public:
+    Mail() : head(0), tail(0), freeCount(queue_sz) {
+        for (uint32_t i = 0; i < queue_sz; i++) freeList[i] = &blocks[i];
+    }
+    T *alloc(uint32_t millisec = 0) { (void)millisec; return freeCount > 0 ? freeList[--freeCount] : 0; }
+    osStatus put(T *mptr) { queue[tail++ % queue_sz] = mptr; return osOK; }
+    osEvent get(uint32_t millisec = osWaitForever) {
+        (void)millisec;
+        osEvent event;
+        event.status = head != tail ? osEventMail : osEventTimeout;
+        event.value.p = head != tail ? queue[head++ % queue_sz] : 0;
+        return event;
+    }
+    osStatus free(T *mptr) { freeList[freeCount++] = mptr; return osOK; }
+
+private:
+    T blocks[queue_sz];
+    T *freeList[queue_sz];
+    T *queue[queue_sz];
+    uint32_t head, tail, freeCount;
+};
+
+#endif
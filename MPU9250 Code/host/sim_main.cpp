@@ -0,0 +1,350 @@
+// Runs the MPU9250 driver and its fusion filter against the simulated board and
+// reports acquisition throughput and orientation error against the simulated truth.
+//
+//   mpu9250_sim [--fifo] [--interrupt] [--queue] [--pipeline] [--boards N] [--divider N] [--fusion-us US]
+//               [--seconds S] [--noise K] [--rate DPS] [--seed N]
+//               [--serial FILE] [--baud N] [--raw-frames] [--euler libm|poly|lut] [--realtime]
+//               [--csv FILE] [--max-error DEG]
+//
+// --interrupt wires the simulated INT pin to an InterruptIn so the driver sleeps on
+// a semaphore between data-ready edges instead of polling the bus.
+// --boards puts up to four boards on the two buses of main.cpp (0x68 and 0x69 on
+// each) and samples them round robin from one thread; --queue fetches their bursts
+// through an I2CQueue per bus, so both buses transfer while the CPU fuses, and exits
+// with 1 if a burst buffer was refilled before the sampling thread had copied it.
+// --pipeline runs the stages of Pipeline.h in turn instead of update(): an
+// acquisition pass per bus, then fusion and transmit of whatever was queued.
+// --divider sets SMPLRT_DIV, in FIFO mode too, and --fusion-us charges simulated CPU
+// time per fused sample, standing in for the filter on the target.
+// --serial writes the binary frames (QuatFrame.h) of the first board to FILE, e.g.
+// the slave side of a pty, and --realtime paces the simulation so the viewer can be
+// pointed at it. --baud gives the UART a wire time per byte, otherwise it is ideal, so
+// the frame queues of UartTx.h fill and drop as on a slow link. --raw-frames sends
+// QUAT_FRAME_RAW frames, which add the sensor counts;
+// --euler sends QUAT_FRAME_EULER frames with the angles from that method of FastTrig.h.
+#include "mbed.h"
+#include "MPU9250.h"
+#include "Pipeline.h"
+#include "MPU9250Sim.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double angleBetween(const float *estimate, const double *truth)
+{
+    double dot = 0;
+    for (int i = 0; i < 4; i++) {
+        dot += estimate[i] * truth[i];
+    }
+    dot = fabs(dot);
+    if (dot > 1.0) dot = 1.0;
+    return 2.0 * acos(dot) * 180.0 / 3.14159265358979323846;
+}
+
+static double wallSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: mpu9250_sim [--fifo] [--interrupt] [--queue] [--pipeline] [--boards N] [--divider N] [--fusion-us US]\n"
+                    "                   [--seconds S] [--noise K] [--rate DPS] [--seed N]\n"
+                    "                   [--serial FILE] [--baud N] [--raw-frames] [--euler libm|poly|lut] [--realtime]\n"
+                    "                   [--csv FILE] [--max-error DEG]\n");
+    exit(2);
+}
+
+enum { MaxBoards = 4 };
+
+struct BoardError {
+    uint64_t fused;
+    uint64_t samples;
+    double squares;
+    double max;
+    double last;
+};
+
+int main(int argc, char **argv)
+{
+    bool fifo = false, interrupt = false, queued = false, pipelined = false, realtime = false, rawFrames = false;
+    double seconds = 30.0, noise = 1.0, maxError = -1.0, rate = -1.0;
+    unsigned seed = 1;
+    int boards = 1, divider = -1, fusionUs = 0, baud = 0, outputMode = OUTPUT_QUATERNION;
+    const char *serialPath = NULL, *csvPath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "--fifo")) fifo = true;
+        else if (!strcmp(arg, "--interrupt")) interrupt = true;
+        else if (!strcmp(arg, "--queue")) queued = true;
+        else if (!strcmp(arg, "--pipeline")) pipelined = true;
+        else if (!strcmp(arg, "--realtime")) realtime = true;
+        else if (!strcmp(arg, "--raw-frames")) rawFrames = true;
+        else if (!strcmp(arg, "--euler") && hasValue) {
+            const char *method = argv[++i];
+            if (!strcmp(method, "libm")) outputMode = OUTPUT_EULER_LIBM;
+            else if (!strcmp(method, "poly")) outputMode = OUTPUT_EULER_POLY;
+            else if (!strcmp(method, "lut")) outputMode = OUTPUT_EULER_LUT;
+            else usage();
+        }
+        else if (!strcmp(arg, "--boards") && hasValue) boards = atoi(argv[++i]);
+        else if (!strcmp(arg, "--divider") && hasValue) divider = atoi(argv[++i]);
+        else if (!strcmp(arg, "--fusion-us") && hasValue) fusionUs = atoi(argv[++i]);
+        else if (!strcmp(arg, "--seconds") && hasValue) seconds = atof(argv[++i]);
+        else if (!strcmp(arg, "--noise") && hasValue) noise = atof(argv[++i]);
+        else if (!strcmp(arg, "--rate") && hasValue) rate = atof(argv[++i]);
+        else if (!strcmp(arg, "--seed") && hasValue) seed = (unsigned)atoi(argv[++i]);
+        else if (!strcmp(arg, "--serial") && hasValue) serialPath = argv[++i];
+        else if (!strcmp(arg, "--baud") && hasValue) baud = atoi(argv[++i]);
+        else if (!strcmp(arg, "--csv") && hasValue) csvPath = argv[++i];
+        else if (!strcmp(arg, "--max-error") && hasValue) maxError = atof(argv[++i]);
+        else usage();
+    }
+    if (boards < 1 || boards > MaxBoards || divider > 255 || fusionUs < 0 || baud < 0) {
+        usage();
+    }
+    // Polling leaves the AK8963 in bypass, where every board answers at the same address
+    if (boards > 1 && !interrupt && !fifo) {
+        fprintf(stderr, "--boards needs --interrupt or --fifo\n");
+        return 2;
+    }
+    if (queued && (!interrupt || fifo)) {
+        fprintf(stderr, "--queue needs --interrupt in register mode\n");
+        return 2;
+    }
+    FILE *serial = NULL, *csv = NULL;
+    if (serialPath != NULL && (serial = fopen(serialPath, "wb")) == NULL) {
+        perror(serialPath);
+        return 1;
+    }
+    if (csvPath != NULL && (csv = fopen(csvPath, "w")) == NULL) {
+        perror(csvPath);
+        return 1;
+    }
+    Serial::setOutput(serial);
+    pc.baud(baud);
+    sim::setRealtime(realtime);
+
+    MotionTrace motion;
+    if (rate >= 0) {
+        double scale = rate / motion.amplitudeDps[2];
+        for (int i = 0; i < 3; i++) {
+            motion.amplitudeDps[i] *= scale;
+        }
+    }
+    // Boards are brought up one after the other and each has to calibrate at rest
+    motion.restSeconds *= boards;
+    SensorErrors errors;
+    errors.scaleNoise(noise);
+    errors.seed = seed;
+
+    // Boards 1 and 2 on the first bus, 3 and 4 on the second, as in main.cpp
+    I2C bus1(p9, p10), bus2(p28, p27);
+    I2C *buses[2] = { &bus1, &bus2 };
+    bus1.frequency(400000);
+    bus2.frequency(400000);
+    I2CQueue queue1(bus1), queue2(bus2);
+    I2CQueue *queues[2] = { &queue1, &queue2 };
+    static const PinName intPins[MaxBoards] = { p21, p22, p23, p24 };
+    Pipeline pipeline;
+
+    MPU9250Sim *sims[MaxBoards];
+    InterruptIn *pins[MaxBoards];
+    MPU9250 *mpus[MaxBoards];
+    BoardError stats[MaxBoards];
+    for (int b = 0; b < boards; b++) {
+        int address = (b % 2 == 0 ? 0x68 : 0x69) << 1;
+        SensorErrors boardErrors = errors;
+        boardErrors.seed = seed + b;
+        sims[b] = new MPU9250Sim(address, motion, boardErrors);
+        buses[b / 2]->attach(sims[b]);
+        pins[b] = new InterruptIn(intPins[b]);
+        mpus[b] = new MPU9250(*buses[b / 2], address, b + 1);
+        mpus[b]->fifoMode = fifo;
+        if (divider >= 0) mpus[b]->sampleDivider = mpus[b]->fifoDivider = (uint8_t)divider;
+        if (rawFrames) mpus[b]->frameType = QUAT_FRAME_RAW;
+        mpus[b]->outputMode = (uint8_t)outputMode;
+        if (interrupt) {
+            sims[b]->connectInterrupt(pins[b]);
+            mpus[b]->attachInterrupt(*pins[b]);
+        }
+        if (queued) {
+            mpus[b]->attachQueue(*queues[b / 2]);
+        }
+        if (pipelined) {
+            pipeline.addBoard(*mpus[b], b / 2);
+        }
+        memset(&stats[b], 0, sizeof(stats[b]));
+    }
+    for (int b = 0; b < boards; b++) {
+        if (!mpus[b]->begin()) {
+            fprintf(stderr, "MPU9250 %d did not answer\n", b + 1);
+            return 1;
+        }
+    }
+    MPU9250Sim &board = *sims[0];
+    MPU9250 &mpu9250 = *mpus[0];
+
+    // Measure from the end of the setup; skip the first seconds of convergence
+    uint64_t startUs = sim::nowUs();
+    uint64_t endUs = startUs + (uint64_t)(seconds * 1000000.0);
+    uint64_t settleUs = startUs + 3000000;
+    uint64_t transactions0 = bus1.transactions + bus2.transactions, bytes0 = bus1.bytes + bus2.bytes;
+    uint64_t busUs0[2] = { bus1.busUs, bus2.busUs };
+    uint64_t produced0[MaxBoards];
+    uint64_t blockedUs0 = sim::blockedUs();
+    for (int b = 0; b < boards; b++) {
+        mpus[b]->update(0);     // drop what queued up while the other boards were set up
+        mpus[b]->interruptOverruns = 0;
+        mpus[b]->resetLatency();
+        produced0[b] = sims[b]->samplesProduced();
+    }
+    pipeline.resetStats();
+    uartTx.resetStats();
+
+    if (csv != NULL) {
+        fprintf(csv, "t_us,fused,q0,q1,q2,q3,true_q0,true_q1,true_q2,true_q3,ax,ay,az,gx,gy,gz,mx,my,mz\n");
+    }
+
+    uint64_t fused = 0;
+    double truth[4];
+    double wallStart = wallSeconds();
+    while (sim::nowUs() < endUs) {
+        int round = 0;
+        int pipelineFused[MaxBoards] = { 0 };
+        if (pipelined) {
+            for (int bus = 0; bus < (boards + 1) / 2; bus++) {
+                pipeline.acquire(bus, boards == 1 ? INT_WAIT_MS : 0);
+            }
+            MPU9250 *m;
+            while ((m = pipeline.fuse(0)) != NULL) {
+                pipelineFused[m->boardNo - 1]++;
+            }
+            while (pipeline.transmit(0) > 0) {
+            }
+        }
+        for (int b = 0; b < boards; b++) {
+            // One board may block on its pin; several are checked in turn without waiting
+            int n = pipelined ? pipelineFused[b] : boards == 1 ? mpus[b]->update() : mpus[b]->update(0);
+            if (n == 0) {
+                continue;
+            }
+            round += n;
+            sim::advanceUs((uint64_t)fusionUs * n);
+            BoardError &e = stats[b];
+            e.fused += n;
+            sims[b]->trueQuaternion(truth);
+            e.last = angleBetween(mpus[b]->q, truth);
+            if (sim::nowUs() >= settleUs) {
+                e.squares += e.last * e.last;
+                e.samples++;
+                if (e.last > e.max) e.max = e.last;
+            }
+            if (csv != NULL && b == 0) {
+                fprintf(csv, "%llu,%d,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f\n",
+                        (unsigned long long)(sim::nowUs() - startUs), n,
+                        mpu9250.q[0], mpu9250.q[1], mpu9250.q[2], mpu9250.q[3],
+                        truth[0], truth[1], truth[2], truth[3],
+                        mpu9250.ax, mpu9250.ay, mpu9250.az, mpu9250.gx, mpu9250.gy, mpu9250.gz,
+                        mpu9250.mx, mpu9250.my, mpu9250.mz);
+            }
+        }
+        fused += round;
+        if (boards > 1 && round == 0) {
+            sim::idleUs(sim::StepUs);
+        }
+    }
+    double wall = wallSeconds() - wallStart;
+
+    double simSeconds = (sim::nowUs() - startUs) / 1000000.0;
+    double perSample = fused > 0 ? 1.0 / fused : 0.0;
+    double squares = 0, errorMax = 0;
+    uint64_t errorSamples = 0, produced = 0;
+    for (int b = 0; b < boards; b++) {
+        squares += stats[b].squares;
+        errorSamples += stats[b].samples;
+        if (stats[b].max > errorMax) errorMax = stats[b].max;
+        produced += sims[b]->samplesProduced() - produced0[b];
+    }
+    double rms = errorSamples > 0 ? sqrt(squares / errorSamples) : 0.0;
+
+    printf("mode:                   %s, %s%s%s, %d board%s\n", fifo ? "fifo" : "registers",
+           interrupt ? "interrupt" : "polling", queued ? ", queued" : "", pipelined ? ", pipeline" : "",
+           boards, boards > 1 ? "s" : "");
+    printf("simulated time:         %.3f s (%.3f s wall)\n", simSeconds, wall);
+    printf("samples produced:       %llu\n", (unsigned long long)produced);
+    printf("samples fused:          %llu (%.1f Hz)\n", (unsigned long long)fused, fused / simSeconds);
+    printf("i2c transactions/sample: %.2f\n", (bus1.transactions + bus2.transactions - transactions0) * perSample);
+    printf("i2c bytes/sample:       %.2f\n", (bus1.bytes + bus2.bytes - bytes0) * perSample);
+    printf("i2c bus busy:           %.1f %% / %.1f %%\n",
+           100.0 * (bus1.busUs - busUs0[0]) / (simSeconds * 1000000.0),
+           100.0 * (bus2.busUs - busUs0[1]) / (simSeconds * 1000000.0));
+    printf("cpu idle:               %.1f %%\n", 100.0 * (sim::blockedUs() - blockedUs0) / (simSeconds * 1000000.0));
+    printf("fifo overflows:         %llu (driver resets %u)\n",
+           (unsigned long long)board.fifoOverflowCount(), (unsigned)mpu9250.fifoOverflows);
+    printf("serial bytes:           %llu\n", (unsigned long long)Serial::bytesWritten());
+    if (queued) {
+        printf("queue:                  max depth %u / %u, %u rejected, %u failed\n",
+               (unsigned)queue1.maxDepth, (unsigned)queue2.maxDepth,
+               (unsigned)(queue1.rejected + queue2.rejected), (unsigned)(queue1.failed + queue2.failed));
+    }
+    if (pipelined) {
+        for (int bus = 0; bus < (boards + 1) / 2; bus++) {
+            const PipelineStage &s = pipeline.bus(bus)->stage;
+            printf("acquisition bus %d:      %u passes, avg %.0f max %u us\n", bus + 1, (unsigned)s.count,
+                   s.count ? (double)s.sumUs / s.count : 0.0, (unsigned)s.maxUs);
+        }
+        const PipelineStage *stages[3] = { &pipeline.fuseStage, &pipeline.transmitStage, &pipeline.latency };
+        static const char *const names[3] = { "fusion:                ", "transmit:              ", "edge to uart queue:    " };
+        for (int i = 0; i < 3; i++) {
+            printf("%s %u, avg %.0f max %u us\n", names[i], (unsigned)stages[i]->count,
+                   stages[i]->count ? (double)stages[i]->sumUs / stages[i]->count : 0.0, (unsigned)stages[i]->maxUs);
+        }
+        printf("pipeline queues:        samples high water %u / %d, %u dropped; frames high water %u / %d, %u dropped\n",
+               (unsigned)pipeline.samplesHighWater, PIPELINE_SAMPLE_DEPTH, (unsigned)pipeline.sampleDrops,
+               (unsigned)pipeline.framesHighWater, PIPELINE_FRAME_DEPTH, (unsigned)pipeline.frameDrops);
+    }
+    for (int b = 0; b < boards; b++) {
+        MPU9250 &m = *mpus[b];
+        if (boards > 1) {
+            printf("board %d:                %.1f Hz, rms %.2f deg\n", b + 1, stats[b].fused / simSeconds,
+                   stats[b].samples > 0 ? sqrt(stats[b].squares / stats[b].samples) : 0.0);
+        }
+        printf("uart frames:            %u sent (%.1f Hz), %u dropped\n", (unsigned)uartTx.sent[b],
+               uartTx.sent[b] / simSeconds, (unsigned)uartTx.dropped[b]);
+        if (interrupt) {
+            printf("int to quaternion:      min %u avg %.0f p99 < %u max %u us (%u timeouts, %u overruns)\n",
+                   (unsigned)(m.latencyCount ? m.latencyMinUs : 0),
+                   m.latencyCount ? (double)m.latencySumUs / m.latencyCount : 0.0,
+                   (unsigned)m.latencyPercentileUs(0.99f), (unsigned)m.latencyMaxUs,
+                   (unsigned)m.interruptTimeouts, (unsigned)m.interruptOverruns);
+        }
+        if (queued) {
+            printf("queued bursts:          %u edges rejected, %u failed, %u overwritten while copied\n", (unsigned)m.queueRejects,
+                   (unsigned)m.burstErrors, (unsigned)m.burstOverwrites);
+        }
+    }
+    printf("orientation error:      rms %.2f deg, max %.2f deg, final %.2f deg\n", rms, errorMax, stats[0].last);
+
+    if (serial != NULL) fclose(serial);
+    if (csv != NULL) fclose(csv);
+
+    for (int b = 0; queued && b < boards; b++) {
+        if (mpus[b]->burstOverwrites > 0) {
+            fprintf(stderr, "board %d: %u queued bursts overwritten while copied\n", b + 1,
+                    (unsigned)mpus[b]->burstOverwrites);
+            return 1;
+        }
+    }
+    if (maxError >= 0 && rms > maxError) {
+        fprintf(stderr, "rms orientation error %.2f deg exceeds %.2f deg\n", rms, maxError);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,252 @@
+// Error and cost of the FastTrig.h approximations against libm, and of the whole
+// quaternion to yaw, pitch and roll conversion of MPU9250::update() per EulerMethod.
+//
+//   trig_bench [--samples N] [--min-seconds S] [--seed N]
+//
+// Errors are against the double libm functions over N inputs: atan2 at random
+// angles and radii, asin over [-1, 1], and the Euler angles of random unit
+// quaternions. Cost is host time and, on x86, TSC cycles per call; the soft float
+// routines of the LPC1768 cost far more per operation, but the ranking holds since
+// the approximations replace a libm call with a few multiplies. Exits with 1 when
+// an error exceeds the bound FastTrig.h documents.
+#include "FastTrig.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+static const double Pi = 3.14159265358979323846;
+
+static double monotonicSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Uniform in [0, 1), xorshift so every run sees the same inputs
+static unsigned long long rngState = 88172645463325252ULL;
+static double uniform()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (rngState >> 11) * (1.0 / 9007199254740992.0);
+}
+
+struct ErrorStats {
+    double max;
+    double squares;
+    long count;
+};
+
+static void addError(ErrorStats &e, double error)
+{
+    error = fabs(error);
+    if (error > e.max) e.max = error;
+    e.squares += error * error;
+    e.count++;
+}
+
+// Difference of two angles in radians, wrapped to [-pi, pi]
+static double angleDiff(double a, double b)
+{
+    double d = a - b;
+    while (d > Pi) d -= 2 * Pi;
+    while (d < -Pi) d += 2 * Pi;
+    return d;
+}
+
+struct Cost {
+    double ns;
+    double cycles;
+};
+
+static volatile float sink;
+
+// Time fn over the inputs until minSeconds have passed
+template <typename Fn>
+static Cost measure(Fn fn, const std::vector<float> &a, const std::vector<float> &b, double minSeconds)
+{
+    long calls = 0;
+    float sum = 0.0f;
+    double start = monotonicSeconds(), elapsed;
+#ifdef BENCH_HAVE_TSC
+    unsigned long long tsc = __rdtsc();
+#endif
+    do {
+        for (size_t i = 0; i < a.size(); i++) {
+            sum += fn(a[i], b[i]);
+        }
+        calls += (long)a.size();
+        elapsed = monotonicSeconds() - start;
+    } while (elapsed < minSeconds);
+    Cost c;
+    c.ns = elapsed * 1e9 / calls;
+    c.cycles = 0.0;
+#ifdef BENCH_HAVE_TSC
+    c.cycles = (double)(__rdtsc() - tsc) / calls;
+#endif
+    sink = sum;
+    return c;
+}
+
+struct Atan2Libm { float operator()(float y, float x) const { return atan2f(y, x); } };
+struct Atan2Poly { float operator()(float y, float x) const { return fastAtan2(y, x, EULER_POLY); } };
+struct Atan2Lut  { float operator()(float y, float x) const { return fastAtan2(y, x, EULER_LUT); } };
+struct AsinLibm  { float operator()(float x, float) const { return asinf(x); } };
+struct AsinPoly  { float operator()(float x, float) const { return fastAsin(x, EULER_POLY); } };
+struct AsinLut   { float operator()(float x, float) const { return fastAsin(x, EULER_LUT); } };
+
+// One conversion per call; the quaternion index comes in as the first argument
+struct EulerRun {
+    const std::vector<float> *q;
+    int method;
+    float operator()(float index, float) const {
+        float yaw, pitch, roll;
+        quaternionToEuler(&(*q)[4 * (size_t)index], method, &yaw, &pitch, &roll);
+        return yaw + pitch + roll;
+    }
+};
+
+static void printRow(const char *function, const char *method, const ErrorStats *e, double unit,
+                     const char *unitName, Cost cost, Cost libm)
+{
+    if (e != NULL) {
+        printf("%-8s %-5s %12.3g %12.3g %-4s", function, method, e->max * unit,
+               sqrt(e->squares / e->count) * unit, unitName);
+    } else {
+        printf("%-8s %-5s %12s %12s %-4s", function, method, "-", "-", unitName);
+    }
+    printf(" %9.2f %10.1f %8.2fx\n", cost.ns, cost.cycles, libm.ns / cost.ns);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: trig_bench [--samples N] [--min-seconds S] [--seed N]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    long samples = 1000000;
+    double minSeconds = 0.3;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "--samples") && hasValue) samples = atol(argv[++i]);
+        else if (!strcmp(arg, "--min-seconds") && hasValue) minSeconds = atof(argv[++i]);
+        else if (!strcmp(arg, "--seed") && hasValue) rngState += (unsigned long long)atoll(argv[++i]);
+        else usage();
+    }
+    if (samples < 1) {
+        usage();
+    }
+
+    // atan2 at random angles, radii over six decades
+    std::vector<float> ys(samples), xs(samples);
+    ErrorStats atan2Errors[3];
+    memset(atan2Errors, 0, sizeof(atan2Errors));
+    for (long i = 0; i < samples; i++) {
+        double angle = (uniform() * 2 - 1) * Pi;
+        double radius = pow(10.0, uniform() * 6 - 3);
+        ys[i] = (float)(radius * sin(angle));
+        xs[i] = (float)(radius * cos(angle));
+        double exact = atan2((double)ys[i], (double)xs[i]);
+        addError(atan2Errors[EULER_LIBM], angleDiff(atan2f(ys[i], xs[i]), exact));
+        addError(atan2Errors[EULER_POLY], angleDiff(fastAtan2(ys[i], xs[i], EULER_POLY), exact));
+        addError(atan2Errors[EULER_LUT], angleDiff(fastAtan2(ys[i], xs[i], EULER_LUT), exact));
+    }
+
+    // asin over [-1, 1], the ends included
+    std::vector<float> sines(samples), unused(samples, 0.0f);
+    ErrorStats asinErrors[3];
+    memset(asinErrors, 0, sizeof(asinErrors));
+    for (long i = 0; i < samples; i++) {
+        sines[i] = samples > 1 ? (float)(-1.0 + 2.0 * i / (samples - 1)) : 0.0f;
+        double exact = asin((double)sines[i]);
+        addError(asinErrors[EULER_LIBM], asinf(sines[i]) - exact);
+        addError(asinErrors[EULER_POLY], fastAsin(sines[i], EULER_POLY) - exact);
+        addError(asinErrors[EULER_LUT], fastAsin(sines[i], EULER_LUT) - exact);
+    }
+
+    // Euler angles of random unit quaternions against the same formulas in double
+    std::vector<float> quats(4 * samples), indices(samples);
+    ErrorStats eulerErrors[3];
+    memset(eulerErrors, 0, sizeof(eulerErrors));
+    for (long i = 0; i < samples; i++) {
+        double u1 = uniform(), u2 = uniform() * 2 * Pi, u3 = uniform() * 2 * Pi;
+        double q[4] = { sqrt(1 - u1) * sin(u2), sqrt(1 - u1) * cos(u2), sqrt(u1) * sin(u3), sqrt(u1) * cos(u3) };
+        float *f = &quats[4 * i];
+        for (int k = 0; k < 4; k++) {
+            f[k] = (float)q[k];
+        }
+        indices[i] = (float)i;
+        double d[4] = { f[0], f[1], f[2], f[3] };
+        double sp = 2 * (d[1] * d[3] - d[0] * d[2]);
+        double exact[3] = {
+            atan2(2 * (d[1] * d[2] + d[0] * d[3]), 1 - 2 * (d[2] * d[2] + d[3] * d[3])) * 180 / Pi,
+            -asin(sp > 1 ? 1 : (sp < -1 ? -1 : sp)) * 180 / Pi,
+            atan2(2 * (d[0] * d[1] + d[2] * d[3]), d[0] * d[0] - d[1] * d[1] - d[2] * d[2] + d[3] * d[3]) * 180 / Pi
+        };
+        for (int method = EULER_LIBM; method <= EULER_LUT; method++) {
+            float ypr[3];
+            quaternionToEuler(f, method, &ypr[0], &ypr[1], &ypr[2]);
+            for (int k = 0; k < 3; k++) {
+                double diff = ypr[k] - exact[k];
+                diff -= 360.0 * floor((diff + 180.0) / 360.0);
+                addError(eulerErrors[method], diff);
+            }
+        }
+    }
+    if (samples > 1 << 16) {
+        // Keep the timed loops in cache; the errors above used every sample
+        ys.resize(4096), xs.resize(4096), sines.resize(4096), unused.resize(4096), indices.resize(4096);
+    }
+
+    Cost atan2Cost[3] = {
+        measure(Atan2Libm(), ys, xs, minSeconds),
+        measure(Atan2Poly(), ys, xs, minSeconds),
+        measure(Atan2Lut(), ys, xs, minSeconds)
+    };
+    Cost asinCost[3] = {
+        measure(AsinLibm(), sines, unused, minSeconds),
+        measure(AsinPoly(), sines, unused, minSeconds),
+        measure(AsinLut(), sines, unused, minSeconds)
+    };
+    Cost eulerCost[3];
+    for (int method = EULER_LIBM; method <= EULER_LUT; method++) {
+        EulerRun run = { &quats, method };
+        eulerCost[method] = measure(run, indices, unused, minSeconds);
+    }
+
+    static const char *const methods[3] = { "libm", "poly", "lut" };
+    printf("%d inputs per function, errors against double libm\n", (int)samples);
+    printf("%-8s %-5s %12s %12s %-4s %9s %10s %9s\n", "function", "", "max error", "rms error", "",
+           "ns/call", "cycles", "vs libm");
+    for (int m = 0; m < 3; m++) {
+        printRow("atan2", methods[m], &atan2Errors[m], 1.0, "rad", atan2Cost[m], atan2Cost[0]);
+    }
+    for (int m = 0; m < 3; m++) {
+        printRow("asin", methods[m], &asinErrors[m], 1.0, "rad", asinCost[m], asinCost[0]);
+    }
+    for (int m = 0; m < 3; m++) {
+        printRow("euler", methods[m], &eulerErrors[m], 1.0, "deg", eulerCost[m], eulerCost[0]);
+    }
+
+    // The bounds FastTrig.h promises
+    bool failed = atan2Errors[EULER_POLY].max > 1.2e-5 || asinErrors[EULER_POLY].max > 7e-5 ||
+                  atan2Errors[EULER_LUT].max > 6e-6 || asinErrors[EULER_LUT].max > 6e-6;
+    if (failed) {
+        fprintf(stderr, "an approximation exceeds its documented error bound\n");
+        return 1;
+    }
+    return 0;
+}
@@ -30,6 +30,7 @@
 //F401_init84 myinit(0);
 #include "mbed.h"
 #include "MPU9250.h"
+#include "Pipeline.h"
 #include "rtos.h"
 
 //#include "N5110.h"
@@ -45,32 +46,69 @@
 I2C newi2c_1(p9,p10); 
 I2C newi2c_2(p28,p27); 
 
-DigitalOut led2(LED2);
+// One transaction queue per bus; the data-ready handlers submit the burst reads
+I2CQueue queue_1(newi2c_1);
+I2CQueue queue_2(newi2c_2);
 
+DigitalOut led2(LED2);
 
-void OutputQuaternions(void const *args)
-{       
-    MPU9250* mpu9250;
-    mpu9250 = (MPU9250*)args;
-    mpu9250->Calculations();
-           
-}
+// INT pads of the four boards, on port 2 pins which can raise GPIO interrupts
+InterruptIn int_1(p21);
+InterruptIn int_2(p22);
+InterruptIn int_3(p23);
+InterruptIn int_4(p24);
 
+// Acquisition per bus, fusion and transmit as separate threads, see Pipeline.h.
+// Queues and stacks are static so the pipeline never touches the heap.
+Pipeline pipeline;
+static uint64_t acquireStack_1[DEFAULT_STACK_SIZE / 8];
+static uint64_t acquireStack_2[DEFAULT_STACK_SIZE / 8];
+static uint64_t fusionStack[DEFAULT_STACK_SIZE / 8];
+static uint64_t transmitStack[DEFAULT_STACK_SIZE / 8];
+static uint64_t linkStack[DEFAULT_STACK_SIZE / 8];
 
 
 
 int main()
 {
-  //pc.baud(921600);  
+  // The UART starts at QUAT_LINK_DEFAULT_BAUD; the viewer negotiates it up, see SerialLink.h
 
   //Set up I2C
   newi2c_1.frequency(400000);  // use fast (400 kHz) I2C 
   newi2c_2.frequency(400000);  // use fast (400 kHz) I2C   
   
-  //MPU9250 mpu9250_1(newi2c_1, 0x68<<1, 1);   //Board 1
-  //MPU9250 mpu9250_2(newi2c_1, 0x69<<1, 2); //Board 2
+  // Every board streams its own quaternion frames; the viewer maps board numbers
+  // to joints in joints.ini. Boards that do not answer WHO_AM_I are left out.
+  MPU9250 mpu9250_1(newi2c_1, 0x68<<1, 1); //Board 1
+  MPU9250 mpu9250_2(newi2c_1, 0x69<<1, 2); //Board 2
   MPU9250 mpu9250_3(newi2c_2, 0x68<<1, 3); //Board 3
-  //MPU9250 mpu9250_4(newi2c_2, 0x69<<1, 4); //Board 4
+  MPU9250 mpu9250_4(newi2c_2, 0x69<<1, 4); //Board 4
+
+  // Four boards at 1 kHz need more than the 400 kHz buses carry once the bus mutex
+  // serialises them, so sample the registers at 333 Hz (SMPLRT_DIV 2) instead of
+  // streaming the FIFO. fifoMode = true needs the same rate, fifoDivider = 2: at
+  // 1 kHz each board takes about half a bus and four of them overflow their FIFOs.
+  mpu9250_1.sampleDivider = 2;
+  mpu9250_2.sampleDivider = 2;
+  mpu9250_3.sampleDivider = 2;
+  mpu9250_4.sampleDivider = 2;
+
+  // Sleep on the data-ready interrupt instead of polling INT_STATUS over I2C
+  mpu9250_1.attachInterrupt(int_1);
+  mpu9250_2.attachInterrupt(int_2);
+  mpu9250_3.attachInterrupt(int_3);
+  mpu9250_4.attachInterrupt(int_4);
+
+  // The interrupt queues each burst read, so fusion overlaps the next transfer
+  mpu9250_1.attachQueue(queue_1);
+  mpu9250_2.attachQueue(queue_1);
+  mpu9250_3.attachQueue(queue_2);
+  mpu9250_4.attachQueue(queue_2);
+
+  pipeline.addBoard(mpu9250_1, 0);
+  pipeline.addBoard(mpu9250_2, 0);
+  pipeline.addBoard(mpu9250_3, 1);
+  pipeline.addBoard(mpu9250_4, 1);
 
 /*
 mpu9250_3.testConnection();
@@ -78,12 +116,23 @@ float * dest1;
 float * dest2;
 mpu9250_3.magcalMPU9250(dest1,dest2);
 */
-//Thread thread1(OutputQuaternions, &mpu9250_1, osPriorityNormal, DEFAULT_STACK_SIZE,NULL);
-//Thread thread2(OutputQuaternions, &mpu9250_2, osPriorityNormal, DEFAULT_STACK_SIZE,NULL);
-Thread thread3(OutputQuaternions, &mpu9250_3, osPriorityNormal, DEFAULT_STACK_SIZE,NULL);
-//Thread thread4(OutputQuaternions, &mpu9250_4, osPriorityNormal, DEFAULT_STACK_SIZE,NULL);
+// Reads preempt the filter and the filter preempts the UART, so a slow write only
+// delays frames. The acquisition threads bring their boards up first.
+Thread acquire1(Pipeline::acquisitionThread, pipeline.bus(0), osPriorityHigh, DEFAULT_STACK_SIZE, (unsigned char *)acquireStack_1);
+Thread acquire2(Pipeline::acquisitionThread, pipeline.bus(1), osPriorityHigh, DEFAULT_STACK_SIZE, (unsigned char *)acquireStack_2);
+Thread fusion(Pipeline::fusionThread, &pipeline, osPriorityNormal, DEFAULT_STACK_SIZE, (unsigned char *)fusionStack);
+Thread transmit(Pipeline::transmitThread, &pipeline, osPriorityBelowNormal, DEFAULT_STACK_SIZE, (unsigned char *)transmitStack);
+Thread link(SerialLink::linkThread, &serialLink, osPriorityBelowNormal, DEFAULT_STACK_SIZE, (unsigned char *)linkStack);
 
-while(true){};
+// Nothing left to do here; sleep instead of spinning so the sampling threads get the CPU.
+// For bench runs without the viewer, print the interrupt to quaternion latency and the
+// per-stage timing and queue high-water marks of the pipeline, and the rate negotiations.
+while(true){
+    Thread::wait(5000);
+    //mpu9250_1.printLatency();
+    //pipeline.printStats();
+    //serialLink.printStats();
+}
    //Thread t1 (osPriority priority=osPriorityNormal, uint32_t stack_size=DEFAULT_STACK_SIZE, unsigned char *stack_pointer=NULL);
    //start (Thread *t1, mpu9250_1.Calculations());
 
@@ -0,0 +1,145 @@
+#include "FrameParser.h"
+
+#include <string.h>
+
+FrameParser::FrameParser(QuatSampleSink *sink)
+    : sink(sink)
+{
+    reset();
+}
+
+void FrameParser::reset()
+{
+    state = SeekSync;
+    head = 0;
+    tail = 0;
+    memset(seqValid, 0, sizeof(seqValid));
+    memset(lastSeq, 0, sizeof(lastSeq));
+    memset(&counters, 0, sizeof(counters));
+}
+
+void FrameParser::readFrom(QIODevice *device)
+{
+    while (device->bytesAvailable() > 0) {
+        if (freeSpace() == 0) {
+            // Only happens if parse() cannot make progress, which it always can
+            // once RingSize exceeds a frame; bail out rather than spin.
+            break;
+        }
+        // Read into the contiguous free region up to the physical end of the ring
+        int offset = head & (RingSize - 1);
+        int chunk = qMin(freeSpace(), RingSize - offset);
+        qint64 got = device->read(reinterpret_cast<char *>(&ring[offset]), chunk);
+        if (got <= 0) {
+            break;
+        }
+        head += (quint32)got;
+        counters.bytes += (quint64)got;
+        parse();
+    }
+}
+
+void FrameParser::feed(const uint8_t *data, int length)
+{
+    while (length > 0) {
+        int chunk = qMin(length, freeSpace());
+        if (chunk == 0) {
+            counters.overflowBytes += (quint64)length;
+            return;
+        }
+        int offset = head & (RingSize - 1);
+        int first = qMin(chunk, RingSize - offset);
+        memcpy(&ring[offset], data, first);
+        memcpy(&ring[0], data + first, chunk - first);
+        head += (quint32)chunk;
+        counters.bytes += (quint64)chunk;
+        data += chunk;
+        length -= chunk;
+        parse();
+    }
+}
+
+void FrameParser::skipByte()
+{
+    tail++;
+    if (state == ReadFrame) {
+        counters.resyncs++;
+        state = SeekSync;
+    }
+}
+
+void FrameParser::parse()
+{
+    QuatSample sample;
+    QuatLink link;
+
+    while (used() > 0) {
+        // Hunt for the sync word; a lone SYNC0 at the end waits for the next byte
+        if (at(tail) != QUAT_FRAME_SYNC0) {
+            skipByte();
+            continue;
+        }
+        if (used() < 3) {
+            return;
+        }
+        if (at(tail + 1) != QUAT_FRAME_SYNC1) {
+            skipByte();
+            continue;
+        }
+        int payload = quatFramePayloadSize(at(tail + 2));
+        if (payload == 0) {
+            skipByte();
+            continue;
+        }
+
+        // Wait for the rest of the frame, resuming here on the next call
+        int length = QUAT_FRAME_HEADER_SIZE + payload + QUAT_FRAME_CRC_SIZE;
+        if (used() < length) {
+            return;
+        }
+
+        const uint8_t *data;
+        int offset = tail & (RingSize - 1);
+        if (offset + length <= RingSize) {
+            data = &ring[offset];
+        } else {
+            int first = RingSize - offset;
+            memcpy(frame, &ring[offset], first);
+            memcpy(frame + first, &ring[0], length - first);
+            data = frame;
+        }
+
+        bool isLink = at(tail + 2) == QUAT_FRAME_LINK;
+        int decoded = isLink ? quatLinkDecode(data, length, &link) : quatFrameDecode(data, length, &sample);
+        if (decoded != length) {
+            // False sync inside the data or a corrupted frame; rescan from the next byte
+            counters.crcErrors++;
+            skipByte();
+            continue;
+        }
+
+        tail += (quint32)length;
+        state = ReadFrame;
+        if (isLink) {
+            counters.linkFrames++;
+            sink->consumeLink(link);
+            continue;
+        }
+        counters.frames++;
+        checkSequence(sample);
+        sink->consumeSample(sample);
+    }
+}
+
+void FrameParser::checkSequence(const QuatSample &sample)
+{
+    if (seqValid[sample.board]) {
+        quint16 gap = (quint16)(sample.seq - lastSeq[sample.board] - 1);
+        // A large backwards jump is a board reset rather than lost frames
+        if (gap < 0x8000) {
+            counters.droppedSamples += gap;
+        }
+    }
+    seqValid[sample.board] = true;
+    lastSeq[sample.board] = sample.seq;
+}
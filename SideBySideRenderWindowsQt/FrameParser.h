@@ -0,0 +1,70 @@
+#ifndef FrameParser_H
+#define FrameParser_H
+
+#include <QtGlobal>
+#include <QIODevice>
+
+#include "QuatFrame.h"
+
+// Receives every quaternion sample decoded from the telemetry stream
+class QuatSampleSink
+{
+public:
+  virtual ~QuatSampleSink() {}
+  virtual void consumeSample(const QuatSample &sample) = 0;
+  // Baud rate negotiation frames from the board; only the serial reader takes them
+  virtual void consumeLink(const QuatLink &link) { Q_UNUSED(link); }
+};
+
+struct FrameParserStats
+{
+  quint64 bytes;           // raw bytes taken in
+  quint64 frames;          // frames decoded and handed to the sink
+  quint64 linkFrames;      // QUAT_FRAME_LINK frames handed to the sink
+  quint64 resyncs;         // times the parser lost frame alignment and had to hunt for a sync word
+  quint64 crcErrors;       // candidate frames rejected by the CRC check
+  quint64 droppedSamples;  // gaps in the per-board sequence numbers
+  quint64 overflowBytes;   // bytes discarded because the ring buffer was full
+};
+
+// Streaming parser for QuatFrame.h frames.
+// Raw bytes go into a fixed ring buffer and are consumed by a small state machine,
+// so a frame split across several readyRead() calls is picked up where it stopped
+// and nothing is allocated per byte or per frame.
+class FrameParser
+{
+public:
+  enum { RingSize = 4096 };   // must be a power of two
+
+  FrameParser(QuatSampleSink *sink);
+
+  // Read everything the device has buffered straight into the ring and parse it
+  void readFrom(QIODevice *device);
+  // Copy bytes into the ring and parse them
+  void feed(const uint8_t *data, int length);
+  void reset();
+
+  const FrameParserStats &stats() const { return counters; }
+
+private:
+  enum State { SeekSync, ReadFrame };
+
+  int used() const { return (int)(head - tail); }
+  int freeSpace() const { return RingSize - used(); }
+  uint8_t at(quint32 index) const { return ring[index & (RingSize - 1)]; }
+  void parse();
+  void skipByte();
+  void checkSequence(const QuatSample &sample);
+
+  QuatSampleSink *sink;
+  State state;
+  uint8_t ring[RingSize];
+  quint32 head;   // next write position, free running
+  quint32 tail;   // first byte not consumed yet, free running
+  uint8_t frame[QUAT_FRAME_MAX_SIZE];   // linear copy of a candidate frame that wraps the ring
+  bool seqValid[256];
+  quint16 lastSeq[256];
+  FrameParserStats counters;
+};
+
+#endif
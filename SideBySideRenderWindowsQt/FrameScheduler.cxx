@@ -0,0 +1,100 @@
+#include "FrameScheduler.h"
+
+#include <vtkRenderWindow.h>
+
+#include <string.h>
+
+FrameScheduler::FrameScheduler(vtkRenderWindow *window, QObject *parent)
+    : QObject(parent), window(window), pending(false)
+{
+    memset(dirty, 0, sizeof(dirty));
+    memset(poses, 0, sizeof(poses));
+    for (int i = 0; i < MaxJoints; i++) {
+        poses[i][0] = 1.0;
+    }
+    resetStats();
+
+    timer.setTimerType(Qt::PreciseTimer);
+    timer.setSingleShot(true);
+    connect(&timer, SIGNAL(timeout()), this, SLOT(tick()));
+    clock.start();
+    setMaxFrameRate(60.0);
+}
+
+void FrameScheduler::setMaxFrameRate(double hz)
+{
+    frameRate = hz > 0.0 ? hz : 60.0;
+    periodNs = (qint64)(1.0e9 / frameRate);
+    nextTickNs = clock.nsecsElapsed() + periodNs;
+    scheduleTick();
+    // Level of detail actors pick the mesh that fits this budget
+    window->SetDesiredUpdateRate(frameRate);
+}
+
+void FrameScheduler::scheduleTick()
+{
+    // Whole milliseconds rounded down, so a tick is early rather than late; the
+    // deadlines themselves stay exact and keep the average rate
+    qint64 waitNs = nextTickNs - clock.nsecsElapsed();
+    timer.start(waitNs > 0 ? (int)(waitNs / 1000000) : 0);
+}
+
+void FrameScheduler::resetStats()
+{
+    memset(&counters, 0, sizeof(counters));
+}
+
+void FrameScheduler::submitPose(int joint, const double *q)
+{
+    if (joint < 0 || joint >= MaxJoints) {
+        return;
+    }
+    counters.samples++;
+    if (dirty[joint]) {
+        counters.coalesced++;
+    }
+    for (int i = 0; i < 4; i++) {
+        poses[joint][i] = q[i];
+    }
+    dirty[joint] = true;
+    pending = true;
+}
+
+bool FrameScheduler::takePose(int joint, double *q)
+{
+    if (joint < 0 || joint >= MaxJoints || !dirty[joint]) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        q[i] = poses[joint][i];
+    }
+    dirty[joint] = false;
+    return true;
+}
+
+void FrameScheduler::tick()
+{
+    // Next deadline one period on; after a stall start over rather than catch up
+    qint64 now = clock.nsecsElapsed();
+    nextTickNs += periodNs;
+    if (nextTickNs <= now) {
+        nextTickNs = now + periodNs;
+    }
+    scheduleTick();
+
+    emit collectPoses();
+    if (!pending) {
+        return;
+    }
+    pending = false;
+
+    frameTimer.start();
+    emit frameDue();
+    window->Render();
+
+    double ms = frameTimer.nsecsElapsed() / 1.0e6;
+    counters.frames++;
+    counters.lastFrameMs = ms;
+    counters.avgFrameMs = counters.frames == 1 ? ms : 0.9 * counters.avgFrameMs + 0.1 * ms;
+    counters.maxFrameMs = qMax(counters.maxFrameMs, ms);
+}
@@ -0,0 +1,72 @@
+#ifndef FrameScheduler_H
+#define FrameScheduler_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+class vtkRenderWindow;
+
+struct FrameSchedulerStats
+{
+  quint64 samples;      // poses submitted
+  quint64 coalesced;    // poses overwritten by a newer one before they were rendered
+  quint64 frames;       // renders performed
+  double lastFrameMs;   // duration of the last frameDue() + Render()
+  double avgFrameMs;    // exponential moving average of the frame time
+  double maxFrameMs;
+};
+
+// Decouples the sensor sample rate from the VTK frame rate.
+// Incoming poses only overwrite the latest pose of their joint; a timer running at
+// the configured cap renders at most once per tick and only when a pose changed.
+// Ticks follow deadlines one frame period apart on a monotonic clock, rearming a
+// single-shot timer for each, so a period that is not a whole number of milliseconds
+// (16.67 ms at 60 Hz) still averages out to the requested rate.
+class FrameScheduler : public QObject
+{
+  Q_OBJECT
+public:
+  enum { MaxJoints = 64 };
+
+  FrameScheduler(vtkRenderWindow *window, QObject *parent = 0);
+
+  void setMaxFrameRate(double hz);
+  double maxFrameRate() const { return frameRate; }
+
+  // Store the latest orientation (qw, qx, qy, qz) of a joint
+  void submitPose(int joint, const double *q);
+  // Fetch the pose of a joint if it changed since the last call
+  bool takePose(int joint, double *q);
+  // Render at the next tick even if no pose changed, after other changes to the scene
+  void requestFrame() { pending = true; }
+
+  const FrameSchedulerStats &stats() const { return counters; }
+  void resetStats();
+
+signals:
+  // Emitted at every tick; sources that buffer samples submit their poses here
+  void collectPoses();
+  // Emitted right before rendering; apply the pending poses to the scene here
+  void frameDue();
+
+private slots:
+  void tick();
+
+private:
+  void scheduleTick();
+
+  vtkRenderWindow *window;
+  QTimer timer;
+  QElapsedTimer frameTimer;
+  QElapsedTimer clock;
+  double frameRate;
+  qint64 periodNs;
+  qint64 nextTickNs;    // deadline of the next tick on clock
+  bool pending;
+  bool dirty[MaxJoints];
+  double poses[MaxJoints][4];
+  FrameSchedulerStats counters;
+};
+
+#endif
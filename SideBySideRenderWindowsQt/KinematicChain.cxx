@@ -0,0 +1,290 @@
+#include "KinematicChain.h"
+
+#include <vtkProperty.h>
+#include <vtkLODActor.h>
+
+#include <QSettings>
+#include <QStringList>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QMutexLocker>
+#include <QDebug>
+
+KinematicChain::KinematicChain()
+    : forcedLod(-1), lastBuildMs(0.0), pending(0)
+{
+    lodReductions << 0.5 << 0.9;
+    for (int i = 0; i < 256; i++) {
+        boardToJoint[i] = -1;
+    }
+}
+
+KinematicChain::~KinematicChain()
+{
+    // The load tasks use the joints and the cache
+    cancelLoading();
+}
+
+void KinematicChain::addJoint(const QString &mesh, double tx, double ty, double tz, int board)
+{
+    Joint joint;
+    joint.config.mesh = mesh;
+    joint.config.translation[0] = tx;
+    joint.config.translation[1] = ty;
+    joint.config.translation[2] = tz;
+    joint.config.board = board;
+    joint.config.hasColor = false;
+    joint.poseIndex = -1;
+    joints.append(joint);
+}
+
+void KinematicChain::loadDefault()
+{
+    joints.clear();
+    addJoint("stl/Base_Joint.STL", 0.0, 0.0, 0.0, 0);
+    addJoint("stl/Joint1.STL", 0.0, 65, 0.0, 3);
+    addJoint("stl/Joint2.STL", 0.0, 69.803599, 0.0, 0);
+    addJoint("stl/Joint3.STL", 0.267949, 91.428531, 0.0, 0);
+
+    double cyan[3] = { 0.0, 220./255, 225./255 };
+    for (int i = 1; i < 4; i += 2) {
+        for (int c = 0; c < 3; c++) {
+            joints[i].config.color[c] = cyan[c];
+        }
+        joints[i].config.hasColor = true;
+    }
+}
+
+bool KinematicChain::load(const QString &fileName)
+{
+    loadDefault();
+    if (!QFileInfo(fileName).exists()) {
+        qDebug() << "No joint config" << fileName << "- using the default arm";
+        return false;
+    }
+
+    QSettings settings(fileName, QSettings::IniFormat);
+    int count = settings.value("count", 0).toInt();
+    if (count <= 0) {
+        qDebug() << "Joint config" << fileName << "has no joints - using the default arm";
+        return false;
+    }
+
+    if (settings.contains("lod")) {
+        lodReductions.clear();
+        QStringList lod = settings.value("lod").toStringList();
+        for (int i = 0; i < lod.size(); i++) {
+            double reduction = lod[i].trimmed().toDouble();
+            if (reduction > 0.0 && reduction < 1.0) {
+                lodReductions.append(reduction);
+            }
+        }
+    }
+    cache.setDirectory(settings.value("meshCache", cache.cacheDirectory()).toString());
+
+    joints.clear();
+    for (int i = 0; i < count; i++) {
+        settings.beginGroup(QString("joint%1").arg(i));
+        QStringList t = settings.value("translation").toStringList();
+        addJoint(settings.value("mesh").toString(),
+                 t.size() > 0 ? t[0].toDouble() : 0.0,
+                 t.size() > 1 ? t[1].toDouble() : 0.0,
+                 t.size() > 2 ? t[2].toDouble() : 0.0,
+                 settings.value("board", 0).toInt());
+        QStringList color = settings.value("color").toStringList();
+        if (color.size() == 3) {
+            for (int c = 0; c < 3; c++) {
+                joints[i].config.color[c] = color[c].toDouble();
+            }
+            joints[i].config.hasColor = true;
+        }
+        settings.endGroup();
+    }
+    return true;
+}
+
+// Loads one joint's mesh on the pool
+class MeshLoadTask : public QRunnable
+{
+public:
+    MeshLoadTask(KinematicChain *chain, int joint, const QString &mesh, const QVector<double> &reductions)
+        : chain(chain), joint(joint), mesh(mesh), reductions(reductions) {}
+
+    virtual void run()
+    {
+        QVector<vtkSmartPointer<vtkPolyData> > levels = chain->cache.load(mesh, reductions);
+        QMutexLocker locker(&chain->loadLock);
+        chain->loaded[joint] = levels;
+        chain->loadedReady[joint] = true;
+    }
+
+private:
+    KinematicChain *chain;
+    int joint;
+    QString mesh;
+    QVector<double> reductions;
+};
+
+void KinematicChain::build(vtkRenderer *renderer)
+{
+    QElapsedTimer timer;
+    timer.start();
+    MeshCacheStats before = cache.stats();
+
+    createJoints(renderer);
+    for (int i = 0; i < joints.size(); i++) {
+        attach(i, cache.load(joints[i].config.mesh, lodReductions));
+    }
+
+    lastBuildMs = timer.nsecsElapsed() / 1e6;
+    MeshCacheStats after = cache.stats();
+    qDebug() << "Loaded" << joints.size() << "meshes in" << lastBuildMs << "ms,"
+             << after.hits - before.hits << "levels from the cache," << after.misses - before.misses << "built";
+}
+
+void KinematicChain::buildAsync(vtkRenderer *renderer)
+{
+    cancelLoading();
+    loadTimer.start();
+    loadStats = cache.stats();
+    createJoints(renderer);
+
+    QMutexLocker locker(&loadLock);
+    loaded.fill(QVector<vtkSmartPointer<vtkPolyData> >(), joints.size());
+    loadedReady.fill(false, joints.size());
+    pending = joints.size();
+    locker.unlock();
+    // Joints are started in order, so the base usually shows up first
+    for (int i = 0; i < joints.size(); i++) {
+        loadPool.start(new MeshLoadTask(this, i, joints[i].config.mesh, lodReductions));
+    }
+}
+
+int KinematicChain::attachLoadedMeshes()
+{
+    int attached = 0;
+    for (int i = 0; i < joints.size() && pending > 0; i++) {
+        QVector<vtkSmartPointer<vtkPolyData> > levels;
+        {
+            QMutexLocker locker(&loadLock);
+            if (i >= loadedReady.size() || !loadedReady[i]) {
+                continue;
+            }
+            loadedReady[i] = false;
+            levels.swap(loaded[i]);
+        }
+        attach(i, levels);
+        pending--;
+        attached++;
+    }
+    if (attached > 0 && pending == 0) {
+        lastBuildMs = loadTimer.nsecsElapsed() / 1e6;
+        MeshCacheStats after = cache.stats();
+        qDebug() << "Loaded" << joints.size() << "meshes on" << loadPool.maxThreadCount() << "threads in"
+                 << lastBuildMs << "ms," << after.hits - loadStats.hits << "levels from the cache,"
+                 << after.misses - loadStats.misses << "built";
+    }
+    return attached;
+}
+
+void KinematicChain::cancelLoading()
+{
+    loadPool.clear();
+    loadPool.waitForDone();
+    pending = 0;
+}
+
+// Actors, transforms and board mapping; the actors join the renderer with their mesh
+void KinematicChain::createJoints(vtkRenderer *renderer)
+{
+    scene = renderer;
+    for (int i = 0; i < joints.size(); i++) {
+        Joint &joint = joints[i];
+
+        joint.levels.clear();
+        joint.lodMappers.clear();
+        joint.mapper = 0;
+        if (forcedLod >= 0) {
+            joint.actor = vtkSmartPointer<vtkActor>::New();
+        } else {
+            joint.actor = vtkSmartPointer<vtkLODActor>::New();
+        }
+        if (joint.config.hasColor) {
+            joint.actor->GetProperty()->SetColor(joint.config.color);
+        }
+
+        // Each joint is expressed in the frame of the previous one
+        joint.transform = vtkSmartPointer<vtkTransform>::New();
+        if (i > 0) {
+            joint.transform->SetInput(joints[i - 1].transform);
+        }
+        joint.actor->SetUserTransform(joint.transform);
+
+        joint.poseIndex = poseApplier.addJoint(joint.transform, joint.config.translation);
+        double identity[4] = { 1.0, 0.0, 0.0, 0.0 };
+        poseApplier.applyPose(joint.poseIndex, identity);
+
+        int board = joint.config.board;
+        if (board > 0 && board < 256) {
+            boardToJoint[board] = i;
+        }
+    }
+}
+
+void KinematicChain::attach(int i, const QVector<vtkSmartPointer<vtkPolyData> > &levels)
+{
+    Joint &joint = joints[i];
+    joint.levels = levels;
+    if (joint.levels.isEmpty()) {
+        // Keep the joint in the chain so the ones after it stay in place
+        joint.levels.append(vtkSmartPointer<vtkPolyData>::New());
+    }
+    joint.lodMappers.clear();
+    for (int l = 0; l < joint.levels.size(); l++) {
+        vtkSmartPointer<vtkPolyDataMapper> mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+        mapper->SetInputData(joint.levels[l]);
+        joint.lodMappers.append(mapper);
+    }
+
+    if (forcedLod >= 0) {
+        joint.mapper = joint.lodMappers[qMin(forcedLod, joint.lodMappers.size() - 1)];
+    } else {
+        // The LOD actor renders the finest level whose estimated time fits its share
+        // of the frame budget; it only makes its own point cloud levels when given none
+        joint.mapper = joint.lodMappers[0];
+        vtkLODActor *lod = vtkLODActor::SafeDownCast(joint.actor);
+        for (int l = 1; l < joint.lodMappers.size(); l++) {
+            lod->AddLODMapper(joint.lodMappers[l]);
+        }
+    }
+    joint.actor->SetMapper(joint.mapper);
+    scene->AddActor(joint.actor);
+}
+
+vtkIdType KinematicChain::triangleCount(int level) const
+{
+    vtkIdType count = 0;
+    for (int i = 0; i < joints.size(); i++) {
+        const QVector<vtkSmartPointer<vtkPolyData> > &levels = joints[i].levels;
+        if (!levels.isEmpty()) {
+            count += levels[qMin(level, levels.size() - 1)]->GetNumberOfPolys();
+        }
+    }
+    return count;
+}
+
+int KinematicChain::jointForBoard(int board) const
+{
+    if (board < 0 || board >= 256) {
+        return -1;
+    }
+    return boardToJoint[board];
+}
+
+bool KinematicChain::applyPose(int joint, const double q[4])
+{
+    if (joint < 0 || joint >= joints.size()) {
+        return false;
+    }
+    return poseApplier.applyPose(joints[joint].poseIndex, q);
+}
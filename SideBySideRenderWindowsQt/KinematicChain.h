@@ -0,0 +1,130 @@
+#ifndef KinematicChain_H
+#define KinematicChain_H
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyDataMapper.h>
+#include <vtkActor.h>
+#include <vtkPolyData.h>
+#include <vtkRenderer.h>
+#include <vtkTransform.h>
+
+#include <QString>
+#include <QVector>
+#include <QThreadPool>
+#include <QMutex>
+#include <QElapsedTimer>
+
+#include "PoseApplier.h"
+#include "MeshCache.h"
+
+struct JointConfig
+{
+  QString mesh;           // STL file, relative to the working directory
+  double translation[3];  // offset from the previous joint, applied after the joint rotation
+  int board;              // board number driving this joint, 0 for a static joint
+  double color[3];
+  bool hasColor;
+};
+
+// Serial chain of STL joints described by a config file. Joint i is attached to
+// joint i-1; joints with a board number follow that board's quaternion stream.
+//
+// Meshes come through a MeshCache, which keeps them preprocessed on disk. Every mesh
+// also gets decimated levels of detail, cached alongside, and a vtkLODActor that falls back to them when the full mesh does not fit the render
+// window's frame budget (vtkRenderWindow::SetDesiredUpdateRate).
+//
+// Config file (INI):
+//   [General]
+//   count=4
+//   lod=0.5, 0.9          ; triangle reductions of the levels, empty for no LOD
+//   meshCache=meshcache   ; directory of the preprocessed meshes
+//   [joint1]
+//   mesh=stl/Joint1.STL
+//   translation=0, 65, 0
+//   board=3
+//   color=0, 0.863, 0.882
+class KinematicChain
+{
+public:
+  KinematicChain();
+  ~KinematicChain();
+
+  // Read the joint list; returns false and keeps the built-in four joint arm when
+  // the file is missing or has no joints
+  bool load(const QString &fileName);
+  void loadDefault();
+
+  // Load the meshes, create mappers, actors and chained transforms and add them to the renderer
+  void build(vtkRenderer *renderer);
+  // Same, but the meshes load on a thread pool, one task per joint. The transforms and
+  // board mapping work on return; each actor joins the renderer once its mesh is
+  // loaded and attachLoadedMeshes() runs, so the scene can render from the start.
+  void buildAsync(vtkRenderer *renderer);
+  // Add the actors whose meshes finished loading; returns how many. GUI thread only
+  int attachLoadedMeshes();
+  int pendingMeshes() const { return pending; }
+  // Drop the loads not started yet and wait for the running ones
+  void cancelLoading();
+  // Milliseconds build() took, or buildAsync() until its last mesh was attached
+  double buildMs() const { return lastBuildMs; }
+
+  // Fraction of the triangles each decimated level drops, finest first. Set before build().
+  void setLodReductions(const QVector<double> &reductions) { lodReductions = reductions; }
+  MeshCache &meshCache() { return cache; }
+  // Render only this level (0 is the full mesh) instead of choosing by frame budget,
+  // e.g. to benchmark each level; -1 for the budget. Set before build().
+  void setForcedLod(int level) { forcedLod = level; }
+  int lodLevelCount() const { return lodReductions.size() + 1; }
+  // Triangles of all joints at a level, after build()
+  vtkIdType triangleCount(int level) const;
+
+  int jointCount() const { return joints.size(); }
+  const JointConfig &config(int joint) const { return joints[joint].config; }
+  vtkActor *actor(int joint) const { return joints[joint].actor; }
+  vtkTransform *transform(int joint) const { return joints[joint].transform; }
+
+  // Joint driven by a board, -1 when the board is not mapped
+  int jointForBoard(int board) const;
+
+  // Set the orientation (qw, qx, qy, qz) of a joint; true when the transform changed
+  bool applyPose(int joint, const double q[4]);
+  const PoseApplier &poses() const { return poseApplier; }
+
+private:
+  struct Joint
+  {
+    JointConfig config;
+    vtkSmartPointer<vtkPolyDataMapper> mapper;
+    QVector<vtkSmartPointer<vtkPolyData> > levels;          // full mesh, then decimated
+    QVector<vtkSmartPointer<vtkPolyDataMapper> > lodMappers;
+    vtkSmartPointer<vtkActor> actor;
+    vtkSmartPointer<vtkTransform> transform;
+    int poseIndex;
+  };
+
+  friend class MeshLoadTask;
+
+  void addJoint(const QString &mesh, double tx, double ty, double tz, int board);
+  void createJoints(vtkRenderer *renderer);
+  void attach(int joint, const QVector<vtkSmartPointer<vtkPolyData> > &levels);
+
+  QVector<Joint> joints;
+  int boardToJoint[256];
+  PoseApplier poseApplier;
+  QVector<double> lodReductions;
+  int forcedLod;
+  MeshCache cache;
+  double lastBuildMs;
+  vtkSmartPointer<vtkRenderer> scene;
+
+  // buildAsync(): loaded meshes wait in loaded[] until attachLoadedMeshes() takes them
+  QThreadPool loadPool;
+  QMutex loadLock;
+  QVector<QVector<vtkSmartPointer<vtkPolyData> > > loaded;
+  QVector<bool> loadedReady;
+  int pending;                // meshes not attached yet
+  QElapsedTimer loadTimer;
+  MeshCacheStats loadStats;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef LatencyHistogram_H
+#define LatencyHistogram_H
+
+#include <QAtomicInt>
+
+// Latency histogram with power-of-two microsecond buckets: bucket 0 holds < 1 us,
+// bucket i holds [2^(i-1), 2^i) us and the last bucket everything above.
+// One thread records, any thread may read; counts are only approximate while recording.
+class LatencyHistogram
+{
+public:
+  enum { Buckets = 24 };   // last bucket starts at ~4.2 s
+
+  LatencyHistogram() { reset(); }
+
+  void reset()
+  {
+    for (int i = 0; i < Buckets; i++) {
+      counts[i].store(0);
+    }
+  }
+
+  void record(qint64 nsecs)
+  {
+    qint64 us = nsecs / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < Buckets - 1) {
+      us >>= 1;
+      bucket++;
+    }
+    counts[bucket].fetchAndAddRelaxed(1);
+  }
+
+  int count(int bucket) const { return counts[bucket].load(); }
+
+  // Upper bound, in microseconds, of the bucket containing the given percentile
+  qint64 percentileUs(double percentile) const
+  {
+    qint64 total = 0;
+    for (int i = 0; i < Buckets; i++) {
+      total += counts[i].load();
+    }
+    if (total == 0) {
+      return 0;
+    }
+    qint64 target = (qint64)(total * percentile / 100.0);
+    qint64 seen = 0;
+    for (int i = 0; i < Buckets; i++) {
+      seen += counts[i].load();
+      if (seen > target) {
+        return (qint64)1 << i;
+      }
+    }
+    return (qint64)1 << (Buckets - 1);
+  }
+
+private:
+  QAtomicInt counts[Buckets];
+};
+
+#endif
@@ -0,0 +1,279 @@
+#include "MeshCache.h"
+
+#include <vtkVersion.h>
+#include <vtkSTLReader.h>
+#include <vtkCleanPolyData.h>
+#include <vtkQuadricDecimation.h>
+#include <vtkPolyDataNormals.h>
+#include <vtkPoints.h>
+#include <vtkPointData.h>
+#include <vtkCellArray.h>
+#include <vtkFloatArray.h>
+#include <vtkIdList.h>
+#if VTK_MAJOR_VERSION >= 9
+#include <vtkTypeInt32Array.h>
+#else
+#include <vtkIdTypeArray.h>
+#endif
+
+#include <QDir>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QDebug>
+
+#include <string.h>
+
+// FNV-1a over the whole file, 0 when it cannot be read
+static quint64 fileHash(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return 0;
+    }
+    qint64 size = file.size();
+    const uchar *data = size > 0 ? file.map(0, size) : 0;
+    if (data == 0) {
+        return 0;
+    }
+    quint64 hash = Q_UINT64_C(14695981039346656037);
+    for (qint64 i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * Q_UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+MeshCache::MeshCache()
+    : directory("meshcache")
+{
+    memset(&counters, 0, sizeof(counters));
+}
+
+MeshCache::~MeshCache()
+{
+    qDeleteAll(mapped);
+}
+
+MeshCacheStats MeshCache::stats() const
+{
+    QMutexLocker locker(&lock);
+    return counters;
+}
+
+QString MeshCache::cacheFile(const QString &mesh, double reduction) const
+{
+    QFileInfo source(mesh);
+    return QDir(directory).filePath(QString("%1-%2.r%3.qmesh")
+        .arg(source.completeBaseName())
+        .arg(qHash(source.absoluteFilePath()), 8, 16, QChar('0'))
+        .arg(qRound(reduction * 100)));
+}
+
+void MeshCache::clear()
+{
+    QDir dir(directory);
+    QStringList files = dir.entryList(QStringList() << "*.qmesh", QDir::Files);
+    for (int i = 0; i < files.size(); i++) {
+        dir.remove(files[i]);
+    }
+}
+
+QVector<vtkSmartPointer<vtkPolyData> > MeshCache::load(const QString &mesh, const QVector<double> &reductions)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QVector<vtkSmartPointer<vtkPolyData> > levels(reductions.size() + 1);
+    int hits = 0, misses = 0;
+    for (int l = 0; l < levels.size(); l++) {
+        levels[l] = map(cacheFile(mesh, l == 0 ? 0.0 : reductions[l - 1]), mesh);
+        hits += levels[l] ? 1 : 0;
+    }
+
+    if (hits < levels.size()) {
+        // Merging is left to the cleaning, which also drops degenerate triangles
+        vtkSmartPointer<vtkSTLReader> reader = vtkSmartPointer<vtkSTLReader>::New();
+        reader->SetFileName(mesh.toLocal8Bit().constData());
+        reader->MergingOff();
+        vtkSmartPointer<vtkCleanPolyData> clean = vtkSmartPointer<vtkCleanPolyData>::New();
+        clean->SetInputConnection(reader->GetOutputPort());
+        clean->Update();
+        if (clean->GetOutput()->GetNumberOfPolys() == 0) {
+            qDebug() << "Could not read mesh" << mesh;
+            return QVector<vtkSmartPointer<vtkPolyData> >();
+        }
+
+        for (int l = 0; l < levels.size(); l++) {
+            if (levels[l]) {
+                continue;
+            }
+            vtkSmartPointer<vtkPolyDataNormals> normals = vtkSmartPointer<vtkPolyDataNormals>::New();
+            vtkSmartPointer<vtkQuadricDecimation> decimation;
+            if (l == 0) {
+                normals->SetInputData(clean->GetOutput());
+            } else {
+                decimation = vtkSmartPointer<vtkQuadricDecimation>::New();
+                decimation->SetInputData(clean->GetOutput());
+                decimation->SetTargetReduction(reductions[l - 1]);
+                normals->SetInputConnection(decimation->GetOutputPort());
+            }
+            normals->ComputePointNormalsOn();
+            normals->ComputeCellNormalsOff();
+            normals->Update();
+
+            levels[l] = vtkSmartPointer<vtkPolyData>::New();
+            levels[l]->ShallowCopy(normals->GetOutput());
+            QString fileName = cacheFile(mesh, l == 0 ? 0.0 : reductions[l - 1]);
+            if (!store(fileName, mesh, levels[l])) {
+                qDebug() << "Could not cache" << mesh << "in" << fileName;
+            }
+            misses++;
+        }
+    }
+
+    QMutexLocker locker(&lock);
+    counters.hits += hits;
+    counters.misses += misses;
+    counters.loadMs += timer.nsecsElapsed() / 1e6;
+    return levels;
+}
+
+vtkSmartPointer<vtkPolyData> MeshCache::map(const QString &fileName, const QString &mesh)
+{
+    QFile *file = new QFile(fileName);
+    if (!file->open(QIODevice::ReadOnly) || file->size() < (qint64)sizeof(MeshCacheHeader)) {
+        delete file;
+        return vtkSmartPointer<vtkPolyData>();
+    }
+    // Private pages: VTK gets writable arrays and the file never changes
+    qint64 size = file->size();
+    uchar *data = file->map(0, size, QFileDevice::MapPrivateOption);
+    const MeshCacheHeader *h = reinterpret_cast<const MeshCacheHeader *>(data);
+    QFileInfo source(mesh);
+    bool valid = data != 0 && memcmp(h->magic, "QVTKMSH", 8) == 0 && h->version == MeshCacheVersion &&
+                 h->byteOrder == MeshCacheByteOrder && h->pointCount >= 0 && h->triangleCount >= 0 &&
+                 size == (qint64)sizeof(MeshCacheHeader) + h->pointCount * 6 * (qint64)sizeof(float) +
+                         (h->triangleCount * 4 + 1) * (qint64)sizeof(qint32) &&
+                 h->sourceSize == source.size();
+    // A new time stamp alone, as a checkout leaves it, does not invalidate the cache
+    if (valid && h->sourceMtimeMs != source.lastModified().toMSecsSinceEpoch()) {
+        valid = h->sourceHash == fileHash(mesh);
+    }
+    if (!valid) {
+        delete file;
+        return vtkSmartPointer<vtkPolyData>();
+    }
+
+    vtkIdType points = h->pointCount, triangles = h->triangleCount;
+    float *pointData = reinterpret_cast<float *>(data + sizeof(MeshCacheHeader));
+    float *normalData = pointData + 3 * points;
+    qint32 *offsetData = reinterpret_cast<qint32 *>(normalData + 3 * points);
+    qint32 *connectivityData = offsetData + triangles + 1;
+
+    // save = 1: the arrays never free the mapping
+    vtkSmartPointer<vtkFloatArray> pointArray = vtkSmartPointer<vtkFloatArray>::New();
+    pointArray->SetNumberOfComponents(3);
+    pointArray->SetArray(pointData, 3 * points, 1);
+    vtkSmartPointer<vtkPoints> pointSet = vtkSmartPointer<vtkPoints>::New();
+    pointSet->SetData(pointArray);
+
+    vtkSmartPointer<vtkFloatArray> normalArray = vtkSmartPointer<vtkFloatArray>::New();
+    normalArray->SetName("Normals");
+    normalArray->SetNumberOfComponents(3);
+    normalArray->SetArray(normalData, 3 * points, 1);
+
+    vtkSmartPointer<vtkCellArray> cells = vtkSmartPointer<vtkCellArray>::New();
+#if VTK_MAJOR_VERSION >= 9
+    vtkSmartPointer<vtkTypeInt32Array> offsets = vtkSmartPointer<vtkTypeInt32Array>::New();
+    offsets->SetArray(offsetData, triangles + 1, 1);
+    vtkSmartPointer<vtkTypeInt32Array> connectivity = vtkSmartPointer<vtkTypeInt32Array>::New();
+    connectivity->SetArray(connectivityData, 3 * triangles, 1);
+    cells->SetData(offsets, connectivity);
+#else
+    // Before VTK 9 cells are stored as (count, ids...) in vtkIdType, one copy is needed
+    vtkSmartPointer<vtkIdTypeArray> ids = vtkSmartPointer<vtkIdTypeArray>::New();
+    ids->SetNumberOfValues(4 * triangles);
+    vtkIdType *id = ids->GetPointer(0);
+    for (vtkIdType t = 0; t < triangles; t++) {
+        *id++ = 3;
+        *id++ = connectivityData[3 * t];
+        *id++ = connectivityData[3 * t + 1];
+        *id++ = connectivityData[3 * t + 2];
+    }
+    cells->SetCells(triangles, ids);
+#endif
+
+    vtkSmartPointer<vtkPolyData> polyData = vtkSmartPointer<vtkPolyData>::New();
+    polyData->SetPoints(pointSet);
+    polyData->SetPolys(cells);
+    polyData->GetPointData()->SetNormals(normalArray);
+
+    QMutexLocker locker(&lock);
+    mapped.append(file);
+    return polyData;
+}
+
+bool MeshCache::store(const QString &fileName, const QString &mesh, vtkPolyData *polyData) const
+{
+    vtkPoints *points = polyData->GetPoints();
+    vtkDataArray *normals = polyData->GetPointData()->GetNormals();
+    if (points == 0 || normals == 0 || !QDir(directory).mkpath(".")) {
+        return false;
+    }
+
+    vtkIdType pointCount = points->GetNumberOfPoints();
+    QVector<float> pointData(3 * pointCount), normalData(3 * pointCount);
+    for (vtkIdType i = 0; i < pointCount; i++) {
+        double p[3], n[3];
+        points->GetPoint(i, p);
+        normals->GetTuple(i, n);
+        for (int c = 0; c < 3; c++) {
+            pointData[3 * i + c] = (float)p[c];
+            normalData[3 * i + c] = (float)n[c];
+        }
+    }
+
+    // Only triangles are kept; the cleaning turns degenerate ones into lines
+    QVector<qint32> offsets, connectivity;
+    offsets.reserve(polyData->GetNumberOfPolys() + 1);
+    connectivity.reserve(3 * polyData->GetNumberOfPolys());
+    offsets.append(0);
+    vtkSmartPointer<vtkIdList> cell = vtkSmartPointer<vtkIdList>::New();
+    vtkCellArray *polys = polyData->GetPolys();
+    polys->InitTraversal();
+    while (polys->GetNextCell(cell)) {
+        if (cell->GetNumberOfIds() == 3) {
+            for (int c = 0; c < 3; c++) {
+                connectivity.append((qint32)cell->GetId(c));
+            }
+            offsets.append(connectivity.size());
+        }
+    }
+
+    QFileInfo source(mesh);
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "QVTKMSH", 8);
+    header.version = MeshCacheVersion;
+    header.byteOrder = MeshCacheByteOrder;
+    header.sourceSize = source.size();
+    header.sourceMtimeMs = source.lastModified().toMSecsSinceEpoch();
+    header.sourceHash = fileHash(mesh);
+    header.pointCount = pointCount;
+    header.triangleCount = offsets.size() - 1;
+
+    // Written under a temporary name and renamed, so a reader never maps half a file
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(pointData.constData()), pointData.size() * sizeof(float));
+    file.write(reinterpret_cast<const char *>(normalData.constData()), normalData.size() * sizeof(float));
+    file.write(reinterpret_cast<const char *>(offsets.constData()), offsets.size() * sizeof(qint32));
+    file.write(reinterpret_cast<const char *>(connectivity.constData()), connectivity.size() * sizeof(qint32));
+    return file.commit();
+}
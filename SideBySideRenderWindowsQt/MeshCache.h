@@ -0,0 +1,91 @@
+#ifndef MeshCache_H
+#define MeshCache_H
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+
+#include <QtGlobal>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+// Preprocessed mesh file (.qmesh), one per source mesh and level of detail.
+//
+//   header         64 bytes
+//   points         float x, y, z per point
+//   normals        float nx, ny, nz per point
+//   offsets        qint32 per triangle and one more: 0, 3, 6, ...
+//   connectivity   qint32 point ids, three per triangle
+//
+// The sections are laid out as VTK keeps them in memory, so a load maps the file and
+// hands the mapped sections to VTK arrays instead of parsing anything. Fields are in
+// host byte order, like the session log.
+
+enum {
+  MeshCacheVersion = 1,
+  MeshCacheByteOrder = 0x01020304
+};
+
+struct MeshCacheHeader
+{
+  char magic[8];                // "QVTKMSH" and a zero
+  quint32 version;
+  quint32 byteOrder;            // MeshCacheByteOrder as the writer stored it
+  qint64 sourceSize;            // the mesh file this was made from
+  qint64 sourceMtimeMs;
+  quint64 sourceHash;           // FNV-1a of the mesh file's contents
+  qint64 pointCount;
+  qint64 triangleCount;
+  quint8 reserved[8];
+};
+
+Q_STATIC_ASSERT(sizeof(MeshCacheHeader) == 64);
+
+struct MeshCacheStats
+{
+  int hits;                     // levels mapped from the cache
+  int misses;                   // levels built from the mesh file and stored
+  double loadMs;                // time spent in load()
+};
+
+// Loads STL meshes cleaned (merged points, no degenerate triangles) and with point
+// normals, plus decimated levels of detail, through the cache directory. A cache file
+// is used while the mesh file keeps its size and modification time, or its contents
+// when only the time changed (after a checkout, say). Anything else rebuilds it from
+// the mesh file, which is what the first launch pays.
+//
+// The mapped files stay open for the life of the cache, since the returned polydata
+// point into them; keep the cache alive as long as the meshes are rendered.
+// load() may run on several threads at once.
+class MeshCache
+{
+public:
+  MeshCache();
+  ~MeshCache();
+
+  void setDirectory(const QString &dir) { directory = dir; }
+  QString cacheDirectory() const { return directory; }
+
+  // The full mesh, then one level per reduction (fraction of triangles dropped);
+  // an empty vector when the mesh file cannot be read
+  QVector<vtkSmartPointer<vtkPolyData> > load(const QString &mesh, const QVector<double> &reductions);
+
+  // Delete every cache file of the directory, e.g. to time a cold start
+  void clear();
+
+  MeshCacheStats stats() const;
+
+private:
+  QString cacheFile(const QString &mesh, double reduction) const;
+  vtkSmartPointer<vtkPolyData> map(const QString &fileName, const QString &mesh);
+  bool store(const QString &fileName, const QString &mesh, vtkPolyData *polyData) const;
+
+  QString directory;
+  mutable QMutex lock;
+  QList<QFile *> mapped;        // files the loaded arrays point into
+  MeshCacheStats counters;
+};
+
+#endif
@@ -0,0 +1,174 @@
+// Throughput of FrameParser on a synthetic telemetry stream: frames of every board
+// with noise between them and corrupted bytes inside some, fed through feed() in
+// random chunk sizes as readyRead() would hand them over. Needs only Qt Core.
+//
+//   ParserBench [--megabytes MB] [--boards N] [--raw-frames] [--noise P] [--corrupt P]
+//               [--chunk MIN-MAX] [--rounds N] [--seed N] [--min-mbps MBPS]
+//
+// --noise is the probability of 1 to 16 noise bytes after a frame, a stray sync word
+// among them now and then; --corrupt the probability that a frame has one byte flipped,
+// which the CRC rejects. The stream is built once and fed --rounds times (default 5);
+// the best round gives the MB/s. The defaults, 5.6 MB of float frames from four boards
+// in chunks of 37-136 bytes, are the stream the parser was first measured on. Prints
+// the parser's counters; --min-mbps makes it exit with 1 below that rate.
+#include <QElapsedTimer>
+#include <QVector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FrameParser.h"
+
+// Uniform in [0, 1), xorshift so every run builds the same stream
+static quint64 rngState = Q_UINT64_C(88172645463325252);
+static double uniform()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (rngState >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Counts the samples that come out of the parser
+class CountingSink : public QuatSampleSink
+{
+public:
+    CountingSink() : samples(0) {}
+    virtual void consumeSample(const QuatSample &sample)
+    {
+        Q_UNUSED(sample);
+        samples++;
+    }
+
+    quint64 samples;
+};
+
+static void usage()
+{
+    fprintf(stderr, "usage: ParserBench [--megabytes MB] [--boards N] [--raw-frames] [--noise P] [--corrupt P]\n"
+                    "                   [--chunk MIN-MAX] [--rounds N] [--seed N] [--min-mbps MBPS]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    double megabytes = 5.6, noise = 0.05, corrupt = 0.01, minMbps = 0.0;
+    int boards = 4, minChunk = 37, maxChunk = 136, rounds = 5;
+    bool rawFrames = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "--megabytes") && hasValue) megabytes = atof(argv[++i]);
+        else if (!strcmp(arg, "--boards") && hasValue) boards = atoi(argv[++i]);
+        else if (!strcmp(arg, "--raw-frames")) rawFrames = true;
+        else if (!strcmp(arg, "--noise") && hasValue) noise = atof(argv[++i]);
+        else if (!strcmp(arg, "--corrupt") && hasValue) corrupt = atof(argv[++i]);
+        else if (!strcmp(arg, "--chunk") && hasValue) {
+            if (sscanf(argv[++i], "%d-%d", &minChunk, &maxChunk) != 2) usage();
+        }
+        else if (!strcmp(arg, "--rounds") && hasValue) rounds = atoi(argv[++i]);
+        else if (!strcmp(arg, "--seed") && hasValue) rngState += (quint64)atoll(argv[++i]);
+        else if (!strcmp(arg, "--min-mbps") && hasValue) minMbps = atof(argv[++i]);
+        else usage();
+    }
+    if (megabytes <= 0.0 || boards < 1 || boards > 255 || minChunk < 1 || maxChunk < minChunk || rounds < 1) {
+        usage();
+    }
+
+    // The stream: boards take turns, each with its own sequence numbers
+    QVector<uint8_t> stream;
+    int target = (int)(megabytes * 1e6);
+    stream.reserve(target + QUAT_FRAME_MAX_SIZE + 16);
+    uint8_t type = rawFrames ? QUAT_FRAME_RAW : QUAT_FRAME_FLOAT;
+    int16_t raw[QUAT_FRAME_RAW_COUNTS];
+    quint16 seq[256];
+    memset(seq, 0, sizeof(seq));
+    quint64 framesWritten = 0, noiseBytes = 0, corrupted = 0;
+    while (stream.size() < target) {
+        uint8_t board = (uint8_t)(1 + framesWritten % boards);
+        float q[4];
+        for (int i = 0; i < 4; i++) {
+            q[i] = (float)(uniform() * 2.0 - 1.0);
+        }
+        for (int i = 0; i < QUAT_FRAME_RAW_COUNTS; i++) {
+            raw[i] = (int16_t)(uniform() * 65535.0 - 32768.0);
+        }
+        uint8_t frame[QUAT_FRAME_MAX_SIZE];
+        int length = quatFrameEncode(frame, type, board, seq[board]++, (quint32)(framesWritten * 1500), q, raw);
+        if (uniform() < corrupt) {
+            frame[QUAT_FRAME_HEADER_SIZE + (int)(uniform() * (length - QUAT_FRAME_HEADER_SIZE))] ^= 0x10;
+            corrupted++;
+        }
+        for (int i = 0; i < length; i++) {
+            stream.append(frame[i]);
+        }
+        framesWritten++;
+
+        if (uniform() < noise) {
+            int count = 1 + (int)(uniform() * 16);
+            for (int i = 0; i < count; i++) {
+                if (i + 1 < count && uniform() < 0.1) {
+                    stream.append(QUAT_FRAME_SYNC0);
+                    stream.append(QUAT_FRAME_SYNC1);
+                    i++;
+                } else {
+                    stream.append((uint8_t)(uniform() * 256.0));
+                }
+            }
+            noiseBytes += count;
+        }
+    }
+
+    // Chunk sizes drawn once, so every round splits the stream the same way
+    QVector<int> chunks;
+    for (int pos = 0; pos < stream.size();) {
+        int chunk = qMin(minChunk + (int)(uniform() * (maxChunk - minChunk + 1)), stream.size() - pos);
+        chunks.append(chunk);
+        pos += chunk;
+    }
+
+    CountingSink sink;
+    FrameParser parser(&sink);
+    double bestMbps = 0.0, totalNs = 0.0;
+    for (int round = 0; round < rounds; round++) {
+        parser.reset();
+        const uint8_t *data = stream.constData();
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < chunks.size(); i++) {
+            parser.feed(data, chunks[i]);
+            data += chunks[i];
+        }
+        qint64 ns = timer.nsecsElapsed();
+        totalNs += ns;
+        bestMbps = qMax(bestMbps, stream.size() / (ns / 1e9) / 1e6);
+    }
+
+    const FrameParserStats &s = parser.stats();
+    printf("stream:           %.2f MB, %llu %s frames from %d board%s, chunks of %d-%d bytes\n",
+           stream.size() / 1e6, (unsigned long long)framesWritten, rawFrames ? "raw" : "float", boards,
+           boards > 1 ? "s" : "", minChunk, maxChunk);
+    printf("injected:         %llu noise bytes, %llu corrupted frames\n",
+           (unsigned long long)noiseBytes, (unsigned long long)corrupted);
+    printf("throughput:       %.1f MB/s best, %.1f MB/s mean of %d rounds\n", bestMbps,
+           stream.size() * (double)rounds / (totalNs / 1e9) / 1e6, rounds);
+    printf("frames:           %llu decoded, %llu bytes taken in\n",
+           (unsigned long long)sink.samples / rounds, (unsigned long long)s.bytes);
+    printf("resyncs:          %llu\n", (unsigned long long)s.resyncs);
+    printf("crc errors:       %llu\n", (unsigned long long)s.crcErrors);
+    printf("dropped samples:  %llu\n", (unsigned long long)s.droppedSamples);
+    printf("overflow bytes:   %llu\n", (unsigned long long)s.overflowBytes);
+
+    if (s.frames + corrupted != framesWritten) {
+        fprintf(stderr, "%llu frames decoded, expected %llu\n", (unsigned long long)s.frames,
+                (unsigned long long)(framesWritten - corrupted));
+        return 1;
+    }
+    if (minMbps > 0.0 && bestMbps < minMbps) {
+        fprintf(stderr, "%.1f MB/s is below --min-mbps %.1f\n", bestMbps, minMbps);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include "PoseApplier.h"
+
+#include <math.h>
+
+PoseApplier::PoseApplier()
+    : epsilon(1.0e-5), applied(0), skipped(0)
+{
+}
+
+int PoseApplier::addJoint(vtkTransform *transform, const double translation[3])
+{
+    Joint joint;
+    joint.matrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    joint.local = vtkSmartPointer<vtkMatrixToLinearTransform>::New();
+    joint.local->SetInput(joint.matrix);
+    for (int i = 0; i < 3; i++) {
+        joint.translation[i] = translation[i];
+    }
+    joint.valid = false;
+
+    // Live concatenation: later changes to joint.matrix flow into transform
+    transform->Concatenate(joint.local);
+
+    joints.append(joint);
+    return joints.size() - 1;
+}
+
+void PoseApplier::quaternionToMatrix(const double q[4], const double translation[3], double elements[16])
+{
+    double qw = q[0], qx = q[1], qy = q[2], qz = q[3];
+
+    elements[0]  = (qw*qw) + (qx*qx) - (qy*qy) - (qz*qz);
+    elements[1]  = (2*qx*qy) - (2*qz*qw);
+    elements[2]  = (2*qx*qz) + (2*qy*qw);
+    elements[3]  = translation[0];
+
+    elements[4]  = (2*qx*qy) + (2*qz*qw);
+    elements[5]  = (qw*qw) - (qx*qx) + (qy*qy) - (qz*qz);
+    elements[6]  = (2*qy*qz) - (2*qx*qw);
+    elements[7]  = translation[1];
+
+    elements[8]  = (2*qx*qz) - (2*qy*qw);
+    elements[9]  = (2*qy*qz) + (2*qx*qw);
+    elements[10] = (qw*qw) - (qx*qx) - (qy*qy) + (qz*qz);
+    elements[11] = translation[2];
+
+    elements[12] = 0;
+    elements[13] = 0;
+    elements[14] = 0;
+    elements[15] = 1;
+}
+
+bool PoseApplier::applyPose(int index, const double q[4])
+{
+    if (index < 0 || index >= joints.size()) {
+        return false;
+    }
+    Joint &joint = joints[index];
+
+    if (joint.valid) {
+        double change = 0;
+        for (int i = 0; i < 4; i++) {
+            change = qMax(change, fabs(q[i] - joint.lastQ[i]));
+        }
+        if (change < epsilon) {
+            skipped++;
+            return false;
+        }
+    }
+
+    quaternionToMatrix(q, joint.translation, elements);
+    joint.matrix->DeepCopy(elements);   // one copy and one Modified()
+    for (int i = 0; i < 4; i++) {
+        joint.lastQ[i] = q[i];
+    }
+    joint.valid = true;
+    applied++;
+    return true;
+}
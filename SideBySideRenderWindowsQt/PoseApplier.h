@@ -0,0 +1,56 @@
+#ifndef PoseApplier_H
+#define PoseApplier_H
+
+#include <vtkSmartPointer.h>
+#include <vtkTransform.h>
+#include <vtkMatrix4x4.h>
+#include <vtkMatrixToLinearTransform.h>
+
+#include <QtGlobal>
+#include <QVector>
+
+// Applies joint orientations to their vtkTransforms without allocating per sample.
+// Every joint owns one preallocated vtkMatrix4x4 that is concatenated into its
+// transform once, through a vtkMatrixToLinearTransform, so an update is a single
+// DeepCopy of a packed 4x4 array. Poses closer than epsilon to the last applied one
+// are skipped, which keeps Modified() and the pipeline quiet while the sensor rests.
+class PoseApplier
+{
+public:
+  PoseApplier();
+
+  // Register a joint; its local matrix is rotation(q) followed by translation.
+  // Returns the joint index used by applyPose().
+  int addJoint(vtkTransform *transform, const double translation[3]);
+  int jointCount() const { return joints.size(); }
+
+  // Returns true when the transform was updated
+  bool applyPose(int joint, const double q[4]);
+
+  void setEpsilon(double epsilon) { this->epsilon = epsilon; }
+  double getEpsilon() const { return epsilon; }
+
+  quint64 appliedCount() const { return applied; }
+  quint64 skippedCount() const { return skipped; }
+
+  // Packed row-major 4x4 for quaternion (qw, qx, qy, qz) and a translation
+  static void quaternionToMatrix(const double q[4], const double translation[3], double elements[16]);
+
+private:
+  struct Joint
+  {
+    vtkSmartPointer<vtkMatrix4x4> matrix;
+    vtkSmartPointer<vtkMatrixToLinearTransform> local;
+    double translation[3];
+    double lastQ[4];
+    bool valid;
+  };
+
+  QVector<Joint> joints;
+  double epsilon;
+  double elements[16];
+  quint64 applied;
+  quint64 skipped;
+};
+
+#endif
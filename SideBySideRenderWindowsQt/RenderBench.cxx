@@ -0,0 +1,471 @@
+// Headless render benchmark of the joint scene: the meshes and transform chain of
+// the viewer, driven by a synthetic motion or a recorded session, rendered off
+// screen without Qt widgets.
+//
+//   RenderBench [--config joints.ini] [--frames N] [--size WxH] [--replay FILE]
+//               [--frame-ms MS] [--png FILE] [--min-fps FPS] [--lod auto|N|all]
+//   RenderBench --startup [--config joints.ini] [--size WxH]
+//   RenderBench --poses [--samples N]
+//
+// Without a display or GPU this needs VTK built with OSMesa (VTK_OPENGL_HAS_OSMESA,
+// and VTK_DEFAULT_RENDER_WINDOW_OFFSCREEN or VTK_USE_OFFSCREEN) so the render window
+// factory returns a software window. --replay plays a .qlog session at --frame-ms of
+// recorded time per frame (default 1000/60), otherwise every driven joint swings
+// through a fixed motion. Reports frame rate, wall and CPU time per frame and the
+// resident memory; --min-fps makes it exit with 1 when the rate falls below, for
+// catching render path regressions in a script.
+//
+// --lod chooses the mesh detail: auto lets the level of detail actors follow the
+// frame budget of --frame-ms, N renders level N only (0 is the full mesh), and all
+// runs the benchmark once per level and prints a table to compare them.
+//
+// --startup times the first frame and the full scene: cold, after emptying the mesh
+// cache so every mesh is read and preprocessed, then warm from the cache; each with the
+// meshes loaded serially before the first frame, then on the thread pool as the viewer does.
+//
+// --poses times one pose update of a joint in a four joint transform chain, without
+// rendering: PoseApplier::applyPose() against the path it replaced, a new vtkMatrix4x4
+// per sample filled with 16 SetElement() calls and then Identity() and SetMatrix() on
+// the joint's transform. Each runs on a moving pose and on a resting one, which
+// PoseApplier skips as within its epsilon of the last, and is timed with and without
+// reading the matrix of the last joint, as rendering the chain does.
+#include <vtkSmartPointer.h>
+#include <vtkRenderer.h>
+#include <vtkRenderWindow.h>
+#include <vtkAxesActor.h>
+#include <vtkCamera.h>
+#include <vtkWindowToImageFilter.h>
+#include <vtkPNGWriter.h>
+#include <vtkTransform.h>
+#include <vtkMatrix4x4.h>
+
+#include <QElapsedTimer>
+#include <QString>
+#include <QVector>
+#include <QThread>
+#include <QThreadPool>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "KinematicChain.h"
+#include "PoseApplier.h"
+#include "SessionLog.h"
+
+static double cpuSeconds()
+{
+#if defined(CLOCK_PROCESS_CPUTIME_ID)
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Resident set size in MiB, 0 where it cannot be read
+static double residentMiB()
+{
+#if defined(__linux__)
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file != NULL) {
+        long pages = 0, resident = 0;
+        int n = fscanf(file, "%ld %ld", &pages, &resident);
+        fclose(file);
+        if (n == 2) {
+            return resident * (double)sysconf(_SC_PAGESIZE) / 1048576.0;
+        }
+    }
+#endif
+    return 0.0;
+}
+
+static double peakResidentMiB()
+{
+#if defined(__linux__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_maxrss / 1024.0;    // kB on Linux
+    }
+#elif defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_maxrss / 1048576.0; // bytes on macOS
+    }
+#endif
+    return 0.0;
+}
+
+// Rotation about a fixed tilted axis per joint, swinging +-60 degrees
+static void syntheticPose(int joint, int frame, double q[4])
+{
+    double phase = frame * 0.05 + joint * 0.7;
+    double angle = (60.0 * 3.14159265358979323846 / 180.0) * sin(phase);
+    double axis[3] = { cos(joint * 1.3), 1.0, sin(joint * 1.3) };
+    double n = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    double s = sin(angle / 2) / n;
+    q[0] = cos(angle / 2);
+    q[1] = axis[0] * s;
+    q[2] = axis[1] * s;
+    q[3] = axis[2] * s;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: RenderBench [--config joints.ini] [--frames N] [--size WxH] [--replay FILE]\n"
+                    "                   [--frame-ms MS] [--png FILE] [--min-fps FPS] [--lod auto|N|all]\n"
+                    "       RenderBench --startup [--config joints.ini] [--size WxH]\n"
+                    "       RenderBench --poses [--samples N]\n");
+    exit(2);
+}
+
+struct BenchOptions
+{
+    QString config;
+    const char *replayPath;
+    const char *pngPath;
+    int frames, width, height;
+    double frameMs;
+};
+
+struct BenchResult
+{
+    QString windowClass;
+    int joints, driven;
+    qint64 triangles;
+    double setupMs, wallMs, cpuMs, fps;
+    QVector<double> sortedMs;
+    quint64 posesApplied;
+    double memorySetup;
+};
+
+// Build the scene at a level of detail (-1 for the frame budget) and render the frames
+static BenchResult runBench(const BenchOptions &options, SessionLogReader &log, int lod)
+{
+    BenchResult result;
+    QElapsedTimer setupTimer;
+    setupTimer.start();
+
+    // The scene of SideBySideRenderWindowsQt's left window
+    KinematicChain chain;
+    chain.load(options.config);
+    chain.setForcedLod(lod);
+    vtkSmartPointer<vtkRenderer> renderer = vtkSmartPointer<vtkRenderer>::New();
+    chain.build(renderer);
+    vtkSmartPointer<vtkAxesActor> baseAxes = vtkSmartPointer<vtkAxesActor>::New();
+    baseAxes->SetTotalLength(40, 40, 40);
+    renderer->AddActor(baseAxes);
+    renderer->SetBackground(1.0, 1.0, 1.0);
+
+    vtkSmartPointer<vtkRenderWindow> window = vtkSmartPointer<vtkRenderWindow>::New();
+    window->SetOffScreenRendering(1);
+    window->SetSize(options.width, options.height);
+    window->SetDesiredUpdateRate(1000.0 / options.frameMs);
+    window->AddRenderer(renderer);
+    renderer->ResetCamera();
+    window->Render();   // builds the GL state
+    result.setupMs = setupTimer.nsecsElapsed() / 1e6;
+    result.memorySetup = residentMiB();
+    result.windowClass = window->GetClassName();
+    result.joints = chain.jointCount();
+    result.triangles = chain.triangleCount(lod >= 0 ? lod : 0);
+
+    // Joints that move: those mapped to a board, or all but the base for the synthetic motion
+    QVector<int> driven;
+    for (int i = 0; i < chain.jointCount(); i++) {
+        if (chain.config(i).board > 0 || (options.replayPath == NULL && i > 0)) {
+            driven.append(i);
+        }
+    }
+    result.driven = driven.size();
+
+    QVector<double> frameMsList;
+    frameMsList.reserve(options.frames);
+    qint64 next = 0;
+    qint64 replayStartNs = log.recordCount() > 0 ? log.record(0).hostNs : 0;
+    result.posesApplied = 0;
+    QElapsedTimer total;
+    total.start();
+    double cpuStart = cpuSeconds();
+    for (int frame = 0; frame < options.frames; frame++) {
+        QElapsedTimer frameTimer;
+        frameTimer.start();
+
+        if (options.replayPath != NULL) {
+            // Latest record of each board up to this frame's recorded time
+            qint64 until = replayStartNs + (qint64)((frame + 1) * options.frameMs * 1e6);
+            for (; next < log.recordCount() && log.record(next).hostNs <= until; next++) {
+                const SessionRecord &r = log.record(next);
+                int joint = chain.jointForBoard(r.board);
+                if (joint >= 0) {
+                    double q[4] = { r.q[0], r.q[1], r.q[2], r.q[3] };
+                    result.posesApplied += chain.applyPose(joint, q) ? 1 : 0;
+                }
+            }
+        } else {
+            for (int i = 0; i < driven.size(); i++) {
+                double q[4];
+                syntheticPose(driven[i], frame, q);
+                result.posesApplied += chain.applyPose(driven[i], q) ? 1 : 0;
+            }
+        }
+        window->Render();
+
+        frameMsList.append(frameTimer.nsecsElapsed() / 1e6);
+    }
+    result.cpuMs = (cpuSeconds() - cpuStart) * 1e3;
+    result.wallMs = total.nsecsElapsed() / 1e6;
+    result.fps = options.frames / (result.wallMs / 1e3);
+
+    if (options.pngPath != NULL) {
+        vtkSmartPointer<vtkWindowToImageFilter> image = vtkSmartPointer<vtkWindowToImageFilter>::New();
+        image->SetInput(window);
+        image->ReadFrontBufferOff();
+        vtkSmartPointer<vtkPNGWriter> writer = vtkSmartPointer<vtkPNGWriter>::New();
+        writer->SetFileName(options.pngPath);
+        writer->SetInputConnection(image->GetOutputPort());
+        writer->Write();
+    }
+
+    result.sortedMs = frameMsList;
+    std::sort(result.sortedMs.begin(), result.sortedMs.end());
+    return result;
+}
+
+// Scene setup with an empty or a filled mesh cache, loading the meshes one after the
+// other before the first frame, or on the thread pool while frames are rendered
+static void runStartup(const BenchOptions &options, bool cold, bool parallel)
+{
+    double memoryStart = residentMiB();
+    QElapsedTimer timer;
+    timer.start();
+
+    KinematicChain chain;
+    chain.load(options.config);
+    if (cold) {
+        chain.meshCache().clear();
+    }
+    vtkSmartPointer<vtkRenderer> renderer = vtkSmartPointer<vtkRenderer>::New();
+    vtkSmartPointer<vtkRenderWindow> window = vtkSmartPointer<vtkRenderWindow>::New();
+    window->SetOffScreenRendering(1);
+    window->SetSize(options.width, options.height);
+    window->AddRenderer(renderer);
+    if (parallel) {
+        chain.buildAsync(renderer);
+    } else {
+        chain.build(renderer);
+    }
+    renderer->ResetCamera();
+    window->Render();
+    double firstFrameMs = timer.nsecsElapsed() / 1e6;
+
+    // Render whenever meshes arrive, as the viewer does
+    while (chain.pendingMeshes() > 0) {
+        if (chain.attachLoadedMeshes() > 0) {
+            renderer->ResetCamera();
+            window->Render();
+        } else {
+            QThread::msleep(1);
+        }
+    }
+    double fullSceneMs = timer.nsecsElapsed() / 1e6;
+
+    MeshCacheStats stats = chain.meshCache().stats();
+    printf("%-5s %-9s first frame %8.1f ms   full scene %8.1f ms   %d levels from the cache, %d built   %+.1f MiB\n",
+           cold ? "cold" : "warm", parallel ? "parallel" : "serial", firstFrameMs, fullSceneMs,
+           stats.hits, stats.misses, residentMiB() - memoryStart);
+}
+
+// The pose update of the viewer before PoseApplier
+static void applyPoseWithNewMatrix(vtkTransform *transform, const double q[4], const double translation[3])
+{
+    double elements[16];
+    PoseApplier::quaternionToMatrix(q, translation, elements);
+    vtkSmartPointer<vtkMatrix4x4> matrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    for (int row = 0; row < 4; row++) {
+        for (int column = 0; column < 4; column++) {
+            matrix->SetElement(row, column, elements[row * 4 + column]);
+        }
+    }
+    transform->Identity();
+    transform->SetMatrix(matrix);
+}
+
+// Nanoseconds per pose update of joint 1 of a four joint chain, the joint moving
+// or at rest, optionally reading the composed matrix of the last joint after each
+static double timePoses(bool poseApplier, bool moving, bool readChain, int samples, quint64 *applied)
+{
+    const double translations[4][3] = { { 0, 0, 0 }, { 0, 65, 0 }, { 0, 69.803599, 0 }, { 0.267949, 91.428531, 0 } };
+    vtkSmartPointer<vtkTransform> chain[4];
+    PoseApplier applier;
+    int poseIndex = -1;
+    for (int i = 0; i < 4; i++) {
+        chain[i] = vtkSmartPointer<vtkTransform>::New();
+        if (i > 0) {
+            chain[i]->SetInput(chain[i - 1]);
+        }
+        if (i == 1 && poseApplier) {
+            poseIndex = applier.addJoint(chain[i], translations[i]);
+        } else {
+            chain[i]->Translate(translations[i][0], translations[i][1], translations[i][2]);
+        }
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int n = 0; n < samples; n++) {
+        double q[4];
+        syntheticPose(1, moving ? n : 0, q);
+        if (poseApplier) {
+            applier.applyPose(poseIndex, q);
+        } else {
+            applyPoseWithNewMatrix(chain[1], q, translations[1]);
+        }
+        if (readChain) {
+            chain[3]->GetMatrix();     // updates the chain as the actor's matrix does
+        }
+    }
+    double ns = (double)timer.nsecsElapsed() / samples;
+    *applied = poseApplier ? applier.appliedCount() : (quint64)samples;
+    return ns;
+}
+
+static void runPoses(int samples)
+{
+    printf("%d samples per case, joint 1 of a 4 joint chain\n", samples);
+    printf("%-22s %-8s %10s %18s %12s\n", "update", "pose", "ns/sample", "ns/sample + chain", "applied");
+    for (int moving = 1; moving >= 0; moving--) {
+        for (int poseApplier = 0; poseApplier <= 1; poseApplier++) {
+            quint64 applied = 0;
+            double ns = timePoses(poseApplier, moving, false, samples, &applied);
+            double nsWithChain = timePoses(poseApplier, moving, true, samples, &applied);
+            printf("%-22s %-8s %10.1f %18.1f %12llu\n", poseApplier ? "PoseApplier" : "new vtkMatrix4x4",
+                   moving ? "moving" : "resting", ns, nsWithChain, (unsigned long long)applied);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    options.config = "joints.ini";
+    options.replayPath = options.pngPath = NULL;
+    options.frames = 600;
+    options.width = 800;
+    options.height = 600;
+    options.frameMs = 1000.0 / 60.0;
+    double minFps = 0.0;
+    const char *lodArg = "auto";
+    bool startup = false, poses = false;
+    int samples = 1000000;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "--config") && hasValue) options.config = argv[++i];
+        else if (!strcmp(arg, "--frames") && hasValue) options.frames = atoi(argv[++i]);
+        else if (!strcmp(arg, "--size") && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2) usage();
+        }
+        else if (!strcmp(arg, "--replay") && hasValue) options.replayPath = argv[++i];
+        else if (!strcmp(arg, "--frame-ms") && hasValue) options.frameMs = atof(argv[++i]);
+        else if (!strcmp(arg, "--png") && hasValue) options.pngPath = argv[++i];
+        else if (!strcmp(arg, "--min-fps") && hasValue) minFps = atof(argv[++i]);
+        else if (!strcmp(arg, "--lod") && hasValue) lodArg = argv[++i];
+        else if (!strcmp(arg, "--startup")) startup = true;
+        else if (!strcmp(arg, "--poses")) poses = true;
+        else if (!strcmp(arg, "--samples") && hasValue) samples = atoi(argv[++i]);
+        else usage();
+    }
+    if (options.frames < 1 || options.width < 16 || options.height < 16 || options.frameMs <= 0.0 || samples < 1) {
+        usage();
+    }
+    bool allLevels = !strcmp(lodArg, "all");
+    int lod = -1;
+    if (!allLevels && strcmp(lodArg, "auto")) {
+        char *end;
+        lod = (int)strtol(lodArg, &end, 10);
+        if (*end != '\0' || lod < 0) usage();
+    }
+
+    if (poses) {
+        runPoses(samples);
+        return 0;
+    }
+
+    if (startup) {
+        printf("%d mesh load threads\n", QThreadPool::globalInstance()->maxThreadCount());
+        runStartup(options, true, false);
+        runStartup(options, false, false);
+        runStartup(options, true, true);
+        runStartup(options, false, true);
+        return 0;
+    }
+
+    SessionLogReader log;
+    if (options.replayPath != NULL && !log.open(options.replayPath)) {
+        fprintf(stderr, "%s: %s\n", options.replayPath, log.errorString().toLocal8Bit().constData());
+        return 1;
+    }
+
+    double memoryStart = residentMiB();
+
+    if (allLevels) {
+        // One scene per level; the first run also fills the decimation cache
+        KinematicChain probe;
+        probe.load(options.config);
+        int levels = probe.lodLevelCount();
+        printf("%-6s %12s %10s %10s %10s %10s %10s\n", "level", "triangles", "setup ms", "fps",
+               "avg ms", "p99 ms", "cpu ms");
+        bool belowMin = false;
+        for (int level = 0; level < levels; level++) {
+            BenchResult r = runBench(options, log, level);
+            printf("%-6d %12lld %10.1f %10.1f %10.3f %10.3f %10.3f\n", level, (long long)r.triangles,
+                   r.setupMs, r.fps, r.wallMs / options.frames, r.sortedMs[(int)(options.frames * 0.99)],
+                   r.cpuMs / options.frames);
+            belowMin = belowMin || (minFps > 0.0 && r.fps < minFps);
+        }
+        printf("memory:           %.1f MiB at start, %.1f MiB at end, peak %.1f MiB\n",
+               memoryStart, residentMiB(), peakResidentMiB());
+        if (belowMin) {
+            fprintf(stderr, "a level renders below --min-fps %.1f\n", minFps);
+            return 1;
+        }
+        return 0;
+    }
+
+    BenchResult r = runBench(options, log, lod);
+    int frames = options.frames;
+
+    printf("render window:    %s, %dx%d\n", r.windowClass.toLocal8Bit().constData(), options.width, options.height);
+    printf("scene:            %d joints, %d driven, %s\n", r.joints, r.driven,
+           options.replayPath != NULL ? options.replayPath : "synthetic motion");
+    if (lod >= 0) {
+        printf("level of detail:  %d, %lld triangles\n", lod, (long long)r.triangles);
+    } else {
+        printf("level of detail:  auto for %.1f ms frames, %lld triangles at full detail\n",
+               options.frameMs, (long long)r.triangles);
+    }
+    printf("setup:            %.1f ms\n", r.setupMs);
+    printf("frames:           %d, %llu poses applied\n", frames, (unsigned long long)r.posesApplied);
+    printf("frame rate:       %.1f fps\n", r.fps);
+    printf("frame wall time:  avg %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", r.wallMs / frames,
+           r.sortedMs[frames / 2], r.sortedMs[(int)(frames * 0.99)], r.sortedMs[frames - 1]);
+    printf("frame cpu time:   avg %.3f ms\n", r.cpuMs / frames);
+    printf("memory:           %.1f MiB at start, %.1f MiB after setup, %.1f MiB at end, peak %.1f MiB\n",
+           memoryStart, r.memorySetup, residentMiB(), peakResidentMiB());
+
+    if (minFps > 0.0 && r.fps < minFps) {
+        fprintf(stderr, "frame rate %.1f fps is below --min-fps %.1f\n", r.fps, minFps);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "ReplaySource.h"
+
+#include <QDebug>
+
+ReplaySource::ReplaySource(const QString &fileName, const QElapsedTimer *clock, SampleQueue *queue)
+    : fileName(fileName), clock(clock), queue(queue), parser(this), timer(0), speed(1.0), loop(false),
+      next(0), baseLogNs(0), baseClockNs(0), replayNs(0), position(0), duration(0), replayed(0), finished(0)
+{
+}
+
+ReplaySource::~ReplaySource()
+{
+    close();
+}
+
+void ReplaySource::open()
+{
+    if (!log.open(fileName)) {
+        qDebug() << "Could not replay" << fileName << log.errorString();
+        finished.store(1);
+        return;
+    }
+    duration.store(log.durationNs());
+    next = 0;
+    rebase(log.recordCount() > 0 ? log.record(0).hostNs : 0);
+
+    // Created here so the timer belongs to the replay thread
+    timer = new QTimer(this);
+    timer->setTimerType(Qt::PreciseTimer);
+    connect(timer, SIGNAL(timeout()), this, SLOT(tick()));
+    setSpeed(speed);
+}
+
+void ReplaySource::close()
+{
+    if (timer) {
+        timer->stop();
+        delete timer;
+        timer = 0;
+    }
+    log.close();
+}
+
+void ReplaySource::rebase(qint64 logNs)
+{
+    baseLogNs = logNs;
+    baseClockNs = clock->nsecsElapsed();
+}
+
+qint64 ReplaySource::logTime(qint64 clockNs) const
+{
+    return baseLogNs + (qint64)((clockNs - baseClockNs) * speed);
+}
+
+void ReplaySource::setSpeed(double speed)
+{
+    // Continue from where the old speed got to
+    if (this->speed > 0.0 && timer) {
+        rebase(logTime(clock->nsecsElapsed()));
+    } else if (next < log.recordCount()) {
+        rebase(log.record(next).hostNs);
+    }
+    this->speed = speed > 0.0 ? speed : 0.0;
+    if (timer) {
+        // A zero interval runs tick() whenever the event loop is idle
+        timer->start(this->speed > 0.0 ? 1 : 0);
+    }
+}
+
+void ReplaySource::seek(qint64 ns)
+{
+    if (!log.isOpen() || log.recordCount() == 0) {
+        return;
+    }
+    qint64 target = log.record(0).hostNs + qMax((qint64)0, ns);
+    next = log.findRecord(target);
+    rebase(target);
+    // Sequence numbers jump across a seek; start the loss count afresh
+    parser.reset();
+    finished.store(0);
+    if (timer && !timer->isActive()) {
+        timer->start(speed > 0.0 ? 1 : 0);
+    }
+}
+
+void ReplaySource::setLoop(bool loop)
+{
+    this->loop = loop;
+}
+
+void ReplaySource::tick()
+{
+    qint64 count = log.recordCount();
+    qint64 target = logTime(clock->nsecsElapsed());
+    for (int i = 0; i < MaxRecordsPerTick; i++) {
+        if (next >= count) {
+            if (!loop || count == 0) {
+                timer->stop();
+                finished.store(1);
+                break;
+            }
+            next = 0;
+            parser.reset();
+            rebase(log.record(0).hostNs);
+            target = baseLogNs;
+        }
+        const SessionRecord &record = log.record(next);
+        if (speed > 0.0 ? record.hostNs > target : queue->depth() >= queue->capacity()) {
+            break;
+        }
+        replay(record);
+        next++;
+    }
+    if (next < count) {
+        position.store(log.record(next).hostNs - log.record(0).hostNs);
+    } else {
+        position.store(duration.load());
+    }
+}
+
+void ReplaySource::replay(const SessionRecord &record)
+{
+    int16_t raw[QUAT_FRAME_RAW_COUNTS] = {
+        record.accel[0], record.accel[1], record.accel[2], record.gyro[0], record.gyro[1], record.gyro[2],
+        record.mag[0], record.mag[1], record.mag[2], record.temp
+    };
+    uint8_t type = (record.flags & SessionRecordRaw) ? QUAT_FRAME_RAW : QUAT_FRAME_FLOAT;
+    int length = quatFrameEncode(frame, type, record.board, record.seq, record.timestampUs, record.q, raw);
+    replayNs = clock->nsecsElapsed();
+    parser.feed(frame, length);
+}
+
+void ReplaySource::consumeSample(const QuatSample &sample)
+{
+    TimedSample timed;
+    timed.sample = sample;
+    timed.readNs = replayNs;
+    timed.queuedNs = clock->nsecsElapsed();
+    if (queue->push(timed)) {
+        latency.record(timed.queuedNs - timed.readNs);
+    }
+    replayed.fetchAndAddRelaxed(1);
+}
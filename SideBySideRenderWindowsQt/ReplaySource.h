@@ -0,0 +1,76 @@
+#ifndef ReplaySource_H
+#define ReplaySource_H
+
+#include <QString>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QAtomicInteger>
+
+#include "SampleSource.h"
+#include "SessionLog.h"
+
+// Plays a recorded session (SessionLog) into the sample queue in place of the serial
+// port, on the same kind of background thread. Each record is encoded back into its
+// QuatFrame and goes through a FrameParser, so a replay exercises the parsing path
+// as well as rendering, and the same file always produces the same sample sequence.
+//
+// Speed 1 replays at the recorded pace and 10 ten times faster, from the recorded
+// host time stamps. Speed 0 replays as fast as the GUI thread drains the queue and
+// never overfills it, so nothing is dropped and every run renders the same samples.
+class ReplaySource : public SampleSource, public QuatSampleSink
+{
+  Q_OBJECT
+public:
+  ReplaySource(const QString &fileName, const QElapsedTimer *clock, SampleQueue *queue);
+  ~ReplaySource();
+
+  virtual const FrameParserStats &parserStats() const { return parser.stats(); }
+  virtual const LatencyHistogram &producerLatency() const { return latency; }
+
+  // Safe from any thread
+  qint64 positionNs() const { return position.load(); }
+  qint64 durationNs() const { return duration.load(); }
+  quint64 replayedCount() const { return replayed.load(); }
+  bool atEnd() const { return finished.load() != 0; }
+
+public slots:
+  virtual void open();
+  virtual void close();
+  // Replay speed relative to the recording, 0 for as fast as possible
+  void setSpeed(double speed);
+  // Continue from the first record at this time after the start of the recording
+  void seek(qint64 ns);
+  void setLoop(bool loop);
+
+private slots:
+  void tick();
+
+private:
+  enum { MaxRecordsPerTick = 4096 };   // keeps seek() and close() responsive at speed 0
+
+  void rebase(qint64 logNs);
+  qint64 logTime(qint64 clockNs) const;
+  void replay(const SessionRecord &record);
+  virtual void consumeSample(const QuatSample &sample);
+
+  QString fileName;
+  const QElapsedTimer *clock;
+  SampleQueue *queue;
+  SessionLogReader log;
+  FrameParser parser;
+  QTimer *timer;
+  double speed;
+  bool loop;
+  qint64 next;            // next record to replay
+  qint64 baseLogNs;       // recorded time replayed at baseClockNs
+  qint64 baseClockNs;
+  qint64 replayNs;        // clock time the current frame was fed to the parser
+  uint8_t frame[QUAT_FRAME_MAX_SIZE];
+  LatencyHistogram latency;
+  QAtomicInteger<qint64> position;
+  QAtomicInteger<qint64> duration;
+  QAtomicInteger<quint64> replayed;
+  QAtomicInt finished;
+};
+
+#endif
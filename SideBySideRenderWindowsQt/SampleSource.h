@@ -0,0 +1,38 @@
+#ifndef SampleSource_H
+#define SampleSource_H
+
+#include <QObject>
+
+#include "FrameParser.h"
+#include "SpscRing.h"
+#include "LatencyHistogram.h"
+
+// A decoded sample stamped with the host time it was read from the port
+struct TimedSample
+{
+  QuatSample sample;
+  qint64 readNs;      // clock time when the bytes carrying it were read
+  qint64 queuedNs;    // clock time when it was pushed into the queue
+};
+
+typedef SpscRing<TimedSample, 1024> SampleQueue;
+
+// Producer of the samples the GUI thread drains: the serial port or a recorded
+// session. A source lives on its own thread, where open() and close() run, and
+// publishes into a SampleQueue.
+class SampleSource : public QObject
+{
+  Q_OBJECT
+public:
+  SampleSource(QObject *parent = 0) : QObject(parent) {}
+
+  virtual const FrameParserStats &parserStats() const = 0;
+  // Time from reading the bytes to publishing the decoded sample
+  virtual const LatencyHistogram &producerLatency() const = 0;
+
+public slots:
+  virtual void open() = 0;
+  virtual void close() = 0;
+};
+
+#endif
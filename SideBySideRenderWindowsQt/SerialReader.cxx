@@ -0,0 +1,146 @@
+#include "SerialReader.h"
+#include "SessionRecorder.h"
+
+#include <QDebug>
+#include <QtSerialPort/QSerialPortInfo>
+
+SerialReader::SerialReader(const QString &portName, const QElapsedTimer *clock, SampleQueue *queue)
+    : portName(portName), clock(clock), queue(queue), recorder(0), serialPort(0), parser(this), readNs(0),
+      link(*this), linkTimer(0), linkSettled(false)
+{
+}
+
+QString SerialReader::findPort()
+{
+    QList<QSerialPortInfo> ports = QSerialPortInfo::availablePorts();
+    foreach (const QSerialPortInfo &info, ports) {
+        if (info.hasVendorIdentifier() && info.vendorIdentifier() == 0x0d28) {
+            return info.portName();
+        }
+    }
+    foreach (const QSerialPortInfo &info, ports) {
+        if (info.description().contains("mbed", Qt::CaseInsensitive)) {
+            return info.portName();
+        }
+    }
+    return ports.isEmpty() ? QString() : ports.first().portName();
+}
+
+SerialReader::~SerialReader()
+{
+    close();
+}
+
+void SerialReader::open()
+{
+    if (portName.isEmpty()) {
+        portName = findPort();
+        qDebug() << "Using serial port" << portName;
+    }
+    // Created here so the port and its notifier belong to the reader thread
+    serialPort = new QSerialPort(portName, this);
+    serialPort->setBaudRate(QUAT_LINK_DEFAULT_BAUD);
+    if (!serialPort->open(QIODevice::ReadWrite)) {
+        qDebug() << "Could not open" << portName << serialPort->errorString();
+    }
+    serialPort->setDataBits(QSerialPort::Data8);
+    serialPort->setParity(QSerialPort::NoParity);
+    serialPort->setStopBits(QSerialPort::OneStop);
+    serialPort->setFlowControl(QSerialPort::NoFlowControl);
+    connect(serialPort, SIGNAL(readyRead()), this, SLOT(readData()));
+
+    // The negotiation runs on the reader thread too, between reads
+    linkTimer = new QTimer(this);
+    connect(linkTimer, SIGNAL(timeout()), this, SLOT(updateLink()));
+    linkTimer->start(20);
+    link.start((quint32)clock->elapsed(), parser.stats().frames, linkErrors());
+}
+
+void SerialReader::close()
+{
+    if (linkTimer) {
+        linkTimer->stop();
+        delete linkTimer;
+        linkTimer = 0;
+    }
+    if (serialPort) {
+        serialPort->close();
+        delete serialPort;
+        serialPort = 0;
+    }
+}
+
+void SerialReader::readData()
+{
+    readNs = clock->nsecsElapsed();
+    parser.readFrom(serialPort);
+    updateLink();
+}
+
+quint64 SerialReader::linkErrors() const
+{
+    const FrameParserStats &s = parser.stats();
+    return s.crcErrors + s.resyncs;
+}
+
+void SerialReader::updateLink()
+{
+    link.update((quint32)clock->elapsed(), parser.stats().frames, linkErrors());
+    if (link.settled() && !linkSettled) {
+        logTrials();
+    }
+    linkSettled = link.settled();
+}
+
+void SerialReader::logTrials()
+{
+    qDebug() << "Serial link settled at" << link.baud() << "baud";
+    for (int i = 0; i < QUAT_LINK_RATE_COUNT; i++) {
+        const LinkTrial &t = link.trials[i];
+        if (t.result == LINK_TRIAL_NONE && t.ms == 0) {
+            continue;
+        }
+        qDebug() << "  " << t.baud << "baud:" << t.framesPerSecond() << "samples/s,"
+                 << 100.0f * t.errorRate() << "% frame errors, result" << t.result;
+    }
+}
+
+QString SerialReader::linkStatus() const
+{
+    static const char *const phases[] = { "searching", "proposing", "switching", "trial", "committing",
+                                          "falling back", "" };
+    QString phase = phases[link.currentPhase()];
+    return QString("   %1 %2 baud%3").arg(portName).arg(link.baud()).arg(phase.isEmpty() ? phase : " " + phase);
+}
+
+void SerialReader::consumeLink(const QuatLink &quatLink)
+{
+    link.onLink(quatLink, (quint32)clock->elapsed());
+}
+
+void SerialReader::setBaud(quint32 baud)
+{
+    // Drop what arrived at the old rate; the parser resyncs on the rest
+    serialPort->setBaudRate((qint32)baud);
+    serialPort->clear(QSerialPort::Input);
+}
+
+void SerialReader::write(const uint8_t *data, int length)
+{
+    serialPort->write(reinterpret_cast<const char *>(data), length);
+}
+
+void SerialReader::consumeSample(const QuatSample &sample)
+{
+    if (recorder) {
+        recorder->append(sample, readNs);
+    }
+    TimedSample timed;
+    timed.sample = sample;
+    timed.readNs = readNs;
+    timed.queuedNs = clock->nsecsElapsed();
+    // Never block acquisition; a full queue is counted by the queue itself
+    if (queue->push(timed)) {
+        latency.record(timed.queuedNs - timed.readNs);
+    }
+}
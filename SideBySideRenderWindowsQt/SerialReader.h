@@ -0,0 +1,76 @@
+#ifndef SerialReader_H
+#define SerialReader_H
+
+#include <QString>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QtSerialPort/QSerialPort>
+
+#include "SampleSource.h"
+#include "LinkNegotiator.h"
+
+class SessionRecorder;
+
+// Owns the serial port and the frame parser on a background thread and publishes
+// decoded samples into a lock-free queue drained by the GUI thread, so render
+// stalls can no longer hold up serial reads.
+//
+// The port starts at the board's default rate and a LinkNegotiator (LinkNegotiator.h)
+// raises it to the fastest rate that carries the frames without errors, and lowers it
+// again when errors appear; each trial is logged with the samples per second it carried.
+class SerialReader : public SampleSource, public QuatSampleSink, public LinkPort
+{
+  Q_OBJECT
+public:
+  // clock must be started before the reader and shared with the consumer. An empty
+  // portName takes the port findPort() picks when the reader opens.
+  SerialReader(const QString &portName, const QElapsedTimer *clock, SampleQueue *queue);
+  ~SerialReader();
+
+  // The first mbed interface port (ARM vendor id 0x0d28), else the first port whose
+  // description names mbed, else the first port; empty when there is none
+  static QString findPort();
+
+  // Fastest rate to negotiate, QUAT_LINK_DEFAULT_BAUD keeps the default; set before open()
+  void setMaxBaud(quint32 baud) { link.maxBaud = baud; }
+  // Status bar text: the port, its rate and what the negotiation is doing
+  QString linkStatus() const;
+
+  // Every decoded sample is also offered to the recorder, before the queue can drop
+  // it; set before the reader thread starts
+  void setRecorder(SessionRecorder *recorder) { this->recorder = recorder; }
+
+  virtual const FrameParserStats &parserStats() const { return parser.stats(); }
+  virtual const LatencyHistogram &producerLatency() const { return latency; }
+
+public slots:
+  // Run in the reader thread, e.g. from QThread::started()
+  virtual void open();
+  virtual void close();
+
+private slots:
+  void readData();
+  void updateLink();
+
+private:
+  virtual void consumeSample(const QuatSample &sample);
+  virtual void consumeLink(const QuatLink &link);
+  virtual void setBaud(quint32 baud);
+  virtual void write(const uint8_t *data, int length);
+  quint64 linkErrors() const;
+  void logTrials();
+
+  QString portName;
+  const QElapsedTimer *clock;
+  SampleQueue *queue;
+  SessionRecorder *recorder;
+  QSerialPort *serialPort;
+  FrameParser parser;
+  qint64 readNs;
+  LatencyHistogram latency;
+  LinkNegotiator link;
+  QTimer *linkTimer;
+  bool linkSettled;          // negotiation settled when last checked
+};
+
+#endif
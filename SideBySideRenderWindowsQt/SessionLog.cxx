@@ -0,0 +1,174 @@
+#include "SessionLog.h"
+
+#include <string.h>
+
+void sessionRecordFromSample(const QuatSample &sample, qint64 hostNs, SessionRecord *record)
+{
+    memset(record, 0, sizeof(*record));
+    record->hostNs = hostNs;
+    record->timestampUs = sample.timestampUs;
+    record->seq = sample.seq;
+    record->board = sample.board;
+    record->flags = sample.hasRaw ? SessionRecordRaw : 0;
+    for (int i = 0; i < 4; i++) {
+        record->q[i] = sample.q[i];
+    }
+    if (sample.hasRaw) {
+        for (int i = 0; i < 3; i++) {
+            record->accel[i] = sample.raw[i];
+            record->gyro[i] = sample.raw[3 + i];
+            record->mag[i] = sample.raw[6 + i];
+        }
+        record->temp = sample.raw[9];
+    }
+}
+
+SessionLogReader::SessionLogReader()
+    : data(0), size(0), count(0), chunkStride(0)
+{
+}
+
+SessionLogReader::~SessionLogReader()
+{
+    close();
+}
+
+bool SessionLogReader::open(const QString &fileName)
+{
+    close();
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = file.errorString();
+        return false;
+    }
+    size = file.size();
+    if (size < (qint64)sizeof(SessionLogHeader)) {
+        error = "not a session log";
+        file.close();
+        return false;
+    }
+    data = file.map(0, size);
+    if (data == 0) {
+        error = file.errorString();
+        file.close();
+        return false;
+    }
+
+    const SessionLogHeader &h = header();
+    if (memcmp(h.magic, "QVTKLOG", 8) != 0) {
+        error = "not a session log";
+    } else if (h.byteOrder != SessionLogByteOrder) {
+        error = "session log written with the other byte order";
+    } else if (h.version != SessionLogVersion || h.headerSize != sizeof(SessionLogHeader) ||
+               h.chunkHeaderSize != sizeof(SessionChunkHeader) || h.recordSize != sizeof(SessionRecord) ||
+               h.chunkRecords == 0) {
+        error = QString("unsupported session log version %1").arg(h.version);
+    }
+    if (!error.isEmpty()) {
+        QString message = error;
+        close();
+        error = message;
+        return false;
+    }
+
+    chunkStride = (qint64)h.chunkHeaderSize + (qint64)h.chunkRecords * h.recordSize;
+    // A recording that did not stop cleanly has no count; every chunk was written
+    // in one piece, so counting the chunk headers recovers all complete chunks
+    qint64 chunks = countChunks();
+    qint64 found = 0;
+    if (chunks > 0) {
+        const SessionChunkHeader *last = chunk(chunks - 1);
+        found = last->firstRecord + last->count;
+    }
+    count = h.recordCount >= 0 ? qMin(h.recordCount, found) : found;
+    return true;
+}
+
+void SessionLogReader::close()
+{
+    if (data != 0) {
+        file.unmap(const_cast<uchar *>(data));
+        data = 0;
+    }
+    file.close();
+    size = 0;
+    count = 0;
+    chunkStride = 0;
+    error.clear();
+}
+
+const SessionChunkHeader *SessionLogReader::chunk(qint64 index) const
+{
+    return reinterpret_cast<const SessionChunkHeader *>(data + sizeof(SessionLogHeader) + index * chunkStride);
+}
+
+qint64 SessionLogReader::countChunks() const
+{
+    const SessionLogHeader &h = header();
+    qint64 chunks = 0;
+    qint64 offset = sizeof(SessionLogHeader);
+    while (offset + (qint64)sizeof(SessionChunkHeader) <= size) {
+        const SessionChunkHeader *c = chunk(chunks);
+        qint64 end = offset + sizeof(SessionChunkHeader) + (qint64)c->count * h.recordSize;
+        if (c->magic != SessionLogChunkMagic || c->count > h.chunkRecords ||
+            c->firstRecord != chunks * h.chunkRecords || end > size) {
+            break;
+        }
+        chunks++;
+        if (c->count < h.chunkRecords) {
+            break;      // only the last chunk is partial
+        }
+        offset += chunkStride;
+    }
+    return chunks;
+}
+
+const SessionRecord &SessionLogReader::record(qint64 index) const
+{
+    const SessionLogHeader &h = header();
+    qint64 chunkIndex = index / h.chunkRecords;
+    const uchar *records = reinterpret_cast<const uchar *>(chunk(chunkIndex)) + sizeof(SessionChunkHeader);
+    return *reinterpret_cast<const SessionRecord *>(records + (index % h.chunkRecords) * sizeof(SessionRecord));
+}
+
+qint64 SessionLogReader::chunkCount() const
+{
+    qint64 chunkRecords = header().chunkRecords;
+    return (count + chunkRecords - 1) / chunkRecords;
+}
+
+qint64 SessionLogReader::findRecord(qint64 hostNs) const
+{
+    if (count == 0) {
+        return 0;
+    }
+    // Last chunk starting at or before the time; the record may still be in the next one
+    qint64 low = 0, high = chunkCount() - 1;
+    while (low < high) {
+        qint64 mid = (low + high + 1) / 2;
+        if (chunk(mid)->firstHostNs <= hostNs) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    qint64 first = low * header().chunkRecords;
+    qint64 last = qMin(count, first + header().chunkRecords);
+    while (first < last) {
+        qint64 mid = (first + last) / 2;
+        if (record(mid).hostNs < hostNs) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    return first;
+}
+
+qint64 SessionLogReader::durationNs() const
+{
+    if (count == 0) {
+        return 0;
+    }
+    return record(count - 1).hostNs - record(0).hostNs;
+}
@@ -0,0 +1,112 @@
+#ifndef SessionLog_H
+#define SessionLog_H
+
+#include <QtGlobal>
+#include <QFile>
+#include <QString>
+
+#include "QuatFrame.h"
+
+// Recorded session file (.qlog), written by SessionRecorder.
+//
+//   file header     64 bytes
+//   chunk 0         64 byte chunk header, then chunkRecords records of 64 bytes
+//   chunk 1 ...     same; only the last chunk may hold fewer records
+//
+// Every chunk but the last has the same size, so record i is found by arithmetic
+// and the reader maps the file instead of parsing it. Fields are in host byte order;
+// byteOrder tells a reader on the other endianness that it cannot use the file.
+
+enum {
+  SessionLogVersion = 1,
+  SessionLogChunkRecords = 4096,      // 256 KiB of records per chunk
+  SessionLogByteOrder = 0x01020304,
+  SessionLogChunkMagic = 0x4B4E4843   // "CHNK"
+};
+
+struct SessionLogHeader
+{
+  char magic[8];                // "QVTKLOG" and a zero
+  quint32 version;
+  quint32 headerSize;           // sizeof(SessionLogHeader)
+  quint32 chunkHeaderSize;      // sizeof(SessionChunkHeader)
+  quint32 recordSize;           // sizeof(SessionRecord)
+  quint32 chunkRecords;         // records in a full chunk
+  quint32 byteOrder;            // SessionLogByteOrder as the writer stored it
+  qint64 startMsecsSinceEpoch;  // wall clock time of the first record
+  qint64 recordCount;           // set when recording stops, -1 while it runs
+  quint8 reserved[16];
+};
+
+struct SessionChunkHeader
+{
+  quint32 magic;                // SessionLogChunkMagic
+  quint32 count;                // records in this chunk
+  qint64 firstRecord;           // index of its first record in the session
+  qint64 firstHostNs;
+  qint64 lastHostNs;
+  quint8 reserved[32];
+};
+
+enum { SessionRecordRaw = 0x01 };   // the raw counts are valid
+
+struct SessionRecord
+{
+  qint64 hostNs;                // host time the sample was read, from the start of the recording
+  quint32 timestampUs;          // board time stamp of the frame
+  quint16 seq;
+  quint8 board;
+  quint8 flags;                 // SessionRecordRaw
+  float q[4];                   // qw, qx, qy, qz
+  qint16 accel[3];              // accelCount, gyroCount, magCount and tempCount of MPU9250.h
+  qint16 gyro[3];
+  qint16 mag[3];
+  qint16 temp;
+  quint8 reserved[12];
+};
+
+Q_STATIC_ASSERT(sizeof(SessionLogHeader) == 64);
+Q_STATIC_ASSERT(sizeof(SessionChunkHeader) == 64);
+Q_STATIC_ASSERT(sizeof(SessionRecord) == 64);
+
+// Fill a record from a decoded sample
+void sessionRecordFromSample(const QuatSample &sample, qint64 hostNs, SessionRecord *record);
+
+// Random access to a recorded session through a read-only memory map of the file.
+// Records are returned in place, so they stay valid until close().
+class SessionLogReader
+{
+public:
+  SessionLogReader();
+  ~SessionLogReader();
+
+  bool open(const QString &fileName);
+  void close();
+  bool isOpen() const { return data != 0; }
+  QString errorString() const { return error; }
+
+  const SessionLogHeader &header() const { return *reinterpret_cast<const SessionLogHeader *>(data); }
+  qint64 recordCount() const { return count; }
+  const SessionRecord &record(qint64 index) const;
+
+  // Recording time from the first to the last record
+  qint64 durationNs() const;
+  // First record with hostNs >= the given time, recordCount() when there is none.
+  // The chunk headers are the index: a binary search over them picks the chunk and
+  // a second one runs inside it, so a seek touches a few pages of a large file.
+  qint64 findRecord(qint64 hostNs) const;
+
+private:
+  const SessionChunkHeader *chunk(qint64 index) const;
+  qint64 countChunks() const;
+  qint64 chunkCount() const;
+
+  QFile file;
+  const uchar *data;
+  qint64 size;
+  qint64 count;
+  qint64 chunkStride;     // bytes from one chunk header to the next
+  QString error;
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include "SessionRecorder.h"
+
+#include <QDateTime>
+#include <QMutexLocker>
+
+#include <stddef.h>
+#include <string.h>
+
+SessionRecorder::SessionRecorder(const QElapsedTimer *clock, QObject *parent)
+    : QThread(parent), clock(clock), recording(false), stopping(false), originNs(0),
+      records(0), dropped(0), written(0), current(0)
+{
+    // Allocated once; recording never allocates
+    pool.resize(PoolChunks);
+    for (int i = 0; i < pool.size(); i++) {
+        pool[i].data.resize(sizeof(SessionChunkHeader) + SessionLogChunkRecords * sizeof(SessionRecord));
+        pool[i].count = 0;
+    }
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    close();
+}
+
+bool SessionRecorder::open(const QString &fileName)
+{
+    close();
+
+    QMutexLocker locker(&lock);
+    error.clear();
+    file.setFileName(fileName);
+    // Chunks are already large, the QFile buffer would only add a copy
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered)) {
+        error = file.errorString();
+        return false;
+    }
+
+    SessionLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "QVTKLOG", 8);
+    header.version = SessionLogVersion;
+    header.headerSize = sizeof(SessionLogHeader);
+    header.chunkHeaderSize = sizeof(SessionChunkHeader);
+    header.recordSize = sizeof(SessionRecord);
+    header.chunkRecords = SessionLogChunkRecords;
+    header.byteOrder = SessionLogByteOrder;
+    header.startMsecsSinceEpoch = QDateTime::currentMSecsSinceEpoch();
+    header.recordCount = -1;
+    if (file.write(reinterpret_cast<const char *>(&header), sizeof(header)) != sizeof(header)) {
+        error = file.errorString();
+        file.close();
+        return false;
+    }
+
+    freeChunks.clear();
+    fullChunks.clear();
+    for (int i = 0; i < pool.size(); i++) {
+        freeChunks.append(&pool[i]);
+    }
+    current = 0;
+    originNs = clock->nsecsElapsed();
+    records = dropped = 0;
+    written = sizeof(header);
+    stopping = false;
+    recording = true;
+    locker.unlock();
+
+    start(QThread::LowPriority);
+    return true;
+}
+
+void SessionRecorder::close()
+{
+    {
+        QMutexLocker locker(&lock);
+        if (!recording) {
+            return;
+        }
+        recording = false;
+        if (current != 0 && current->count > 0) {
+            queueCurrent();
+        }
+        stopping = true;
+        chunksQueued.wakeAll();
+    }
+    wait();
+
+    // The writer is gone; store the final count, which also marks a clean stop
+    qint64 count = records - dropped;
+    if (file.seek(offsetof(SessionLogHeader, recordCount))) {
+        file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    }
+    file.close();
+}
+
+bool SessionRecorder::isRecording() const
+{
+    QMutexLocker locker(&lock);
+    return recording;
+}
+
+QString SessionRecorder::fileName() const
+{
+    QMutexLocker locker(&lock);
+    return file.fileName();
+}
+
+QString SessionRecorder::errorString() const
+{
+    QMutexLocker locker(&lock);
+    return error;
+}
+
+SessionRecorderStats SessionRecorder::stats() const
+{
+    QMutexLocker locker(&lock);
+    SessionRecorderStats s;
+    s.recording = recording;
+    s.records = records;
+    s.bytesWritten = written;
+    s.droppedRecords = dropped;
+    s.queuedChunks = fullChunks.size();
+    return s;
+}
+
+SessionRecorder::Chunk *SessionRecorder::takeFreeChunk()
+{
+    if (freeChunks.isEmpty()) {
+        return 0;
+    }
+    Chunk *chunk = freeChunks.last();
+    freeChunks.removeLast();
+    chunk->count = 0;
+    return chunk;
+}
+
+void SessionRecorder::queueCurrent()
+{
+    fullChunks.append(current);
+    current = 0;
+    chunksQueued.wakeOne();
+}
+
+void SessionRecorder::append(const QuatSample &sample, qint64 hostNs)
+{
+    QMutexLocker locker(&lock);
+    if (!recording) {
+        return;
+    }
+    records++;
+    if (current == 0 && (current = takeFreeChunk()) == 0) {
+        dropped++;
+        return;
+    }
+
+    SessionRecord *slot = reinterpret_cast<SessionRecord *>(current->data.data() + sizeof(SessionChunkHeader)) + current->count;
+    sessionRecordFromSample(sample, hostNs - originNs, slot);
+    current->count++;
+    if (current->count == SessionLogChunkRecords) {
+        queueCurrent();
+    }
+}
+
+void SessionRecorder::run()
+{
+    // Index of the next record on disk; dropped records leave no gap in the file
+    qint64 firstRecord = 0;
+
+    QMutexLocker locker(&lock);
+    while (true) {
+        while (fullChunks.isEmpty() && !stopping) {
+            chunksQueued.wait(&lock);
+        }
+        if (fullChunks.isEmpty()) {
+            break;
+        }
+        Chunk *chunk = fullChunks.first();
+        fullChunks.remove(0);
+        locker.unlock();
+
+        const SessionRecord *first = reinterpret_cast<const SessionRecord *>(chunk->data.constData() + sizeof(SessionChunkHeader));
+        SessionChunkHeader *header = reinterpret_cast<SessionChunkHeader *>(chunk->data.data());
+        memset(header, 0, sizeof(*header));
+        header->magic = SessionLogChunkMagic;
+        header->count = chunk->count;
+        header->firstRecord = firstRecord;
+        header->firstHostNs = first[0].hostNs;
+        header->lastHostNs = first[chunk->count - 1].hostNs;
+        firstRecord += chunk->count;
+
+        qint64 length = sizeof(SessionChunkHeader) + (qint64)chunk->count * sizeof(SessionRecord);
+        qint64 done = file.write(chunk->data.constData(), length);
+
+        locker.relock();
+        if (done != length && error.isEmpty()) {
+            error = file.errorString();
+        }
+        if (done > 0) {
+            written += done;
+        }
+        freeChunks.append(chunk);
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef SessionRecorder_H
+#define SessionRecorder_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QString>
+#include <QVector>
+
+#include "SessionLog.h"
+
+struct SessionRecorderStats
+{
+  bool recording;
+  qint64 records;         // records appended in this recording
+  qint64 bytesWritten;    // bytes on disk so far
+  qint64 droppedRecords;  // records lost because every chunk buffer was waiting for the disk
+  int queuedChunks;       // full chunks not written yet
+};
+
+// Records decoded samples into a SessionLog file without blocking the caller.
+// append() only copies the record into the current chunk buffer; full chunks go to
+// a writer thread, which stores each with one large unbuffered write. The buffers
+// come from a fixed pool, so when the disk falls behind by the whole pool new
+// records are dropped and counted rather than stalling the serial reader.
+class SessionRecorder : public QThread
+{
+  Q_OBJECT
+public:
+  enum { PoolChunks = 16 };   // 4 MiB of records in flight at most
+
+  // clock is the one the hostNs passed to append() come from
+  SessionRecorder(const QElapsedTimer *clock, QObject *parent = 0);
+  ~SessionRecorder();
+
+  // Create the file and start recording; false with errorString() on failure
+  bool open(const QString &fileName);
+  // Flush everything, finish the header and close the file
+  void close();
+  bool isRecording() const;
+  QString fileName() const;
+  QString errorString() const;
+  SessionRecorderStats stats() const;
+
+  // Any thread; does nothing while not recording
+  void append(const QuatSample &sample, qint64 hostNs);
+
+protected:
+  virtual void run();
+
+private:
+  struct Chunk
+  {
+    QByteArray data;      // chunk header and SessionLogChunkRecords records
+    int count;
+  };
+
+  Chunk *takeFreeChunk();
+  void queueCurrent();
+
+  const QElapsedTimer *clock;
+  mutable QMutex lock;
+  QWaitCondition chunksQueued;
+  QFile file;
+  QString error;
+  bool recording;
+  bool stopping;
+  qint64 originNs;        // clock time of the first record
+  qint64 records;
+  qint64 dropped;
+  qint64 written;
+  QVector<Chunk> pool;
+  QVector<Chunk *> freeChunks;
+  QVector<Chunk *> fullChunks;  // written in order
+  Chunk *current;
+};
+
+#endif
@@ -1,10 +1,16 @@
 #include "SideBySideRenderWindowsQt.h"
 
+#include <vtkRenderWindowInteractor.h>
+
 #include <QtSerialPort/QSerialPortInfo>
 #include <QTextStream>
 #include <QStringList>
 #include <QDebug>
 #include <QThread>
+#include <QStatusBar>
+#include <QAction>
+#include <QDateTime>
+#include <QCoreApplication>
 //#include <unistd.h>
 
 #include <iostream>
@@ -12,216 +18,259 @@ using namespace std;
 
 // Constructor
 
-const double SideBySideRenderWindowsQt::translation1[3] = {0.0,65,0.0};
-const double SideBySideRenderWindowsQt::translation2[3] = {0.0,69.803599,0.0};
-const double SideBySideRenderWindowsQt::translation3[3] = {0.267949,91.428531};
-
 SideBySideRenderWindowsQt::SideBySideRenderWindowsQt() 
 {
 
     this->setupUi(this);
     count = 0;
-    serialPort1 = new QSerialPort("Com3");
-    //serialPort1 = new QSerialPort("/dev/ttyACM1");
-    //serialPort1 = new QSerialPort("/dev/tty.usbmodem1412");
-    serialPort1->setBaudRate(QSerialPort::Baud9600);
-    serialPort1->open(QIODevice::ReadWrite);
-    serialPort1->setDataBits(QSerialPort::Data8);
-    serialPort1->setParity(QSerialPort::NoParity);
-    serialPort1->setStopBits(QSerialPort::OneStop);
-    serialPort1->setFlowControl(QSerialPort::NoFlowControl);
-    connect(serialPort1, SIGNAL(readyRead()), this, SLOT(readData()));
-    qw = 1;
-    qx = 0;
-    qy = 0;
-    qz = 0;
-
-    // Read stl
-    for (int i=0; i<4; i++ ){
-        reader[i] = vtkSmartPointer<vtkSTLReader>::New();
-    }
-
-    reader[0]->SetFileName("stl/Base_Joint.STL");
-    reader[1]->SetFileName("stl/Joint1.STL");
-    reader[2]->SetFileName("stl/Joint2.STL");
-    reader[3]->SetFileName("stl/Joint3.STL");
 
-    //Mapper
-    for (int i=0; i<4; i++){
-        mapper[i] = vtkSmartPointer<vtkPolyDataMapper>::New();
-        mapper[i] -> SetInputConnection(reader[i]->GetOutputPort());
-    }
-
-    //Actor
-    for (int i=0; i<4; i++){
-        actor[i] = vtkSmartPointer<vtkActor>::New();
-        actor[i] -> SetMapper(mapper[i]);
+    // The port is owned and read by SerialReader on its own thread. With
+    //   --replay FILE [--speed X] [--seek SECONDS] [--loop]
+    // a recorded session plays through ReplaySource instead; speed 0 is as fast as possible
+    clock.start();
+    recorder = new SessionRecorder(&clock, this);
+    serialReader = 0;
+    replaySource = 0;
+    QStringList args = QCoreApplication::arguments();
+    int replayArg = args.indexOf("--replay");
+    if (replayArg > 0 && replayArg + 1 < args.size()) {
+        replaySource = new ReplaySource(args[replayArg + 1], &clock, &sampleQueue);
+        int speedArg = args.indexOf("--speed");
+        if (speedArg > 0 && speedArg + 1 < args.size()) {
+            replaySource->setSpeed(args[speedArg + 1].toDouble());
+        }
+        int seekArg = args.indexOf("--seek");
+        if (seekArg > 0 && seekArg + 1 < args.size()) {
+            // Queued, so it runs on the replay thread once open() has loaded the file
+            QMetaObject::invokeMethod(replaySource, "seek", Qt::QueuedConnection,
+                                      Q_ARG(qint64, (qint64)(args[seekArg + 1].toDouble() * 1e9)));
+        }
+        replaySource->setLoop(args.contains("--loop"));
+        source = replaySource;
+    } else {
+        // --port COM3, /dev/ttyACM1, ...; without it the reader looks for the mbed's port
+        int portArg = args.indexOf("--port");
+        QString portName = portArg > 0 && portArg + 1 < args.size() ? args[portArg + 1] : QString();
+        serialReader = new SerialReader(portName, &clock, &sampleQueue);
+        int baudArg = args.indexOf("--max-baud");
+        if (baudArg > 0 && baudArg + 1 < args.size()) {
+            serialReader->setMaxBaud(args[baudArg + 1].toUInt());
+        }
+        serialReader->setRecorder(recorder);
+        source = serialReader;
     }
-
-    //Changing Colors
-    actor[1]-> GetProperty()->SetColor(0.0,220./255,225./255);
-    actor[3]-> GetProperty()->SetColor(0.0,220./255,225./255);
+    source->moveToThread(&readerThread);
+    connect(&readerThread, SIGNAL(started()), source, SLOT(open()));
+    connect(&readerThread, SIGNAL(finished()), source, SLOT(deleteLater()));
+    readerThread.start(QThread::HighPriority);
 
     //Base Axes
     baseAxes = vtkSmartPointer<vtkAxesActor>::New();
     // Set coordinate axes rendering
     baseAxes->SetTotalLength(40,40,40);
 
-    //Transformations
-    transform[0] = vtkSmartPointer<vtkTransform>::New();
-    actor[0]->SetUserTransform(transform[0]);
-
-    for (int i=1; i<4; i++){
-        transform[i] = vtkSmartPointer<vtkTransform>::New();
-        transform[i]->SetInput(transform[i-1]);
-        actor[i]->SetUserTransform(transform[i]);
-    }
-
     leftRenderer = vtkSmartPointer<vtkRenderer>::New();
     rightRenderer = vtkSmartPointer<vtkRenderer>::New();
 
-    for (int i=0; i<4 ; i++){
-        leftRenderer->AddActor(actor[i]);
-    }
+    // Build the chained joint transforms; the meshes load on a thread pool and join
+    // the scene as they arrive (drainSamples), so the window does not wait for them
+    chain.load("joints.ini");
+    chain.buildAsync(leftRenderer);
+    firstFrameNs = fullSceneNs = -1;
 
     leftRenderer->AddActor(baseAxes);
     leftRenderer->SetBackground(1.0, 1.0, 1.0);
 
-    transform[2]-> Translate(translation2);
-    transform[3]-> Translate(translation3);
-
-    //double element00 = 1 - (2*(qy*qy)) - (2*(qz*qz));
-    double element00 = (qw*qw) + (qx*qx) - (qy*qy) - (qz*qz);
-    double element01 = (2 * qx * qy) - (2*qz*qw);
-    double element02 = (2*qx*qz) + (2*qy*qw);
-    double element03 = translation1[0];
-
-    double element10 = (2*qx*qy) + (2*qz*qw);
-    //double element11 = (1-(2*qx*qx)-(2*qz*qz));
-    double element11 = (qw*qw) - (qx*qx) + (qy*qy) - (qz*qz);
-    double element12 = (2*qy*qz) - (2*qx*qw);
-    double element13 = translation1[1];
-
-    double element20 = (2*qx*qz) - (2*qy*qw);
-    double element21 = (2*qy*qz) + (2*qx*qw);
-    //double element22 = 1 - (2*qx*qx) - (2*qy*qy);
-    double element22 = (qw*qw) - (qx*qx) - (qy*qy) + (qz*qz);
-    double element23 = translation1[2];
-
-    double element30 = 0;
-    double element31 = 0;
-    double element32 = 0;
-    double element33 = 1;
-
-    matrix = vtkSmartPointer<vtkMatrix4x4>::New();
-    matrix->SetElement(0,0,element00);
-    matrix->SetElement(0,1,element01);
-    matrix->SetElement(0,2,element02);
-    matrix->SetElement(0,3,element03);
-
-    matrix->SetElement(1,0,element10);
-    matrix->SetElement(1,1,element11);
-    matrix->SetElement(1,2,element12);
-    matrix->SetElement(1,3,element13);
-
-    matrix->SetElement(2,0,element20);
-    matrix->SetElement(2,1,element21);
-    matrix->SetElement(2,2,element22);
-    matrix->SetElement(2,3,element23);
-
-    matrix->SetElement(3,0,element30);
-    matrix->SetElement(3,1,element31);
-    matrix->SetElement(3,2,element32);
-    matrix->SetElement(3,3,element33);
-
-    transform[1]->SetMatrix(matrix);
-
     // VTK/Qt wedded
     this->qvtkWidgetLeft->GetRenderWindow()->AddRenderer(leftRenderer);
     this->qvtkWidgetRight->GetRenderWindow()->AddRenderer(rightRenderer);
 
+    // Render at most 60 times per second no matter how fast samples arrive
+    scheduler = new FrameScheduler(this->qvtkWidgetLeft->GetRenderWindow(), this);
+    connect(scheduler, SIGNAL(collectPoses()), this, SLOT(drainSamples()));
+    connect(scheduler, SIGNAL(frameDue()), this, SLOT(updateModel()));
+    lastStats = scheduler->stats();
+    scheduler->requestFrame();
+
+    // Live plots of every board in the right window, redrawn on their own timer
+    telemetry = new TelemetryView(this->qvtkWidgetRight->GetRenderWindow(), rightRenderer, &clock, this);
+    lastTelemetry = telemetry->stats();
+    // The interactor resets the update rate to its still rate after every camera move,
+    // which would bring back the full meshes whatever they cost
+    if (this->qvtkWidgetLeft->GetRenderWindow()->GetInteractor()) {
+        this->qvtkWidgetLeft->GetRenderWindow()->GetInteractor()->SetStillUpdateRate(scheduler->maxFrameRate());
+        this->qvtkWidgetLeft->GetRenderWindow()->GetInteractor()->SetDesiredUpdateRate(scheduler->maxFrameRate());
+    }
+
+    statsTimer = new QTimer(this);
+    connect(statsTimer, SIGNAL(timeout()), this, SLOT(showStats()));
+    statsTimer->start(1000);
+
+    QAction *recordAction = new QAction("Record", this);
+    recordAction->setShortcut(QKeySequence("Ctrl+R"));
+    connect(recordAction, SIGNAL(triggered()), this, SLOT(toggleRecording()));
+    addAction(recordAction);
+
+    if (replaySource) {
+        QAction *forwardAction = new QAction("Forward", this);
+        forwardAction->setShortcut(QKeySequence(Qt::Key_Right));
+        connect(forwardAction, SIGNAL(triggered()), this, SLOT(seekForward()));
+        addAction(forwardAction);
+        QAction *backAction = new QAction("Back", this);
+        backAction->setShortcut(QKeySequence(Qt::Key_Left));
+        connect(backAction, SIGNAL(triggered()), this, SLOT(seekBackward()));
+        addAction(backAction);
+    }
+
     // Set up action signals and slots
     // connect(this->actionExit, SIGNAL(triggered()), this, SLOT(slotExit()));
 }
 
 void SideBySideRenderWindowsQt::updateModel(){
 
-    double element00 = (qw*qw) + (qx*qx) - (qy*qy) - (qz*qz);
-    double element01 = (2 * qx * qy) - (2*qz*qw);
-    double element02 = (2*qx*qz) + (2*qy*qw);
-    double element03 = translation1[0];
-
-    double element10 = (2*qx*qy) + (2*qz*qw);
-    double element11 = (qw*qw) - (qx*qx) + (qy*qy) - (qz*qz);
-    double element12 = (2*qy*qz) - (2*qx*qw);
-    double element13 = translation1[1];
-
-    double element20 = (2*qx*qz) - (2*qy*qw);
-    double element21 = (2*qy*qz) + (2*qx*qw);
-    double element22 = (qw*qw) - (qx*qx) - (qy*qy) + (qz*qz);
-    double element23 = translation1[2];
-
-    double element30 = 0;
-    double element31 = 0;
-    double element32 = 0;
-    double element33 = 1;
-
-    vtkSmartPointer<vtkMatrix4x4> matrix = vtkSmartPointer<vtkMatrix4x4>::New();
-    matrix->SetElement(0,0,element00);
-    matrix->SetElement(0,1,element01);
-    matrix->SetElement(0,2,element02);
-    matrix->SetElement(0,3,element03);
-
-    matrix->SetElement(1,0,element10);
-    matrix->SetElement(1,1,element11);
-    matrix->SetElement(1,2,element12);
-    matrix->SetElement(1,3,element13);
-
-    matrix->SetElement(2,0,element20);
-    matrix->SetElement(2,1,element21);
-    matrix->SetElement(2,2,element22);
-    matrix->SetElement(2,3,element23);
-
-    matrix->SetElement(3,0,element30);
-    matrix->SetElement(3,1,element31);
-    matrix->SetElement(3,2,element32);
-    matrix->SetElement(3,3,element33);
-    transform[1]->Identity();
-    transform[1]->SetMatrix(matrix);
-    this->qvtkWidgetLeft->GetRenderWindow()->Render();
-    //this->qvtkWidgetLeft->GetRenderWindow()->Modified();
-    // this->qvtkWidgetRight->GetRenderWindow()->AddRenderer(rightRenderer);
+    if (firstFrameNs < 0) {
+        firstFrameNs = clock.nsecsElapsed();
+        qDebug() << "First frame after" << firstFrameNs / 1e6 << "ms";
+    }
 
+    // Apply every joint that got a new pose since the last frame; one Render() follows
+    double q[4];
+    for (int i = 0; i < chain.jointCount(); i++) {
+        if (scheduler->takePose(i, q)) {
+            chain.applyPose(i, q);
+        }
+    }
 }
 
-void SideBySideRenderWindowsQt::readData()
+SideBySideRenderWindowsQt::~SideBySideRenderWindowsQt()
 {
-    QStringList receivedBufferSplit = receivedBuffer.split(",");
-    if(receivedBufferSplit.length() < 10){
-        receivedData = serialPort1->readAll();
-        receivedBuffer += QString :: fromStdString(receivedData.toStdString());
-    }else{
-        for(int i = 1 ; i < receivedBufferSplit.length()-2;i++){
-            if(receivedBufferSplit[i-1]=="qw" && receivedBufferSplit[i+1]=="qx"){
-                qw = receivedBufferSplit[i].toDouble();
-            }
-            if(receivedBufferSplit[i-1]=="qx" && receivedBufferSplit[i+1]=="qy"){
-                qx = receivedBufferSplit[i].toDouble();
-            }
-            if(receivedBufferSplit[i-1]=="qy" && receivedBufferSplit[i+1]=="qz"){
-                qy = receivedBufferSplit[i].toDouble();
-            }
-            if(receivedBufferSplit[i-1]=="qz" && receivedBufferSplit[i+1]=="qw"){
-                qz = receivedBufferSplit[i].toDouble();
-            }
-            qDebug()<<"received"<<receivedBufferSplit;
-            qDebug()<<qw;
-            qDebug()<<qx;
-            qDebug()<<qy;
-            qDebug()<<qz;
-            receivedBuffer = "";
+    readerThread.quit();
+    readerThread.wait();
+    recorder->close();
+}
+
+void SideBySideRenderWindowsQt::drainSamples()
+{
+    if (chain.pendingMeshes() > 0 && chain.attachLoadedMeshes() > 0) {
+        // Frame the arm again as it grows, and show the new meshes even without samples
+        leftRenderer->ResetCamera();
+        scheduler->requestFrame();
+        if (chain.pendingMeshes() == 0) {
+            fullSceneNs = clock.nsecsElapsed();
+            qDebug() << "Full scene after" << fullSceneNs / 1e6 << "ms";
         }
-        updateModel();
+    }
+
+    TimedSample timed;
+    while (sampleQueue.pop(timed)) {
+        qint64 now = clock.nsecsElapsed();
+        consumerLatency.record(now - timed.queuedNs);
+        telemetry->addSample(timed.sample, timed.readNs, now);
+        int joint = chain.jointForBoard(timed.sample.board);
+        if (joint < 0) {
+            continue;
+        }
+        double q[4] = { timed.sample.q[0], timed.sample.q[1], timed.sample.q[2], timed.sample.q[3] };
+        scheduler->submitPose(joint, q);
+    }
+}
+
+void SideBySideRenderWindowsQt::showStats()
+{
+    const FrameSchedulerStats &s = scheduler->stats();
+    statusBar()->showMessage(QString("%1 fps   %2 samples/s   %3 coalesced/s   frame %4 ms avg, %5 ms max   "
+                                     "queue %6 (max %7, dropped %8)   parse p99 %9 us   queue p99 %10 us")
+                             .arg(s.frames - lastStats.frames)
+                             .arg(s.samples - lastStats.samples)
+                             .arg(s.coalesced - lastStats.coalesced)
+                             .arg(s.avgFrameMs, 0, 'f', 2)
+                             .arg(s.maxFrameMs, 0, 'f', 2)
+                             .arg(sampleQueue.depth())
+                             .arg(sampleQueue.maxDepth())
+                             .arg(sampleQueue.droppedCount())
+                             .arg(source->producerLatency().percentileUs(99))
+                             .arg(consumerLatency.percentileUs(99))
+                             + replayStatus()
+                             + recordingStatus()
+                             + loadingStatus()
+                             + telemetryStatus()
+                             + (serialReader ? serialReader->linkStatus() : QString()));
+    lastStats = s;
+    lastTelemetry = telemetry->stats();
+}
+
+QString SideBySideRenderWindowsQt::telemetryStatus() const
+{
+    const TelemetryViewStats &t = telemetry->stats();
+    return QString("   plots %1/s, %2 ms avg, %3 ms max")
+        .arg(t.draws - lastTelemetry.draws)
+        .arg(t.avgDrawMs, 0, 'f', 2)
+        .arg(t.maxDrawMs, 0, 'f', 2);
+}
+
+QString SideBySideRenderWindowsQt::loadingStatus() const
+{
+    if (chain.pendingMeshes() > 0) {
+        return QString("   loading %1 of %2 meshes").arg(chain.pendingMeshes()).arg(chain.jointCount());
+    }
+    if (fullSceneNs >= 0 && clock.nsecsElapsed() - fullSceneNs < 5000000000LL) {
+        return QString("   scene loaded in %1 ms, first frame at %2 ms")
+            .arg(fullSceneNs / 1e6, 0, 'f', 0)
+            .arg(firstFrameNs / 1e6, 0, 'f', 0);
+    }
+    return QString();
+}
+
+QString SideBySideRenderWindowsQt::replayStatus() const
+{
+    if (!replaySource) {
+        return QString();
+    }
+    return QString("   replay %1 / %2 s, %3 samples%4")
+        .arg(replaySource->positionNs() / 1e9, 0, 'f', 1)
+        .arg(replaySource->durationNs() / 1e9, 0, 'f', 1)
+        .arg(replaySource->replayedCount())
+        .arg(replaySource->atEnd() ? ", done" : "");
+}
+
+void SideBySideRenderWindowsQt::seekForward()
+{
+    QMetaObject::invokeMethod(replaySource, "seek", Qt::QueuedConnection,
+                              Q_ARG(qint64, replaySource->positionNs() + 10000000000LL));
+}
+
+void SideBySideRenderWindowsQt::seekBackward()
+{
+    QMetaObject::invokeMethod(replaySource, "seek", Qt::QueuedConnection,
+                              Q_ARG(qint64, replaySource->positionNs() - 10000000000LL));
+}
+
+QString SideBySideRenderWindowsQt::recordingStatus() const
+{
+    SessionRecorderStats r = recorder->stats();
+    QString error = recorder->errorString();
+    if (!error.isEmpty()) {
+        return QString("   recording failed: %1").arg(error);
+    }
+    if (!r.recording) {
+        return QString();
+    }
+    return QString("   rec %1: %2 records, %3 MB, %4 dropped")
+        .arg(recorder->fileName())
+        .arg(r.records)
+        .arg(r.bytesWritten / 1048576.0, 0, 'f', 1)
+        .arg(r.droppedRecords);
+}
+
+void SideBySideRenderWindowsQt::toggleRecording()
+{
+    if (recorder->isRecording()) {
+        recorder->close();
+        return;
+    }
+    QString name = QDateTime::currentDateTime().toString("'session-'yyyyMMdd-hhmmss'.qlog'");
+    if (!recorder->open(name)) {
+        qDebug() << "Could not record to" << name << recorder->errorString();
     }
 }
 
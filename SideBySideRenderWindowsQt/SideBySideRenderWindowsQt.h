@@ -17,9 +17,17 @@
 #include <vtkTransform.h>
 #include <vtkMatrix4x4.h>
 #include <QMainWindow>
-#include <QtSerialPort/QSerialPort>
+#include <QThread>
+#include <QElapsedTimer>
 
 #include "ui_SideBySideRenderWindowsQt.h"
+#include "QuatFrame.h"
+#include "FrameScheduler.h"
+#include "SerialReader.h"
+#include "ReplaySource.h"
+#include "KinematicChain.h"
+#include "SessionRecorder.h"
+#include "TelemetryView.h"
 
 class SideBySideRenderWindowsQt : public QMainWindow, private Ui::SideBySideRenderWindowsQt
 {
@@ -28,37 +36,48 @@ public:
 
   // Constructor/Destructor
   SideBySideRenderWindowsQt(); 
-  ~SideBySideRenderWindowsQt() {};
+  ~SideBySideRenderWindowsQt();
   int count;
-  double qw;
-  double qx;
-  double qy;
-  double qz;
-  static const double translation1[3];
-  static const double translation2[3];
-  static const double translation3[3];
 
-  vtkSmartPointer<vtkSTLReader> reader [4];
-  vtkSmartPointer<vtkPolyDataMapper> mapper [4];
-  vtkSmartPointer<vtkActor> actor [4];
+  // Joints, meshes and board mapping come from joints.ini
+  KinematicChain chain;
   vtkSmartPointer<vtkAxesActor> baseAxes;
-  vtkSmartPointer<vtkTransform> transform[4];
-  vtkSmartPointer<vtkMatrix4x4> matrix;
 
   //Left Renderer
   vtkSmartPointer<vtkRenderer> leftRenderer;
-  //Right Renderer
+  //Right Renderer, live plots of the boards
   vtkSmartPointer<vtkRenderer> rightRenderer;
 
 private:
-  QSerialPort *serialPort1;
-  QByteArray receivedData;
-  QString receivedBuffer;
+  QElapsedTimer clock;
+  SampleQueue sampleQueue;
+  QThread readerThread;
+  SampleSource *source;               // serialReader or replaySource
+  SerialReader *serialReader;         // live boards, 0 when replaying
+  ReplaySource *replaySource;         // --replay FILE, 0 when live
+  SessionRecorder *recorder;          // raw samples to disk, toggled with Ctrl+R
+  LatencyHistogram consumerLatency;   // time samples spend in sampleQueue
+  FrameScheduler *scheduler;
+  QTimer *statsTimer;
+  FrameSchedulerStats lastStats;
+  TelemetryView *telemetry;
+  TelemetryViewStats lastTelemetry;
+  qint64 firstFrameNs;                // clock time of the first render, -1 before it
+  qint64 fullSceneNs;                 // clock time the last mesh joined the scene
+
+  QString recordingStatus() const;
+  QString replayStatus() const;
+  QString loadingStatus() const;
+  QString telemetryStatus() const;
 public slots:
 
   virtual void slotExit();
-  virtual void readData();
+  virtual void drainSamples();
   virtual void updateModel();
+  virtual void showStats();
+  virtual void toggleRecording();
+  virtual void seekForward();
+  virtual void seekBackward();
 };
 
 #endif
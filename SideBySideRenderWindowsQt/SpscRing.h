@@ -0,0 +1,60 @@
+#ifndef SpscRing_H
+#define SpscRing_H
+
+#include <QAtomicInt>
+
+// Lock-free single-producer/single-consumer ring of fixed capacity.
+// push() may only be called from one thread and pop() from one other thread.
+// Size must be a power of two; one slot is never used so head == tail means empty.
+template <typename T, int Size>
+class SpscRing
+{
+public:
+  SpscRing() : head(0), tail(0), highWater(0), dropped(0) {}
+
+  // Producer side. Returns false, and counts a drop, when the ring is full.
+  bool push(const T &item)
+  {
+    int h = head.load();
+    int next = (h + 1) & (Size - 1);
+    if (next == tail.loadAcquire()) {
+      dropped.fetchAndAddRelaxed(1);
+      return false;
+    }
+    items[h] = item;
+    head.storeRelease(next);
+
+    int depth = (next - tail.load()) & (Size - 1);
+    if (depth > highWater.load()) {
+      highWater.store(depth);
+    }
+    return true;
+  }
+
+  // Consumer side. Returns false when the ring is empty.
+  bool pop(T &item)
+  {
+    int t = tail.load();
+    if (t == head.loadAcquire()) {
+      return false;
+    }
+    item = items[t];
+    tail.storeRelease((t + 1) & (Size - 1));
+    return true;
+  }
+
+  // Approximate when called from a third thread
+  int depth() const { return (head.loadAcquire() - tail.loadAcquire()) & (Size - 1); }
+  int capacity() const { return Size - 1; }
+  int maxDepth() const { return highWater.load(); }
+  int droppedCount() const { return dropped.load(); }
+
+private:
+  T items[Size];
+  QAtomicInt head;
+  QAtomicInt tail;
+  QAtomicInt highWater;
+  QAtomicInt dropped;
+};
+
+#endif
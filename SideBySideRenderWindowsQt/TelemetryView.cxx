@@ -0,0 +1,315 @@
+#include "TelemetryView.h"
+
+#include <vtkRenderWindow.h>
+#include <vtkRenderer.h>
+#include <vtkContextScene.h>
+#include <vtkChartXY.h>
+#include <vtkAxis.h>
+#include <vtkPen.h>
+#include <vtkVector.h>
+
+#include <math.h>
+#include <string.h>
+
+TelemetryBuffer::TelemetryBuffer(int series, int buckets, double bucketSeconds)
+    : buckets(buckets), bucketSeconds(bucketSeconds), slot(0), bucketStart(-1.0), changed(false),
+      minimum(series), maximum(series)
+{
+    data = vtkSmartPointer<vtkTable>::New();
+    time = vtkSmartPointer<vtkDoubleArray>::New();
+    time->SetName("t");
+    time->SetNumberOfValues(2 * buckets);
+    data->AddColumn(time);
+    for (int s = 0; s < series; s++) {
+        vtkSmartPointer<vtkFloatArray> column = vtkSmartPointer<vtkFloatArray>::New();
+        column->SetName(QString("s%1").arg(s).toLatin1().constData());
+        column->SetNumberOfValues(2 * buckets);
+        data->AddColumn(column);
+        columns.append(column);
+        minimum[s] = HUGE_VALF;
+        maximum[s] = -HUGE_VALF;
+    }
+    for (int b = 0; b < buckets; b++) {
+        blank(b);
+    }
+}
+
+void TelemetryBuffer::blank(int b)
+{
+    for (int s = 0; s < columns.size(); s++) {
+        columns[s]->SetValue(2 * b, NAN);
+        columns[s]->SetValue(2 * b + 1, NAN);
+    }
+}
+
+void TelemetryBuffer::add(double t, int series, double value)
+{
+    advance(t);
+    float v = (float)value;
+    if (v < minimum[series]) {
+        minimum[series] = v;
+    }
+    if (v > maximum[series]) {
+        maximum[series] = v;
+    }
+}
+
+void TelemetryBuffer::advance(double t)
+{
+    if (bucketStart < 0.0) {
+        bucketStart = floor(t / bucketSeconds) * bucketSeconds;
+    }
+    if (t - bucketStart >= buckets * bucketSeconds) {
+        // Quiet for longer than the whole history: nothing of it stays
+        for (int b = 0; b < buckets; b++) {
+            blank(b);
+        }
+        bucketStart = floor(t / bucketSeconds) * bucketSeconds - bucketSeconds;
+        changed = true;
+    }
+    while (t >= bucketStart + bucketSeconds) {
+        closeBucket();
+    }
+    if (changed) {
+        // The plots reread the table only when it is newer than their cache
+        time->Modified();
+        for (int s = 0; s < columns.size(); s++) {
+            columns[s]->Modified();
+        }
+        data->Modified();
+        changed = false;
+    }
+}
+
+void TelemetryBuffer::closeBucket()
+{
+    time->SetValue(2 * slot, bucketStart);
+    time->SetValue(2 * slot + 1, bucketStart + bucketSeconds / 2);
+    for (int s = 0; s < columns.size(); s++) {
+        bool empty = minimum[s] > maximum[s];
+        columns[s]->SetValue(2 * slot, empty ? NAN : minimum[s]);
+        columns[s]->SetValue(2 * slot + 1, empty ? NAN : maximum[s]);
+        minimum[s] = HUGE_VALF;
+        maximum[s] = -HUGE_VALF;
+    }
+    slot = (slot + 1) % buckets;
+    blank(slot);
+    bucketStart += bucketSeconds;
+    changed = true;
+}
+
+// Components of a chart and the colour of each, the boards differ by line style
+static const char *const quaternionNames[] = { "qw", "qx", "qy", "qz" };
+static const char *const eulerNames[] = { "yaw", "pitch", "roll" };
+static const unsigned char componentColors[4][3] = {
+    { 0, 0, 0 }, { 220, 40, 40 }, { 40, 160, 40 }, { 40, 80, 220 }
+};
+static const int chartComponents[] = { 4, 3, 1, 1 };     // per chart, for each board
+static const int boardLineTypes[TelemetryView::MaxBoards] = {
+    vtkPen::SOLID_LINE, vtkPen::DASH_LINE, vtkPen::DOT_LINE, vtkPen::DASH_DOT_LINE
+};
+
+TelemetryView::TelemetryView(vtkRenderWindow *window, vtkRenderer *renderer, const QElapsedTimer *clock,
+                             QObject *parent)
+    : QObject(parent), window(window), renderer(renderer), clock(clock), rateStart(-1.0),
+      budgetMs(4.0), maxRate(30.0)
+{
+    memset(&counters, 0, sizeof(counters));
+    for (int i = 0; i < MaxBoards; i++) {
+        boards[i] = -1;
+        rateCounts[i] = 0;
+    }
+    createCharts();
+
+    timer.setTimerType(Qt::PreciseTimer);
+    connect(&timer, SIGNAL(timeout()), this, SLOT(redraw()));
+    setMaxRefreshRate(maxRate);
+}
+
+TelemetryView::~TelemetryView()
+{
+    qDeleteAll(buffers);
+}
+
+void TelemetryView::createCharts()
+{
+    double bucketSeconds = (double)HistorySeconds / Buckets;
+    buffers.append(new TelemetryBuffer(4 * MaxBoards, Buckets, bucketSeconds));
+    buffers.append(new TelemetryBuffer(3 * MaxBoards, Buckets, bucketSeconds));
+    // The rate is counted per rate bucket, one value in each
+    buffers.append(new TelemetryBuffer(MaxBoards, HistorySeconds * 1000 / RateBucketMs, RateBucketMs / 1000.0));
+    buffers.append(new TelemetryBuffer(MaxBoards, Buckets, bucketSeconds));
+
+    static const char *const titles[ChartCount] = { "Quaternion", "Euler angles", "Sample rate", "Latency" };
+    static const char *const units[ChartCount] = { "", "degrees", "samples/s", "ms" };
+
+    matrix = vtkSmartPointer<vtkChartMatrix>::New();
+    matrix->SetSize(vtkVector2i(1, ChartCount));
+    plots.resize(ChartCount);
+    for (int c = 0; c < ChartCount; c++) {
+        vtkChart *xy = chart(c);
+        xy->SetTitle(titles[c]);
+        xy->SetShowLegend(c < RateChart);
+        xy->GetAxis(vtkAxis::LEFT)->SetTitle(units[c]);
+        xy->GetAxis(vtkAxis::BOTTOM)->SetTitle(c == LatencyChart ? "s" : "");
+        xy->GetAxis(vtkAxis::BOTTOM)->SetBehavior(vtkAxis::FIXED);
+        if (c == QuaternionChart) {
+            xy->GetAxis(vtkAxis::LEFT)->SetBehavior(vtkAxis::FIXED);
+            xy->GetAxis(vtkAxis::LEFT)->SetRange(-1.0, 1.0);
+        } else if (c == EulerChart) {
+            xy->GetAxis(vtkAxis::LEFT)->SetBehavior(vtkAxis::FIXED);
+            xy->GetAxis(vtkAxis::LEFT)->SetRange(-180.0, 180.0);
+        }
+
+        for (int slot = 0; slot < MaxBoards; slot++) {
+            for (int k = 0; k < chartComponents[c]; k++) {
+                int series = slot * chartComponents[c] + k;
+                vtkPlot *line = xy->AddPlot(vtkChart::LINE);
+                line->SetInputData(buffers[c]->table(), 0, series + 1);
+                const unsigned char *rgb = componentColors[chartComponents[c] > 1 ? k : slot];
+                line->SetColor(rgb[0], rgb[1], rgb[2], 255);
+                line->SetWidth(1.0);
+                line->GetPen()->SetLineType(chartComponents[c] > 1 ? boardLineTypes[slot] : vtkPen::SOLID_LINE);
+                // Shown once a board takes the slot
+                line->SetVisible(false);
+                plots[c].append(line);
+            }
+        }
+    }
+
+    actor = vtkSmartPointer<vtkContextActor>::New();
+    actor->GetScene()->AddItem(matrix);
+    actor->GetScene()->SetRenderer(renderer);
+    renderer->AddActor(actor);
+}
+
+vtkChart *TelemetryView::chart(int index) const
+{
+    // Row 0 of the matrix is at the bottom
+    return matrix->GetChart(vtkVector2i(0, ChartCount - 1 - index));
+}
+
+void TelemetryView::setMaxRefreshRate(double hz)
+{
+    maxRate = hz > 0.0 ? hz : 30.0;
+    counters.refreshRate = maxRate;
+    timer.start(qMax(1, (int)(1000.0 / maxRate + 0.5)));
+}
+
+int TelemetryView::slotForBoard(int board)
+{
+    for (int i = 0; i < MaxBoards; i++) {
+        if (boards[i] == board) {
+            return i;
+        }
+    }
+    for (int i = 0; i < MaxBoards; i++) {
+        if (boards[i] < 0) {
+            boards[i] = board;
+            for (int c = 0; c < ChartCount; c++) {
+                for (int k = 0; k < chartComponents[c]; k++) {
+                    vtkPlot *line = plots[c][i * chartComponents[c] + k];
+                    QString label = chartComponents[c] == 4 ? QString("%1 %2").arg(board).arg(quaternionNames[k])
+                                  : chartComponents[c] == 3 ? QString("%1 %2").arg(board).arg(eulerNames[k])
+                                  : QString("board %1").arg(board);
+                    line->SetLabel(label.toLatin1().constData());
+                    line->SetVisible(true);
+                }
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+void TelemetryView::flushRates(double t)
+{
+    double bucket = RateBucketMs / 1000.0;
+    if (rateStart < 0.0) {
+        rateStart = floor(t / bucket) * bucket;
+    }
+    if (t - rateStart > HistorySeconds) {
+        rateStart = floor(t / bucket) * bucket;
+        memset(rateCounts, 0, sizeof(rateCounts));
+    }
+    while (t >= rateStart + bucket) {
+        for (int i = 0; i < MaxBoards; i++) {
+            if (boards[i] >= 0) {
+                buffers[RateChart]->add(rateStart, i, rateCounts[i] / bucket);
+            }
+            rateCounts[i] = 0;
+        }
+        rateStart += bucket;
+    }
+}
+
+void TelemetryView::addSample(const QuatSample &sample, qint64 readNs, qint64 nowNs)
+{
+    int slot = slotForBoard(sample.board);
+    if (slot < 0) {
+        return;
+    }
+    counters.samples++;
+    double t = readNs / 1e9;
+    flushRates(t);
+    rateCounts[slot]++;
+
+    const float *q = sample.q;
+    for (int k = 0; k < 4; k++) {
+        buffers[QuaternionChart]->add(t, slot * 4 + k, q[k]);
+    }
+
+    double angles[3];
+    if (sample.hasEuler) {
+        // The board's own angles, as its fast approximations computed them
+        for (int k = 0; k < 3; k++) {
+            angles[k] = sample.euler[k];
+        }
+    } else {
+        // As the firmware derives them in Calculations()
+        double rad = 180.0 / 3.14159265358979323846;
+        double sinPitch = 2.0 * (q[1] * q[3] - q[0] * q[2]);
+        sinPitch = sinPitch > 1.0 ? 1.0 : (sinPitch < -1.0 ? -1.0 : sinPitch);
+        angles[0] = atan2(2.0 * (q[1] * q[2] + q[0] * q[3]), 1.0 - 2.0 * (q[2] * q[2] + q[3] * q[3])) * rad;
+        angles[1] = -asin(sinPitch) * rad;
+        angles[2] = atan2(2.0 * (q[0] * q[1] + q[2] * q[3]), q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3]) * rad;
+    }
+    for (int k = 0; k < 3; k++) {
+        buffers[EulerChart]->add(t, slot * 3 + k, angles[k]);
+    }
+
+    buffers[LatencyChart]->add(t, slot, (nowNs - readNs) / 1e6);
+}
+
+void TelemetryView::redraw()
+{
+    QElapsedTimer drawTimer;
+    drawTimer.start();
+
+    double now = clock->nsecsElapsed() / 1e9;
+    flushRates(now);
+    for (int c = 0; c < ChartCount; c++) {
+        buffers[c]->advance(now);
+        chart(c)->GetAxis(vtkAxis::BOTTOM)->SetRange(now - HistorySeconds, now);
+    }
+    window->Render();
+
+    double ms = drawTimer.nsecsElapsed() / 1e6;
+    counters.draws++;
+    counters.lastDrawMs = ms;
+    counters.avgDrawMs = counters.draws == 1 ? ms : 0.9 * counters.avgDrawMs + 0.1 * ms;
+    counters.maxDrawMs = qMax(counters.maxDrawMs, ms);
+
+    // Halve the refresh rate while redraws run over budget, double it when they are
+    // well under, between 2 per second and the maximum
+    double rate = counters.refreshRate;
+    if (counters.avgDrawMs > budgetMs && rate > 2.0) {
+        rate = qMax(2.0, rate / 2);
+    } else if (counters.avgDrawMs < budgetMs / 4 && rate < maxRate) {
+        rate = qMin(maxRate, rate * 2);
+    }
+    if (rate != counters.refreshRate) {
+        counters.refreshRate = rate;
+        timer.start(qMax(1, (int)(1000.0 / rate + 0.5)));
+    }
+}
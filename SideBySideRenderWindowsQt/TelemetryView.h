@@ -0,0 +1,131 @@
+#ifndef TelemetryView_H
+#define TelemetryView_H
+
+#include <vtkSmartPointer.h>
+#include <vtkTable.h>
+#include <vtkFloatArray.h>
+#include <vtkDoubleArray.h>
+#include <vtkChartMatrix.h>
+#include <vtkContextActor.h>
+#include <vtkPlot.h>
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QString>
+#include <QVector>
+
+#include "QuatFrame.h"
+
+class vtkRenderWindow;
+class vtkRenderer;
+class vtkChart;
+
+// Scrolling history of a few series kept as min/max envelopes in a fixed number of
+// time buckets, stored in a vtkTable for a chart. Column 0 is the time in seconds and
+// each series has a column; a bucket takes two rows, the minimum at the start of the
+// bucket and the maximum half a bucket later, so the line through them covers every
+// sample of the bucket however many there were. The table never grows: a closed
+// bucket overwrites the oldest one in place and the one after it is blanked with NaN,
+// which breaks the line between the newest and the oldest bucket. Drawing therefore
+// costs the same whatever the sample rate or how long the viewer has been running.
+class TelemetryBuffer
+{
+public:
+  TelemetryBuffer(int series, int buckets, double bucketSeconds);
+
+  vtkTable *table() const { return data; }
+  int seriesCount() const { return minimum.size(); }
+  double historySeconds() const { return buckets * bucketSeconds; }
+
+  // A value of a series at time t in seconds; times must not go backwards
+  void add(double t, int series, double value);
+  // Close the buckets that ended by time t. Call before drawing so the table reaches
+  // the present, with gaps for series that had no values.
+  void advance(double t);
+
+private:
+  void closeBucket();
+  void blank(int slot);
+
+  vtkSmartPointer<vtkTable> data;
+  vtkSmartPointer<vtkDoubleArray> time;
+  QVector<vtkSmartPointer<vtkFloatArray> > columns;
+  int buckets;
+  double bucketSeconds;
+  int slot;                     // ring position of the open bucket
+  double bucketStart;           // start time of the open bucket, < 0 before the first value
+  bool changed;                 // rows written since the table was marked modified
+  QVector<float> minimum;       // of the open bucket, minimum > maximum when it has no value
+  QVector<float> maximum;
+};
+
+struct TelemetryViewStats
+{
+  quint64 samples;              // samples plotted
+  quint64 draws;
+  double lastDrawMs;            // update() and Render() of the plot window
+  double avgDrawMs;             // exponential moving average
+  double maxDrawMs;
+  double refreshRate;           // redraws per second at the moment
+};
+
+// Live plots in the right-hand render window, one chart per quantity: quaternion
+// components, Euler angles (the yaw, pitch, roll of Euler frames as the board sent
+// them, otherwise derived from the quaternion as the firmware does), sample rate and
+// latency from the serial read to the GUI thread. Each chart draws one line per board and
+// component, telling the boards apart by line style; the first MaxBoards boards seen
+// are plotted.
+//
+// Samples only update the open bucket. A timer redraws the plots, and backs off when a
+// redraw takes longer than the draw budget so the plots never take time the joint
+// window needs; it speeds up again when the redraws get cheap.
+class TelemetryView : public QObject
+{
+  Q_OBJECT
+public:
+  enum { MaxBoards = 4 };
+
+  // clock is the one the sample times come from
+  TelemetryView(vtkRenderWindow *window, vtkRenderer *renderer, const QElapsedTimer *clock,
+                QObject *parent = 0);
+  ~TelemetryView();
+
+  // Longest redraw before the refresh rate drops, and the highest refresh rate
+  void setDrawBudget(double ms) { budgetMs = ms; }
+  void setMaxRefreshRate(double hz);
+
+  // A decoded sample, read from the port at readNs and taken off the queue at nowNs
+  void addSample(const QuatSample &sample, qint64 readNs, qint64 nowNs);
+
+  const TelemetryViewStats &stats() const { return counters; }
+
+private slots:
+  void redraw();
+
+private:
+  enum { QuaternionChart, EulerChart, RateChart, LatencyChart, ChartCount };
+  enum { HistorySeconds = 10, Buckets = 250, RateBucketMs = 250 };
+
+  void createCharts();
+  vtkChart *chart(int index) const;
+  int slotForBoard(int board);
+  void flushRates(double t);
+
+  vtkRenderWindow *window;
+  vtkRenderer *renderer;
+  const QElapsedTimer *clock;
+  vtkSmartPointer<vtkChartMatrix> matrix;
+  vtkSmartPointer<vtkContextActor> actor;
+  QVector<TelemetryBuffer *> buffers;      // one per chart
+  QVector<QVector<vtkPlot *> > plots;      // per chart, slot-major
+  int boards[MaxBoards];                   // board of each slot, -1 when free
+  int rateCounts[MaxBoards];
+  double rateStart;                        // start of the open rate bucket, seconds
+  double budgetMs;
+  double maxRate;
+  QTimer timer;
+  TelemetryViewStats counters;
+};
+
+#endif